@@ -50,6 +50,70 @@
  *    checked before and after the (putative) new database creation, and the commit process is 
  *    aborted if the D/B file has already been replaced by some other asyncronous process.
  *
+ *  - The commit can optionally be deferred until after the request has completed, so that the cost
+ *    of rewriting a large DB isn't added to the response time.  The rewrite is prepared during the
+ *    close, but the copying of the records and the move are done by a background thread or a 
+ *    detached child process (see _cachedb_commit_deferred).
+ *
+ *  - Records may optionally carry an expiry timestamp, which is held in the index entry alongside 
+ *    the record lengths rather than in the user metadata.  Expiry is evaluated against the time that
+ *    the DB was opened, so the visibility of a record is stable for the lifetime of a handle. An 
+ *    expired record is treated as a miss by find without its payload being read, and its key can be
+ *    re-added.  Expired records are lazily evicted: they are dropped when the DB is next committed,
+ *    or on an explicit purge (close mode 'p').
+ *
+ *  - Since version 2 of the file format, the base file may also carry a trailer after the last 
+ *    record.  This is a sequence of tagged sections followed by a fixed-length footer at the end 
+ *    of the file, and the header fingerprint ("cachedb+" rather than "cachedb-") flags its presence.
+ *    The record offsets are unchanged by the trailer.  The only section currently written is a Bloom
+ *    filter over the DB's keys.  Unknown sections are ignored on load.
+ *
+ *  - The trailer also carries a CRC32C of the index, which is always checked on open, and a CRC32C
+ *    of each record, which is checked on a configurable percentage of fetches.  A mismatch, or a 
+ *    missing footer, is reported as a warning and the open or fetch fails, rather than passing a
+ *    torn or partially written file on to zlib and the unserializer.
+ *
+ *  - A DB keyed by small dense integers (row ids and the like) can be opened in integer mode ('i').
+ *    Its keys are still held in the index as decimal strings, so it is also readable by a normal
+ *    handle, but the trailer also carries a flat array of record slots indexed by id.  A readonly
+ *    integer mode handle uses this array directly and never unserializes or hashes the index, and
+ *    _cachedb_find_int() is an array lookup.  Integer keyed records can't carry metadata.
+ *
+ *  - All fixed-length fields in the file are explicitly sized and little-endian, so a DB is portable
+ *    between hosts.  A DB of more than CACHEDB_PAGED_MIN_RECORDS records also carries a paged index:
+ *    a B+tree of sorted key pages in the trailer.  A readonly handle opened in paged mode ('p') keeps
+ *    only the root page in memory and reads one page per level on each find, rather than loading
+ *    the whole index, so that multi-gigabyte DBs can be read with bounded memory per open.  A paged
+ *    handle can't return metadata or the index via info, and doesn't count expired records.
+ *
+ *  - Metadata fields can be declared as indexed when a DB is created.  Each commit then also writes 
+ *    a postings section to the trailer: for each indexed field, a list of the records holding each 
+ *    (scalar) value.  _cachedb_find_by() uses these to return the keys of the records with a given 
+ *    field value without scanning the index entries or reading any payloads.  The section is only 
+ *    loaded on first use, and the declaration carries forward to later commits.
+ *
+ *  - A readonly handle can be opened in shared mode ('s').  The index of each version of a DB file
+ *    is then built once per process as an immutable hash table in persistent memory, which is held 
+ *    in a process-wide registry and shared by every handle (in any thread) that opens that version.
+ *    Lookups don't take any locks; the registry lock is only taken to acquire or release a shared 
+ *    index.  When a new version of the file is published, the next shared open builds its index and 
+ *    replaces the registry entry, RCU style: the old index stays valid for the handles still using
+ *    it and is freed when the last of these is closed.  An unused index whose file has been 
+ *    replaced, renamed or deleted is evicted from the registry at its last close or at the next 
+ *    publish, so a long-running process doesn't accumulate indexes of files that have gone.  As 
+ *    with paged mode, a shared handle can't return metadata or the index via info, and doesn't 
+ *    count expired records.
+ *
+ *  - Several DBs can be opened as a single layered handle, e.g. a small per-tenant DB on top of a 
+ *    large shared one.  A find walks the layers from top to bottom and returns the first live hit,
+ *    using each layer's Bloom filter to skip the index probe for most keys that the layer does not
+ *    contain. Additions always go to the top layer, and only the top layer is ever committed.
+ *
+ *  - A DB can also be sharded: a directory of N shard DBs with each key routed to a shard by a hash 
+ *    of the key.  The shards are opened lazily on first access and are committed independently, so 
+ *    a commit only rewrites the shards that have received additions, and concurrent writers adding 
+ *    different keys will usually touch different shards and so not collide.
+ *
  *  - Lastly unlike php_cdb which is implemented as a wrapper around a (non-php) clone of 
  *    Bernstein's original cdb C code, cachedb is written only to work within a PHP extension.
  *
@@ -85,14 +149,26 @@
 #include "ext/standard/php_smart_str.h"
 
 #include "cachedb.h"
+#include "cachedb_crc32c.h"
 
 #include <sys/types.h>
+#include <fcntl.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdint.h>
 #include <zlib.h>
+#if defined(ZTS) && defined(PTHREADS)
+#include <pthread.h>
+#elif defined(HAVE_FORK) && !defined(PHP_WIN32)
+#include <sys/wait.h>
+#endif
 
 typedef struct _cachedb_rec_t {
 	char       *key;
@@ -101,6 +177,8 @@ typedef struct _cachedb_rec_t {
     off_t       start;
 	size_t      zlen;
 	size_t      len;
+	size_t      ndx;
+	cachedb_t  *layer;
 } cachedb_rec_t;
 
 typedef struct _cachedb_file_t {
@@ -122,15 +200,186 @@ struct _cachedb_t {
 	cachedb_rec_t  last_find;
 	int			   is_binary;
 	char           mode;
+	time_t         open_time;
+	size_t         expired_count;
+	off_t          records_end;
+	unsigned char *bloom;
+	uint32_t       bloom_bits;
+	uint32_t       bloom_hashes;
+	cachedb_t     *lower;
+	cachedb_t    **shards;
+	int            shard_count;
+	char           shard_mode[3];
+	int            durability;
+	uint32_t      *crcs;
+	size_t         crc_count;
+	size_t         crc_size;
+	int            base_crcs;
+	uint32_t       index_crc;
+	int            verify;
+	unsigned int   fetch_count;
+	int            is_dense;
+	struct _cachedb_dense_t *dense;
+	uint32_t       dense_count;
+	uint32_t       dense_size;
+	int            is_paged;
+	off_t          paged_offset;
+	uint64_t       paged_length;
+	char          *paged_root;
+	char          *paged_buf;
+	size_t         paged_buf_size;
+	off_t          crc_offset;
+	size_t         base_count;
+	zval          *postings;
+	off_t          postings_offset;
+	uint64_t       postings_length;
+	uint32_t       postings_crc;
+	int            is_shared;
+	struct _cachedb_shared_t *shared;
+	cachedb_stats_t stats;
 };
 
-#define CACHEDB_HEADER_FINGERPRINT "cachedb-"
+#define CACHEDB_HEADER_FINGERPRINT         "cachedb-"
+#define CACHEDB_HEADER_FINGERPRINT_TRAILER "cachedb+"
 typedef struct _cachedb_header_t {
 	char       fingerprint[8];
-	size_t     zlen;
-	size_t     len;
+	uint64_t   zlen;
+	uint64_t   len;
 } cachedb_header_t;
 
+/* The trailer sections are each prefixed by a section header, and the footer is the last 16 bytes 
+ * of the file. The section tags are: */
+#define CACHEDB_SECTION_BLOOM    1
+#define CACHEDB_SECTION_CRC      2
+#define CACHEDB_SECTION_DENSE    3
+#define CACHEDB_SECTION_PAGED    4
+#define CACHEDB_SECTION_POSTINGS 5
+
+typedef struct _cachedb_section_t {
+	uint32_t   tag;
+	uint32_t   param;
+	uint64_t   length;
+} cachedb_section_t;
+
+typedef struct _cachedb_footer_t {
+	uint64_t   trailer_length;
+	char       fingerprint[8];
+} cachedb_footer_t;
+
+/* An integer mode record slot.  The dense section is an array of these indexed by id, and its param
+ * is the record count.  In memory, start follows the index_hash convention that offsets at or past 
+ * records_end are in the temporary file. */
+typedef struct _cachedb_dense_t {
+	uint64_t   start;
+	uint32_t   zlen;
+	uint32_t   len;
+	uint32_t   ndx;          /* index position + 1, or 0 if there is no record with this id */
+	uint32_t   expires;      /* 0 = never expires */
+} cachedb_dense_t;
+
+/* The dense array is sized by the largest id, so this caps its size at 384Mb.  An added id must
+ * also be below twice the record count plus CACHEDB_DENSE_SLACK, so that a few stray large ids
+ * can't grow the array far beyond the records that it holds. */
+#define CACHEDB_DENSE_MAX_ID  0xFFFFFF
+#define CACHEDB_DENSE_SLACK   0x10000
+
+/* The paged index is a static B+tree which is built bottom up at commit.  Its section body starts 
+ * with the root page offset and the entry count, followed by the pages; each page starts with its 
+ * length, entry count and level (0 for a leaf) and holds entries sorted by key.  A leaf entry holds 
+ * the record location and a node entry the offset of a child page, each followed by the key length 
+ * and the key.  The key of a node entry is the first key of its child.  Page offsets are relative to
+ * the section body.  Pages are filled up to CACHEDB_PAGE_SIZE, but hold at least one entry. */
+#define CACHEDB_PAGED_MIN_RECORDS  1024
+#define CACHEDB_PAGE_SIZE          4096
+#define CACHEDB_PAGED_HEADER       16     /* root, entry count (64-bit) */
+#define CACHEDB_PAGE_HEADER        12     /* length, count, level (32-bit) */
+#define CACHEDB_LEAF_ENTRY         36     /* start, zlen, len (64-bit), ndx, expires, key length (32-bit) */
+#define CACHEDB_NODE_ENTRY         12     /* child (64-bit), key length (32-bit) */
+#define CACHEDB_PAGED_MAX_LEVEL    32
+
+/* The postings section body is the uncompressed length (64-bit), the length of the field names and 
+ * a CRC32C of these first 12 bytes and the names (32-bit), the indexed field names each NUL 
+ * terminated, and then the compressed serialized array field => array(value => list).  Its param is
+ * the CRC32C of the compressed array.  Each list is a string of the record index positions in 
+ * ascending order, delta and varint encoded.  The names are held apart so that a commit can carry 
+ * the declaration forward without loading the array. */
+#define CACHEDB_POSTINGS_HEADER    16
+
+/* A paged index entry while the tree is being built; a node entry only uses key and start */
+typedef struct _cachedb_paged_key_t {
+	const char *key;
+	uint32_t    key_length;
+	uint64_t    start;
+	uint64_t    zlen;
+	uint64_t    len;
+	uint32_t    ndx;
+	uint32_t    expires;
+} cachedb_paged_key_t;
+
+/* A shared index, see cachedb_attach_shared().  Everything except refcount, is_registered and next
+ * is immutable once the index is published, and these are only accessed under the registry lock.  
+ * The buckets are an open addressed hash table of entry numbers + 1, with 0 for an empty bucket. */
+typedef struct _cachedb_shared_entry_t {
+	uint64_t   start;
+	uint64_t   zlen;
+	uint64_t   len;
+	size_t     key_offset;
+	uint32_t   key_length;
+	uint32_t   expires;
+} cachedb_shared_entry_t;
+
+typedef struct _cachedb_shared_t {
+	char                    *name;
+	struct stat              sb;
+	int                      refcount;
+	int                      is_registered;
+	uint32_t                 count;
+	uint32_t                 bucket_mask;
+	uint32_t                *buckets;
+	cachedb_shared_entry_t  *entries;
+	char                    *keys;
+	uint32_t                *crcs;
+	int                      has_crcs;
+	size_t                   header_length;
+	off_t                    records_end;
+	struct _cachedb_shared_t *next;
+} cachedb_shared_t;
+
+/* A prepared commit, see cachedb_commit_prepare() */
+typedef struct _cachedb_extent_t {
+	int        fd;
+	off_t      start;
+	size_t     length;
+} cachedb_extent_t;
+
+struct _cachedb_commit_t {
+	char              *name;
+	char              *dir;
+	struct stat        sb;
+	char              *prefix;
+	size_t             prefix_length;
+	char              *suffix;
+	size_t             suffix_length;
+	cachedb_extent_t  *extents;
+	int                extent_count;
+	int                extent_size;
+	int                base_fd;
+	int                tmp_fd;
+	int                durability;
+	int                outcome;
+	uint32_t           index_crc;
+	cachedb_commit_t  *next;
+};
+
+/* The Bloom filter is sized at ~10 bits per key with 7 probes, giving a false positive rate of ~1% */
+#define CACHEDB_BLOOM_BITS_PER_KEY 10
+#define CACHEDB_BLOOM_HASHES       7
+
+/* The buffer size used for copying records into the new DB, and the cap on the descriptor scan 
+ * when a background worker closes its inherited descriptors */
+#define CACHEDB_COPY_BUFFER_SIZE   (64*1024)
+#define CACHEDB_MAX_CLOSE_FD       4096
+
 
 static const char _cachedb_ndx_err[]   = "Invalid index in cachedb file %s.";
 static const char _cachedb_eom_err[]   = "Invalid record read in cachedb file";
@@ -138,6 +387,36 @@ static const char _cachedb_mode_err[]  = "Invalid mode %c during open of cachedb
 static const char _cachedb_add_err[]   = "Internal error during open of cachedb file %s";
 static const char _cachedb_close_err[] = "Internal error during close of cachedb file %s";
 static const char _cachedb_write_err[] = "Internal error write to cachedb file";
+static const char _cachedb_trailer_err[] = "Invalid trailer in cachedb file %s";
+static const char _cachedb_shard_err[] = "Cannot open shard %d of sharded cachedb %s";
+static const char _cachedb_crc_err[]   = "Checksum mismatch in cachedb file %s";
+static const char _cachedb_dense_err[] = "Non-integer key in cachedb file %s opened in integer mode";
+static const char _cachedb_sparse_err[] = "The id %lu is too sparse for the %u records in cachedb file %s";
+static const char _cachedb_paged_err[] = "Invalid paged index in cachedb file %s";
+static const char _cachedb_postings_err[] = "Invalid metadata postings in cachedb file %s";
+
+/* The process-wide registry of shared indexes, which holds the current version of each DB file.
+ * Each handle attached to an index holds a reference, and so does the registry while the index is
+ * the current version.  An index that is only held by the registry is evicted once its file has 
+ * been replaced, renamed or deleted, see cachedb_shared_release() and cachedb_shared_publish(). */
+static cachedb_shared_t *cachedb_shared_list = NULL;
+#ifdef ZTS
+static MUTEX_T           cachedb_shared_mutex = NULL;
+# define CACHEDB_SHARED_LOCK()   tsrm_mutex_lock(cachedb_shared_mutex)
+# define CACHEDB_SHARED_UNLOCK() tsrm_mutex_unlock(cachedb_shared_mutex)
+#else
+# define CACHEDB_SHARED_LOCK()
+# define CACHEDB_SHARED_UNLOCK()
+#endif
+
+/* Returned by the internal load and read functions if a checksum or structural check shows that 
+ * the file is damaged.  This is reported as a warning rather than an error, as it is an expected
+ * consequence of a torn or partial file on some network filesystems. */
+#define CACHEDB_CORRUPT (-2)
+
+/* Shard file names within a sharded DB directory encode the shard count, so that reopening with a 
+ * different count can't misroute keys */
+#define CACHEDB_SHARD_NAME "%s/shard-%03d-of-%03d.cachedb"
 
 #undef TRUE
 #define TRUE 1
@@ -157,6 +436,7 @@ static const char _cachedb_write_err[] = "Internal error write to cachedb file";
 #define hash_index_find(e,i,v) zend_hash_index_find(e, i, (void **) &v)
 #define hash_add_next_index_zval(h,v) zend_hash_next_index_insert(h, &v, sizeof(zval *), NULL)
 #define hash_add(h,k,v) zend_hash_add(h,k,k##_length+1, &v, sizeof(zval *), NULL)
+#define hash_update(h,k,v) zend_hash_update(h,k,k##_length+1, &v, sizeof(zval *), NULL)
 #define hash_copy(to,fm,dmy) zend_hash_copy(to, fm, (copy_ctor_func_t) zval_add_ref, (void *)&dmy, sizeof(zval*))
 #define hash_count(h) zend_hash_num_elements(h)
 #define hash_init(h,c) zend_hash_init(h, c, NULL, ZVAL_PTR_DTOR, 0)
@@ -169,11 +449,87 @@ static const char _cachedb_write_err[] = "Internal error write to cachedb file";
 
 #define filelength sb.sb.st_size 
 
+/* The file format is little-endian throughout, so these are no-ops on little-endian hosts.  PHP's
+ * configure defines WORDS_BIGENDIAN on big-endian ones. */
+#ifdef WORDS_BIGENDIAN
+# define cachedb_le32(x) cachedb_swap32(x)
+# define cachedb_le64(x) cachedb_swap64(x)
+static uint32_t cachedb_swap32(uint32_t x)
+{
+	return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+static uint64_t cachedb_swap64(uint64_t x)
+{
+	return ((uint64_t) cachedb_swap32((uint32_t) x) << 32) | cachedb_swap32((uint32_t) (x >> 32));
+}
+#else
+# define cachedb_le32(x) (x)
+# define cachedb_le64(x) (x)
+#endif
+
 /* internal cachedb functions */
-static int cachedb_read_var(php_stream *fp, int is_binary, zval *value, size_t zlen, size_t len TSRMLS_DC);
-static int cachedb_write_var(php_stream *fp, int is_binary, zval *value, size_t *zlen, size_t *len TSRMLS_DC);
+static int cachedb_read_var(php_stream *fp, int is_binary, zval *value, size_t zlen, size_t len, const uint32_t *crc, cachedb_stats_t *stats TSRMLS_DC);
+static int cachedb_write_var(php_stream *fp, int is_binary, zval *value, size_t *zlen, size_t *len, uint32_t *crc, cachedb_stats_t *stats TSRMLS_DC);
+static int cachedb_encode_var(zval *value, char **zbuf, size_t *zlen, size_t *len, cachedb_stats_t *stats TSRMLS_DC);
+static double cachedb_now(void);
+static void cachedb_merge_stats(cachedb_stats_t *to, const cachedb_stats_t *from);
 static int cachedb_load_index(cachedb_t* db TSRMLS_DC);
+static int cachedb_is_expired(cachedb_t* db, HashTable *entry_list);
+static int cachedb_load_trailer(cachedb_t* db TSRMLS_DC);
+static int cachedb_build_trailer(smart_str *buf, HashTable *index_list, uint32_t index_crc, const uint32_t *crcs, off_t records_start, int is_dense, HashTable *indexed TSRMLS_DC);
+static int cachedb_build_postings(smart_str *buf, HashTable *index_list, HashTable *indexed TSRMLS_DC);
+static int cachedb_load_postings(cachedb_t* db TSRMLS_DC);
+static zval *cachedb_load_postings_fields(cachedb_t* db TSRMLS_DC);
+static char *cachedb_read_postings_names(cachedb_t* db, char *hdr TSRMLS_DC);
+static int cachedb_find_by_in_layer(cachedb_t* db, cachedb_t* layer, char *field, size_t field_length, zval *value, zval *keys TSRMLS_DC);
+static void cachedb_find_by_add(cachedb_t* db, cachedb_t* layer, size_t ndx, zval *keys);
+static void cachedb_find_by_scan(cachedb_t* db, cachedb_t* layer, char *field, size_t field_length, zval *value, zval *keys, size_t ndx);
+static int cachedb_postings_value(zval *value, zval *str);
+static int cachedb_attach_shared(cachedb_t* db TSRMLS_DC);
+static cachedb_shared_t *cachedb_shared_build(cachedb_t* db TSRMLS_DC);
+static cachedb_shared_t *cachedb_shared_acquire(const char *name, const struct stat *sb);
+static cachedb_shared_t *cachedb_shared_publish(cachedb_shared_t *shared);
+static void cachedb_shared_release(cachedb_shared_t *shared);
+static void cachedb_shared_free(cachedb_shared_t *shared);
+static int cachedb_shared_same_version(const struct stat *a, const struct stat *b);
+static int cachedb_find_shared(cachedb_t* db, char *key, size_t key_length);
+static int cachedb_build_paged(smart_str *buf, HashTable *index_list, off_t records_start TSRMLS_DC);
+static int cachedb_paged_cmp(const void *a, const void *b);
+static int cachedb_find_paged(cachedb_t* db, char *key, size_t key_length TSRMLS_DC);
+static char *cachedb_read_page(cachedb_t* db, uint64_t offset TSRMLS_DC);
+static int cachedb_read_crc(cachedb_t* db, size_t ndx, uint32_t *crc TSRMLS_DC);
+static uint32_t cachedb_get32(const char *p);
+static uint64_t cachedb_get64(const char *p);
+static void cachedb_put32(char *p, uint32_t v);
+static void cachedb_put64(char *p, uint64_t v);
+static int cachedb_parse_id(const char *key, size_t key_length, unsigned long *id);
+static cachedb_dense_t *cachedb_dense_slot(cachedb_t* db, unsigned long id);
+static void cachedb_add_crc(cachedb_t* db, uint32_t crc);
+static int cachedb_fill_base_crcs(cachedb_t* db TSRMLS_DC);
+static int cachedb_find_in_layer(cachedb_t* db, cachedb_t* layer, char *key, size_t key_length, zval *metadata TSRMLS_DC);
+static void cachedb_bloom_hash(const char *key, size_t key_length, uint32_t *h1, uint32_t *h2);
+static int cachedb_bloom_test(const unsigned char *bloom, uint32_t bits, uint32_t hashes, uint32_t h1, uint32_t h2);
+static void cachedb_bloom_set(unsigned char *bloom, uint32_t bits, uint32_t hashes, uint32_t h1, uint32_t h2);
+static cachedb_t *cachedb_get_shard(cachedb_t* db, int shard TSRMLS_DC);
+static int cachedb_route_key(cachedb_t* db, char *key, size_t key_length);
 static void cachedb_db_dtor(cachedb_t** pdb TSRMLS_DC);
+static cachedb_commit_t *cachedb_commit_prepare(cachedb_t* db TSRMLS_DC);
+static void cachedb_commit_add_extent(cachedb_commit_t *job, int fd, off_t start, size_t length);
+static int cachedb_dup_fd(php_stream *fp TSRMLS_DC);
+static int cachedb_commit_open_tmp(cachedb_commit_t *job, char **new_name);
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+static int cachedb_commit_link_tmp(cachedb_commit_t *job, int fd, char **new_name);
+#endif
+static int cachedb_commit_run(cachedb_commit_t *job);
+static void cachedb_commit_sync_dirs(cachedb_commit_t *jobs);
+static int cachedb_commit_run_list(cachedb_commit_t *jobs);
+static void cachedb_commit_free(cachedb_commit_t *job);
+static void cachedb_commit_free_list(cachedb_commit_t *jobs);
+#if defined(ZTS) && defined(PTHREADS)
+static void *cachedb_commit_thread(void *jobs);
+#elif defined(HAVE_FORK) && !defined(PHP_WIN32)
+static void cachedb_commit_close_fds(cachedb_commit_t *jobs);
+#endif
 
 /* }}} */
 
@@ -184,6 +540,9 @@ static void cachedb_db_dtor(cachedb_t** pdb TSRMLS_DC);
  *   r: Read.   The DB must exist and records can only be read
  *   w: Write.  The DB may exist and records can be read or written
  *   c: Create/Truncate.  An existing DB may exist, but it is ignored and a new one created
+ * optionally followed by 'b' for a binary DB of string values and / or 'i' for integer mode or 'p' 
+ * for paged mode or 's' for shared mode.  Paged and shared modes only apply to 'r', and a DB without
+ * a paged index is loaded as usual.
  *
  * The first base file is opened readonly if it exists if the mode is 'r' or 'w'. It can therefore be 
  * safely shared amongst asyncronous threads/processes.  The second temporary file is private to the 
@@ -201,7 +560,7 @@ PHPAPI int _cachedb_open(cachedb_t** pdb, char *file, size_t file_length, char *
 	int				mode_length = strlen(mode);
 	char            error_type  = ' ';
 
-	if (!pdb || !file || !file_length || mode_length == 0 || mode_length > 2) {
+	if (!pdb || !file || !file_length || mode_length == 0 || mode_length > 3) {
 		return FAILURE;
 	}
 
@@ -250,7 +609,16 @@ PHPAPI int _cachedb_open(cachedb_t** pdb, char *file, size_t file_length, char *
     }
 	EFREE(opened);
 
-	db->is_binary = (mode_length == 2 && mode[1] == 'b');
+	db->is_binary = (strchr(mode + 1, 'b') != NULL);
+	db->is_dense  = (strchr(mode + 1, 'i') != NULL);
+	db->is_paged  = (strchr(mode + 1, 'p') != NULL && db->mode == 'r');
+	db->is_shared = (strchr(mode + 1, 's') != NULL && db->mode == 'r');
+	db->open_time = time(NULL);
+
+	if ((db->is_dense != 0) + (strchr(mode + 1, 'p') != NULL) + (strchr(mode + 1, 's') != NULL) > 1) {
+		cachedb_db_dtor(&db TSRMLS_CC);
+		return FAILURE;   /* these modes all replace the index, so they can't be combined */
+	}
 
 	/* Load the DB file stats or set a dummy create statrec in the case of a create */
 	if (db->base_file.fp) {
@@ -264,9 +632,14 @@ PHPAPI int _cachedb_open(cachedb_t** pdb, char *file, size_t file_length, char *
 		db->base_file.filelength = 0;
 	}
 
-	if(cachedb_load_index(db TSRMLS_CC)==SUCCESS){
-		*pdb = db;
-		return SUCCESS;   /* nornal return */
+	switch (db->is_shared ? cachedb_attach_shared(db TSRMLS_CC) : cachedb_load_index(db TSRMLS_CC)) {
+		case SUCCESS:
+			*pdb = db;
+			return SUCCESS;   /* nornal return */
+		case CACHEDB_CORRUPT:
+			/* already reported as a warning */
+			cachedb_db_dtor(&db TSRMLS_CC);
+			return FAILURE;
 	}
 
 error:
@@ -278,379 +651,2861 @@ error:
 }
 /* }}} */
 
-/* {{{ proto boolean _cachedb_close(struct db, char mode)
-   Close the cachedb, if necessary replacing the db with an updated version */
-PHPAPI int _cachedb_close(cachedb_t* db, char force_mode TSRMLS_DC)
-{
-	php_stream *new = NULL;
-	struct stat sb;
-	char *new_tmpname = NULL;
-	int  base_ok;
-	char error_type  = ' ';
+/* {{{ proto boolean _cachedb_open_layers(struct* db, array files, array file_lengths, int count, char mode)
+   Open a list of cachedb databases as a single layered DB, top layer first */
 
-	if (db->mode != 'r' && force_mode != 'r' && db->tmp_file.next_pos > 0) {
-		size_t  len, zlen;
-		char   *zbuf = NULL;
-		zval   *list;
-		zval   *tmp;
-		cachedb_header_t hdr={"",0,0};
-		size_t  dummy;
+/* The top layer is opened in the given mode and is the only layer that can be added to.  The lower
+ * layers are always opened readonly. The returned handle is the top layer and each layer links to 
+ * the next layer down, so a single layer DB is just the degenerate case of this.
+ */
+PHPAPI int _cachedb_open_layers(cachedb_t** pdb, char **files, size_t *file_lengths, int count, char *mode TSRMLS_DC)
+{
+	cachedb_t  *db        = NULL;
+	cachedb_t **player    = &db;
+	char        lower_mode[3] = "r";
+	int         i;
 
-		/* The DB was opened in c or w mode and extra records have been added */ 
-		new = php_stream_fopen_temporary_file(db->base_file.dir, ".cachedb_tmp_", &new_tmpname);
+	if (!pdb || !files || count < 1 || !mode || !mode[0] || strpbrk(mode + 1, "ips")) {
+		return FAILURE;   /* integer, paged and shared modes aren't supported for layers */
+	}
+	lower_mode[1] = mode[1];     /* propagate any 'b' binary flag to the lower layers */
 
-		/* write placeholder header (will soon be overwritten) */		
-		CHECKA(php_stream_write(new, (const char *) &hdr, sizeof(hdr))==sizeof(hdr));
-      
-		/* Make shallow copies of index_list into a zval list */
-		MAKE_STD_ZVAL(list);
-		array_init_size(list, hash_count(db->index_list));
+	for (i = 0; i < count; i++) {
+		if (_cachedb_open(player, files[i], file_lengths[i], (i == 0 ? mode : lower_mode) TSRMLS_CC) == FAILURE) {
+			if (db) {
+				cachedb_db_dtor(&db TSRMLS_CC);
+			}
+			return FAILURE;
+		}
+		player = &((*player)->lower);
+	}
 
-		hash_copy(Z_ARRVAL_P(list), db->index_list, tmp);
-			CHECKA(cachedb_write_var(new, 0, list, &zlen, &len TSRMLS_CC)==SUCCESS);
-		zval_ptr_dtor(&list);
-		/* Now append base if it exists and temp file contents */
+	*pdb = db;
+	return SUCCESS;
+}
+/* }}} */
 
-		/* Overwrite header with correct contents */
-		memcpy(hdr.fingerprint, CACHEDB_HEADER_FINGERPRINT, sizeof(CACHEDB_HEADER_FINGERPRINT)-1);
-		hdr.zlen = zlen;
-		hdr.len  = len;
-		php_stream_seek(new, 0, SEEK_SET);
-		CHECKA(php_stream_write(new, (const char *) &hdr, sizeof(hdr))==sizeof(hdr));
-		php_stream_seek(new, 0, SEEK_END);
+/* {{{ proto boolean _cachedb_open_sharded(struct* db, string dir, int dir_length, int shards, char mode)
+   Open a directory of cachedb shards as a single DB */
 
-		if(db->base_file.fp) {
-			php_stream_seek(db->base_file.fp, db->base_file.header_length, SEEK_SET);
-			php_stream_copy_to_stream_ex(db->base_file.fp, new, PHP_STREAM_COPY_ALL, &dummy);
-		}
-		php_stream_seek(db->tmp_file.fp, 0, SEEK_SET);
-		php_stream_copy_to_stream_ex(db->tmp_file.fp, new, PHP_STREAM_COPY_ALL, &dummy);
-		php_stream_close(new);
-	}
+/* The returned DB is a root control block which holds no index of its own, just a vector of shard
+ * DBs which are opened in the given mode on first access.  In the 'c' and 'w' modes the directory
+ * is created if necessary.  Note that in 'r' mode the shards are opened 'w' and then demoted to 'r',
+ * since a shard that hasn't yet been written is a valid empty DB and not an error.  For the same
+ * reason a 'c' close removes the files of any shards without additions (see _cachedb_close_ex).
+ */
+PHPAPI int _cachedb_open_sharded(cachedb_t** pdb, char *dir, size_t dir_length, int shards, char *mode TSRMLS_DC)
+{
+	cachedb_t  *db;
+	int         mode_length = mode ? strlen(mode) : 0;
+	struct stat sb;
 
-	if (db->tmp_file.fp) {
-		php_stream_close(db->tmp_file.fp);
-		db->tmp_file.fp = NULL;
+	if (!pdb || !dir || !dir_length || shards < 1 || shards > 999 || 
+	    mode_length == 0 || mode_length > 2 || !strchr("rwc", mode[0]) || strpbrk(mode + 1, "ips")) {
+		return FAILURE;   /* nor for shards */
 	}
 
-	if (db->base_file.fp) {
-		php_stream_close(db->base_file.fp);
-		db->base_file.fp = NULL;
+	if (mode[0] != 'r' && stat(dir, &sb) != 0 && mkdir(dir, 0777) != 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Cannot create cachedb shard directory %s", dir);
+		return FAILURE;
 	}
 
-	if (new_tmpname) {
-		int stat_status;
-		/* If we've created a new temp file it may need moving to the old one 
-		 *  - if the base file existed and still has the same mtime
-         *  - if the base file didn't exist and still doesn't.
-		 */
-		stat_status = stat(db->base_file.name, &sb);
-
-		if (db->base_file.sb.sb.st_size > 0) { /* size>0 means it existed */
-			/* Most FS now store mtimes stamped to the nS, but we can't guarantee this so
-             * the file-change check is based on the dev + inode + mtime 
-			 */
-			base_ok = (stat_status == 0) && 
-				(db->base_file.sb.sb.st_ino   == sb.st_ino) &&
-				(db->base_file.sb.sb.st_dev   == sb.st_dev) &&
-				(db->base_file.sb.sb.st_mtime == sb.st_mtime);
-		} else { /* it didn't exist or was unchanged */
-			base_ok = (stat_status == -1) ||
-			   ((db->base_file.sb.sb.st_ino   == sb.st_ino) &&
-				(db->base_file.sb.sb.st_dev   == sb.st_dev) &&
-				(db->base_file.sb.sb.st_mtime == sb.st_mtime));
-		}
-
-		if (base_ok) {
-			rename(new_tmpname, db->base_file.name);
-		} else {
-			unlink(new_tmpname);
-		}
-		EFREE(new_tmpname);
-	}	
-	
-	cachedb_db_dtor(&db TSRMLS_CC);
+	db = (cachedb_t*) ecalloc(sizeof(cachedb_t), 1);
+	db->base_file.name        = estrndup(dir, dir_length);
+	db->base_file.name_length = dir_length;
+	db->mode                  = mode[0];
+	db->is_binary             = (mode_length == 2 && mode[1] == 'b');
+	db->open_time             = time(NULL);
+	db->shards                = ecalloc(shards, sizeof(cachedb_t *));
+	db->shard_count           = shards;
+	db->shard_mode[0]         = (mode[0] == 'r') ? 'w' : mode[0];
+	db->shard_mode[1]         = db->is_binary ? 'b' : '\0';
+
+	/* The root has an empty index so that the index operations are still valid on it */ 
+	db->index_list = emalloc(sizeof(HashTable));
+	hash_init(db->index_list, 0);
+	db->index_hash = emalloc(sizeof(HashTable));
+	hash_init(db->index_hash, 0);
+
+	*pdb = db;
 	return SUCCESS;
-
-error:
-
-	php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_mode_err, db->mode, db->base_file.name);
-	cachedb_db_dtor(&db TSRMLS_CC);
-	return FAILURE;
 }
 /* }}} */
 
-/* {{{ proto boolean _cachedb_find(struct db)
-   Set the record position at the specified key, returning a boolean to indicate if the key exists */
-PHPAPI int _cachedb_find(cachedb_t* db, char *key, size_t key_length, zval *metadata TSRMLS_DC)
+/* {{{ proto boolean _cachedb_close(struct db, char mode)
+   Close the cachedb, if necessary replacing the db with an updated version */
+
+/* The close mode is one of:
+ *   r: Discard any pending additions and leave the base file unchanged
+ *   p: Purge.  As the default, but the DB is rewritten to evict expired records even if no 
+ *      records have been added
+ *   d: Deferred.  As the default, but the commit may be deferred until after the request
+ *   *: (or any other character) Commit any pending additions
+ *
+ * Any expired records are dropped when the DB is rewritten.  In this case the records are copied
+ * individually rather than as a single bulk copy of the base and temporary file contents. 
+ */
+PHPAPI int _cachedb_close(cachedb_t* db, char force_mode TSRMLS_DC)
 {
-	zval          **entry = NULL;
-	zval          **ndx, **start, **zlen, **len, **meta=NULL;
-	cachedb_rec_t *rec = &(db->last_find);
-	char           error_type  = ' ';
-	
-	if (hash_find(db->index_hash, key, entry)==SUCCESS) {
+	return _cachedb_close_ex(db, force_mode, NULL, NULL TSRMLS_CC);
+}
+/* }}} */
 
-		HashTable *entry_hash = Z_ARRVAL_PP(entry);
-		HashTable *entry_list;
+/* {{{ proto boolean _cachedb_close_ex(struct db, char mode, struct **deferred, struct stats)
+   Close the cachedb, optionally queuing any commit on a deferred list rather than running it */
 
-		CHECKA(hash_index_find(entry_hash, 0, ndx) == SUCCESS);
-		CHECKA(hash_index_find(entry_hash, 1, start) == SUCCESS);
-		CHECKA(hash_index_find(db->index_list, Z_LVAL_PP(ndx), entry) == SUCCESS);
+/* The commit is prepared in two phases (see cachedb_commit_prepare below).  If deferred is not NULL
+ * then the prepared commit is appended to this list for the caller to later pass to 
+ * _cachedb_commit_deferred(), typically once the response has been sent.  Otherwise it is run 
+ * before returning.  Note that a deferred commit still checks that the base file is unchanged, so 
+ * if the same DB is committed more than once in a request only the first commit will succeed.
+ * If stats is not NULL, then the DB's final statistics including the commit outcome are returned.
+ */
+PHPAPI int _cachedb_close_ex(cachedb_t* db, char force_mode, cachedb_commit_t **deferred, cachedb_stats_t *stats TSRMLS_DC)
+{
+	cachedb_commit_t *job     = NULL;
+	int               status  = SUCCESS;
+	double            t0      = cachedb_now();
+
+	if (db->shards) {
+		/* Each opened shard is closed and hence committed independently.  A create replaces the 
+		 * whole DB, so if any shard has additions then the file of every other shard is removed, 
+		 * as a missing shard is a valid empty DB. */
+		cachedb_stats_t total     = db->stats;
+		int             is_create = 0;
+		int             i;
+		if (db->mode == 'c' && force_mode != 'r') {
+			for (i = 0; i < db->shard_count && !is_create; i++) {
+				is_create = (db->shards[i] && db->shards[i]->tmp_file.next_pos > 0);
+			}
+		}
+		for (i = 0; i < db->shard_count; i++) {
+			cachedb_stats_t shard_stats;
+			int             is_stale = is_create && (!db->shards[i] || db->shards[i]->tmp_file.next_pos == 0);
+			if (db->shards[i]) {
+				db->shards[i]->durability = db->durability;
+				if (_cachedb_close_ex(db->shards[i], force_mode, deferred, &shard_stats TSRMLS_CC) == FAILURE) {
+					status = FAILURE;
+				}
+				cachedb_merge_stats(&total, &shard_stats);
+				db->shards[i] = NULL;
+			}
+			if (is_stale) {
+				char *name;
+				spprintf(&name, 0, CACHEDB_SHARD_NAME, db->base_file.name, i, db->shard_count);
+				unlink(name);
+				efree(name);
+			}
+		}
+		if (stats) {
+			*stats = total;
+		}
+		cachedb_db_dtor(&db TSRMLS_CC);
+		return status;
+	}
 
-		entry_list = Z_ARRVAL_PP(entry);
-		CHECKA(hash_index_find(entry_list, 1, zlen) == SUCCESS);
-		CHECKA(hash_index_find(entry_list, 2, len) == SUCCESS);
+	db->stats.commit_outcome = CACHEDB_COMMIT_NONE;
+	if (db->mode != 'r' && force_mode != 'r' && 
+	    (db->tmp_file.next_pos > 0 || (force_mode == 'p' && db->expired_count > 0))) {
+		/* The DB was opened in c or w mode and extra records have been added */ 
+		if ((job = cachedb_commit_prepare(db TSRMLS_CC)) == NULL) {
+			php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_close_err, db->base_file.name);
+			cachedb_db_dtor(&db TSRMLS_CC);
+			return FAILURE;
+		}
+	}
 
-		rec->key        = key;
-    	rec->key_length = key_length;
-		rec->is_base    = (Z_LVAL_PP(start) < db->base_file.filelength);
-		rec->start      = rec->is_base ? Z_LVAL_PP(start) : Z_LVAL_PP(start) - db->base_file.filelength;
-		rec->zlen       = Z_LVAL_PP(zlen);
-		rec->len        = Z_LVAL_PP(len);
+	/* The commit job holds its own descriptors, so the DB can now be released */
+	if (stats) {
+		*stats = db->stats;
+	}
+	cachedb_db_dtor(&db TSRMLS_CC);
 
-		/* return any metadata if it exists and the metadata argument has been supplied */
-		if (metadata && hash_index_find(entry_list, 3, meta) == SUCCESS) {
-			zval *tmp_zval;
-			zval_dtor(metadata);
-			array_init(metadata);
-			hash_copy(HASH_OF(metadata), HASH_OF(*meta), tmp_zval);
+	if (job && deferred) {
+		while (*deferred) {
+			deferred = &((*deferred)->next);
+		}
+		*deferred = job;
+		if (stats) {
+			stats->commit_outcome = CACHEDB_COMMIT_DEFERRED;
 		}
-		return SUCCESS;
 
-	} else {
+	} else if (job) {
+		if (cachedb_commit_run(job) == CACHEDB_COMMIT_FAILED) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_close_err, job->name);
+			status = FAILURE;
+		}
+		cachedb_commit_sync_dirs(job);
+		if (stats) {
+			stats->commit_outcome = job->outcome;
+		}
+		cachedb_commit_free(job);
+	}
 
-		memset(rec, 0, sizeof(cachedb_rec_t));
-		return FAILURE;
+	if (stats && job) {
+		stats->commit_time = cachedb_now() - t0;
 	}
+	return status;
+}
+/* }}} */
 
-error:
-	/* Find only uses internal stuctures so any CHECKA errors are fatal and should abort */	
-	php_error_docref(NULL TSRMLS_CC, E_ERROR, "invalid find for %s in file %s", key, db->base_file.name);
-	return FAILURE;
+/* {{{ proto void _cachedb_set_durability(struct db, int durability)
+   Set the durability of the DB's next commit, one of the CACHEDB_DURABILITY_* levels */
+
+/* The levels trade commit latency for crash safety:
+ *   NONE: The new file is published without any syncing, so a crash shortly after a commit may 
+ *         leave a truncated or empty DB, which is then rejected on open.  This is the default.
+ *   DATA: The new file's contents are fdatasynced before it is renamed over the base file.
+ *   DIR:  As DATA, and the directory is fsynced after the rename so that the publication itself
+ *         survives a crash.  For deferred commits this is done once per directory per request.
+ */
+PHPAPI void _cachedb_set_durability(cachedb_t* db, int durability TSRMLS_DC)
+{
+	if (durability < CACHEDB_DURABILITY_NONE) {
+		durability = CACHEDB_DURABILITY_NONE;
+	} else if (durability > CACHEDB_DURABILITY_DIR) {
+		durability = CACHEDB_DURABILITY_DIR;
+	}
+	db->durability = durability;
 }
 /* }}} */
 
-/* {{{ proto boolean _cachedb_fetch(struct db, zval &value)
-   Fetch the current record */
-PHPAPI int _cachedb_fetch(cachedb_t* db, zval *value TSRMLS_DC)
+/* {{{ proto void _cachedb_set_verify(struct db, int percent)
+   Set the percentage of fetches for which the record CRC is verified: 0 = off, 100 = always */
+PHPAPI void _cachedb_set_verify(cachedb_t* db, int percent TSRMLS_DC)
 {
-	cachedb_rec_t         *rec           = &(db->last_find);
-	size_t                 zlen          = rec->zlen;
-	int                    is_base_fetch = rec->is_base;
-	cachedb_file_t        *file          = is_base_fetch ? &(db->base_file) : &(db->tmp_file);
-	char                   error_type    = ' ';
+	db->verify = (percent < 0) ? 0 : (percent > 100 ? 100 : percent);
+}
+/* }}} */
 
-	if (zlen == 0) {
-		return 0;    /* last find failed so can't do a fetch */
-	}
+/* {{{ proto void _cachedb_commit_deferred(struct *jobs)
+   Run a list of deferred commits, in the background where the platform allows */
 
-	if (rec->start != file->next_pos) {
-		php_stream_seek(file->fp, rec->start, SEEK_SET);
+/* In a threaded (ZTS) build the commits are run by a detached thread.  Otherwise the process 
+ * double-forks so that the worker is reparented to init and can't become a zombie of the SAPI 
+ * process.  The worker closes any descriptors other than those of the jobs, so that it doesn't 
+ * hold open the client connection.  If neither is possible, the commits are run synchronously.
+ * As this is normally called after the request has been deactivated, failures are silent: a failed
+ * deferred commit is indistinguishable from one lost to a concurrent writer.
+ */
+PHPAPI void _cachedb_commit_deferred(cachedb_commit_t *jobs TSRMLS_DC)
+{
+	if (!jobs) {
+		return;
 	}
-
-	if ( cachedb_read_var(file->fp, db->is_binary, value, zlen, rec->len TSRMLS_CC) == SUCCESS) {
-		file->next_pos = rec->start + zlen;
-		return SUCCESS;
-	} else {
-		rec->start = 0;
-		return FAILURE;
+#if defined(ZTS) && defined(PTHREADS)
+	{
+		pthread_t      thread;
+		pthread_attr_t attr;
+		int            started;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		started = (pthread_create(&thread, &attr, cachedb_commit_thread, jobs) == 0);
+		pthread_attr_destroy(&attr);
+		if (started) {
+			return;
+		}
+	}
+#elif defined(HAVE_FORK) && !defined(PHP_WIN32)
+	{
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			if (fork() == 0) {
+				setsid();
+				cachedb_commit_close_fds(jobs);
+				cachedb_commit_run_list(jobs);
+			}
+			_exit(0);
+		} else if (pid > 0) {
+			waitpid(pid, NULL, 0);
+			cachedb_commit_free_list(jobs);
+			return;
+		}
 	}
+#endif
+	/* No background worker could be started so run the commits inline */
+	cachedb_commit_run_list(jobs);
 }
 /* }}} */
 
-/* {{{ proto boolean _cachedb_add(struct db, string key, int key_length, vzal value)
-   Add a pending record to the cachedb */
-PHPAPI int _cachedb_add(cachedb_t* db, char *key, size_t key_length, zval *value, zval *metadata TSRMLS_DC)
+/* {{{ Commit jobs
+   A commit is split into two phases.  The prepare phase runs in the request and uses the Zend API to
+   build the new index and trailer.  Its result is a self-contained job in malloced memory holding 
+   the new file prefix (header + index) and suffix (trailer + footer), the list of record extents to
+   be copied between them, and private dups of the base and temporary file descriptors.  The run 
+   phase only uses POSIX I/O and no Zend state, so it can safely be executed after the request has 
+   completed, in a forked child or in a background thread. 
+ */
+static cachedb_commit_t *cachedb_commit_prepare(cachedb_t* db TSRMLS_DC)
 {
-	void           *dummy;
-	zval           *tmp;
-	size_t          len, zlen, ndx;
-	cachedb_file_t *tf = &(db->tmp_file);
-	char            error_type  = ' ';
-
-	if (db->mode=='r' || hash_find(db->index_hash, key, dummy) == SUCCESS) {
-		return FAILURE; /* Cannot add to a R/O DB or if the key already exists! */
+	cachedb_commit_t *job     = NULL;
+	cachedb_header_t  hdr     = {"",0,0};
+	zval             *list    = NULL;
+	zval             *indexed = NULL;
+	zval             *tmp;
+	zval            **entry;
+	char             *zbuf    = NULL;
+	uint32_t         *crcs    = db->crcs;
+	size_t            zlen, len, ndx;
+	smart_str         trailer = {NULL, 0, 0};
+	char              error_type = ' ';
+
+	/* A DB written before record CRCs were introduced gets them on its first rewrite */
+	if (!db->base_crcs && cachedb_fill_base_crcs(db TSRMLS_CC) == FAILURE) {
+		return NULL;
 	}
 
-	CHECKA(!db->is_binary || Z_TYPE_P(value) == IS_STRING);
- 
-	if (tf->fp == 0) {
-		char           *opened = NULL;
-
-		/* Open and initialise temporary output file which holds added records */
-		tf->fp = php_stream_fopen_temporary_file(tf->dir, ".cachedb_otmp_", &opened);
-  		CHECKA(tf->fp > 0 && opened != NULL && strlen(opened) > 0);
+	job = pecalloc(1, sizeof(cachedb_commit_t), 1);
+	job->base_fd = job->tmp_fd = -1;
+	job->name    = pestrdup(db->base_file.name, 1);
+	job->dir     = pestrdup(db->base_file.dir, 1);
+	job->sb      = db->base_file.sb.sb;
+	job->durability = db->durability;
+  
+	/* Make shallow copies of the live index_list entries into a zval list, and ditto their CRCs */
+	MAKE_STD_ZVAL(list);
+	array_init_size(list, hash_count(db->index_list) - db->expired_count);
 
-		/* collect the filename and unlink the file so that it is automatical garbage collected on closure */
-		tf->name        = opened;
-		tf->name_length = strlen(opened);
-		unlink(tf->name);
-		tf->next_pos    = 0;
+	if (db->expired_count == 0) {
+		hash_copy(Z_ARRVAL_P(list), db->index_list, tmp);
+	} else {
+		crcs = emalloc((hash_count(db->index_list) + 1) * sizeof(uint32_t));
+		for (hash_reset(db->index_list), ndx = 0; 
+		     hash_get(db->index_list, entry) == SUCCESS; 
+		     hash_next(db->index_list), ndx++) {
+			if (!cachedb_is_expired(db, Z_ARRVAL_PP(entry))) {
+				crcs[hash_count(Z_ARRVAL_P(list))] = db->crcs[ndx];
+				Z_ADDREF_PP(entry);
+				add_next_index_zval(list, *entry);
+			}
+		}
 	}
 
-	/* Any additions are written to the end of the temporary file */ 
-	if (tf->next_pos != tf->filelength) {
-		php_stream_seek(tf->fp, 0, SEEK_END);
-		CHECKA(php_stream_tell(tf->fp) == tf->filelength);
+	/* The prefix is the header followed by the serialized index */
+	CHECKA(cachedb_encode_var(list, &zbuf, &zlen, &len, NULL TSRMLS_CC) == SUCCESS);
+	job->index_crc = cachedb_crc32c(0, zbuf, zlen);
+	memcpy(hdr.fingerprint, CACHEDB_HEADER_FINGERPRINT_TRAILER, sizeof(CACHEDB_HEADER_FINGERPRINT_TRAILER)-1);
+	hdr.zlen = cachedb_le64((uint64_t) zlen);
+	hdr.len  = cachedb_le64((uint64_t) len);
+	job->prefix_length = sizeof(hdr) + zlen;
+	job->prefix        = pemalloc(job->prefix_length, 1);
+	memcpy(job->prefix, &hdr, sizeof(hdr));
+	memcpy(job->prefix + sizeof(hdr), zbuf, zlen);
+	EFREE(zbuf);
+
+	/* The suffix is the trailer sections and footer.  The postings are rebuilt in full from the 
+	 * index, so only the field names are needed from any existing section */
+	indexed = db->postings ? db->postings : cachedb_load_postings_fields(db TSRMLS_CC);
+	CHECKA(cachedb_build_trailer(&trailer, Z_ARRVAL_P(list), job->index_crc, crcs, job->prefix_length, 
+	                             db->is_dense, (indexed ? Z_ARRVAL_P(indexed) : NULL) TSRMLS_CC) == SUCCESS);
+	if (indexed && indexed != db->postings) {
+		zval_ptr_dtor(&indexed);
 	}
-	CHECKA(cachedb_write_var(tf->fp, db->is_binary, value, &zlen, &len TSRMLS_CC)==SUCCESS);
-	tf->filelength += zlen;
-	tf->next_pos    = tf->filelength;
+	job->suffix_length = trailer.len;
+	job->suffix        = pemalloc(trailer.len, 1);
+	memcpy(job->suffix, trailer.c, trailer.len);
+	smart_str_free(&trailer);
 
-	/* Update index_list and index_hash */
-	ndx = hash_count(db->index_list);
-	MAKE_STD_ZVAL(tmp);
-	array_init_size(tmp, (metadata ? 4 : 3));
-	add_next_index_stringl(tmp, key, key_length, 1);
-	add_next_index_long(tmp, zlen);
-	add_next_index_long(tmp, len);
-	if (metadata) {
-		add_next_index_zval(tmp, metadata);
-		Z_ADDREF_P(metadata);
+	if (db->base_file.fp) {
+		CHECKA((job->base_fd = cachedb_dup_fd(db->base_file.fp TSRMLS_CC)) >= 0);
+	}
+	if (db->tmp_file.fp) {
+		CHECKA((job->tmp_fd = cachedb_dup_fd(db->tmp_file.fp TSRMLS_CC)) >= 0);
 	}
-	hash_add_next_index_zval(db->index_list, tmp);
 
-	MAKE_STD_ZVAL(tmp);
-	array_init_size(tmp, 2);
-	add_next_index_long(tmp, ndx);
-	add_next_index_long(tmp, db->base_file.filelength + (tf->next_pos -zlen) );
-	hash_add(db->index_hash, key, tmp);
+	if (db->expired_count == 0) {
+		cachedb_commit_add_extent(job, job->base_fd, db->base_file.header_length,
+		                          db->records_end - db->base_file.header_length);
+		cachedb_commit_add_extent(job, job->tmp_fd, 0, db->tmp_file.filelength);
 
-	return SUCCESS;
+	} else {
+		/* Walk the index in record order adding the live records. The record offsets are implicit,
+		 * so track the running offset to determine which file the record is in.  Runs of adjacent 
+		 * live records in the same file are coalesced into a single extent. 
+		 */
+		off_t pos = db->base_file.header_length;
+
+		for (hash_reset(db->index_list); 
+		     hash_get(db->index_list, entry) == SUCCESS; 
+		     hash_next(db->index_list)) {
+			zval **rec_zlen;
+			int    is_base = (pos < db->records_end);
+
+			CHECKA(hash_index_find(Z_ARRVAL_PP(entry), 1, rec_zlen) == SUCCESS);
+			if (!cachedb_is_expired(db, Z_ARRVAL_PP(entry))) {
+				cachedb_commit_add_extent(job, is_base ? job->base_fd : job->tmp_fd, 
+				                          is_base ? pos : pos - db->records_end, Z_LVAL_PP(rec_zlen));
+			}
+			pos += Z_LVAL_PP(rec_zlen);
+		}
+	}
 
-error:
-	php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_add_err, db->base_file.name);
-	return FAILURE;
+	zval_ptr_dtor(&list);
+	if (crcs != db->crcs) {
+		efree(crcs);
+	}
+	return job;
 
+error:
+	if (list) {
+		zval_ptr_dtor(&list);
+	}
+	if (indexed && indexed != db->postings) {
+		zval_ptr_dtor(&indexed);
+	}
+	if (crcs != db->crcs) {
+		efree(crcs);
+	}
+	EFREE(zbuf);
+	smart_str_free(&trailer);
+	cachedb_commit_free(job);
+	return NULL;
 }
-/* }}} */
 
-/* {{{ proto boolean _cachedb_info(struct db)
-   Return a copy of the cachedb index */
-PHPAPI int _cachedb_info( zval **info, cachedb_t* db TSRMLS_DC)
+static void cachedb_commit_add_extent(cachedb_commit_t *job, int fd, off_t start, size_t length)
 {
-	zval *list, *hash;
-	zval *dummy = NULL;
-	char error_type  = ' ';
+	cachedb_extent_t *last = job->extent_count ? &job->extents[job->extent_count - 1] : NULL;
 
-	/* Make shallow copies of index_list and index_hash into zvals */
-	MAKE_STD_ZVAL(list);
-	array_init_size(list, hash_count(db->index_list));
-	hash_copy(Z_ARRVAL_P(list), db->index_list, dummy);
+	if (length == 0) {
+		return;
+	}
+	if (last && last->fd == fd && last->start + last->length == start) {
+		last->length += length;
+		return;
+	}
+	if (job->extent_count == job->extent_size) {
+		job->extent_size = job->extent_size ? 2 * job->extent_size : 8;
+		job->extents     = perealloc(job->extents, job->extent_size * sizeof(cachedb_extent_t), 1);
+	}
+	last         = &job->extents[job->extent_count++];
+	last->fd     = fd;
+	last->start  = start;
+	last->length = length;
+}
 
-	MAKE_STD_ZVAL(hash);
-	array_init_size(hash, hash_count(db->index_hash));
-	hash_copy(Z_ARRVAL_P(hash), db->index_hash, dummy);
+/* Return a private dup of the stream's descriptor so the job is independent of the stream */
+static int cachedb_dup_fd(php_stream *fp TSRMLS_DC)
+{
+	int fd;
 
-	array_init_size(*info, 2);
-	add_next_index_zval(*info, list);
-	add_next_index_zval(*info, hash);
+	php_stream_flush(fp);
+	if (php_stream_cast(fp, PHP_STREAM_AS_FD | PHP_STREAM_CAST_INTERNAL, (void **) &fd, 0) == FAILURE) {
+		return -1;
+	}
+	return dup(fd);
+}
 
+static int cachedb_write_fd(int fd, const char *buf, size_t length)
+{
+	while (length > 0) {
+		ssize_t n = write(fd, buf, length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return FAILURE;
+		}
+		buf    += n;
+		length -= n;
+	}
 	return SUCCESS;
 }
-/* }}} */
 
-/* {{{ proto struct stat *cachedb_get_s(struct db)
-   Return cachedb stat block */
+static int cachedb_copy_extent(int to, cachedb_extent_t *extent, char *buf, size_t buf_size)
+{
+	off_t  pos       = extent->start;
+	size_t remaining = extent->length;
+
+	while (remaining > 0) {
+		ssize_t n = pread(extent->fd, buf, remaining < buf_size ? remaining : buf_size, pos);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0 || cachedb_write_fd(to, buf, n) == FAILURE) {
+			return FAILURE;
+		}
+		pos       += n;
+		remaining -= n;
+	}
+	return SUCCESS;
+}
+
+/* {{{ Temporary file creation and publication
+   Where the platform supports O_TMPFILE, the new DB is built in an anonymous file in the DB's
+   directory, and only given a name by linkat() once it is complete and about to be renamed over
+   the base file.  So a crash or failure during the build leaves no litter.  Otherwise a named 
+   mkstemp() file is used as before.  The returned name is NULL in the anonymous case.
+ */
+static int cachedb_commit_open_tmp(cachedb_commit_t *job, char **new_name)
+{
+	int fd;
+
+	*new_name = NULL;
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+	if ((fd = open(job->dir, O_TMPFILE | O_WRONLY, 0600)) >= 0) {
+		return fd;
+	}
+	/* the FS or kernel doesn't support O_TMPFILE, so fall through to use a named file */
+#endif
+	*new_name = pemalloc(strlen(job->dir) + sizeof("/.cachedb_tmp_XXXXXX"), 1);
+	sprintf(*new_name, "%s/.cachedb_tmp_XXXXXX", job->dir);
+	if ((fd = mkstemp(*new_name)) < 0) {
+		PEFREE(*new_name, 1);
+	}
+	return fd;
+}
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+/* Give an anonymous file a temporary name.  This is unique to the process and descriptor, with a
+ * retry count in case a stale name has been left by a crashed process with the same pid. */
+static int cachedb_commit_link_tmp(cachedb_commit_t *job, int fd, char **new_name)
+{
+	char proc_name[sizeof("/proc/self/fd/") + 3*sizeof(int)];
+	int  attempt;
+
+	sprintf(proc_name, "/proc/self/fd/%d", fd);
+	*new_name = pemalloc(strlen(job->dir) + sizeof("/.cachedb_tmp_") + 9*sizeof(int), 1);
+	for (attempt = 0; attempt < 4; attempt++) {
+		sprintf(*new_name, "%s/.cachedb_tmp_%ld_%d_%d", job->dir, (long) getpid(), fd, attempt);
+		if (linkat(AT_FDCWD, proc_name, AT_FDCWD, *new_name, AT_SYMLINK_FOLLOW) == 0) {
+			return SUCCESS;
+		} else if (errno != EEXIST) {
+			break;
+		}
+	}
+	PEFREE(*new_name, 1);
+	return FAILURE;
+}
+#endif
+/* }}} */
+
+/* Build the new DB in a temporary file in the DB's directory, then move it over the base file if 
+ *  - the base file existed and still has the same dev + inode + mtime
+ *  - the base file didn't exist and still doesn't.
+ * If the job's durability is at least CACHEDB_DURABILITY_DATA then the file contents are flushed to
+ * stable storage before the file is published.
+ */
+static int cachedb_commit_run(cachedb_commit_t *job)
+{
+	char        *new_name = NULL;
+	char        *buf;
+	struct stat  sb;
+	int          fd, i, ok, base_ok, stat_status;
+
+	if ((fd = cachedb_commit_open_tmp(job, &new_name)) < 0) {
+		return (job->outcome = CACHEDB_COMMIT_FAILED);
+	}
+
+	buf = pemalloc(CACHEDB_COPY_BUFFER_SIZE, 1);
+	ok  = (cachedb_write_fd(fd, job->prefix, job->prefix_length) == SUCCESS);
+	for (i = 0; ok && i < job->extent_count; i++) {
+		ok = (cachedb_copy_extent(fd, &job->extents[i], buf, CACHEDB_COPY_BUFFER_SIZE) == SUCCESS);
+	}
+	ok = ok && (cachedb_write_fd(fd, job->suffix, job->suffix_length) == SUCCESS);
+	pefree(buf, 1);
+
+	if (ok && job->durability >= CACHEDB_DURABILITY_DATA) {
+#ifdef HAVE_FDATASYNC
+		ok = (fdatasync(fd) == 0);
+#elif !defined(PHP_WIN32)
+		ok = (fsync(fd) == 0);
+#endif
+	}
+
+	stat_status = stat(job->name, &sb);
+	if (job->sb.st_size > 0) { /* size>0 means it existed */
+		/* Most FS now store mtimes stamped to the nS, but we can't guarantee this so
+		 * the file-change check is based on the dev + inode + mtime 
+		 */
+		base_ok = (stat_status == 0) && 
+			(job->sb.st_ino   == sb.st_ino) &&
+			(job->sb.st_dev   == sb.st_dev) &&
+			(job->sb.st_mtime == sb.st_mtime);
+	} else { /* it didn't exist or was unchanged */
+		base_ok = (stat_status == -1) ||
+		   ((job->sb.st_ino   == sb.st_ino) &&
+			(job->sb.st_dev   == sb.st_dev) &&
+			(job->sb.st_mtime == sb.st_mtime));
+	}
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+	if (ok && base_ok && !new_name) {
+		ok = (cachedb_commit_link_tmp(job, fd, &new_name) == SUCCESS);
+	}
+#endif
+	ok = (close(fd) == 0) && ok;
+
+	if (ok && base_ok && rename(new_name, job->name) == 0) {
+		job->outcome = CACHEDB_COMMIT_PUBLISHED;
+	} else {
+		job->outcome = ok ? CACHEDB_COMMIT_DISCARDED : CACHEDB_COMMIT_FAILED;
+		if (new_name) {
+			unlink(new_name);
+		}
+	}
+	PEFREE(new_name, 1);
+	return job->outcome;
+}
+
+/* With CACHEDB_DURABILITY_DIR, the directories of the published jobs are fsynced so that the 
+ * renames are themselves durable.  This is batched so that each directory is synced only once.
+ */
+static void cachedb_commit_sync_dirs(cachedb_commit_t *jobs)
+{
+#ifndef PHP_WIN32
+	cachedb_commit_t *job, *prev;
+
+	for (job = jobs; job; job = job->next) {
+		if (job->durability < CACHEDB_DURABILITY_DIR || job->outcome != CACHEDB_COMMIT_PUBLISHED) {
+			continue;
+		}
+		for (prev = jobs; prev != job; prev = prev->next) {
+			if (prev->durability >= CACHEDB_DURABILITY_DIR && prev->outcome == CACHEDB_COMMIT_PUBLISHED &&
+			    strcmp(prev->dir, job->dir) == 0) {
+				break;    /* this directory has already been synced */
+			}
+		}
+		if (prev == job) {
+			int dir_fd = open(job->dir, O_RDONLY);
+			if (dir_fd >= 0) {
+				fsync(dir_fd);
+				close(dir_fd);
+			}
+		}
+	}
+#endif
+}
+
+/* Run and free a list of jobs, returning the number that failed */
+static int cachedb_commit_run_list(cachedb_commit_t *jobs)
+{
+	cachedb_commit_t *job;
+	int               failed = 0;
+
+	for (job = jobs; job; job = job->next) {
+		if (cachedb_commit_run(job) == CACHEDB_COMMIT_FAILED) {
+			failed++;
+		}
+	}
+	cachedb_commit_sync_dirs(jobs);
+	cachedb_commit_free_list(jobs);
+	return failed;
+}
+
+static void cachedb_commit_free(cachedb_commit_t *job)
+{
+	if (job->base_fd >= 0) {
+		close(job->base_fd);
+	}
+	if (job->tmp_fd >= 0) {
+		close(job->tmp_fd);
+	}
+	PEFREE(job->name, 1);
+	PEFREE(job->dir, 1);
+	PEFREE(job->prefix, 1);
+	PEFREE(job->suffix, 1);
+	PEFREE(job->extents, 1);
+	pefree(job, 1);
+}
+
+static void cachedb_commit_free_list(cachedb_commit_t *jobs)
+{
+	while (jobs) {
+		cachedb_commit_t *next = jobs->next;
+		cachedb_commit_free(jobs);
+		jobs = next;
+	}
+}
+
+#if defined(ZTS) && defined(PTHREADS)
+static void *cachedb_commit_thread(void *jobs)
+{
+	cachedb_commit_run_list((cachedb_commit_t *) jobs);
+	return NULL;
+}
+#elif defined(HAVE_FORK) && !defined(PHP_WIN32)
+/* Close every descriptor in the worker except those used by the jobs */
+static void cachedb_commit_close_fds(cachedb_commit_t *jobs)
+{
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	int  fd;
+
+	if (max_fd < 0 || max_fd > CACHEDB_MAX_CLOSE_FD) {
+		max_fd = CACHEDB_MAX_CLOSE_FD;
+	}
+	for (fd = 0; fd < max_fd; fd++) {
+		cachedb_commit_t *job;
+		for (job = jobs; job && job->base_fd != fd && job->tmp_fd != fd; job = job->next) {}
+		if (!job) {
+			close(fd);
+		}
+	}
+}
+#endif
+/* }}} */
+
+/* {{{ proto boolean _cachedb_find(struct db)
+   Set the record position at the specified key, returning a boolean to indicate if the key exists */
+
+/* For a layered DB, the layers are searched top down.  The Bloom filters are only used in this case
+ * as for a single layer DB, the filter check would cost as much as the index probe that it avoids.
+ */
+PHPAPI int _cachedb_find(cachedb_t* db, char *key, size_t key_length, zval *metadata TSRMLS_DC)
+{
+	cachedb_t *layer;
+	uint32_t   h1, h2;
+	int        hashed = 0;
+
+	if (db->is_dense) {
+		unsigned long id;
+		if (cachedb_parse_id(key, key_length, &id) == FAILURE) {
+			id = CACHEDB_DENSE_MAX_ID + 1;    /* a non-integer key is always a miss */
+		}
+		return _cachedb_find_int(db, id TSRMLS_CC);
+	}
+
+	db->stats.finds++;
+	if (db->shared) {
+		if (cachedb_find_shared(db, key, key_length) == SUCCESS) {
+			db->stats.hits++;
+			return SUCCESS;
+		}
+		memset(&(db->last_find), 0, sizeof(cachedb_rec_t));
+		db->stats.misses++;
+		return FAILURE;
+	}
+	if (db->paged_root) {
+		if (cachedb_find_paged(db, key, key_length TSRMLS_CC) == SUCCESS) {
+			db->stats.hits++;
+			return SUCCESS;
+		}
+		memset(&(db->last_find), 0, sizeof(cachedb_rec_t));
+		db->stats.misses++;
+		return FAILURE;
+	}
+	if (db->shards) {
+		cachedb_t *shard = cachedb_get_shard(db, cachedb_route_key(db, key, key_length) TSRMLS_CC);
+		if (shard && cachedb_find_in_layer(db, shard, key, key_length, metadata TSRMLS_CC) == SUCCESS) {
+			db->stats.hits++;
+			return SUCCESS;
+		}
+		memset(&(db->last_find), 0, sizeof(cachedb_rec_t));
+		db->stats.misses++;
+		return FAILURE;
+	}
+
+	for (layer = db; layer; layer = layer->lower) {
+		if (db->lower && layer->bloom) {
+			if (!hashed) {
+				cachedb_bloom_hash(key, key_length, &h1, &h2);
+				hashed = 1;
+			}
+			if (!cachedb_bloom_test(layer->bloom, layer->bloom_bits, layer->bloom_hashes, h1, h2)) {
+				continue;   /* the key is definitely not in this layer */
+			}
+		}
+		if (cachedb_find_in_layer(db, layer, key, key_length, metadata TSRMLS_CC) == SUCCESS) {
+			db->stats.hits++;
+			return SUCCESS;
+		}
+	}
+
+	memset(&(db->last_find), 0, sizeof(cachedb_rec_t));
+	db->stats.misses++;
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto boolean _cachedb_find_int(struct db, int id)
+   Set the record position at the specified id of an integer mode DB, returning a boolean to 
+   indicate if the id exists.  This is a direct lookup in the dense array without any hashing. */
+PHPAPI int _cachedb_find_int(cachedb_t* db, unsigned long id TSRMLS_DC)
+{
+	cachedb_rec_t   *rec = &(db->last_find);
+	cachedb_dense_t *slot;
+
+	db->stats.finds++;
+	if (db->is_dense && id < db->dense_count && (slot = &(db->dense[id]))->ndx != 0 &&
+	    (slot->expires == 0 || slot->expires > db->open_time)) {
+		rec->key        = NULL;
+		rec->key_length = 0;
+		rec->is_base    = (slot->start < (uint64_t) db->records_end);
+		rec->start      = rec->is_base ? slot->start : slot->start - db->records_end;
+		rec->zlen       = slot->zlen;
+		rec->len        = slot->len;
+		rec->ndx        = slot->ndx - 1;
+		rec->layer      = db;
+		db->stats.hits++;
+		return SUCCESS;
+	}
+
+	memset(rec, 0, sizeof(cachedb_rec_t));
+	db->stats.misses++;
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_find_in_layer(struct db, struct layer)
+   Look up a key in one layer of a DB, setting the DB record position on a hit */
+static int cachedb_find_in_layer(cachedb_t* db, cachedb_t* layer, char *key, size_t key_length, zval *metadata TSRMLS_DC)
+{
+	zval          **entry = NULL;
+	zval          **ndx, **start, **zlen, **len, **meta=NULL;
+	cachedb_rec_t *rec = &(db->last_find);
+	char           error_type  = ' ';
+	
+	if (hash_find(layer->index_hash, key, entry)==SUCCESS) {
+
+		HashTable *entry_hash = Z_ARRVAL_PP(entry);
+		HashTable *entry_list;
+
+		CHECKA(hash_index_find(entry_hash, 0, ndx) == SUCCESS);
+		CHECKA(hash_index_find(entry_hash, 1, start) == SUCCESS);
+		CHECKA(hash_index_find(layer->index_list, Z_LVAL_PP(ndx), entry) == SUCCESS);
+
+		entry_list = Z_ARRVAL_PP(entry);
+		if (cachedb_is_expired(layer, entry_list)) {
+			return FAILURE;   /* an expired record is a miss */
+		}
+		CHECKA(hash_index_find(entry_list, 1, zlen) == SUCCESS);
+		CHECKA(hash_index_find(entry_list, 2, len) == SUCCESS);
+
+		rec->key        = key;
+    	rec->key_length = key_length;
+		rec->is_base    = (Z_LVAL_PP(start) < layer->records_end);
+		rec->start      = rec->is_base ? Z_LVAL_PP(start) : Z_LVAL_PP(start) - layer->records_end;
+		rec->zlen       = Z_LVAL_PP(zlen);
+		rec->len        = Z_LVAL_PP(len);
+		rec->ndx        = Z_LVAL_PP(ndx);
+		rec->layer      = layer;
+
+		/* return any metadata if it exists and the metadata argument has been supplied */
+		if (metadata && hash_index_find(entry_list, 3, meta) == SUCCESS && Z_TYPE_PP(meta) == IS_ARRAY) {
+			zval *tmp_zval;
+			zval_dtor(metadata);
+			array_init(metadata);
+			hash_copy(HASH_OF(metadata), HASH_OF(*meta), tmp_zval);
+		}
+		return SUCCESS;
+	}
+	return FAILURE;
+
+error:
+	/* Find only uses internal stuctures so any CHECKA errors are fatal and should abort */	
+	php_error_docref(NULL TSRMLS_CC, E_ERROR, "invalid find for %s in file %s", key, layer->base_file.name);
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto boolean _cachedb_fetch(struct db, zval &value)
+   Fetch the current record */
+PHPAPI int _cachedb_fetch(cachedb_t* db, zval *value TSRMLS_DC)
+{
+	cachedb_rec_t         *rec           = &(db->last_find);
+	size_t                 zlen          = rec->zlen;
+	int                    is_base_fetch = rec->is_base;
+	cachedb_t             *layer         = rec->layer ? rec->layer : db;
+	cachedb_file_t        *file          = is_base_fetch ? &(layer->base_file) : &(layer->tmp_file);
+	const uint32_t        *crc           = NULL;
+	uint32_t               paged_crc;
+	int                    status;
+	char                   error_type    = ' ';
+
+	if (zlen == 0) {
+		return 0;    /* last find failed so can't do a fetch */
+	}
+
+	db->stats.fetches++;
+
+	/* Verify the record checksum on all or a sample of fetches. The sample uses a stride which is
+	 * coprime to 100 so that the verified fetches are spread evenly rather than bunched.  A paged
+	 * handle doesn't load the CRC section, so reads the record's CRC from it. */
+	if (db->verify > 0 && rec->ndx < layer->crc_count && (layer->base_crcs || !is_base_fetch) &&
+	    (db->verify >= 100 || ((db->fetch_count++ * 37) % 100) < (unsigned int) db->verify)) {
+		if (layer->shared) {
+			crc = &(layer->shared->crcs[rec->ndx]);
+		} else if (layer->crcs) {
+			crc = &(layer->crcs[rec->ndx]);
+		} else if (cachedb_read_crc(layer, rec->ndx, &paged_crc TSRMLS_CC) == SUCCESS) {
+			crc = &paged_crc;
+		} else {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_trailer_err, layer->base_file.name);
+			return FAILURE;
+		}
+	}
+
+	if (rec->start != file->next_pos) {
+		php_stream_seek(file->fp, rec->start, SEEK_SET);
+		db->stats.seeks++;
+	}
+
+	status = cachedb_read_var(file->fp, db->is_binary, value, zlen, rec->len, crc, &(db->stats) TSRMLS_CC);
+	if (status == SUCCESS) {
+		file->next_pos = rec->start + zlen;
+		if (is_base_fetch) {
+			db->stats.base_bytes_read   += zlen;
+		} else {
+			db->stats.staged_bytes_read += zlen;
+		}
+		return SUCCESS;
+	} else {
+		if (status == CACHEDB_CORRUPT) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_crc_err, layer->base_file.name);
+		}
+		file->next_pos = -1;
+		rec->start = 0;
+		return FAILURE;
+	}
+}
+/* }}} */
+
+/* {{{ proto boolean _cachedb_add(struct db, string key, int key_length, vzal value)
+   Add a pending record to the cachedb */
+PHPAPI int _cachedb_add(cachedb_t* db, char *key, size_t key_length, zval *value, zval *metadata TSRMLS_DC)
+{
+	return _cachedb_add_ex(db, key, key_length, value, metadata, 0 TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ proto boolean _cachedb_add_ex(struct db, string key, int key_length, vzal value, array metadata, int expires)
+   Add a pending record to the cachedb with an optional expiry time (0 = never expires) */
+PHPAPI int _cachedb_add_ex(cachedb_t* db, char *key, size_t key_length, zval *value, zval *metadata, time_t expires TSRMLS_DC)
+{
+	zval          **entry;
+	zval           *tmp;
+	size_t          len, zlen, ndx;
+	uint32_t        crc;
+	unsigned long   id = 0;
+	cachedb_dense_t *slot;
+	cachedb_file_t *tf = &(db->tmp_file);
+	char            error_type  = ' ';
+
+	if (db->mode=='r') {
+		return FAILURE; /* Cannot add to a R/O DB */
+	}
+
+	if (db->shards) {
+		cachedb_t *shard = cachedb_get_shard(db, cachedb_route_key(db, key, key_length) TSRMLS_CC);
+		return shard ? _cachedb_add_ex(shard, key, key_length, value, metadata, expires TSRMLS_CC) : FAILURE;
+	}
+
+	if (db->is_dense) {
+		/* An integer key must be in canonical decimal form, and may only be re-added if expired */
+		if (metadata || cachedb_parse_id(key, key_length, &id) == FAILURE) {
+			return FAILURE;
+		}
+		if (id < db->dense_count && db->dense[id].ndx != 0 &&
+		    (db->dense[id].expires == 0 || db->dense[id].expires > db->open_time)) {
+			return FAILURE;
+		}
+		if (id >= db->dense_count && id >= 2 * (unsigned long) hash_count(db->index_list) + CACHEDB_DENSE_SLACK) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_sparse_err, id, 
+			                 hash_count(db->index_list), db->base_file.name);
+			return FAILURE;
+		}
+
+	} else if (hash_find(db->index_hash, key, entry) == SUCCESS) {
+		zval **list_ndx, **list_entry;
+
+		/* The key already exists, which is only allowed if the existing record has expired */
+		if (hash_index_find(Z_ARRVAL_PP(entry), 0, list_ndx) != SUCCESS ||
+		    hash_index_find(db->index_list, Z_LVAL_PP(list_ndx), list_entry) != SUCCESS ||
+		    !cachedb_is_expired(db, Z_ARRVAL_PP(list_entry))) {
+			return FAILURE;
+		}
+	}
+
+	CHECKA(!db->is_binary || Z_TYPE_P(value) == IS_STRING);
+ 
+	if (tf->fp == 0) {
+		char           *opened = NULL;
+
+		/* Open and initialise temporary output file which holds added records */
+		tf->fp = php_stream_fopen_temporary_file(tf->dir, ".cachedb_otmp_", &opened);
+  		CHECKA(tf->fp > 0 && opened != NULL && strlen(opened) > 0);
+
+		/* collect the filename and unlink the file so that it is automatical garbage collected on closure */
+		tf->name        = opened;
+		tf->name_length = strlen(opened);
+		unlink(tf->name);
+		tf->next_pos    = 0;
+	}
+
+	/* Any additions are written to the end of the temporary file */ 
+	if (tf->next_pos != tf->filelength) {
+		php_stream_seek(tf->fp, 0, SEEK_END);
+		CHECKA(php_stream_tell(tf->fp) == tf->filelength);
+	}
+	CHECKA(cachedb_write_var(tf->fp, db->is_binary, value, &zlen, &len, &crc, &(db->stats) TSRMLS_CC)==SUCCESS);
+	tf->filelength += zlen;
+	tf->next_pos    = tf->filelength;
+	cachedb_add_crc(db, crc);
+	db->stats.records_added++;
+
+	/* Update index_list and index_hash */
+	ndx = hash_count(db->index_list);
+	MAKE_STD_ZVAL(tmp);
+	array_init_size(tmp, (expires ? 5 : (metadata ? 4 : 3)));
+	add_next_index_stringl(tmp, key, key_length, 1);
+	add_next_index_long(tmp, zlen);
+	add_next_index_long(tmp, len);
+	if (metadata) {
+		add_next_index_zval(tmp, metadata);
+		Z_ADDREF_P(metadata);
+	} else if (expires) {
+		add_next_index_null(tmp);
+	}
+	if (expires) {
+		add_next_index_long(tmp, expires);
+	}
+	hash_add_next_index_zval(db->index_list, tmp);
+
+	/* Note that this replaces any existing expired entry for this key */
+	if (db->is_dense) {
+		slot          = cachedb_dense_slot(db, id);
+		slot->start   = db->records_end + (tf->next_pos - zlen);
+		slot->zlen    = zlen;
+		slot->len     = len;
+		slot->ndx     = ndx + 1;
+		slot->expires = (uint32_t) expires;
+	} else {
+		MAKE_STD_ZVAL(tmp);
+		array_init_size(tmp, 2);
+		add_next_index_long(tmp, ndx);
+		add_next_index_long(tmp, db->records_end + (tf->next_pos -zlen) );
+		hash_update(db->index_hash, key, tmp);
+	}
+
+	/* Keep any Bloom filter valid for lookups through a layered handle */
+	if (db->bloom) {
+		uint32_t h1, h2;
+		cachedb_bloom_hash(key, key_length, &h1, &h2);
+		cachedb_bloom_set(db->bloom, db->bloom_bits, db->bloom_hashes, h1, h2);
+	}
+
+	return SUCCESS;
+
+error:
+	php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_add_err, db->base_file.name);
+	return FAILURE;
+
+}
+/* }}} */
+
+/* {{{ proto boolean _cachedb_info(struct db)
+   Return a copy of the cachedb index */
+PHPAPI int _cachedb_info( zval **info, cachedb_t* db TSRMLS_DC)
+{
+	zval *list, *hash;
+	zval *dummy = NULL;
+	char error_type  = ' ';
+
+	if (db->shards) {
+		/* For a sharded DB, return the array of per-shard info arrays */
+		int i;
+		array_init_size(*info, db->shard_count);
+		for (i = 0; i < db->shard_count; i++) {
+			cachedb_t *shard = cachedb_get_shard(db, i TSRMLS_CC);
+			zval      *shard_info;
+			MAKE_STD_ZVAL(shard_info);
+			if (shard) {
+				_cachedb_info(&shard_info, shard TSRMLS_CC);
+			} else {
+				ZVAL_NULL(shard_info);
+			}
+			add_next_index_zval(*info, shard_info);
+		}
+		return SUCCESS;
+	}
+
+	/* Make shallow copies of index_list and index_hash into zvals */
+	MAKE_STD_ZVAL(list);
+	array_init_size(list, hash_count(db->index_list));
+	hash_copy(Z_ARRVAL_P(list), db->index_list, dummy);
+
+	MAKE_STD_ZVAL(hash);
+	array_init_size(hash, hash_count(db->index_hash));
+	hash_copy(Z_ARRVAL_P(hash), db->index_hash, dummy);
+
+	array_init_size(*info, 2);
+	add_next_index_zval(*info, list);
+	add_next_index_zval(*info, hash);
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ proto boolean _cachedb_index_metadata(struct db, HashTable fields)
+   Declare the given metadata fields as indexed.  This is only allowed for a DB opened in create 
+   mode, and the declaration is then kept by each later commit.  Field names must not be integers. */
+PHPAPI int _cachedb_index_metadata(cachedb_t* db, HashTable *fields TSRMLS_DC)
+{
+	zval **field;
+
+	if (db->shards) {
+		int i;
+		for (i = 0; i < db->shard_count; i++) {
+			cachedb_t *shard = cachedb_get_shard(db, i TSRMLS_CC);
+			if (!shard || _cachedb_index_metadata(shard, fields TSRMLS_CC) == FAILURE) {
+				return FAILURE;
+			}
+		}
+		return SUCCESS;
+	}
+
+	if (db->mode != 'c' || db->is_dense) {
+		return FAILURE;
+	}
+	for (hash_reset(fields); hash_get(fields, field) == SUCCESS; hash_next(fields)) {
+		if (Z_TYPE_PP(field) != IS_STRING || Z_STRLEN_PP(field) == 0 || 
+		    (Z_STRVAL_PP(field)[0] >= '0' && Z_STRVAL_PP(field)[0] <= '9') || Z_STRVAL_PP(field)[0] == '-') {
+			return FAILURE;
+		}
+	}
+
+	if (!db->postings) {
+		MAKE_STD_ZVAL(db->postings);
+		array_init(db->postings);
+	}
+	for (hash_reset(fields); hash_get(fields, field) == SUCCESS; hash_next(fields)) {
+		if (!zend_hash_exists(Z_ARRVAL_P(db->postings), Z_STRVAL_PP(field), Z_STRLEN_PP(field)+1)) {
+			zval *values;
+			MAKE_STD_ZVAL(values);
+			array_init(values);
+			zend_hash_update(Z_ARRVAL_P(db->postings), Z_STRVAL_PP(field), Z_STRLEN_PP(field)+1, 
+			                 &values, sizeof(zval *), NULL);
+		}
+	}
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ proto boolean _cachedb_find_by(struct db, string field, zval value, array keys)
+   Append to the keys array the keys of the live records whose indexed metadata field has the given 
+   value.  Values are compared in their string form, so 32 matches "32".  This returns FAILURE if 
+   the field isn't indexed, or the DB is opened in integer, paged or shared mode. */
+PHPAPI int _cachedb_find_by(cachedb_t* db, char *field, size_t field_length, zval *value, zval *keys TSRMLS_DC)
+{
+	cachedb_t *layer;
+	zval       str;
+	int        indexed = 0;
+	int        status  = SUCCESS;
+
+	if (db->is_dense || db->paged_root || db->shared || cachedb_postings_value(value, &str) == FAILURE) {
+		return FAILURE;
+	}
+
+	if (db->shards) {
+		/* The declaration is made on every shard, but a shard which has never been committed with any
+		 * records doesn't carry it on disk.  So if the field is indexed in any shard, then the index
+		 * entries of the shards without postings for it are scanned instead. */
+		char *unindexed = ecalloc(db->shard_count, 1);
+		int   i;
+		for (i = 0; i < db->shard_count && status != CACHEDB_CORRUPT; i++) {
+			cachedb_t *shard = cachedb_get_shard(db, i TSRMLS_CC);
+			if (shard && (status = cachedb_find_by_in_layer(shard, shard, field, field_length, &str, keys TSRMLS_CC)) == SUCCESS) {
+				indexed = 1;
+			} else if (shard && status == FAILURE) {
+				unindexed[i] = 1;
+			}
+		}
+		for (i = 0; i < db->shard_count && indexed && status != CACHEDB_CORRUPT; i++) {
+			if (unindexed[i]) {
+				cachedb_find_by_scan(db->shards[i], db->shards[i], field, field_length, &str, keys, 0);
+			}
+		}
+		efree(unindexed);
+	} else {
+		for (layer = db; layer && status != CACHEDB_CORRUPT; layer = layer->lower) {
+			if ((status = cachedb_find_by_in_layer(db, layer, field, field_length, &str, keys TSRMLS_CC)) == SUCCESS) {
+				indexed = 1;
+			}
+		}
+	}
+
+	zval_dtor(&str);
+	return (indexed && status != CACHEDB_CORRUPT) ? SUCCESS : FAILURE;
+}
+/* }}} */
+
+/* {{{ proto int _cachedb_expired_count(struct db)
+   Return the number of expired records in the DB at open time, that is the records which would be
+   dropped by the next commit.  This is cheap as the count is taken during the index load. */
+PHPAPI size_t _cachedb_expired_count(cachedb_t* db TSRMLS_DC)
+{
+	size_t count = 0;
+
+	if (db->shards) {
+		int i;
+		for (i = 0; i < db->shard_count; i++) {
+			cachedb_t *shard = cachedb_get_shard(db, i TSRMLS_CC);
+			count += shard ? shard->expired_count : 0;
+		}
+		return count;
+	}
+
+	for (; db; db = db->lower) {
+		count += db->expired_count;
+	}
+	return count;
+}
+/* }}} */
+
+/* {{{ proto void _cachedb_get_stats(struct db, struct stats)
+   Return the statistics for the DB handle.  For a sharded DB these are summed over the opened shards */
+PHPAPI void _cachedb_get_stats(cachedb_t* db, cachedb_stats_t *stats TSRMLS_DC)
+{
+	*stats = db->stats;
+	if (db->shards) {
+		int i;
+		for (i = 0; i < db->shard_count; i++) {
+			if (db->shards[i]) {
+				cachedb_merge_stats(stats, &(db->shards[i]->stats));
+			}
+		}
+	}
+}
+/* }}} */
+
+/* {{{ proto void cachedb_merge_stats(struct to, struct from)
+   Add one set of statistics to another.  The merged commit outcome is the most severe of the two */
+static void cachedb_merge_stats(cachedb_stats_t *to, const cachedb_stats_t *from)
+{
+	static const int severity[] = {0, 1, 3, 4, 2};   /* NONE, PUBLISHED, DISCARDED, FAILED, DEFERRED */
+
+	to->finds             += from->finds;
+	to->hits              += from->hits;
+	to->misses            += from->misses;
+	to->fetches           += from->fetches;
+	to->base_bytes_read   += from->base_bytes_read;
+	to->staged_bytes_read += from->staged_bytes_read;
+	to->seeks             += from->seeks;
+	to->records_added     += from->records_added;
+	to->compress_time     += from->compress_time;
+	to->decompress_time   += from->decompress_time;
+	to->unserialize_time  += from->unserialize_time;
+	to->commit_time       += from->commit_time;
+	if (severity[from->commit_outcome] > severity[to->commit_outcome]) {
+		to->commit_outcome = from->commit_outcome;
+	}
+}
+/* }}} */
+
+/* {{{ proto double cachedb_now()
+   Return a monotonic timestamp in seconds for the statistics timings */
+static double cachedb_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+/* }}} */
+
+/* {{{ proto struct stat *cachedb_get_s(struct db)
+   Return cachedb stat block */
+
+PHPAPI const struct stat *cachedb_get_sb(cachedb_t* db TSRMLS_DC) {
+	return (db && db->base_file.fp) ? (const struct stat *) &db->base_file.sb.sb : NULL;
+}
+
+/* }}} */
+/* {{{ proto int _cachedb_found_length(struct db)
+   Return the (uncompressed) length of the record set by the last successful find */
+
+PHPAPI size_t _cachedb_found_length(cachedb_t* db TSRMLS_DC) {
+	return db->last_find.len;
+}
+
+/* }}} */
+/* {{{ proto boolean cachedb_load_index(struct db)
+   Load the initial index from the DB */
+
+/* The DB index is in two formats: On disk, it is maintained in the form of a compressed serialized
+ * array where the i'th element is the three element zval array: [file_name, compressed_length, 
+ * uncompressed_length], optionally followed by the metadata array and then by an expiry timestamp
+ * (the metadata element is NULL if a record has an expiry but no metadata).  In memory a second keyed array is built on loading to simplify lookup: 
+ * file_name => array(element_index,file_offset).
+ *
+ * In integer mode the keyed array is replaced by the dense slot array.  A readonly integer mode 
+ * handle takes this from the trailer and skips the index altogether, leaving index_list empty.
+ * A paged mode handle likewise skips the index and only loads the root page of the paged index.
+ */
+static int cachedb_load_index(cachedb_t* db TSRMLS_DC)
+{
+	cachedb_header_t    header;
+	zval               *index      = NULL;
+	HashTable          *index_list = NULL;
+	HashTable          *index_hash = NULL;
+	off_t               ndx_start  = sizeof(header);
+	size_t              ndx;
+	int                 has_trailer = 0;
+	int                 status;
+	char                error_type = ' ';
+
+	if (db->base_file.fp > 0) {
+		zval **entry = NULL;
+
+		CHECKA(php_stream_read(db->base_file.fp, (char *) &header, sizeof(header)) == sizeof(header));
+		header.zlen = cachedb_le64(header.zlen);
+		header.len  = cachedb_le64(header.len);
+		CHECKA(header.zlen <= (uint64_t) db->base_file.filelength);
+		has_trailer = (memcmp(header.fingerprint, CACHEDB_HEADER_FINGERPRINT_TRAILER, 
+		                      sizeof(CACHEDB_HEADER_FINGERPRINT_TRAILER)-1) == 0);
+		CHECKA(has_trailer || 
+		       memcmp(header.fingerprint, CACHEDB_HEADER_FINGERPRINT, sizeof(CACHEDB_HEADER_FINGERPRINT)-1)==0);
+
+		/* The trailer is located from the footer, so it is loaded first to allow the index to be
+		 * checked against its CRC before it is unserialized */
+		if (has_trailer && (status = cachedb_load_trailer(db TSRMLS_CC)) != SUCCESS) {
+			return status;
+		}
+
+		if (db->dense) {
+			uint32_t id;
+
+			db->base_file.next_pos      = ndx_start;
+			db->base_file.header_length = ndx_start + header.zlen;
+			db->index_list = emalloc(sizeof(HashTable));
+			hash_init(db->index_list, 0);
+			db->index_hash = emalloc(sizeof(HashTable));
+			hash_init(db->index_hash, 0);
+
+			for (id = 0; id < db->dense_count; id++) {
+				cachedb_dense_t *slot = &(db->dense[id]);
+				if (slot->ndx == 0) {
+					continue;
+				}
+				CHECKA(slot->start >= db->base_file.header_length &&
+				       slot->start + slot->zlen <= (uint64_t) db->records_end &&
+				       (!db->base_crcs || slot->ndx <= db->crc_count));
+				if (slot->expires > 0 && slot->expires <= db->open_time) {
+					db->expired_count++;
+				}
+			}
+			return SUCCESS;
+		}
+
+		if (db->paged_offset) {
+			char     body[CACHEDB_PAGED_HEADER];
+			char    *root;
+			uint32_t level;
+
+			db->base_file.next_pos      = ndx_start;
+			db->base_file.header_length = ndx_start + header.zlen;
+			db->index_list = emalloc(sizeof(HashTable));
+			hash_init(db->index_list, 0);
+			db->index_hash = emalloc(sizeof(HashTable));
+			hash_init(db->index_hash, 0);
+
+			/* The body header gives the root page, which is then kept for the life of the handle */
+			php_stream_seek(db->base_file.fp, db->paged_offset, SEEK_SET);
+			if (db->paged_length < CACHEDB_PAGED_HEADER ||
+			    php_stream_read(db->base_file.fp, body, sizeof(body)) != sizeof(body) ||
+			    cachedb_get64(body + 8) != db->crc_count ||
+			    (root = cachedb_read_page(db, cachedb_get64(body) TSRMLS_CC)) == NULL ||
+			    (level = cachedb_get32(root + 8)) > CACHEDB_PAGED_MAX_LEVEL) {
+				php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_paged_err, db->base_file.name);
+				return CACHEDB_CORRUPT;
+			}
+			db->paged_root = emalloc(cachedb_get32(root));
+			memcpy(db->paged_root, root, cachedb_get32(root));
+			return SUCCESS;
+		}
+
+		MAKE_STD_ZVAL(index);
+		status = cachedb_read_var(db->base_file.fp, 0, index, header.zlen, header.len, 
+		                          (db->base_crcs ? &db->index_crc : NULL), NULL TSRMLS_CC);
+		if (status == CACHEDB_CORRUPT) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_crc_err, db->base_file.name);
+			EFREE(index);
+			return CACHEDB_CORRUPT;
+		}
+		CHECKA(status == SUCCESS && Z_TYPE_P(index) == IS_ARRAY);
+
+		ndx_start                  += header.zlen;
+		db->base_file.next_pos      = ndx_start;
+		db->base_file.header_length = ndx_start;
+
+		/* Extract the Hashtable ptr from index and free its zval storage */
+		index_list = Z_ARRVAL_P(index); 
+		EFREE(index); 
+
+		/* Initialise another HashTable the same size as index_list for keyed access */
+		index_hash = emalloc(sizeof(HashTable));
+		hash_init(index_hash, (db->is_dense ? 0 : hash_count(index_list)));
+
+		/* loop over index_list to build the index_hash */
+		for (hash_reset(index_list), ndx=0; 
+		     hash_get(index_list, entry) == SUCCESS; 
+			 hash_next(index_list), ndx++) {
+
+			HashTable* entry_array;
+			zval **zkey, **zlen, **len, *tmp;
+
+			CHECKA(Z_TYPE_PP(entry) == IS_ARRAY);
+			entry_array = Z_ARRVAL_PP(entry);
+			CHECKA(hash_count(entry_array) >= 3 && hash_count(entry_array) <= 5); 
+
+			/* Pick out the file path and length ZVALs from the entry array*/
+			hash_get_first_zv(entry_array, zkey); 
+			hash_get_next_zv(entry_array, zlen);
+
+			if (db->is_dense) {
+				/* Set dense[id] to the record slot */
+				cachedb_dense_t *slot;
+				zval           **expires;
+				unsigned long    id;
+
+				if (cachedb_parse_id(Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey), &id) == FAILURE) {
+					db->index_list = index_list;
+					db->index_hash = index_hash;
+					php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_dense_err, db->base_file.name);
+					return CACHEDB_CORRUPT;
+				}
+				hash_get_next_zv(entry_array, len);
+				slot          = cachedb_dense_slot(db, id);
+				slot->start   = ndx_start;
+				slot->zlen    = Z_LVAL_PP(zlen);
+				slot->len     = Z_LVAL_PP(len);
+				slot->ndx     = ndx + 1;
+				slot->expires = (hash_count(entry_array) == 5 && hash_index_find(entry_array, 4, expires) == SUCCESS) ?
+				                (uint32_t) Z_LVAL_PP(expires) : 0;
+				ndx_start += Z_LVAL_PP(zlen);
+
+			} else {
+				/* Set index_hash[key] = array(ndx,nxt_start); */
+				MAKE_STD_ZVAL(tmp);
+				array_init_size(tmp,2);
+				add_next_index_long(tmp, ndx);
+				add_next_index_long(tmp, ndx_start);
+				ndx_start += Z_LVAL_PP(zlen);
+				zend_hash_add(index_hash, Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey)+1, 
+				              &tmp, sizeof(zval *), NULL);
+			}
+
+			if (cachedb_is_expired(db, entry_array)) {
+				db->expired_count++;
+			}
+		}
+
+	} else { /* DB creation starts with an empty index array and hash */
+
+		index_list = emalloc(sizeof(HashTable));
+		hash_init(index_list, 0);
+		index_hash = emalloc(sizeof(HashTable));
+		hash_init(index_hash, 0);
+		ndx_start = 0;
+	}
+
+	db->index_list    = index_list;
+	db->index_hash    = index_hash;
+
+	/* The records either run to the end of file or to the start of the trailer */
+	if (has_trailer) {
+		CHECKA(ndx_start == db->records_end);
+	} else {
+		CHECKA(ndx_start==(db->base_file.filelength));
+		db->records_end = ndx_start;
+	}
+
+	db->base_count = hash_count(index_list);
+
+	/* A DB without a CRC section gets a zeroed CRC vector; the base CRCs are then computed if and 
+	 * when the DB is next committed */
+	if (db->base_crcs) {
+		CHECKA(db->crc_count == hash_count(index_list));
+	} else {
+		db->crc_count = db->crc_size = hash_count(index_list);
+		db->crcs      = ecalloc(db->crc_size + 1, sizeof(uint32_t));
+		db->base_crcs = (db->crc_count == 0);
+	}
+
+	return SUCCESS;
+
+error:
+
+	/* Don't bother with freeing memory as this will be swept up by cachedb_db_dtor() */
+	php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_ndx_err, db->base_file.name);
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_is_expired(struct db, HashTable entry_list)
+   Check whether an index_list entry has an expiry timestamp which has passed */
+static int cachedb_is_expired(cachedb_t* db, HashTable *entry_list)
+{
+	zval **expires;
+
+	return hash_count(entry_list) == 5 && 
+	       hash_index_find(entry_list, 4, expires) == SUCCESS &&
+	       Z_LVAL_PP(expires) > 0 && Z_LVAL_PP(expires) <= db->open_time;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_load_trailer(struct db)
+   Load the trailer sections that follow the last record in the base file */
+
+/* The sections are read one at a time, so that a paged handle can skip the bodies of the sections 
+ * that scale with the record count and just note where they are.
+ */
+static int cachedb_load_trailer(cachedb_t* db TSRMLS_DC)
+{
+	php_stream        *fp           = db->base_file.fp;
+	off_t              footer_start = db->base_file.filelength - sizeof(cachedb_footer_t);
+	off_t              pos;
+	cachedb_footer_t   footer;
+	cachedb_section_t  section;
+	char               error_type   = ' ';
+
+	CHECKA(footer_start >= (off_t) sizeof(cachedb_header_t));
+	php_stream_seek(fp, footer_start, SEEK_SET);
+	CHECKA(php_stream_read(fp, (char *) &footer, sizeof(footer)) == sizeof(footer) &&
+	       memcmp(footer.fingerprint, CACHEDB_HEADER_FINGERPRINT_TRAILER, 
+	              sizeof(CACHEDB_HEADER_FINGERPRINT_TRAILER)-1) == 0);
+	footer.trailer_length = cachedb_le64(footer.trailer_length);
+	CHECKA(footer.trailer_length <= (uint64_t) (footer_start - sizeof(cachedb_header_t)));
+	db->records_end = footer_start - footer.trailer_length;
+
+	/* Walk the sections, picking out those that this version understands */
+	for (pos = db->records_end; pos < footer_start; pos += section.length) {
+		CHECKA(pos + (off_t) sizeof(section) <= footer_start);
+		php_stream_seek(fp, pos, SEEK_SET);
+		CHECKA(php_stream_read(fp, (char *) &section, sizeof(section)) == sizeof(section));
+		section.tag    = cachedb_le32(section.tag);
+		section.param  = cachedb_le32(section.param);
+		section.length = cachedb_le64(section.length);
+		pos += sizeof(section);
+		CHECKA(section.length <= (uint64_t) (footer_start - pos));
+
+		switch (section.tag) {
+			case CACHEDB_SECTION_BLOOM:
+				/* The filter is only used for layered DBs, which can't be paged */
+				CHECKA(section.length > 0 && section.length <= UINT32_MAX/8 && section.param > 0);
+				if (!db->is_paged) {
+					db->bloom = emalloc(section.length);
+					CHECKA(php_stream_read(fp, (char *) db->bloom, section.length) == section.length);
+					db->bloom_bits   = (uint32_t) section.length * 8;
+					db->bloom_hashes = section.param;
+				}
+				break;
+			case CACHEDB_SECTION_CRC:
+				/* The index CRC is the param, followed by the record CRCs in index order */
+				CHECKA(section.length % sizeof(uint32_t) == 0);
+				db->index_crc = section.param;
+				db->crc_count = db->crc_size = section.length / sizeof(uint32_t);
+				db->base_crcs = 1;
+				if (db->is_paged) {
+					db->crc_offset = pos;
+				} else {
+					db->crcs = emalloc(section.length + sizeof(uint32_t));
+					CHECKA(php_stream_read(fp, (char *) db->crcs, section.length) == section.length);
+#ifdef WORDS_BIGENDIAN
+					{
+						size_t i;
+						for (i = 0; i < db->crc_count; i++) {
+							db->crcs[i] = cachedb_le32(db->crcs[i]);
+						}
+					}
+#endif
+				}
+				break;
+			case CACHEDB_SECTION_DENSE:
+				/* Only a readonly integer mode handle uses the slots as is, see cachedb_load_index */
+				if (db->is_dense && db->mode == 'r') {
+					CHECKA(section.length % sizeof(cachedb_dense_t) == 0 &&
+					       section.length / sizeof(cachedb_dense_t) <= CACHEDB_DENSE_MAX_ID + 1);
+					db->dense_count = db->dense_size = section.length / sizeof(cachedb_dense_t);
+					db->dense       = emalloc(section.length + sizeof(cachedb_dense_t));
+					CHECKA(php_stream_read(fp, (char *) db->dense, section.length) == section.length);
+#ifdef WORDS_BIGENDIAN
+					{
+						uint32_t id;
+						for (id = 0; id < db->dense_count; id++) {
+							cachedb_dense_t *slot = &(db->dense[id]);
+							slot->start   = cachedb_le64(slot->start);
+							slot->zlen    = cachedb_le32(slot->zlen);
+							slot->len     = cachedb_le32(slot->len);
+							slot->ndx     = cachedb_le32(slot->ndx);
+							slot->expires = cachedb_le32(slot->expires);
+						}
+					}
+#endif
+				}
+				break;
+			case CACHEDB_SECTION_POSTINGS:
+				/* This is only loaded on first use, see cachedb_load_postings */
+				CHECKA(section.length > CACHEDB_POSTINGS_HEADER);
+				db->postings_offset = pos;
+				db->postings_length = section.length;
+				db->postings_crc    = section.param;
+				break;
+			case CACHEDB_SECTION_PAGED:
+				/* Only a paged handle uses this, and then only a page at a time */
+				if (db->is_paged) {
+					db->paged_offset = pos;
+					db->paged_length = section.length;
+				}
+				break;
+			default:
+				break;   /* ignore sections from later versions */
+		}
+	}
+
+	/* Leave the file positioned at the start of the index */
+	php_stream_seek(fp, sizeof(cachedb_header_t), SEEK_SET);
+	return SUCCESS;
+
+error:
+	/* A missing or damaged trailer is the usual symptom of a truncated file */
+	php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_trailer_err, db->base_file.name);
+	return CACHEDB_CORRUPT;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_build_trailer(smart_str buf, HashTable index_list, int index_crc, array crcs, int records_start, boolean is_dense, HashTable indexed)
+   Build the trailer sections and footer for the given index of a new DB file whose records start at 
+   records_start.  A dense section is also built for an integer mode DB, a paged index for a large
+   one, and a postings section if any metadata fields are indexed (the keys of indexed) */
+static int cachedb_build_trailer(smart_str *buf, HashTable *index_list, uint32_t index_crc, const uint32_t *crcs, off_t records_start, int is_dense, HashTable *indexed TSRMLS_DC)
+{
+	cachedb_section_t  section;
+	cachedb_footer_t   footer;
+	cachedb_dense_t   *slots   = NULL;
+	unsigned char     *bloom   = NULL;
+	uint32_t           bits;
+	zval             **entry;
+	char               error_type = ' ';
+
+	/* Bloom filter section over all of the keys in the index */
+	bits = ((hash_count(index_list) * CACHEDB_BLOOM_BITS_PER_KEY + 63) & ~63);
+	if (bits == 0) {
+		bits = 64;
+	}
+	bloom = ecalloc(bits/8, 1);
+	for (hash_reset(index_list); hash_get(index_list, entry) == SUCCESS; hash_next(index_list)) {
+		zval     **zkey;
+		uint32_t   h1, h2;
+
+		CHECKA(hash_index_find(Z_ARRVAL_PP(entry), 0, zkey) == SUCCESS && Z_TYPE_PP(zkey) == IS_STRING);
+		cachedb_bloom_hash(Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey), &h1, &h2);
+		cachedb_bloom_set(bloom, bits, CACHEDB_BLOOM_HASHES, h1, h2);
+	}
+
+	section.tag    = cachedb_le32(CACHEDB_SECTION_BLOOM);
+	section.param  = cachedb_le32(CACHEDB_BLOOM_HASHES);
+	section.length = cachedb_le64((uint64_t) bits/8);
+	smart_str_appendl(buf, (const char *) &section, sizeof(section));
+	smart_str_appendl(buf, (const char *) bloom, bits/8);
+	EFREE(bloom);
+
+	/* Dense section of the record slots, indexed by id */
+	if (is_dense) {
+		unsigned long id, count = 0;
+		off_t         pos = records_start;
+		size_t        ndx;
+
+		for (hash_reset(index_list); hash_get(index_list, entry) == SUCCESS; hash_next(index_list)) {
+			zval **zkey;
+			CHECKA(hash_index_find(Z_ARRVAL_PP(entry), 0, zkey) == SUCCESS && 
+			       cachedb_parse_id(Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey), &id) == SUCCESS);
+			if (id >= count) {
+				count = id + 1;
+			}
+		}
+		slots = ecalloc(count + 1, sizeof(cachedb_dense_t));
+		for (hash_reset(index_list), ndx = 0; hash_get(index_list, entry) == SUCCESS; hash_next(index_list), ndx++) {
+			HashTable *entry_list = Z_ARRVAL_PP(entry);
+			zval     **zkey, **zlen, **len, **expires;
+
+			CHECKA(hash_index_find(entry_list, 0, zkey) == SUCCESS && 
+			       hash_index_find(entry_list, 1, zlen) == SUCCESS &&
+			       hash_index_find(entry_list, 2, len) == SUCCESS);
+			cachedb_parse_id(Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey), &id);
+			slots[id].start   = cachedb_le64((uint64_t) pos);
+			slots[id].zlen    = cachedb_le32((uint32_t) Z_LVAL_PP(zlen));
+			slots[id].len     = cachedb_le32((uint32_t) Z_LVAL_PP(len));
+			slots[id].ndx     = cachedb_le32((uint32_t) ndx + 1);
+			slots[id].expires = cachedb_le32((hash_count(entry_list) == 5 && hash_index_find(entry_list, 4, expires) == SUCCESS) ?
+			                                 (uint32_t) Z_LVAL_PP(expires) : 0);
+			pos += Z_LVAL_PP(zlen);
+		}
+
+		section.tag    = cachedb_le32(CACHEDB_SECTION_DENSE);
+		section.param  = cachedb_le32(hash_count(index_list));
+		section.length = cachedb_le64((uint64_t) count * sizeof(cachedb_dense_t));
+		smart_str_appendl(buf, (const char *) &section, sizeof(section));
+		smart_str_appendl(buf, (const char *) slots, count * sizeof(cachedb_dense_t));
+		EFREE(slots);
+	}
+
+	/* Paged index section, for DBs large enough to be worth opening in paged mode */
+	if (hash_count(index_list) >= CACHEDB_PAGED_MIN_RECORDS) {
+		CHECKA(cachedb_build_paged(buf, index_list, records_start TSRMLS_CC) == SUCCESS);
+	}
+
+	if (indexed) {
+		CHECKA(cachedb_build_postings(buf, index_list, indexed TSRMLS_CC) == SUCCESS);
+	}
+
+	/* CRC section: the index CRC and the record CRCs */
+	section.tag    = cachedb_le32(CACHEDB_SECTION_CRC);
+	section.param  = cachedb_le32(index_crc);
+	section.length = cachedb_le64((uint64_t) hash_count(index_list) * sizeof(uint32_t));
+	smart_str_appendl(buf, (const char *) &section, sizeof(section));
+#ifdef WORDS_BIGENDIAN
+	{
+		size_t i;
+		for (i = 0; i < hash_count(index_list); i++) {
+			uint32_t crc = cachedb_le32(crcs[i]);
+			smart_str_appendl(buf, (const char *) &crc, sizeof(crc));
+		}
+	}
+#else
+	smart_str_appendl(buf, (const char *) crcs, hash_count(index_list) * sizeof(uint32_t));
+#endif
+
+	footer.trailer_length = cachedb_le64((uint64_t) buf->len);
+	memcpy(footer.fingerprint, CACHEDB_HEADER_FINGERPRINT_TRAILER, sizeof(CACHEDB_HEADER_FINGERPRINT_TRAILER)-1);
+	smart_str_appendl(buf, (const char *) &footer, sizeof(footer));
+	return SUCCESS;
+
+error:
+	EFREE(bloom);
+	EFREE(slots);
+	php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_write_err);
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_build_paged(smart_str buf, HashTable index_list, int records_start)
+   Build the paged index section for the given index of a new DB file */
+
+/* The keys are sorted and packed into the leaf pages, then the first key of each page at one level
+ * is packed into the node pages of the level above, until a level fits in a single root page.
+ */
+static int cachedb_build_paged(smart_str *buf, HashTable *index_list, off_t records_start TSRMLS_DC)
+{
+	cachedb_paged_key_t *keys    = NULL;
+	cachedb_paged_key_t *entries;
+	cachedb_paged_key_t *fences  = NULL;
+	cachedb_section_t    section;
+	smart_str            body    = {NULL, 0, 0};
+	char                 tmp[CACHEDB_LEAF_ENTRY];
+	size_t               count   = hash_count(index_list);
+	size_t               fence_count, i, page_start = 0, page_count = 0;
+	uint32_t             level;
+	off_t                pos     = records_start;
+	zval               **entry;
+	char                 error_type = ' ';
+
+	keys = safe_emalloc(count, sizeof(cachedb_paged_key_t), 0);
+	for (hash_reset(index_list), i = 0; hash_get(index_list, entry) == SUCCESS; hash_next(index_list), i++) {
+		HashTable *entry_list = Z_ARRVAL_PP(entry);
+		zval     **zkey, **zlen, **len, **expires;
+
+		CHECKA(hash_index_find(entry_list, 0, zkey) == SUCCESS && 
+		       hash_index_find(entry_list, 1, zlen) == SUCCESS &&
+		       hash_index_find(entry_list, 2, len) == SUCCESS);
+		keys[i].key        = Z_STRVAL_PP(zkey);
+		keys[i].key_length = Z_STRLEN_PP(zkey);
+		keys[i].start      = pos;
+		keys[i].zlen       = Z_LVAL_PP(zlen);
+		keys[i].len        = Z_LVAL_PP(len);
+		keys[i].ndx        = i;
+		keys[i].expires    = (hash_count(entry_list) == 5 && hash_index_find(entry_list, 4, expires) == SUCCESS) ?
+		                     (uint32_t) Z_LVAL_PP(expires) : 0;
+		pos += Z_LVAL_PP(zlen);
+	}
+	qsort(keys, count, sizeof(cachedb_paged_key_t), cachedb_paged_cmp);
+
+	/* Leave room for the root offset and entry count, which are filled in at the end */
+	memset(tmp, 0, sizeof(tmp));
+	smart_str_appendl(&body, tmp, CACHEDB_PAGED_HEADER);
+
+	for (entries = keys, level = 0; ; level++) {
+		size_t entry_size = (level == 0) ? CACHEDB_LEAF_ENTRY : CACHEDB_NODE_ENTRY;
+
+		fences      = safe_emalloc(count, sizeof(cachedb_paged_key_t), 0);
+		fence_count = 0;
+		page_count  = 0;
+
+		for (i = 0; i < count; i++) {
+			cachedb_paged_key_t *e = &entries[i];
+
+			/* Close the current page if this entry would overflow it */
+			if (page_count > 0 && body.len - page_start + entry_size + e->key_length > CACHEDB_PAGE_SIZE) {
+				cachedb_put32(body.c + page_start, body.len - page_start);
+				cachedb_put32(body.c + page_start + 4, page_count);
+				cachedb_put32(body.c + page_start + 8, level);
+				page_count = 0;
+			}
+			if (page_count == 0) {
+				page_start = body.len;
+				fences[fence_count].key        = e->key;
+				fences[fence_count].key_length = e->key_length;
+				fences[fence_count].start      = page_start;
+				fence_count++;
+				smart_str_appendl(&body, tmp, CACHEDB_PAGE_HEADER);
+			}
+			if (level == 0) {
+				cachedb_put64(tmp, e->start);
+				cachedb_put64(tmp + 8, e->zlen);
+				cachedb_put64(tmp + 16, e->len);
+				cachedb_put32(tmp + 24, e->ndx);
+				cachedb_put32(tmp + 28, e->expires);
+			} else {
+				cachedb_put64(tmp, e->start);
+			}
+			cachedb_put32(tmp + entry_size - 4, e->key_length);
+			smart_str_appendl(&body, tmp, entry_size);
+			smart_str_appendl(&body, e->key, e->key_length);
+			page_count++;
+		}
+		cachedb_put32(body.c + page_start, body.len - page_start);
+		cachedb_put32(body.c + page_start + 4, page_count);
+		cachedb_put32(body.c + page_start + 8, level);
+
+		if (entries != keys) {
+			efree(entries);
+		}
+		if (fence_count == 1) {
+			break;      /* the last page written is the root */
+		}
+		CHECKA(level < CACHEDB_PAGED_MAX_LEVEL);
+		entries = fences;
+		count   = fence_count;
+		fences  = NULL;
+	}
+
+	cachedb_put64(body.c, page_start);
+	cachedb_put64(body.c + 8, hash_count(index_list));
+
+	section.tag    = cachedb_le32(CACHEDB_SECTION_PAGED);
+	section.param  = cachedb_le32(level);
+	section.length = cachedb_le64((uint64_t) body.len);
+	smart_str_appendl(buf, (const char *) &section, sizeof(section));
+	smart_str_appendl(buf, body.c, body.len);
+
+	smart_str_free(&body);
+	EFREE(fences);
+	EFREE(keys);
+	return SUCCESS;
+
+error:
+	smart_str_free(&body);
+	EFREE(fences);
+	EFREE(keys);
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_build_postings(smart_str buf, HashTable index_list, HashTable indexed)
+   Build the postings section for the indexed metadata fields of a new DB file */
+static int cachedb_build_postings(smart_str *buf, HashTable *index_list, HashTable *indexed TSRMLS_DC)
+{
+	cachedb_section_t  section;
+	zval              *postings = NULL;
+	zval             **entry, **values, **list, **ndx;
+	char              *zbuf     = NULL;
+	char               hdr[CACHEDB_POSTINGS_HEADER];
+	smart_str          names    = {NULL, 0, 0};
+	size_t             zlen, len, i;
+	char               error_type = ' ';
+
+	/* Start with an empty value array for each field, so that the declaration carries forward */
+	MAKE_STD_ZVAL(postings);
+	array_init_size(postings, hash_count(indexed));
+	for (hash_reset(indexed); hash_get(indexed, entry) == SUCCESS; hash_next(indexed)) {
+		char  *field;
+		uint   field_length;
+		ulong  dummy;
+		zval  *tmp;
+
+		CHECKA(hash_key(indexed, field, dummy) == HASH_KEY_IS_STRING);
+		MAKE_STD_ZVAL(tmp);
+		array_init(tmp);
+		zend_symtable_update(Z_ARRVAL_P(postings), field, field_length, &tmp, sizeof(zval *), NULL);
+		smart_str_appendl(&names, field, field_length);    /* including its terminating NUL */
+	}
+
+	/* Collect the index positions of the records for each field value, in ascending order */
+	for (hash_reset(index_list), i = 0; hash_get(index_list, entry) == SUCCESS; hash_next(index_list), i++) {
+		HashTable *fields = Z_ARRVAL_P(postings);
+		zval     **meta;
+
+		if (hash_index_find(Z_ARRVAL_PP(entry), 3, meta) != SUCCESS || Z_TYPE_PP(meta) != IS_ARRAY) {
+			continue;
+		}
+		for (hash_reset(fields); hash_get(fields, values) == SUCCESS; hash_next(fields)) {
+			char  *field;
+			uint   field_length;
+			ulong  dummy;
+			zval **mvalue, str;
+
+			hash_key(fields, field, dummy);
+			if (zend_symtable_find(Z_ARRVAL_PP(meta), field, field_length, (void **) &mvalue) != SUCCESS ||
+			    cachedb_postings_value(*mvalue, &str) == FAILURE) {
+				continue;
+			}
+			if (zend_symtable_find(Z_ARRVAL_PP(values), Z_STRVAL(str), Z_STRLEN(str)+1, (void **) &list) != SUCCESS) {
+				zval *tmp;
+				MAKE_STD_ZVAL(tmp);
+				array_init(tmp);
+				zend_symtable_update(Z_ARRVAL_PP(values), Z_STRVAL(str), Z_STRLEN(str)+1, &tmp, sizeof(zval *), (void **) &list);
+			}
+			add_next_index_long(*list, i);
+			zval_dtor(&str);
+		}
+	}
+
+	/* Replace each list by its delta varint encoding */
+	for (hash_reset(Z_ARRVAL_P(postings)); hash_get(Z_ARRVAL_P(postings), values) == SUCCESS; hash_next(Z_ARRVAL_P(postings))) {
+		HashTable *value_hash = Z_ARRVAL_PP(values);
+
+		for (hash_reset(value_hash); hash_get(value_hash, list) == SUCCESS; hash_next(value_hash)) {
+			smart_str packed = {NULL, 0, 0};
+			long      last   = 0;
+
+			for (hash_reset(Z_ARRVAL_PP(list)); hash_get(Z_ARRVAL_PP(list), ndx) == SUCCESS; hash_next(Z_ARRVAL_PP(list))) {
+				unsigned long delta = Z_LVAL_PP(ndx) - last;
+				while (delta >= 0x80) {
+					smart_str_appendc(&packed, (char) ((delta & 0x7f) | 0x80));
+					delta >>= 7;
+				}
+				smart_str_appendc(&packed, (char) delta);
+				last = Z_LVAL_PP(ndx);
+			}
+			zval_dtor(*list);
+			ZVAL_STRINGL(*list, packed.c, packed.len, 0);
+		}
+	}
+
+	CHECKA(cachedb_encode_var(postings, &zbuf, &zlen, &len, NULL TSRMLS_CC) == SUCCESS);
+	zval_ptr_dtor(&postings);
+
+	section.tag    = cachedb_le32(CACHEDB_SECTION_POSTINGS);
+	section.param  = cachedb_le32(cachedb_crc32c(0, zbuf, zlen));
+	section.length = cachedb_le64((uint64_t) (CACHEDB_POSTINGS_HEADER + names.len + zlen));
+	cachedb_put64(hdr, len);
+	cachedb_put32(hdr + 8, (uint32_t) names.len);
+	cachedb_put32(hdr + 12, cachedb_crc32c(cachedb_crc32c(0, hdr, 12), names.c, names.len));
+	smart_str_appendl(buf, (const char *) &section, sizeof(section));
+	smart_str_appendl(buf, hdr, sizeof(hdr));
+	smart_str_appendl(buf, names.c, names.len);
+	smart_str_appendl(buf, zbuf, zlen);
+	smart_str_free(&names);
+	EFREE(zbuf);
+	return SUCCESS;
+
+error:
+	if (postings) {
+		zval_ptr_dtor(&postings);
+	}
+	smart_str_free(&names);
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto string cachedb_read_postings_names(struct db, string &hdr)
+   Read and verify the header and field names of the postings section, returning the names in an 
+   emalloced buffer or NULL if they are unreadable.  The file is left positioned at the postings */
+static char *cachedb_read_postings_names(cachedb_t* db, char *hdr TSRMLS_DC)
+{
+	char     *names;
+	uint32_t  names_length;
+
+	php_stream_seek(db->base_file.fp, db->postings_offset, SEEK_SET);
+	db->base_file.next_pos = -1;
+	if (php_stream_read(db->base_file.fp, hdr, CACHEDB_POSTINGS_HEADER) != CACHEDB_POSTINGS_HEADER ||
+	    (names_length = cachedb_get32(hdr + 8)) >= db->postings_length - CACHEDB_POSTINGS_HEADER) {
+		return NULL;
+	}
+	names = emalloc(names_length + 1);
+	if (php_stream_read(db->base_file.fp, names, names_length) != names_length ||
+	    (names_length > 0 && names[names_length - 1] != '\0') || 
+	    cachedb_crc32c(cachedb_crc32c(0, hdr, 12), names, names_length) != cachedb_get32(hdr + 12)) {
+		efree(names);
+		return NULL;
+	}
+	return names;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_load_postings(struct db)
+   Load the postings section, if the DB has one and it isn't already loaded */
+static int cachedb_load_postings(cachedb_t* db TSRMLS_DC)
+{
+	char      hdr[CACHEDB_POSTINGS_HEADER];
+	char     *names;
+	zval     *postings;
+	int       status;
+
+	if (db->postings || !db->postings_offset) {
+		return SUCCESS;
+	}
+
+	if ((names = cachedb_read_postings_names(db, hdr TSRMLS_CC)) == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_postings_err, db->base_file.name);
+		return CACHEDB_CORRUPT;
+	}
+	efree(names);
+
+	MAKE_STD_ZVAL(postings);
+	status = cachedb_read_var(db->base_file.fp, 0, postings, 
+	                          db->postings_length - CACHEDB_POSTINGS_HEADER - cachedb_get32(hdr + 8), 
+	                          cachedb_get64(hdr), &(db->postings_crc), NULL TSRMLS_CC);
+	if (status != SUCCESS || Z_TYPE_P(postings) != IS_ARRAY) {
+		if (status == SUCCESS) {
+			zval_ptr_dtor(&postings);
+		} else {
+			EFREE(postings);
+		}
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_postings_err, db->base_file.name);
+		return CACHEDB_CORRUPT;
+	}
+	db->postings = postings;
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ proto array cachedb_load_postings_fields(struct db)
+   Return a new array keyed by the field names of the postings section, or NULL if the DB has none.
+   This only reads the names, so a commit doesn't need to load the postings themselves.  If they are
+   unreadable then the declaration is dropped with a warning rather than failing the commit, and the
+   next commit writes no postings section */
+static zval *cachedb_load_postings_fields(cachedb_t* db TSRMLS_DC)
+{
+	char      hdr[CACHEDB_POSTINGS_HEADER];
+	char     *names, *p, *pend;
+	zval     *fields;
+
+	if (!db->postings_offset) {
+		return NULL;
+	}
+	if ((names = cachedb_read_postings_names(db, hdr TSRMLS_CC)) == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_postings_err, db->base_file.name);
+		return NULL;
+	}
+
+	MAKE_STD_ZVAL(fields);
+	array_init(fields);
+	for (p = names, pend = names + cachedb_get32(hdr + 8); p < pend; p += strlen(p) + 1) {
+		add_assoc_bool_ex(fields, p, strlen(p) + 1, 1);
+	}
+	efree(names);
+	return fields;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_find_by_in_layer(struct db, struct layer, string field, zval value, array keys)
+   Add the keys of the live records in one layer with the given field value to keys.  This returns 
+   FAILURE if the field isn't indexed in the layer */
+static int cachedb_find_by_in_layer(cachedb_t* db, cachedb_t* layer, char *field, size_t field_length, zval *value, zval *keys TSRMLS_DC)
+{
+	zval         **values, **list;
+	size_t         ndx;
+	int            status;
+
+	if ((status = cachedb_load_postings(layer TSRMLS_CC)) != SUCCESS) {
+		return status;
+	}
+	if (!layer->postings || 
+	    zend_symtable_find(Z_ARRVAL_P(layer->postings), field, field_length+1, (void **) &values) != SUCCESS) {
+		return FAILURE;
+	}
+
+	/* The committed records are in the postings list */
+	if (zend_symtable_find(Z_ARRVAL_PP(values), Z_STRVAL_P(value), Z_STRLEN_P(value)+1, (void **) &list) == SUCCESS && 
+	    Z_TYPE_PP(list) == IS_STRING) {
+		const unsigned char *p    = (const unsigned char *) Z_STRVAL_PP(list);
+		const unsigned char *pend = p + Z_STRLEN_PP(list);
+
+		for (ndx = 0; p < pend; ) {
+			unsigned long delta = 0;
+			int           shift = 0;
+
+			do {
+				if (p == pend || shift > 28) {
+					php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_postings_err, layer->base_file.name);
+					return CACHEDB_CORRUPT;
+				}
+				delta |= (unsigned long) (*p & 0x7f) << shift;
+				shift += 7;
+			} while (*p++ & 0x80);
+
+			ndx += delta;
+			if (ndx >= layer->base_count) {
+				php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_postings_err, layer->base_file.name);
+				return CACHEDB_CORRUPT;
+			}
+			cachedb_find_by_add(db, layer, ndx, keys);
+		}
+	}
+
+	/* Records added since the DB was opened aren't in the postings yet, so check their metadata */
+	cachedb_find_by_scan(db, layer, field, field_length, value, keys, layer->base_count);
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ proto void cachedb_find_by_scan(struct db, struct layer, string field, zval value, array keys, int ndx)
+   Add the keys of the live records in one layer from index position ndx on with the given field 
+   value to keys, by checking the metadata of each index entry */
+static void cachedb_find_by_scan(cachedb_t* db, cachedb_t* layer, char *field, size_t field_length, zval *value, zval *keys, size_t ndx)
+{
+	zval **entry, **meta, **mvalue, str;
+
+	for (; ndx < hash_count(layer->index_list); ndx++) {
+		if (hash_index_find(layer->index_list, ndx, entry) == SUCCESS &&
+		    hash_index_find(Z_ARRVAL_PP(entry), 3, meta) == SUCCESS && Z_TYPE_PP(meta) == IS_ARRAY &&
+		    zend_symtable_find(Z_ARRVAL_PP(meta), field, field_length+1, (void **) &mvalue) == SUCCESS &&
+		    cachedb_postings_value(*mvalue, &str) == SUCCESS) {
+			if (Z_STRLEN(str) == Z_STRLEN_P(value) && memcmp(Z_STRVAL(str), Z_STRVAL_P(value), Z_STRLEN(str)) == 0) {
+				cachedb_find_by_add(db, layer, ndx, keys);
+			}
+			zval_dtor(&str);
+		}
+	}
+}
+/* }}} */
+
+/* {{{ proto void cachedb_find_by_add(struct db, struct layer, int ndx, array keys)
+   Add the key of a record to the find_by result, unless it has expired or is shadowed by the same
+   key in a higher layer */
+static void cachedb_find_by_add(cachedb_t* db, cachedb_t* layer, size_t ndx, zval *keys)
+{
+	zval      **entry, **zkey;
+	cachedb_t  *upper;
+
+	if (hash_index_find(layer->index_list, ndx, entry) != SUCCESS ||
+	    hash_index_find(Z_ARRVAL_PP(entry), 0, zkey) != SUCCESS ||
+	    cachedb_is_expired(layer, Z_ARRVAL_PP(entry))) {
+		return;
+	}
+	for (upper = db; upper != layer; upper = upper->lower) {
+		if (zend_hash_exists(upper->index_hash, Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey)+1)) {
+			return;
+		}
+	}
+	add_next_index_stringl(keys, Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey), 1);
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_postings_value(zval value, zval &str)
+   Convert a metadata value to its postings form, a string, failing if it isn't a scalar.  The caller
+   must zval_dtor str on success */
+static int cachedb_postings_value(zval *value, zval *str)
+{
+	switch (Z_TYPE_P(value)) {
+		case IS_STRING:
+		case IS_LONG:
+		case IS_DOUBLE:
+		case IS_BOOL:
+			*str = *value;
+			zval_copy_ctor(str);
+			convert_to_string(str);
+			return SUCCESS;
+		default:
+			return FAILURE;
+	}
+}
+/* }}} */
+
+/* {{{ proto int cachedb_paged_cmp(struct a, struct b)
+   qsort comparison of paged index entries.  Keys are ordered bytewise, with a shorter key before any
+   longer key that it prefixes */
+static int cachedb_paged_cmp(const void *a, const void *b)
+{
+	const cachedb_paged_key_t *ka = (const cachedb_paged_key_t *) a;
+	const cachedb_paged_key_t *kb = (const cachedb_paged_key_t *) b;
+	int cmp = memcmp(ka->key, kb->key, MIN(ka->key_length, kb->key_length));
+
+	if (cmp == 0 && ka->key_length != kb->key_length) {
+		cmp = (ka->key_length < kb->key_length) ? -1 : 1;
+	}
+	if (cmp == 0) {
+		cmp = (ka->ndx < kb->ndx) ? -1 : 1;
+	}
+	return cmp;
+}
+/* }}} */
 
-PHPAPI const struct stat *cachedb_get_sb(cachedb_t* db TSRMLS_DC) {
-	return (db && db->base_file.fp) ? (const struct stat *) &db->base_file.sb.sb : NULL;
+/* {{{ proto boolean cachedb_find_paged(struct db, string key)
+   Look up a key in the paged index, setting the DB record position on a hit.  This reads one page
+   per level below the root */
+static int cachedb_find_paged(cachedb_t* db, char *key, size_t key_length TSRMLS_DC)
+{
+	cachedb_rec_t *rec   = &(db->last_find);
+	char          *page  = db->paged_root;
+	uint32_t       level = cachedb_get32(page + 8);
+
+	for (;;) {
+		char     *p        = page + CACHEDB_PAGE_HEADER;
+		char     *pend     = page + cachedb_get32(page);
+		uint32_t  count    = cachedb_get32(page + 4);
+		size_t    fixed    = (level == 0) ? CACHEDB_LEAF_ENTRY : CACHEDB_NODE_ENTRY;
+		uint64_t  child    = 0;
+		int       has_child = 0;
+		uint32_t  i;
+
+		if (cachedb_get32(page + 8) != level) {
+			break;       /* a child must be exactly one level below its parent */
+		}
+		for (i = 0; i < count; i++) {
+			uint32_t klen;
+			int      cmp;
+
+			if ((size_t) (pend - p) < fixed || (klen = cachedb_get32(p + fixed - 4)) > (size_t) (pend - p) - fixed) {
+				goto corrupt;
+			}
+			cmp = memcmp(p + fixed, key, MIN(klen, key_length));
+			if (cmp == 0 && klen != key_length) {
+				cmp = (klen < key_length) ? -1 : 1;
+			}
+			if (cmp > 0) {
+				break;       /* entries are sorted, so the key isn't in this page or past it */
+			}
+			if (level == 0 && cmp == 0) {
+				uint64_t start   = cachedb_get64(p);
+				uint64_t zlen    = cachedb_get64(p + 8);
+				uint32_t expires = cachedb_get32(p + 28);
+
+				if (start < db->base_file.header_length || start > (uint64_t) db->records_end || 
+				    zlen > (uint64_t) db->records_end - start) {
+					goto corrupt;
+				}
+				if (expires > 0 && expires <= db->open_time) {
+					return FAILURE;   /* an expired record is a miss */
+				}
+				rec->key        = key;
+				rec->key_length = key_length;
+				rec->is_base    = 1;
+				rec->start      = start;
+				rec->zlen       = zlen;
+				rec->len        = cachedb_get64(p + 16);
+				rec->ndx        = cachedb_get32(p + 24);
+				rec->layer      = db;
+				return SUCCESS;
+			}
+			if (level > 0) {
+				child     = cachedb_get64(p);
+				has_child = 1;
+			}
+			p += fixed + klen;
+		}
+		if (level == 0 || !has_child) {
+			return FAILURE;
+		}
+		if ((page = cachedb_read_page(db, child TSRMLS_CC)) == NULL) {
+			break;
+		}
+		level--;
+	}
+
+corrupt:
+	php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_paged_err, db->base_file.name);
+	return FAILURE;
 }
+/* }}} */
+
+/* {{{ proto string cachedb_read_page(struct db, int offset)
+   Read a page of the paged index into the DB's page buffer, returning NULL if it is invalid */
+static char *cachedb_read_page(cachedb_t* db, uint64_t offset TSRMLS_DC)
+{
+	php_stream *fp = db->base_file.fp;
+	char        hdr[CACHEDB_PAGE_HEADER];
+	uint32_t    length;
+
+	if (offset < CACHEDB_PAGED_HEADER || offset > db->paged_length - CACHEDB_PAGE_HEADER) {
+		return NULL;
+	}
+	php_stream_seek(fp, db->paged_offset + offset, SEEK_SET);
+	db->base_file.next_pos = -1;
+	db->stats.seeks++;
 
+	if (php_stream_read(fp, hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    (length = cachedb_get32(hdr)) < CACHEDB_PAGE_HEADER || length > db->paged_length - offset) {
+		return NULL;
+	}
+	if (length > db->paged_buf_size) {
+		db->paged_buf      = erealloc(db->paged_buf, length);
+		db->paged_buf_size = length;
+	}
+	memcpy(db->paged_buf, hdr, sizeof(hdr));
+	if (php_stream_read(fp, db->paged_buf + sizeof(hdr), length - sizeof(hdr)) != length - sizeof(hdr)) {
+		return NULL;
+	}
+	return db->paged_buf;
+}
 /* }}} */
-/* {{{ proto boolean cachedb_load_index(struct db)
-   Load the initial index from the DB */
 
-/* The DB index is in two formats: On disk, it is maintained in the form of a compressed serialized
- * array where the i'th element is the three element zval array: [file_name, compressed_length, 
- * uncompressed_length].  In memory a second keyed array is built on loading to simplify lookup: 
- * file_name => array(element_index,file_offset).
- */
-static int cachedb_load_index(cachedb_t* db TSRMLS_DC)
+/* {{{ proto boolean cachedb_read_crc(struct db, int ndx, int &crc)
+   Read a record CRC from the CRC section of a DB that hasn't loaded it */
+static int cachedb_read_crc(cachedb_t* db, size_t ndx, uint32_t *crc TSRMLS_DC)
 {
-	cachedb_header_t    header;
-	zval               *index      = NULL;
-	HashTable          *index_list = NULL;
-	HashTable          *index_hash = NULL;
-	uint                ndx_start  = sizeof(header);
-	uint				ndx;
-	char                error_type = ' ';
+	char buf[sizeof(uint32_t)];
 
-	if (db->base_file.fp > 0) {
-		zval **entry = NULL;
+	php_stream_seek(db->base_file.fp, db->crc_offset + ndx * sizeof(uint32_t), SEEK_SET);
+	db->base_file.next_pos = -1;
+	if (php_stream_read(db->base_file.fp, buf, sizeof(buf)) != sizeof(buf)) {
+		return FAILURE;
+	}
+	*crc = cachedb_get32(buf);
+	return SUCCESS;
+}
+/* }}} */
 
-		CHECKA(php_stream_read(db->base_file.fp, (char *) &header, sizeof(header)) == sizeof(header) &&
-		       memcmp(header.fingerprint, CACHEDB_HEADER_FINGERPRINT, sizeof(CACHEDB_HEADER_FINGERPRINT)-1)==0);
-		MAKE_STD_ZVAL(index);
-		CHECKA(cachedb_read_var(db->base_file.fp, 0, index, 
-		                                   header.zlen, header.len TSRMLS_CC) == SUCCESS &&
-		       Z_TYPE_P(index) == IS_ARRAY);
+/* {{{ Little-endian field access for the paged index */
+static uint32_t cachedb_get32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return cachedb_le32(v);
+}
 
-		ndx_start                  += header.zlen;
-		db->base_file.next_pos      = ndx_start;
-		db->base_file.header_length = ndx_start;
+static uint64_t cachedb_get64(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return cachedb_le64(v);
+}
 
-		/* Extract the Hashtable ptr from index and free its zval storage */
-		index_list = Z_ARRVAL_P(index); 
-		EFREE(index); 
+static void cachedb_put32(char *p, uint32_t v)
+{
+	v = cachedb_le32(v);
+	memcpy(p, &v, sizeof(v));
+}
 
-		/* Initialise another HashTable the same size as index_list for keyed access */
-		index_hash = emalloc(sizeof(HashTable));
-		hash_init(index_hash, hash_count(index_list));
+static void cachedb_put64(char *p, uint64_t v)
+{
+	v = cachedb_le64(v);
+	memcpy(p, &v, sizeof(v));
+}
+/* }}} */
 
-		/* loop over index_list to build the index_hash */
-		for (hash_reset(index_list), ndx=0; 
-		     hash_get(index_list, entry) == SUCCESS; 
-			 hash_next(index_list), ndx++) {
+/* {{{ proto void cachedb_add_crc(struct db, int crc)
+   Append a record CRC to the DB's CRC vector */
+static void cachedb_add_crc(cachedb_t* db, uint32_t crc)
+{
+	if (db->crc_count == db->crc_size) {
+		db->crc_size = db->crc_size ? 2 * db->crc_size : 16;
+		db->crcs     = erealloc(db->crcs, (db->crc_size + 1) * sizeof(uint32_t));
+	}
+	db->crcs[db->crc_count++] = crc;
+}
+/* }}} */
 
-			HashTable* entry_array;
-			zval **zkey, **zlen, *tmp;
+/* {{{ proto void _cachedb_shared_startup()
+   Initialise the shared index registry at module startup */
+PHPAPI void _cachedb_shared_startup(void)
+{
+#ifdef ZTS
+	cachedb_shared_mutex = tsrm_mutex_alloc();
+#endif
+}
+/* }}} */
 
-			CHECKA(Z_TYPE_PP(entry) == IS_ARRAY);
-			entry_array = Z_ARRVAL_PP(entry);
-			CHECKA(hash_count(entry_array) == 3 || hash_count(entry_array) == 4); 
+/* {{{ proto void _cachedb_shared_shutdown()
+   Free the shared index registry at module shutdown, by which time all handles have been closed */
+PHPAPI void _cachedb_shared_shutdown(void)
+{
+	while (cachedb_shared_list) {
+		cachedb_shared_t *shared = cachedb_shared_list;
+		cachedb_shared_list = shared->next;
+		shared->is_registered = 0;
+		if (--shared->refcount == 0) {
+			cachedb_shared_free(shared);
+		}
+	}
+#ifdef ZTS
+	if (cachedb_shared_mutex) {
+		tsrm_mutex_free(cachedb_shared_mutex);
+		cachedb_shared_mutex = NULL;
+	}
+#endif
+}
+/* }}} */
 
-			/* Pick out the file path and length ZVALs from the entry array*/
-			hash_get_first_zv(entry_array, zkey); 
-			hash_get_next_zv(entry_array, zlen);
+/* {{{ proto boolean cachedb_attach_shared(struct db)
+   Attach a shared mode handle to the shared index of its file version, building and publishing the
+   index if this is the first open of this version in the process */
+static int cachedb_attach_shared(cachedb_t* db TSRMLS_DC)
+{
+	cachedb_shared_t *shared = NULL;
+	int               status;
+
+	if (db->base_file.fp) {
+		shared = cachedb_shared_acquire(db->base_file.name, &(db->base_file.sb.sb));
+	}
+
+	if (shared) {
+		db->index_list = emalloc(sizeof(HashTable));
+		hash_init(db->index_list, 0);
+		db->index_hash = emalloc(sizeof(HashTable));
+		hash_init(db->index_hash, 0);
+	} else {
+		/* Load the index as usual, then replace it by a shared copy */
+		if ((status = cachedb_load_index(db TSRMLS_CC)) != SUCCESS || !db->base_file.fp ||
+		    (shared = cachedb_shared_build(db TSRMLS_CC)) == NULL) {
+			return status;
+		}
+		shared = cachedb_shared_publish(shared);
+		zend_hash_clean(db->index_list);
+		zend_hash_clean(db->index_hash);
+		EFREE(db->crcs);
+	}
+
+	db->shared                  = shared;
+	db->base_file.header_length = shared->header_length;
+	db->base_file.next_pos      = -1;
+	db->records_end             = shared->records_end;
+	db->crc_count = db->crc_size = shared->count;
+	db->base_crcs               = shared->has_crcs;
+	db->expired_count           = 0;
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ proto struct cachedb_shared_build(struct db)
+   Build a shared index in persistent memory from the loaded index of a DB, returning NULL if the
+   DB is too large to share */
+static cachedb_shared_t *cachedb_shared_build(cachedb_t* db TSRMLS_DC)
+{
+	HashTable        *index_list = db->index_list;
+	cachedb_shared_t *shared;
+	zval            **entry, **zkey, **zlen, **len, **expires;
+	size_t            count      = hash_count(index_list);
+	size_t            key_bytes  = 0;
+	size_t            ndx;
+	uint32_t          buckets    = 16;
+	off_t             pos        = db->base_file.header_length;
+
+	if (count >= UINT32_MAX / 4) {
+		return NULL;
+	}
+	for (hash_reset(index_list); hash_get(index_list, entry) == SUCCESS; hash_next(index_list)) {
+		hash_get_first_zv(Z_ARRVAL_PP(entry), zkey);
+		key_bytes += Z_STRLEN_PP(zkey);
+	}
+	while (buckets < 2 * count) {
+		buckets *= 2;
+	}
 
-			/* Set index_hash[key] = array(ndx,nxt_start); */
-			MAKE_STD_ZVAL(tmp);
-			array_init_size(tmp,2);
-			add_next_index_long(tmp, ndx);
-			add_next_index_long(tmp, ndx_start);
-			ndx_start += Z_LVAL_PP(zlen);
-			zend_hash_add(index_hash, Z_STRVAL_PP(zkey), Z_STRLEN_PP(zkey)+1, 
-			              &tmp, sizeof(zval *), NULL);
+	shared = pecalloc(1, sizeof(cachedb_shared_t), 1);
+	shared->name          = pestrdup(db->base_file.name, 1);
+	shared->sb            = db->base_file.sb.sb;
+	shared->refcount      = 1;
+	shared->count         = count;
+	shared->bucket_mask   = buckets - 1;
+	shared->buckets       = pecalloc(buckets, sizeof(uint32_t), 1);
+	shared->entries       = pemalloc((count + 1) * sizeof(cachedb_shared_entry_t), 1);
+	shared->keys          = pemalloc(key_bytes + 1, 1);
+	shared->crcs          = pemalloc((count + 1) * sizeof(uint32_t), 1);
+	shared->has_crcs      = db->base_crcs;
+	shared->header_length = db->base_file.header_length;
+	shared->records_end   = db->records_end;
+	memcpy(shared->crcs, db->crcs, count * sizeof(uint32_t));
+
+	for (hash_reset(index_list), ndx = 0, key_bytes = 0; 
+	     hash_get(index_list, entry) == SUCCESS; 
+	     hash_next(index_list), ndx++) {
+		HashTable              *entry_list = Z_ARRVAL_PP(entry);
+		cachedb_shared_entry_t *e          = &(shared->entries[ndx]);
+		uint32_t                h1, h2, b;
+
+		hash_get_first_zv(entry_list, zkey); 
+		hash_get_next_zv(entry_list, zlen);
+		hash_get_next_zv(entry_list, len);
+		e->start      = pos;
+		e->zlen       = Z_LVAL_PP(zlen);
+		e->len        = Z_LVAL_PP(len);
+		e->key_offset = key_bytes;
+		e->key_length = Z_STRLEN_PP(zkey);
+		e->expires    = (hash_count(entry_list) == 5 && hash_index_find(entry_list, 4, expires) == SUCCESS) ?
+		                (uint32_t) Z_LVAL_PP(expires) : 0;
+		memcpy(shared->keys + key_bytes, Z_STRVAL_PP(zkey), e->key_length);
+		key_bytes += e->key_length;
+		pos       += e->zlen;
+
+		/* As with index_hash, the first of any duplicate keys wins */
+		cachedb_bloom_hash(Z_STRVAL_PP(zkey), e->key_length, &h1, &h2);
+		for (b = h1 & shared->bucket_mask; shared->buckets[b]; b = (b + 1) & shared->bucket_mask) {
+			cachedb_shared_entry_t *o = &(shared->entries[shared->buckets[b] - 1]);
+			if (o->key_length == e->key_length && 
+			    memcmp(shared->keys + o->key_offset, shared->keys + e->key_offset, e->key_length) == 0) {
+				break;
+			}
+		}
+		if (!shared->buckets[b]) {
+			shared->buckets[b] = ndx + 1;
 		}
+	}
+	return shared;
+}
+/* }}} */
 
-	} else { /* DB creation starts with an empty index array and hash */
+/* {{{ proto struct cachedb_shared_acquire(string name, struct stat sb)
+   Return a reference to the registered shared index for the given file version, or NULL if there
+   isn't one.  Versions are matched on the file identity, size and mtime, so a DB republished by a
+   commit (which renames a new file over the old) never matches the old version's index. */
+static cachedb_shared_t *cachedb_shared_acquire(const char *name, const struct stat *sb)
+{
+	cachedb_shared_t *shared;
 
-		index_list = emalloc(sizeof(HashTable));
-		hash_init(index_list, 0);
-		index_hash = emalloc(sizeof(HashTable));
-		hash_init(index_hash, 0);
-		ndx_start = 0;
+	CACHEDB_SHARED_LOCK();
+	for (shared = cachedb_shared_list; shared; shared = shared->next) {
+		if (cachedb_shared_same_version(&(shared->sb), sb)) {
+			shared->refcount++;
+			break;
+		}
 	}
+	CACHEDB_SHARED_UNLOCK();
+	return shared;
+}
+/* }}} */
 
-	CHECKA(ndx_start==(db->base_file.filelength));
-	db->index_list    = index_list;
-	db->index_hash    = index_hash;
+/* {{{ proto struct cachedb_shared_publish(struct shared)
+   Publish a newly built index as the current version of its file, replacing any older version.  If
+   another thread has already published the same version, then its index is returned and the new 
+   one freed.  An index of a version that has already been replaced on disk isn't published at all,
+   but is still used by the handle that built it.  Publishing also sweeps the registry of any other
+   unused indexes whose files have since been replaced or removed.  This stats each of these under
+   the lock, but a publish is rare as it follows the build of a new index. */
+static cachedb_shared_t *cachedb_shared_publish(cachedb_shared_t *shared)
+{
+	cachedb_shared_t **p;
+	cachedb_shared_t  *old     = NULL;
+	cachedb_shared_t  *current = NULL;
+	cachedb_shared_t  *stale   = NULL;
+	struct stat        sb;
+
+	if (stat(shared->name, &sb) != 0 || !cachedb_shared_same_version(&sb, &(shared->sb))) {
+		return shared;
+	}
 
+	CACHEDB_SHARED_LOCK();
+	for (p = &cachedb_shared_list; *p; p = &((*p)->next)) {
+		if (cachedb_shared_same_version(&((*p)->sb), &(shared->sb))) {
+			current = *p;
+			current->refcount++;
+			break;
+		}
+	}
+	if (!current) {
+		/* Unlink the previous version of this file and drop the registry's reference to it */
+		for (p = &cachedb_shared_list; *p; p = &((*p)->next)) {
+			if (strcmp((*p)->name, shared->name) == 0) {
+				old = *p;
+				*p  = old->next;
+				old->is_registered = 0;
+				if (--old->refcount > 0) {
+					old = NULL;        /* still in use by other handles */
+				}
+				break;
+			}
+		}
+		shared->refcount++;
+		shared->is_registered = 1;
+		shared->next          = cachedb_shared_list;
+		cachedb_shared_list   = shared;
+	}
+	/* Move any unused indexes of replaced or removed files onto the stale list */
+	for (p = &cachedb_shared_list; *p; ) {
+		cachedb_shared_t *entry = *p;
+		if (entry->refcount == 1 && 
+		    (stat(entry->name, &sb) != 0 || !cachedb_shared_same_version(&sb, &(entry->sb)))) {
+			*p                   = entry->next;
+			entry->is_registered = 0;
+			entry->next          = stale;
+			stale                = entry;
+		} else {
+			p = &(entry->next);
+		}
+	}
+	CACHEDB_SHARED_UNLOCK();
+
+	if (old) {
+		cachedb_shared_free(old);
+	}
+	while (stale) {
+		cachedb_shared_t *entry = stale;
+		stale = entry->next;
+		cachedb_shared_free(entry);
+	}
+	if (current) {
+		cachedb_shared_free(shared);
+		return current;
+	}
+	return shared;
+}
+/* }}} */
+
+/* {{{ proto void cachedb_shared_release(struct shared)
+   Drop a handle's reference to a shared index, freeing it if this was the last reference.  If only
+   the registry's reference would then remain, the file is checked and the index is evicted if the 
+   file has been replaced or removed.  The handle's reference is kept over the stat so that the 
+   index can't be freed by another thread meanwhile. */
+static void cachedb_shared_release(cachedb_shared_t *shared)
+{
+	struct stat sb;
+	int         last = 0;
+	int         idle;
+
+	CACHEDB_SHARED_LOCK();
+	idle = (shared->is_registered && shared->refcount == 2);
+	if (!idle) {
+		last = (--shared->refcount == 0);
+	}
+	CACHEDB_SHARED_UNLOCK();
+
+	if (idle) {
+		int is_stale = (stat(shared->name, &sb) != 0 || !cachedb_shared_same_version(&sb, &(shared->sb)));
+
+		CACHEDB_SHARED_LOCK();
+		if (is_stale && shared->is_registered) {
+			cachedb_shared_t **p;
+			for (p = &cachedb_shared_list; *p; p = &((*p)->next)) {
+				if (*p == shared) {
+					*p = shared->next;
+					break;
+				}
+			}
+			shared->is_registered = 0;
+			shared->refcount--;
+		}
+		last = (--shared->refcount == 0);
+		CACHEDB_SHARED_UNLOCK();
+	}
+
+	if (last) {
+		cachedb_shared_free(shared);
+	}
+}
+/* }}} */
+
+/* {{{ proto void cachedb_shared_free(struct shared) */
+static void cachedb_shared_free(cachedb_shared_t *shared)
+{
+	PEFREE(shared->name, 1);
+	PEFREE(shared->buckets, 1);
+	PEFREE(shared->entries, 1);
+	PEFREE(shared->keys, 1);
+	PEFREE(shared->crcs, 1);
+	pefree(shared, 1);
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_shared_same_version(struct stat a, struct stat b) */
+static int cachedb_shared_same_version(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && 
+	       a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_find_shared(struct db, string key)
+   Look up a key in the shared index, setting the DB record position on a hit.  No lock is needed as
+   the index is immutable and the handle holds a reference to it */
+static int cachedb_find_shared(cachedb_t* db, char *key, size_t key_length)
+{
+	cachedb_shared_t *shared = db->shared;
+	cachedb_rec_t    *rec    = &(db->last_find);
+	uint32_t          h1, h2, b, n;
+
+	cachedb_bloom_hash(key, key_length, &h1, &h2);
+	for (b = h1 & shared->bucket_mask; (n = shared->buckets[b]) != 0; b = (b + 1) & shared->bucket_mask) {
+		cachedb_shared_entry_t *e = &(shared->entries[n - 1]);
+
+		if (e->key_length == key_length && memcmp(shared->keys + e->key_offset, key, key_length) == 0) {
+			if (e->expires > 0 && e->expires <= db->open_time) {
+				return FAILURE;   /* an expired record is a miss */
+			}
+			rec->key        = key;
+			rec->key_length = key_length;
+			rec->is_base    = 1;
+			rec->start      = e->start;
+			rec->zlen       = e->zlen;
+			rec->len        = e->len;
+			rec->ndx        = n - 1;
+			rec->layer      = db;
+			return SUCCESS;
+		}
+	}
+	return FAILURE;
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_parse_id(string key, int &id)
+   Parse an integer mode key.  This must be a decimal id in canonical form, that is without a sign,
+   spaces or leading zeros, so that each id has exactly one key string */
+static int cachedb_parse_id(const char *key, size_t key_length, unsigned long *id)
+{
+	unsigned long v = 0;
+	size_t        i;
+
+	if (key_length == 0 || key_length > 8 || (key[0] == '0' && key_length > 1)) {
+		return FAILURE;
+	}
+	for (i = 0; i < key_length; i++) {
+		if (key[i] < '0' || key[i] > '9') {
+			return FAILURE;
+		}
+		v = v * 10 + (key[i] - '0');
+	}
+	if (v > CACHEDB_DENSE_MAX_ID) {
+		return FAILURE;
+	}
+	*id = v;
 	return SUCCESS;
+}
+/* }}} */
 
-error:
+/* {{{ proto struct cachedb_dense_slot(struct db, int id)
+   Return the dense slot for an id, growing the dense array if necessary */
+static cachedb_dense_t *cachedb_dense_slot(cachedb_t* db, unsigned long id)
+{
+	if (id >= db->dense_size) {
+		uint32_t size = db->dense_size ? 2 * db->dense_size : 64;
+		while (size <= id) {
+			size *= 2;
+		}
+		db->dense = erealloc(db->dense, size * sizeof(cachedb_dense_t));
+		memset(db->dense + db->dense_size, 0, (size - db->dense_size) * sizeof(cachedb_dense_t));
+		db->dense_size = size;
+	}
+	if (id >= db->dense_count) {
+		db->dense_count = id + 1;
+	}
+	return &(db->dense[id]);
+}
+/* }}} */
 
-	/* Don't bother with freeing memory as this will be swept up by cachedb_db_dtor() */
-	php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_ndx_err, db->base_file.name);
+/* {{{ proto boolean cachedb_fill_base_crcs(struct db)
+   Compute the CRCs of the base file records for a DB which doesn't have a CRC section */
+static int cachedb_fill_base_crcs(cachedb_t* db TSRMLS_DC)
+{
+	php_stream  *fp   = db->base_file.fp;
+	off_t        pos  = db->base_file.header_length;
+	char        *buf  = NULL;
+	size_t       buf_size = 0, ndx;
+	zval       **entry;
+	char         error_type = ' ';
+
+	php_stream_seek(fp, pos, SEEK_SET);
+	for (hash_reset(db->index_list), ndx = 0; 
+	     pos < db->records_end && hash_get(db->index_list, entry) == SUCCESS; 
+	     hash_next(db->index_list), ndx++) {
+		zval  **rec_zlen;
+		size_t  zlen;
+
+		CHECKA(hash_index_find(Z_ARRVAL_PP(entry), 1, rec_zlen) == SUCCESS);
+		zlen = Z_LVAL_PP(rec_zlen);
+		if (zlen > buf_size) {
+			buf_size = zlen;
+			buf      = erealloc(buf, buf_size);
+		}
+		CHECKA(php_stream_read(fp, buf, zlen) == zlen);
+		db->crcs[ndx] = cachedb_crc32c(0, buf, zlen);
+		pos += zlen;
+	}
+	EFREE(buf);
+	db->base_file.next_pos = pos;
+	db->base_crcs          = 1;
+	return SUCCESS;
+
+error:
+	EFREE(buf);
+	php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_eom_err);
 	return FAILURE;
 }
 /* }}} */
 
-/* {{{ proto boolean cachedb_read_var(php_stream fp, bool is_binary, zval &value)
-   Fetch the current record */
-static int cachedb_read_var(php_stream *fp, int is_binary, zval *value, size_t zlen, size_t len TSRMLS_DC)
+/* {{{ Bloom filter helpers
+   The two base hashes are a DJB and an FNV-1a hash computed in a single pass over the key.  These
+   are 32-bit so that the filter is independent of the platform word size.  The probes use double 
+   hashing, that is probe i tests bit (h1 + i*h2) mod bits.
+ */
+static void cachedb_bloom_hash(const char *key, size_t key_length, uint32_t *h1, uint32_t *h2)
+{
+	const unsigned char *p    = (const unsigned char *) key;
+	const unsigned char *pend = p + key_length;
+	uint32_t             a    = 5381;
+	uint32_t             b    = 2166136261U;
+
+	for (; p < pend; p++) {
+		a = (a << 5) + a + *p;
+		b = (b ^ *p) * 16777619U;
+	}
+	*h1 = a;
+	*h2 = b | 1;
+}
+
+static int cachedb_bloom_test(const unsigned char *bloom, uint32_t bits, uint32_t hashes, uint32_t h1, uint32_t h2)
+{
+	uint32_t i;
+
+	for (i = 0; i < hashes; i++, h1 += h2) {
+		uint32_t bit = h1 % bits;
+		if (!(bloom[bit >> 3] & (1 << (bit & 7)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void cachedb_bloom_set(unsigned char *bloom, uint32_t bits, uint32_t hashes, uint32_t h1, uint32_t h2)
+{
+	uint32_t i;
+
+	for (i = 0; i < hashes; i++, h1 += h2) {
+		uint32_t bit = h1 % bits;
+		bloom[bit >> 3] |= (1 << (bit & 7));
+	}
+}
+/* }}} */
+
+/* {{{ proto struct cachedb_get_shard(struct db, int shard)
+   Return a shard of a sharded DB, opening it on first use */
+static cachedb_t *cachedb_get_shard(cachedb_t* db, int shard TSRMLS_DC)
+{
+	if (!db->shards[shard]) {
+		char *name;
+		int   name_length = spprintf(&name, 0, CACHEDB_SHARD_NAME, db->base_file.name, shard, db->shard_count);
+
+		if (_cachedb_open(&(db->shards[shard]), name, name_length, db->shard_mode TSRMLS_CC) == FAILURE) {
+			db->shards[shard] = NULL;
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, _cachedb_shard_err, shard, db->base_file.name);
+		} else if (db->mode == 'r') {
+			db->shards[shard]->mode = 'r';
+		}
+		efree(name);
+	}
+	return db->shards[shard];
+}
+/* }}} */
+
+/* {{{ proto int cachedb_route_key(struct db, string key)
+   Return the shard for a key.  This uses the platform-independent Bloom hash so that a sharded DB 
+   can be shared between 32 and 64-bit hosts */
+static int cachedb_route_key(cachedb_t* db, char *key, size_t key_length)
+{
+	uint32_t h1, h2;
+
+	cachedb_bloom_hash(key, key_length, &h1, &h2);
+	return (int) (h1 % (uint32_t) db->shard_count);
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_read_var(php_stream fp, bool is_binary, zval &value, int crc, struct stats)
+   Fetch the current record, verifying it against the expected CRC if one is given.  The decode times
+   are added to stats if it isn't NULL */
+static int cachedb_read_var(php_stream *fp, int is_binary, zval *value, size_t zlen, size_t len, const uint32_t *crc, cachedb_stats_t *stats TSRMLS_DC)
 {
 	unsigned char   *buf        = NULL;
 	unsigned char   *p, *pend;
@@ -676,6 +3531,12 @@ static int cachedb_read_var(php_stream *fp, int is_binary, zval *value, size_t z
             p += ret;
 		}
         CHECKA(pend == p);
+		if (crc && cachedb_crc32c(0, buf, len) != *crc) {
+			if (buf != (unsigned char *) Z_STRVAL_P(value)) {
+				efree(buf);
+			}
+			return CACHEDB_CORRUPT;
+		}
 		ZVAL_STRINGL(value, buf, len, 0);
 
 	} else {
@@ -683,17 +3544,24 @@ static int cachedb_read_var(php_stream *fp, int is_binary, zval *value, size_t z
 		php_unserialize_data_t var_hash;
 		size_t                 buf_length = len;
 		int                    status;
+		double                 t0, t1;
 
 		/* copy relevant stream to zbuf and update the relevant next pos */
 		CHECKA(zlen == php_stream_copy_to_mem(fp, &zbuf, zlen, 0));
+		if (crc && cachedb_crc32c(0, zbuf, zlen) != *crc) {
+			PEFREE(zbuf,0);
+			return CACHEDB_CORRUPT;
+		}
 
 		/* uncompress the buffer and free the zbuf */
+		t0  = stats ? cachedb_now() : 0;
 		buf = emalloc(buf_length+1);
 		buf[buf_length]=(char) 0;      /* zero terminate buf to simply debugging */
 		CHECKA(uncompress(buf, &buf_length, zbuf, zlen)==Z_OK && buf_length==len);
 		PEFREE(zbuf,0);
 
 		/* Unserialize the buffer into the returned zval value. */
+		t1 = stats ? cachedb_now() : 0;
 		p = buf;
 		PHP_VAR_UNSERIALIZE_INIT(var_hash);
 	 	status = php_var_unserialize(&value, (const unsigned char**) &p, 
@@ -701,6 +3569,10 @@ static int cachedb_read_var(php_stream *fp, int is_binary, zval *value, size_t z
 		EFREE(buf);
 		PHP_VAR_UNSERIALIZE_DESTROY(var_hash);
 		CHECKA(status);
+		if (stats) {
+			stats->decompress_time  += t1 - t0;
+			stats->unserialize_time += cachedb_now() - t1;
+		}
 	}
 	return SUCCESS;
 
@@ -710,50 +3582,66 @@ error:
 }
 /* }}} */
 
-/* {{{ proto boolean cachedb_write_var(php_stream fp, zval &value)
-   Append the current record to the specified file */
-static int cachedb_write_var(php_stream *fp, int is_binary, zval *value, size_t *zlen, size_t *len TSRMLS_DC)
+/* {{{ proto boolean cachedb_encode_var(zval value, string &zbuf, int &zlen, int &len, struct stats)
+   Serialize and compress a zval into an emalloced buffer */
+static int cachedb_encode_var(zval *value, char **zbuf, size_t *zlen, size_t *len, cachedb_stats_t *stats TSRMLS_DC)
 {
-	size_t               buf_length;
+	size_t               zbuf_length;
+	php_serialize_data_t var_hash;
+	zval                *var       = value;
+	smart_str            buf       = {NULL, 0, 0};
+	double               t0        = stats ? cachedb_now() : 0;
 	char                 error_type  = ' ';
 
-	if (is_binary) {
-		const char *buf;
-		CHECKA(Z_TYPE_P(value) == IS_STRING);
+	/* Serialize zval list into buf */
+	PHP_VAR_SERIALIZE_INIT(var_hash);
+	php_var_serialize(&buf, &var, &var_hash TSRMLS_CC);
+	PHP_VAR_SERIALIZE_DESTROY(var_hash);	
+
+	/* Allocate zbuf len based on worst case for compression, then compress and free original buffer */
+	zbuf_length = compressBound(buf.len) + 1;
+	*zbuf = (char *) emalloc(zbuf_length);
+	CHECKA(compress(*zbuf, &zbuf_length, buf.c, buf.len) == Z_OK);
+
+	*len  = buf.len;
+	*zlen = zbuf_length;
+	smart_str_free(&buf);
+	if (stats) {
+		stats->compress_time += cachedb_now() - t0;
+	}
+	return SUCCESS;
 
-		buf = (const char *) Z_STRVAL_P(value);
-		buf_length = Z_STRLEN_P(value);
+error:
+	smart_str_free(&buf);
+	EFREE(*zbuf);
+	php_error_docref(NULL TSRMLS_CC, E_ERROR, _cachedb_write_err);
+	return FAILURE;
+}
+/* }}} */
 
-		CHECKA(php_stream_write(fp, buf, buf_length) == buf_length);
+/* {{{ proto boolean cachedb_write_var(php_stream fp, zval &value, int &crc, struct stats)
+   Append the current record to the specified file, returning the CRC of the bytes written */
+static int cachedb_write_var(php_stream *fp, int is_binary, zval *value, size_t *zlen, size_t *len, uint32_t *crc, cachedb_stats_t *stats TSRMLS_DC)
+{
+	char                 error_type  = ' ';
 
-		*zlen = buf_length;
+	if (is_binary) {
+		CHECKA(Z_TYPE_P(value) == IS_STRING);
+		CHECKA(php_stream_write(fp, Z_STRVAL_P(value), Z_STRLEN_P(value)) == Z_STRLEN_P(value));
+		*zlen = *len = Z_STRLEN_P(value);
+		*crc  = cachedb_crc32c(0, Z_STRVAL_P(value), Z_STRLEN_P(value));
 
 	} else { /* is serializable */
-		size_t               zbuf_length;
-		php_serialize_data_t var_hash;
-		char                *zbuf      = NULL;
-		zval                *var       = value;
-		smart_str            buf       = {NULL, 0, 0};
-
-		/* Serialize zval list into buf then destroy list*/
-		PHP_VAR_SERIALIZE_INIT(var_hash);
-		php_var_serialize(&buf, &var, &var_hash TSRMLS_CC);
-		PHP_VAR_SERIALIZE_DESTROY(var_hash);	
-		buf_length = buf.len;
-
-		/* Allocate zbuf len based on worst case for compression, then compress and free original buffer */
-		zbuf_length = compressBound(buf_length) + 1;
-		zbuf = (char *) emalloc(zbuf_length);
-		CHECKA(compress(zbuf, &zbuf_length, buf.c, buf_length) == Z_OK);
-		smart_str_free(&buf);
-
-		/* Now write out the buffer to file */
-		CHECKA(php_stream_write(fp, (const char *) zbuf, zbuf_length) == zbuf_length);
+		char *zbuf = NULL;
+
+		CHECKA(cachedb_encode_var(value, &zbuf, zlen, len, stats TSRMLS_CC) == SUCCESS);
+		*crc = cachedb_crc32c(0, zbuf, *zlen);
+		if (php_stream_write(fp, (const char *) zbuf, *zlen) != *zlen) {
+			efree(zbuf);
+			CHECKA(0);
+		}
 		efree(zbuf);
-		*zlen = zbuf_length;
 	}
-
-	*len  = buf_length;
 	return SUCCESS;
 
 error:
@@ -768,6 +3656,18 @@ static void cachedb_db_dtor(cachedb_t** pdb TSRMLS_DC)
 {
 	cachedb_t *db = *pdb;
 
+	if(db->lower) {
+		cachedb_db_dtor(&(db->lower) TSRMLS_CC);
+	}
+	if(db->shards) {
+		int i;
+		for (i = 0; i < db->shard_count; i++) {
+			if (db->shards[i]) {
+				cachedb_db_dtor(&(db->shards[i]) TSRMLS_CC);
+			}
+		}
+		EFREE(db->shards);
+	}
 	if(db->base_file.fp) {
 		php_stream_close(db->base_file.fp);
 	}
@@ -779,6 +3679,17 @@ static void cachedb_db_dtor(cachedb_t** pdb TSRMLS_DC)
 	EFREE(db->base_file.dir);	
 	EFREE(db->tmp_file.name);	
 	EFREE(db->tmp_file.dir);	
+	EFREE(db->bloom);
+	EFREE(db->crcs);
+	EFREE(db->dense);
+	EFREE(db->paged_root);
+	EFREE(db->paged_buf);
+	if (db->postings) {
+		zval_ptr_dtor(&(db->postings));
+	}
+	if (db->shared) {
+		cachedb_shared_release(db->shared);
+	}
 	
 	zend_hash_destroy(db->index_list);
 	EFREE(db->index_list);
@@ -6,26 +6,89 @@
 
 /* {{{ Private types */ 
 typedef struct _cachedb_t cachedb_t, *cachedb_pt;
+typedef struct _cachedb_commit_t cachedb_commit_t;
+/* }}} */
+
+/* {{{ Commit durability levels, see _cachedb_set_durability() */
+#define CACHEDB_DURABILITY_NONE 0
+#define CACHEDB_DURABILITY_DATA 1
+#define CACHEDB_DURABILITY_DIR  2
+/* }}} */
+
+/* {{{ Commit outcomes, as reported in cachedb_stats_t */
+#define CACHEDB_COMMIT_NONE        0     /* no commit was needed */
+#define CACHEDB_COMMIT_PUBLISHED   1     /* the new DB replaced the base file */
+#define CACHEDB_COMMIT_DISCARDED   2     /* the base file had been changed by another process */
+#define CACHEDB_COMMIT_FAILED      3     /* the new DB couldn't be written */
+#define CACHEDB_COMMIT_DEFERRED    4     /* queued to run after the request */
+/* }}} */
+
+/* {{{ Per-handle statistics.  The times are in seconds */
+typedef struct _cachedb_stats_t {
+	unsigned long  finds;
+	unsigned long  hits;
+	unsigned long  misses;
+	unsigned long  fetches;
+	unsigned long  base_bytes_read;      /* record bytes read from the base file */
+	unsigned long  staged_bytes_read;    /* record bytes read back from the temporary file */
+	unsigned long  seeks;
+	unsigned long  records_added;
+	double         compress_time;        /* serialize + compress on add */
+	double         decompress_time;
+	double         unserialize_time;
+	double         commit_time;          /* in the request: prepare and, if not deferred, run */
+	int            commit_outcome;
+} cachedb_stats_t;
 /* }}} */
 
 /* {{{ Public interface to Cache DB */
 PHPAPI int _cachedb_open( cachedb_t** pdb, char *file,   size_t file_len, char *mode TSRMLS_DC);
+PHPAPI int _cachedb_open_layers(cachedb_t** pdb, char **files, size_t *file_lens, int count, char *mode TSRMLS_DC);
+PHPAPI int _cachedb_open_sharded(cachedb_t** pdb, char *dir, size_t dir_len, int shards, char *mode TSRMLS_DC);
 PHPAPI int _cachedb_close(cachedb_t*  db, char mode TSRMLS_DC);
+PHPAPI int _cachedb_close_ex(cachedb_t* db, char mode, cachedb_commit_t **deferred, cachedb_stats_t *stats TSRMLS_DC);
+PHPAPI void _cachedb_commit_deferred(cachedb_commit_t *jobs TSRMLS_DC);
+PHPAPI void _cachedb_set_durability(cachedb_t* db, int durability TSRMLS_DC);
+PHPAPI void _cachedb_set_verify(cachedb_t* db, int percent TSRMLS_DC);
 PHPAPI int _cachedb_find( cachedb_t*  db,  char  *key,   size_t key_len, zval *metadata TSRMLS_DC);
+PHPAPI int _cachedb_find_int(cachedb_t* db, unsigned long id TSRMLS_DC);
 PHPAPI int _cachedb_fetch(cachedb_t*  db,  zval *value TSRMLS_DC);
 PHPAPI int _cachedb_add(  cachedb_t*  db,  char  *key,   size_t key_len, zval *value, zval *metadata TSRMLS_DC);
+PHPAPI int _cachedb_add_ex(cachedb_t* db,  char  *key,   size_t key_len, zval *value, zval *metadata, time_t expires TSRMLS_DC);
 PHPAPI int _cachedb_info( zval **info, cachedb_t* db TSRMLS_DC);
+PHPAPI size_t _cachedb_expired_count(cachedb_t* db TSRMLS_DC);
+PHPAPI void _cachedb_get_stats(cachedb_t* db, cachedb_stats_t *stats TSRMLS_DC);
 PHPAPI const struct stat *cachedb_get_sb(cachedb_t* db TSRMLS_DC);
+PHPAPI size_t _cachedb_found_length(cachedb_t* db TSRMLS_DC);
+PHPAPI int _cachedb_index_metadata(cachedb_t* db, HashTable *fields TSRMLS_DC);
+PHPAPI int _cachedb_find_by(cachedb_t* db, char *field, size_t field_len, zval *value, zval *keys TSRMLS_DC);
+PHPAPI void _cachedb_shared_startup(void);
+PHPAPI void _cachedb_shared_shutdown(void);
 /* }}} */
 
 /* {{{ Public macros to make the calling code more readable */
 #define cachedb_open(p,f,fl,m)    _cachedb_open(p,f,fl,m TSRMLS_CC)
+#define cachedb_open_layers(p,f,fl,n,m) _cachedb_open_layers(p,f,fl,n,m TSRMLS_CC)
+#define cachedb_open_sharded(p,d,dl,n,m) _cachedb_open_sharded(p,d,dl,n,m TSRMLS_CC)
 #define cachedb_close(db)         _cachedb_close(db, '*' TSRMLS_CC)
 #define cachedb_close2(db,m)      _cachedb_close(db, m TSRMLS_CC)
+#define cachedb_close_ex(db,m,d,s) _cachedb_close_ex(db, m, d, s TSRMLS_CC)
+#define cachedb_commit_deferred(j) _cachedb_commit_deferred(j TSRMLS_CC)
+#define cachedb_set_durability(db,d) _cachedb_set_durability(db,d TSRMLS_CC)
+#define cachedb_set_verify(db,v)  _cachedb_set_verify(db,v TSRMLS_CC)
 #define cachedb_find(db,k,kl,m)   _cachedb_find(db,k,kl, m TSRMLS_CC)
+#define cachedb_find_int(db,id)   _cachedb_find_int(db,id TSRMLS_CC)
+#define cachedb_found_length(db)  _cachedb_found_length(db TSRMLS_CC)
 #define cachedb_fetch(db,v)       _cachedb_fetch(db,v TSRMLS_CC)
 #define cachedb_add(db,k,kl,v,m)  _cachedb_add(db,k,kl,v,m TSRMLS_CC)
+#define cachedb_add_ex(db,k,kl,v,m,e) _cachedb_add_ex(db,k,kl,v,m,e TSRMLS_CC)
+#define cachedb_expired_count(db) _cachedb_expired_count(db TSRMLS_CC)
+#define cachedb_get_stats(db,s)   _cachedb_get_stats(db,s TSRMLS_CC)
 #define cachedb_info(rv,db)       _cachedb_info(&rv,db TSRMLS_CC)
+#define cachedb_index_metadata(db,f) _cachedb_index_metadata(db,f TSRMLS_CC)
+#define cachedb_find_by(db,f,fl,v,k) _cachedb_find_by(db,f,fl,v,k TSRMLS_CC)
+#define cachedb_shared_startup()  _cachedb_shared_startup()
+#define cachedb_shared_shutdown() _cachedb_shared_shutdown()
 /* }}} */
 
 #endif /* CACHEDB_H */
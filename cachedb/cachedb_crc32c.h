@@ -0,0 +1,12 @@
+#ifndef CACHEDB_CRC32C_H
+#define CACHEDB_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* {{{ CRC32C (Castagnoli) checksum.  As with zlib's crc32(), the crc argument is the running CRC
+ * of any preceding data, or 0 to start a new checksum. */
+uint32_t cachedb_crc32c(uint32_t crc, const void *buf, size_t length);
+/* }}} */
+
+#endif /* CACHEDB_CRC32C_H */
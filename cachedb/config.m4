@@ -19,7 +19,10 @@ if test "$PHP_CACHEDB" != "no"; then
     AC_DEFINE(__DEBUG_CACHEDB__, 1, [ ])
   fi
 
+  AC_CHECK_FUNCS(fork linkat fdatasync)
+  PHP_CHECK_FUNC(clock_gettime, rt)
+
   AC_DEFINE(HAVE_CACHEDB,1,[Whether CacheDB is present])
-  PHP_NEW_EXTENSION(cachedb, php_cachedb.c cachedb.c, $ext_shared)
+  PHP_NEW_EXTENSION(cachedb, php_cachedb.c cachedb.c cachedb_crc32c.c, $ext_shared)
 fi
 
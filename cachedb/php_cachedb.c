@@ -40,10 +40,13 @@
 #endif
 
 #include "php.h"
+#include "php_ini.h"
 #include "php_cachedb.h"
+#include "cachedb_crc32c.h"
 
 #include <sys/types.h>
 #include <fcntl.h>
+#include <time.h>
 
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
@@ -53,16 +56,34 @@
 #include "ext/standard/file.h"
 #include "ext/standard/info.h"
 #include "ext/standard/php_string.h"
+#include "php_streams.h"
+#include "zend_exceptions.h"
 
 static PHP_MINIT_FUNCTION(cachedb);
 static PHP_MSHUTDOWN_FUNCTION(cachedb);
 static PHP_MINFO_FUNCTION(cachedb);
 static PHP_FUNCTION(cachedb_open);
+static PHP_FUNCTION(cachedb_open_layers);
+static PHP_FUNCTION(cachedb_open_sharded);
 static PHP_FUNCTION(cachedb_exists);
 static PHP_FUNCTION(cachedb_fetch);
+static PHP_FUNCTION(cachedb_fetch_int);
 static PHP_FUNCTION(cachedb_add);
+static PHP_FUNCTION(cachedb_add_int);
+static PHP_FUNCTION(cachedb_index_metadata);
+static PHP_FUNCTION(cachedb_find_by);
 static PHP_FUNCTION(cachedb_info);
 static PHP_FUNCTION(cachedb_close);
+static PHP_FUNCTION(cachedb_expired_count);
+static PHP_FUNCTION(cachedb_stats);
+static PHP_METHOD(CacheDB, __construct);
+static PHP_METHOD(CacheDB, has);
+static PHP_METHOD(CacheDB, get);
+static PHP_METHOD(CacheDB, add);
+static PHP_METHOD(CacheDB, info);
+static PHP_METHOD(CacheDB, stats);
+static PHP_METHOD(CacheDB, expiredCount);
+static PHP_METHOD(CacheDB, close);
 
 /* {{{ arginfo 
 */
@@ -71,6 +92,17 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_open, 0, 0, 1)
 	ZEND_ARG_INFO(0, mode)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_open_layers, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, paths, 0)
+	ZEND_ARG_INFO(0, mode)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_open_sharded, 0, 0, 3)
+	ZEND_ARG_INFO(0, dir)
+	ZEND_ARG_INFO(0, shards)
+	ZEND_ARG_INFO(0, mode)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_exists, 0, 0, 1)
 	ZEND_ARG_INFO(0, key)
 	ZEND_ARG_INFO(0, handle)
@@ -88,6 +120,31 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_add, 0, 0, 2)
 	ZEND_ARG_INFO(0, value)
 	ZEND_ARG_INFO(0, handle)
 	ZEND_ARG_INFO(0, metadata)
+	ZEND_ARG_INFO(0, ttl)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_fetch_int, 0, 0, 1)
+	ZEND_ARG_INFO(0, id)
+	ZEND_ARG_INFO(0, handle)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_add_int, 0, 0, 2)
+	ZEND_ARG_INFO(0, id)
+	ZEND_ARG_INFO(0, value)
+	ZEND_ARG_INFO(0, handle)
+	ZEND_ARG_INFO(0, ttl)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_index_metadata, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, fields, 0)
+	ZEND_ARG_INFO(0, handle)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_find_by, 0, 0, 2)
+	ZEND_ARG_INFO(0, field)
+	ZEND_ARG_INFO(0, value)
+	ZEND_ARG_INFO(0, handle)
+	ZEND_ARG_INFO(0, fetch)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_info, 0, 0, 0)
@@ -97,6 +154,40 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_close, 0, 0, 0)
 	ZEND_ARG_INFO(0, handle)
 	ZEND_ARG_INFO(0, mode)
+	ZEND_ARG_INFO(1, stats)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_stats, 0, 0, 0)
+	ZEND_ARG_INFO(0, handle)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_expired_count, 0, 0, 0)
+	ZEND_ARG_INFO(0, handle)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_method_construct, 0, 0, 2)
+	ZEND_ARG_INFO(0, path)
+	ZEND_ARG_INFO(0, mode)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_method_key, 0, 0, 1)
+	ZEND_ARG_INFO(0, key)
+	ZEND_ARG_INFO(1, metadata)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_method_add, 0, 0, 2)
+	ZEND_ARG_INFO(0, key)
+	ZEND_ARG_INFO(0, value)
+	ZEND_ARG_INFO(0, metadata)
+	ZEND_ARG_INFO(0, ttl)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_method_close, 0, 0, 0)
+	ZEND_ARG_INFO(0, mode)
+	ZEND_ARG_INFO(1, stats)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_cachedb_method_void, 0, 0, 0)
 ZEND_END_ARG_INFO()
 /* }}} */
 
@@ -104,11 +195,34 @@ ZEND_END_ARG_INFO()
  */
 const zend_function_entry cachedb_functions[] = {
 	PHP_FE(cachedb_open,   arginfo_cachedb_open)
+	PHP_FE(cachedb_open_layers, arginfo_cachedb_open_layers)
+	PHP_FE(cachedb_open_sharded, arginfo_cachedb_open_sharded)
 	PHP_FE(cachedb_exists, arginfo_cachedb_exists)
 	PHP_FE(cachedb_fetch,  arginfo_cachedb_fetch)
 	PHP_FE(cachedb_add,    arginfo_cachedb_add)
+	PHP_FE(cachedb_fetch_int, arginfo_cachedb_fetch_int)
+	PHP_FE(cachedb_add_int, arginfo_cachedb_add_int)
+	PHP_FE(cachedb_index_metadata, arginfo_cachedb_index_metadata)
+	PHP_FE(cachedb_find_by, arginfo_cachedb_find_by)
 	PHP_FE(cachedb_info,   arginfo_cachedb_info)
 	PHP_FE(cachedb_close,  arginfo_cachedb_close)
+	PHP_FE(cachedb_expired_count, arginfo_cachedb_expired_count)
+	PHP_FE(cachedb_stats,  arginfo_cachedb_stats)
+	PHP_FE_END
+};
+/* }}} */
+
+/* {{{ cachedb_methods[]
+ */
+static const zend_function_entry cachedb_methods[] = {
+	PHP_ME(CacheDB, __construct,  arginfo_cachedb_method_construct, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	PHP_ME(CacheDB, has,          arginfo_cachedb_method_key,       ZEND_ACC_PUBLIC)
+	PHP_ME(CacheDB, get,          arginfo_cachedb_method_key,       ZEND_ACC_PUBLIC)
+	PHP_ME(CacheDB, add,          arginfo_cachedb_method_add,       ZEND_ACC_PUBLIC)
+	PHP_ME(CacheDB, info,         arginfo_cachedb_method_void,      ZEND_ACC_PUBLIC)
+	PHP_ME(CacheDB, stats,        arginfo_cachedb_method_void,      ZEND_ACC_PUBLIC)
+	PHP_ME(CacheDB, expiredCount, arginfo_cachedb_method_void,      ZEND_ACC_PUBLIC)
+	PHP_ME(CacheDB, close,        arginfo_cachedb_method_close,     ZEND_ACC_PUBLIC)
 	PHP_FE_END
 };
 /* }}} */
@@ -122,17 +236,29 @@ const zend_function_entry cachedb_functions[] = {
 //extern zend_cachedb_globals cachedb_globals;
 
 #define CHECK_HANDLE(d,h)   \
-	if (h >= 0 && h < MAX_DB_FILES && (CACHEDB_G(db))[h] != NULL) {  \
+	if (h >= 0 && h < CACHEDB_G(db_top) && (CACHEDB_G(db))[h] != NULL) {  \
 		d = (CACHEDB_G(db))[h];  \
 	} else {  \
 		RETURN_FALSE;  \
 	}
 
-/* {{{ Globals and Module struct */
+/* {{{ Globals and Module struct 
+ * Open DBs are held in a per-request vector indexed by handle, which is allocated on the first open
+ * and doubled when full.  Closed handles are pushed onto the free_handles stack for reuse.
+ */
 
-#define MAX_DB_FILES 10
+#define CACHEDB_INITIAL_HANDLES 8
 ZEND_BEGIN_MODULE_GLOBALS(cachedb)
-	cachedb_pt db[MAX_DB_FILES];
+	cachedb_pt       *db;                 /* open DBs indexed by handle */
+	int               db_size;            /* allocated size of db and free_handles */
+	int               db_top;             /* handles below db_top have been issued */
+	int              *free_handles;       /* stack of closed handles */
+	int               free_count;
+	zend_bool         deferred_commit;    /* cachedb.deferred_commit INI setting */
+	long              durability;         /* cachedb.durability INI setting */
+	long              verify;             /* cachedb.verify INI setting */
+	cachedb_commit_t *deferred_commits;   /* commits queued to run after the request */
+	HashTable        *stream_dbs;         /* DBs opened by the cachedb:// wrapper, keyed by path */
 ZEND_END_MODULE_GLOBALS(cachedb)
 
 ZEND_DECLARE_MODULE_GLOBALS(cachedb)
@@ -140,6 +266,7 @@ ZEND_DECLARE_MODULE_GLOBALS(cachedb)
 PHP_RINIT_FUNCTION(cachedb);
 PHP_RSHUTDOWN_FUNCTION(cachedb);
 PHP_MINFO_FUNCTION(cachedb);
+static ZEND_MODULE_POST_ZEND_DEACTIVATE_D(cachedb);
 
 zend_module_entry cachedb_module_entry = {
 	STANDARD_MODULE_HEADER_EX,
@@ -147,8 +274,8 @@ zend_module_entry cachedb_module_entry = {
 	NULL,
 	"cachedb",                   /* extension name */
 	cachedb_functions,           /* function list */
-	NULL,                        /* No process startup */
-	NULL,                        /* process shutdown */
+	PHP_MINIT(cachedb),          /* process startup */
+	PHP_MSHUTDOWN(cachedb),      /* process shutdown */
 	PHP_RINIT(cachedb),          /* request startup */
 	PHP_RSHUTDOWN(cachedb),      /* request shutdown */
 	PHP_MINFO(cachedb),          /* extension info */
@@ -156,7 +283,7 @@ zend_module_entry cachedb_module_entry = {
 	PHP_MODULE_GLOBALS(cachedb), /* globals descriptor */
 	NULL,                        /* No globals ctor */
 	NULL,                        /* No globals dtor */
-	NULL,                        /* No post deactivate */
+	ZEND_MODULE_POST_ZEND_DEACTIVATE_N(cachedb), /* post deactivate */
 	STANDARD_MODULE_PROPERTIES_EX
 };
 
@@ -165,18 +292,424 @@ ZEND_GET_MODULE(cachedb)
 #endif
 /* }}} */
 
-/* {{{ PHP Request Initialisation Function
- * The only request initation is to zero out the global db array 
+/* {{{ INI entries
+ * If cachedb.deferred_commit is set then all committing closes are deferred as with close mode 'd'.
+ * cachedb.durability is 0 (none), 1 (fdatasync the new DB before publishing it) or 2 (also fsync 
+ * the directory after publishing, batched across the deferred commits of a request).
+ * cachedb.verify is the percentage of fetches whose record CRC is checked: 0 (off) to 100 (always).
  */
-PHP_RINIT_FUNCTION(cachedb)
+PHP_INI_BEGIN()
+	STD_PHP_INI_BOOLEAN("cachedb.deferred_commit", "0", PHP_INI_ALL, OnUpdateBool, 
+	                    deferred_commit, zend_cachedb_globals, cachedb_globals)
+	STD_PHP_INI_ENTRY("cachedb.durability", "0", PHP_INI_ALL, OnUpdateLong, 
+	                  durability, zend_cachedb_globals, cachedb_globals)
+	STD_PHP_INI_ENTRY("cachedb.verify", "0", PHP_INI_ALL, OnUpdateLong, 
+	                  verify, zend_cachedb_globals, cachedb_globals)
+PHP_INI_END()
+/* }}} */
+
+/* {{{ cachedb_stats_to_array
+ * Convert a stats struct to the associative array returned by cachedb_stats() and cachedb_close()
+ */
+static void cachedb_stats_to_array(zval *rv, cachedb_stats_t *stats)
 {
-	cachedb_t **p;
-	int i, *pi;
+	static const char *outcomes[] = {"none", "published", "discarded", "failed", "deferred"};
 
-	p = CACHEDB_G(db);
-	for (i=0; i<MAX_DB_FILES; i++) {
-		*p++ = NULL;
+	array_init_size(rv, 14);
+	add_assoc_long(rv,   "finds",             stats->finds);
+	add_assoc_long(rv,   "hits",              stats->hits);
+	add_assoc_long(rv,   "misses",            stats->misses);
+	add_assoc_long(rv,   "fetches",           stats->fetches);
+	add_assoc_long(rv,   "base_bytes_read",   stats->base_bytes_read);
+	add_assoc_long(rv,   "staged_bytes_read", stats->staged_bytes_read);
+	add_assoc_long(rv,   "seeks",             stats->seeks);
+	add_assoc_long(rv,   "records_added",     stats->records_added);
+	add_assoc_double(rv, "compress_time",     stats->compress_time);
+	add_assoc_double(rv, "decompress_time",   stats->decompress_time);
+	add_assoc_double(rv, "unserialize_time",  stats->unserialize_time);
+	add_assoc_double(rv, "commit_time",       stats->commit_time);
+	add_assoc_string(rv, "commit_outcome",    (char *) outcomes[stats->commit_outcome], 1);
+}
+/* }}} */
+
+/* {{{ cachedb_new_handle
+ * Store an open DB in the handle vector and return its handle, reusing a closed handle if any
+ */
+static long cachedb_new_handle(cachedb_t *db TSRMLS_DC)
+{
+	int h, size;
+
+	if (CACHEDB_G(free_count) > 0) {
+		h = CACHEDB_G(free_handles)[--CACHEDB_G(free_count)];
+	} else {
+		if (CACHEDB_G(db_top) == CACHEDB_G(db_size)) {
+			size = CACHEDB_G(db_size) ? 2 * CACHEDB_G(db_size) : CACHEDB_INITIAL_HANDLES;
+			CACHEDB_G(db)           = safe_erealloc(CACHEDB_G(db), size, sizeof(cachedb_pt), 0);
+			CACHEDB_G(free_handles) = safe_erealloc(CACHEDB_G(free_handles), size, sizeof(int), 0);
+			CACHEDB_G(db_size)      = size;
+		}
+		h = CACHEDB_G(db_top)++;
+	}
+	CACHEDB_G(db)[h] = db;
+	return h;
+}
+/* }}} */
+
+/* {{{ cachedb_release_handle
+ * Null a closed handle's entry and push it onto the free stack
+ */
+static void cachedb_release_handle(long h TSRMLS_DC)
+{
+	CACHEDB_G(db)[h] = NULL;
+	CACHEDB_G(free_handles)[CACHEDB_G(free_count)++] = (int) h;
+}
+/* }}} */
+
+/* {{{ cachedb_close_common
+ * Close a DB for cachedb_close() and CacheDB::close(), applying the durability and deferred commit
+ * settings.  If zstats is given, it is set to the DB's final statistics.
+ */
+static int cachedb_close_common(cachedb_t *db, char *mode, zval *zstats TSRMLS_DC)
+{
+	cachedb_stats_t stats;
+	int             status;
+
+	cachedb_set_durability(db, CACHEDB_G(durability));
+	if ((mode && mode[0] == 'd') || (CACHEDB_G(deferred_commit) && !(mode && mode[0] == 'r'))) {
+		status = cachedb_close_ex(db, (mode ? mode[0] : '*'), &CACHEDB_G(deferred_commits), &stats);
+	} else {
+		status = cachedb_close_ex(db, (mode ? mode[0] : '*'), NULL, &stats);
+	}
+
+	if (zstats) {
+		zval_dtor(zstats);
+		cachedb_stats_to_array(zstats, &stats);
+	}
+	return status;
+}
+/* }}} */
+
+/* {{{ CacheDB class
+ * The object wraps a single DB, so its methods skip the handle lookup.  A DB left open when the
+ * object is destroyed is closed readonly, as with handles at request shutdown.
+ */
+typedef struct _cachedb_object {
+	zend_object  std;
+	cachedb_t   *db;          /* NULL once closed */
+} cachedb_object;
+
+static zend_class_entry     *cachedb_ce;
+static zend_object_handlers  cachedb_object_handlers;
+
+static void cachedb_object_free_storage(void *object TSRMLS_DC)
+{
+	cachedb_object *intern = (cachedb_object *) object;
+
+	if (intern->db) {
+		cachedb_close2(intern->db, 'r');
+	}
+	zend_object_std_dtor(&intern->std TSRMLS_CC);
+	efree(intern);
+}
+
+static zend_object_value cachedb_object_new(zend_class_entry *ce TSRMLS_DC)
+{
+	zend_object_value  retval;
+	cachedb_object    *intern = ecalloc(1, sizeof(cachedb_object));
+
+	zend_object_std_init(&intern->std, ce TSRMLS_CC);
+#if ZEND_MODULE_API_NO >= 20100525
+	object_properties_init(&intern->std, ce);
+#else
+	{
+		zval *tmp;
+		zend_hash_copy(intern->std.properties, &ce->default_properties, 
+		               (copy_ctor_func_t) zval_add_ref, (void *) &tmp, sizeof(zval *));
+	}
+#endif
+	retval.handle   = zend_objects_store_put(intern, (zend_objects_store_dtor_t) zend_objects_destroy_object,
+	                                         cachedb_object_free_storage, NULL TSRMLS_CC);
+	retval.handlers = &cachedb_object_handlers;
+	return retval;
+}
+
+#define CHECK_OBJECT(d)   \
+	if ((d = ((cachedb_object *) zend_object_store_get_object(getThis() TSRMLS_CC))->db) == NULL) {  \
+		RETURN_FALSE;  \
+	}
+
+/* get() and has() take the key straight off the argument stack in the common case of a single 
+ * string argument, and only fall back to zend_parse_parameters() for conversions and errors. */
+#define PARSE_KEY(k,kl,m)   \
+	{  \
+		zval **zkey;  \
+		if (ZEND_NUM_ARGS() == 1 && zend_get_parameters_array_ex(1, &zkey) == SUCCESS &&  \
+		    Z_TYPE_PP(zkey) == IS_STRING) {  \
+			k  = Z_STRVAL_PP(zkey);  \
+			kl = Z_STRLEN_PP(zkey);  \
+		} else if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|z/", &k, &kl, &m) == FAILURE) {  \
+			return;  \
+		}  \
 	}
+/* }}} */
+
+/* {{{ cachedb:// stream wrapper
+ * A URL of the form cachedb://<path to DB>#<key> opens the record of a binary DB as a readonly
+ * stream, so that include, file_get_contents() etc. can read sources and static assets which have
+ * been packed into a single DB.  The DBs are opened on first use and held open for the rest of the
+ * request, so a request which includes many packed files only opens and indexes the DB once.  They
+ * are opened in paged mode, so a large DB isn't loaded in full.  The record is read in full on 
+ * open.  Its stat is that of the DB file, but with the record's length as the size and an inode 
+ * number which is unique to the key.
+ */
+typedef struct _cachedb_stream_data_t {
+	char               *buf;
+	size_t              length;
+	size_t              pos;
+	php_stream_statbuf  sb;
+} cachedb_stream_data_t;
+
+#define CACHEDB_URL_PREFIX "cachedb://"
+
+/* Split the URL and return the DB holding the record, opening it if necessary */
+static int cachedb_url_open_db(const char *url, cachedb_t **pdb, char **key, int *key_length TSRMLS_DC)
+{
+	const char  *path = url + sizeof(CACHEDB_URL_PREFIX) - 1;
+	const char  *sep;
+	cachedb_t  **pcached;
+	cachedb_t   *db = NULL;
+	char        *file;
+	int          path_length;
+	struct stat  sb;
+
+	if (strncasecmp(url, CACHEDB_URL_PREFIX, sizeof(CACHEDB_URL_PREFIX) - 1) != 0 ||
+	    (sep = strchr(path, '#')) == NULL || sep == path || sep[1] == '\0') {
+		return FAILURE;
+	}
+	path_length = sep - path;
+	*key        = (char *) sep + 1;
+	*key_length = strlen(*key);
+
+	if (CACHEDB_G(stream_dbs) == NULL) {
+		ALLOC_HASHTABLE(CACHEDB_G(stream_dbs));
+		zend_hash_init(CACHEDB_G(stream_dbs), 8, NULL, NULL, 0);
+	} else if (zend_hash_find(CACHEDB_G(stream_dbs), (char *) path, path_length, (void **) &pcached) == SUCCESS) {
+		*pdb = *pcached;
+		return SUCCESS;
+	}
+
+	/* The stat means that a missing DB fails quietly, as url_stat must */
+	file = estrndup(path, path_length);
+	if (stat(file, &sb) != 0 || cachedb_open(&db, file, path_length, "rbp") == FAILURE) {
+		efree(file);
+		return FAILURE;
+	}
+	efree(file);
+	cachedb_set_verify(db, CACHEDB_G(verify));
+	zend_hash_add(CACHEDB_G(stream_dbs), (char *) path, path_length, &db, sizeof(cachedb_t *), NULL);
+	*pdb = db;
+	return SUCCESS;
+}
+
+static void cachedb_url_stat_init(cachedb_t *db, const char *key, int key_length, size_t length, php_stream_statbuf *ssb TSRMLS_DC)
+{
+	const struct stat *db_sb = cachedb_get_sb(db TSRMLS_CC);
+
+	memset(ssb, 0, sizeof(php_stream_statbuf));
+	if (db_sb) {
+		ssb->sb = *db_sb;
+	}
+	ssb->sb.st_mode  = S_IFREG | (ssb->sb.st_mode & 0444);
+	ssb->sb.st_nlink = 1;
+	ssb->sb.st_size  = length;
+	ssb->sb.st_ino  ^= (ino_t) cachedb_crc32c(0, key, key_length);
+}
+
+static size_t cachedb_stream_write(php_stream *stream, const char *buf, size_t count TSRMLS_DC)
+{
+	return 0;
+}
+
+static size_t cachedb_stream_read(php_stream *stream, char *buf, size_t count TSRMLS_DC)
+{
+	cachedb_stream_data_t *data = (cachedb_stream_data_t *) stream->abstract;
+	size_t                 n    = MIN(count, data->length - data->pos);
+
+	memcpy(buf, data->buf + data->pos, n);
+	data->pos += n;
+	if (data->pos >= data->length) {
+		stream->eof = 1;
+	}
+	return n;
+}
+
+static int cachedb_stream_close(php_stream *stream, int close_handle TSRMLS_DC)
+{
+	cachedb_stream_data_t *data = (cachedb_stream_data_t *) stream->abstract;
+
+	efree(data->buf);
+	efree(data);
+	return 0;
+}
+
+static int cachedb_stream_seek(php_stream *stream, off_t offset, int whence, off_t *newoffset TSRMLS_DC)
+{
+	cachedb_stream_data_t *data = (cachedb_stream_data_t *) stream->abstract;
+	off_t                  pos;
+
+	switch (whence) {
+		case SEEK_SET: pos = offset;                          break;
+		case SEEK_CUR: pos = (off_t) data->pos + offset;      break;
+		case SEEK_END: pos = (off_t) data->length + offset;   break;
+		default:       return -1;
+	}
+	if (pos < 0 || pos > (off_t) data->length) {
+		return -1;
+	}
+	data->pos   = pos;
+	stream->eof = 0;
+	*newoffset  = pos;
+	return 0;
+}
+
+static int cachedb_stream_stat(php_stream *stream, php_stream_statbuf *ssb TSRMLS_DC)
+{
+	*ssb = ((cachedb_stream_data_t *) stream->abstract)->sb;
+	return 0;
+}
+
+static php_stream_ops cachedb_stream_ops = {
+	cachedb_stream_write,
+	cachedb_stream_read,
+	cachedb_stream_close,
+	NULL,                        /* flush */
+	"cachedb",
+	cachedb_stream_seek,
+	NULL,                        /* cast */
+	cachedb_stream_stat,
+	NULL                         /* set_option */
+};
+
+static php_stream *cachedb_stream_opener(php_stream_wrapper *wrapper, char *filename, char *mode, int options, 
+                                         char **opened_path, php_stream_context *context STREAMS_DC TSRMLS_DC)
+{
+	cachedb_stream_data_t *data;
+	cachedb_t             *db;
+	char                  *key;
+	int                    key_length;
+	zval                   value;
+
+	if (mode[0] != 'r' || strchr(mode, '+')) {
+		if (options & REPORT_ERRORS) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "cachedb streams are readonly");
+		}
+		return NULL;
+	}
+
+	INIT_ZVAL(value);
+	if (cachedb_url_open_db(filename, &db, &key, &key_length TSRMLS_CC) == SUCCESS &&
+	    cachedb_find(db, key, key_length, NULL) == SUCCESS) {
+		if (cachedb_found_length(db) == 0) {
+			ZVAL_EMPTY_STRING(&value);    /* as a fetch of an empty record is a no-op */
+		} else {
+			cachedb_fetch(db, &value);
+		}
+	}
+	if (Z_TYPE(value) != IS_STRING) {
+		zval_dtor(&value);
+		if (options & REPORT_ERRORS) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Cannot open %s", filename);
+		}
+		return NULL;
+	}
+
+	data         = emalloc(sizeof(cachedb_stream_data_t));
+	data->buf    = Z_STRVAL(value);
+	data->length = Z_STRLEN(value);
+	data->pos    = 0;
+	cachedb_url_stat_init(db, key, key_length, data->length, &data->sb TSRMLS_CC);
+
+	if (opened_path) {
+		*opened_path = estrdup(filename);
+	}
+	return php_stream_alloc(&cachedb_stream_ops, data, NULL, mode);
+}
+
+static int cachedb_url_stat(php_stream_wrapper *wrapper, char *url, int flags, php_stream_statbuf *ssb, 
+                            php_stream_context *context TSRMLS_DC)
+{
+	cachedb_t *db;
+	char      *key;
+	int        key_length;
+
+	if (cachedb_url_open_db(url, &db, &key, &key_length TSRMLS_CC) == FAILURE ||
+	    cachedb_find(db, key, key_length, NULL) == FAILURE) {
+		return -1;
+	}
+	cachedb_url_stat_init(db, key, key_length, cachedb_found_length(db), ssb TSRMLS_CC);
+	return 0;
+}
+
+static php_stream_wrapper_ops cachedb_wrapper_ops = {
+	cachedb_stream_opener,
+	NULL,                        /* stream_closer */
+	NULL,                        /* stream_stat */
+	cachedb_url_stat,
+	NULL,                        /* dir_opener */
+	"cachedb",
+	NULL,                        /* unlink */
+	NULL,                        /* rename */
+	NULL,                        /* mkdir */
+	NULL                         /* rmdir */
+};
+
+static php_stream_wrapper cachedb_stream_wrapper = {
+	&cachedb_wrapper_ops,
+	NULL,
+	0                            /* is_url: so include doesn't need allow_url_include */
+};
+/* }}} */
+
+/* {{{ PHP Module Initialisation and Shutdown Functions
+ */
+static PHP_MINIT_FUNCTION(cachedb)
+{
+	zend_class_entry ce;
+
+	REGISTER_INI_ENTRIES();
+
+	INIT_CLASS_ENTRY(ce, "CacheDB", cachedb_methods);
+	ce.create_object = cachedb_object_new;
+	cachedb_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	memcpy(&cachedb_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	cachedb_object_handlers.clone_obj = NULL;
+
+	php_register_url_stream_wrapper("cachedb", &cachedb_stream_wrapper TSRMLS_CC);
+	cachedb_shared_startup();
+	return SUCCESS;
+}
+
+static PHP_MSHUTDOWN_FUNCTION(cachedb)
+{
+	php_unregister_url_stream_wrapper("cachedb" TSRMLS_CC);
+	cachedb_shared_shutdown();
+	UNREGISTER_INI_ENTRIES();
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP Request Initialisation Function
+ * The only request initation is to empty the handle vector and deferred commit list
+ */
+PHP_RINIT_FUNCTION(cachedb)
+{
+	CACHEDB_G(db)               = NULL;
+	CACHEDB_G(free_handles)     = NULL;
+	CACHEDB_G(db_size)          = 0;
+	CACHEDB_G(db_top)           = 0;
+	CACHEDB_G(free_count)       = 0;
+	CACHEDB_G(deferred_commits) = NULL;
+	CACHEDB_G(stream_dbs)       = NULL;
 	return SUCCESS;
 }
 /* }}} */
@@ -184,20 +717,55 @@ PHP_RINIT_FUNCTION(cachedb)
 /* {{{ PHP Request Shutdown Function
  * The only request shutdown is to close any open DBs (readonly, that is any
  * pending additions at dumped -- the penalty of not doing an explicit close).  
- * The corresponding the global db array entries are nulled.
+ * Only the handles issued in this request are scanned, and the handle vector is freed.  Ditto 
+ * any DBs opened by the stream wrapper.
  */
 PHP_RSHUTDOWN_FUNCTION(cachedb)
 {
 	cachedb_t **p;
 	int i;
 
+	if (CACHEDB_G(stream_dbs) != NULL) {
+		for (zend_hash_internal_pointer_reset(CACHEDB_G(stream_dbs));
+		     zend_hash_get_current_data(CACHEDB_G(stream_dbs), (void **) &p) == SUCCESS;
+		     zend_hash_move_forward(CACHEDB_G(stream_dbs))) {
+			cachedb_close2(*p, 'r');
+		}
+		zend_hash_destroy(CACHEDB_G(stream_dbs));
+		FREE_HASHTABLE(CACHEDB_G(stream_dbs));
+		CACHEDB_G(stream_dbs) = NULL;
+	}
+
+	if (CACHEDB_G(db) == NULL) {
+		return SUCCESS;
+	}
 	p = CACHEDB_G(db);
-	for (i=0; i<MAX_DB_FILES; i++, p++) {
+	for (i=0; i<CACHEDB_G(db_top); i++, p++) {
 		if (*p != NULL) {
 			cachedb_close2(*p, 'r');
-			*p = NULL;
 		}
 	}
+	efree(CACHEDB_G(db));
+	efree(CACHEDB_G(free_handles));
+	CACHEDB_G(db)           = NULL;
+	CACHEDB_G(free_handles) = NULL;
+	CACHEDB_G(db_size)      = CACHEDB_G(db_top) = CACHEDB_G(free_count) = 0;
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP Post Deactivate Function
+ * Any deferred commits are dispatched once the request has been fully deactivated, by which time
+ * the SAPI has flushed the response to the client.
+ */
+static ZEND_MODULE_POST_ZEND_DEACTIVATE_D(cachedb)
+{
+	cachedb_commit_t *jobs;
+	TSRMLS_FETCH();
+
+	jobs = CACHEDB_G(deferred_commits);
+	CACHEDB_G(deferred_commits) = NULL;
+	cachedb_commit_deferred(jobs);
 	return SUCCESS;
 }
 /* }}} */
@@ -208,7 +776,23 @@ PHP_MINFO_FUNCTION(cachedb)
 {
 	php_info_print_table_start();
 	php_info_print_table_row(2, "CacheDB Support", "Enabled");
+	php_info_print_table_row(2, "File format", "2 (Bloom filter, CRC32C, dense, paged index and postings trailer sections)");
+#if defined(ZTS) && defined(PTHREADS)
+	php_info_print_table_row(2, "Deferred commits", "background thread");
+#elif defined(HAVE_FORK) && !defined(PHP_WIN32)
+	php_info_print_table_row(2, "Deferred commits", "detached process");
+#else
+	php_info_print_table_row(2, "Deferred commits", "inline at request end");
+#endif
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+	php_info_print_table_row(2, "Anonymous temporary files", "Enabled");
+#else
+	php_info_print_table_row(2, "Anonymous temporary files", "Disabled");
+#endif
+	php_info_print_table_row(2, "Stream wrapper", "cachedb://");
 	php_info_print_table_end();
+
+	DISPLAY_INI_ENTRIES();
 }
 /* }}} */
 
@@ -218,30 +802,102 @@ PHP_FUNCTION(cachedb_open)
 {
 	char       *file;   /* The file to open */
 	char       *mode = NULL;   /* The mode to open the stream with */
-	int         file_length, mode_length, i;
-	cachedb_t **pdb;
+	int         file_length, mode_length;
+	cachedb_t  *db = NULL;
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ss", &file, &file_length, &mode, &mode_length) == FAILURE || 
+        mode_length == 0 || mode_length > 3) {
+		return; 
+	}
+
+   /* Note that mode[0] is [rwc]:
+	* r: Read
+	* w: Write
+	* c: Create/Truncate
+	* optionally followed by b (binary) and / or one of i (integer keys), p (paged index) or s 
+	* (shared index), however the open function validates this.
+	*/
+	if (cachedb_open(&db, file, file_length, mode)==SUCCESS) {
+		cachedb_set_verify(db, CACHEDB_G(verify));
+		RETURN_LONG(cachedb_new_handle(db TSRMLS_CC));
+	}
+	RETURN_FALSE;
+}
+/* }}} */
+
+/* {{{ proto handle cachedb_open_layers(array files[, string mode])
+   Opens a list of cachedb files, top layer first, as a single layered DB.  Lookups search the 
+   layers top down; additions go to the top layer which is opened in the given mode (default 'r') 
+   and the lower layers are opened readonly.  */
+PHP_FUNCTION(cachedb_open_layers)
+{
+	zval       *files;           /* The array of files to open */
+	zval      **file;
+	char       *mode = "r";      /* The mode to open the top layer with */
+	int         mode_length = 1, count = 0, status;
+	cachedb_t  *db = NULL;
+	char      **names;
+	size_t     *name_lengths;
+	HashTable  *files_hash;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|s", &files, &mode, &mode_length) == FAILURE || 
         mode_length == 0 || mode_length > 2) {
 		return; 
 	}
 
-	/* Search for empty slot in the global db array */ 
-	pdb = CACHEDB_G(db);
-	for (i=0; i<MAX_DB_FILES; i++, pdb++) {
-		if (*pdb == NULL) {
-		   /* The slot is available.  Note that mode[0] is [rwc]:
-			* r: Read
-			* w: Write
-			* c: Create/Truncate
-			* however the open function validates this.
-			*/
-			if (cachedb_open(pdb, file, file_length, mode)==SUCCESS) {
-				RETURN_LONG(i);
-			} else {
-				RETURN_FALSE;
-			}				
+	files_hash = Z_ARRVAL_P(files);
+	if (zend_hash_num_elements(files_hash) == 0) {
+		RETURN_FALSE;
+	}
+
+	names        = safe_emalloc(zend_hash_num_elements(files_hash), sizeof(char *), 0);
+	name_lengths = safe_emalloc(zend_hash_num_elements(files_hash), sizeof(size_t), 0);
+
+	for (zend_hash_internal_pointer_reset(files_hash);
+	     zend_hash_get_current_data(files_hash, (void **) &file) == SUCCESS;
+	     zend_hash_move_forward(files_hash)) {
+		if (Z_TYPE_PP(file) != IS_STRING || Z_STRLEN_PP(file) == 0) {
+			efree(names);
+			efree(name_lengths);
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Layer paths must be non-empty strings");
+			RETURN_FALSE;
 		}
+		names[count]        = Z_STRVAL_PP(file);
+		name_lengths[count] = Z_STRLEN_PP(file);
+		count++;
+	}
+
+	status = cachedb_open_layers(&db, names, name_lengths, count, mode);
+	efree(names);
+	efree(name_lengths);
+
+	if (status == SUCCESS) {
+		cachedb_set_verify(db, CACHEDB_G(verify));
+		RETURN_LONG(cachedb_new_handle(db TSRMLS_CC));
+	}
+	RETURN_FALSE;
+}
+/* }}} */
+
+/* {{{ proto handle cachedb_open_sharded(string dir, int shards, string mode)
+   Opens a directory of cachedb shards as a single DB, with keys routed to a shard by hash.  Each 
+   shard is committed independently on close, and only if records have been added to it. */
+PHP_FUNCTION(cachedb_open_sharded)
+{
+	char       *dir;           /* The shard directory */
+	char       *mode = NULL;   /* The mode to open the shards with */
+	int         dir_length, mode_length;
+	long        shards;
+	cachedb_t  *db = NULL;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sls", &dir, &dir_length, &shards, &mode, &mode_length) == FAILURE || 
+        mode_length == 0 || mode_length > 2) {
+		return; 
+	}
+
+	if (cachedb_open_sharded(&db, dir, dir_length, shards, mode)==SUCCESS) {
+		cachedb_set_verify(db, CACHEDB_G(verify));
+		RETURN_LONG(cachedb_new_handle(db TSRMLS_CC));
 	}
 	RETURN_FALSE;
 }
@@ -267,7 +923,7 @@ PHP_FUNCTION(cachedb_exists)
 /* }}} */
 
 /* {{{ proto string cachedb_fetch(string key[[, int handle], array metadata] )
-   Reads the value for a given key and returns FALSE on key missing */
+   Reads the value for a given key and returns FALSE on key missing or an unreadable record */
 PHP_FUNCTION(cachedb_fetch)
 {
 	char        *key=NULL;        /* The key of record to be fetched */
@@ -286,14 +942,15 @@ PHP_FUNCTION(cachedb_fetch)
 		RETURN_FALSE;
 	}
 
-	if(return_value_used) {
-		cachedb_fetch(db, return_value);
+	if (return_value_used && cachedb_fetch(db, return_value) == FAILURE) {
+		RETURN_FALSE;
 	}
 }
 /* }}} */
 
-/* {{{ proto boolean cachedb_add(string key, string value[[, int handle], array metadata])
-   Add a key with the given value returns FALSE on failure e.g. key already exists */
+/* {{{ proto boolean cachedb_add(string key, string value[[[, int handle], array metadata], int ttl])
+   Add a key with the given value returns FALSE on failure e.g. key already exists.  A record with a
+   non-zero ttl expires after ttl seconds; an expired key can be re-added. */
 PHP_FUNCTION(cachedb_add)
 {
 	char            *key;           /* The key of record to be added */
@@ -302,21 +959,149 @@ PHP_FUNCTION(cachedb_add)
 	int              value_length;
 	zval            *metadata=NULL; /* Optional to be added */
 	long             handle=0;      /* The handle to be used (default 0) */
+	long             ttl=0;         /* Optional time to live in seconds (default 0 = never expires) */
 	cachedb_t       *db;
 	int              status;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz|la", &key, &key_length, &value, &handle, &metadata) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz|la!l", &key, &key_length, &value, &handle, &metadata, &ttl) == FAILURE) {
 		return;
 	}
+	if (ttl < 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "The ttl must not be negative");
+		RETURN_FALSE;
+	}
 
 	CHECK_HANDLE(db,handle);
 
-	status = (cachedb_add(db, key, key_length, value, metadata)==SUCCESS);
+	status = (cachedb_add_ex(db, key, key_length, value, metadata, (ttl ? time(NULL) + ttl : 0))==SUCCESS);
 
 	RETURN_BOOL(status);
 }
 /* }}} */
 
+/* {{{ proto mixed cachedb_fetch_int(int id[, int handle])
+   Reads the value for a given id in a DB opened in integer mode and returns FALSE on id missing or
+   an unreadable record */
+PHP_FUNCTION(cachedb_fetch_int)
+{
+	long         id;
+	long         handle=0;        /* The handle to be used (default 0) */
+	cachedb_t   *db;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|l", &id, &handle) == FAILURE) {
+		return;
+	}
+
+	CHECK_HANDLE(db,handle);
+	if (id < 0 || cachedb_find_int(db, (unsigned long) id)==FAILURE) {
+		RETURN_FALSE;
+	}
+
+	if (return_value_used && cachedb_fetch(db, return_value) == FAILURE) {
+		RETURN_FALSE;
+	}
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_add_int(int id, mixed value[, int handle[, int ttl]])
+   Add an id with the given value to a DB opened in integer mode, returning FALSE on failure e.g.
+   the id already exists or is so large that the dense array would be mostly empty */
+PHP_FUNCTION(cachedb_add_int)
+{
+	long             id;
+	char             key[MAX_LENGTH_OF_LONG + 1];
+	zval            *value;
+	long             handle=0;      /* The handle to be used (default 0) */
+	long             ttl=0;         /* Optional time to live in seconds (default 0 = never expires) */
+	cachedb_t       *db;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "lz|ll", &id, &value, &handle, &ttl) == FAILURE) {
+		return;
+	}
+	if (id < 0 || ttl < 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "The %s must not be negative", (id < 0 ? "id" : "ttl"));
+		RETURN_FALSE;
+	}
+
+	CHECK_HANDLE(db,handle);
+	RETURN_BOOL(cachedb_add_ex(db, key, sprintf(key, "%ld", id), value, NULL, (ttl ? time(NULL) + ttl : 0))==SUCCESS);
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_index_metadata(array fields[, int handle])
+   Declares metadata fields to be indexed for cachedb_find_by().  The DB must be opened in create 
+   mode, and the fields then stay indexed through later commits. */
+PHP_FUNCTION(cachedb_index_metadata)
+{
+	zval            *fields;
+	long             handle=0;   /* The handle to be used (default 0) */
+	cachedb_t       *db;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|l", &fields, &handle) == FAILURE) {
+		return;
+	}
+
+	CHECK_HANDLE(db,handle);
+	RETURN_BOOL(cachedb_index_metadata(db, Z_ARRVAL_P(fields))==SUCCESS);
+}
+/* }}} */
+
+/* {{{ proto array cachedb_find_by(string field, mixed value[, int handle[, boolean fetch]])
+   Returns the keys of the records whose indexed metadata field has the given value, or if fetch is
+   set an array of key => value for these records.  Returns FALSE if the field isn't indexed. */
+PHP_FUNCTION(cachedb_find_by)
+{
+	char            *field;
+	int              field_length;
+	zval            *value;
+	long             handle=0;   /* The handle to be used (default 0) */
+	zend_bool        fetch=0;
+	zval            *keys;
+	zval           **key;
+	cachedb_t       *db;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz|lb", &field, &field_length, &value, &handle, &fetch) == FAILURE) {
+		return;
+	}
+
+	CHECK_HANDLE(db,handle);
+	if (!fetch) {
+		array_init(return_value);
+		if (cachedb_find_by(db, field, field_length, value, return_value) == FAILURE) {
+			zval_dtor(return_value);
+			RETURN_FALSE;
+		}
+		return;
+	}
+
+	MAKE_STD_ZVAL(keys);
+	array_init(keys);
+	if (cachedb_find_by(db, field, field_length, value, keys) == FAILURE) {
+		zval_ptr_dtor(&keys);
+		RETURN_FALSE;
+	}
+
+	array_init_size(return_value, zend_hash_num_elements(Z_ARRVAL_P(keys)));
+	for (zend_hash_internal_pointer_reset(Z_ARRVAL_P(keys));
+	     zend_hash_get_current_data(Z_ARRVAL_P(keys), (void **) &key) == SUCCESS;
+	     zend_hash_move_forward(Z_ARRVAL_P(keys))) {
+		zval *record;
+
+		if (cachedb_find(db, Z_STRVAL_PP(key), Z_STRLEN_PP(key), NULL) == FAILURE) {
+			continue;
+		}
+		MAKE_STD_ZVAL(record);
+		ZVAL_NULL(record);
+		if (cachedb_fetch(db, record) == SUCCESS) {
+			add_assoc_zval_ex(return_value, Z_STRVAL_PP(key), Z_STRLEN_PP(key)+1, record);
+		} else {
+			FREE_ZVAL(record);
+		}
+	}
+	zval_ptr_dtor(&keys);
+}
+/* }}} */
+
 /* {{{ proto handle cachedb_info([int handle])
    Returns an info array on the specified DB  */
 PHP_FUNCTION(cachedb_info)
@@ -332,28 +1117,220 @@ PHP_FUNCTION(cachedb_info)
 }
 /* }}} */
 
-/* {{{ proto boolean cachedb_close(string mode[, int handle])
-   Closes a cachedb DB, optionally committing additions or truncating the DB */
+/* {{{ proto int cachedb_expired_count([int handle])
+   Returns the number of expired records in the DB, which the next commit or purge will drop */
+PHP_FUNCTION(cachedb_expired_count)
+{
+	long             handle=0;   /* The handle to be used (default 0) */
+	cachedb_t       *db;
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &handle) == FAILURE) {
+		return;
+	}
+
+	CHECK_HANDLE(db,handle);
+	RETURN_LONG(cachedb_expired_count(db));
+}
+/* }}} */
+
+/* {{{ proto array cachedb_stats([int handle])
+   Returns the statistics counters and timings (in seconds) of an open DB */
+PHP_FUNCTION(cachedb_stats)
+{
+	long             handle=0;   /* The handle to be used (default 0) */
+	cachedb_t       *db;
+	cachedb_stats_t  stats;
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &handle) == FAILURE) {
+		return;
+	}
+
+	CHECK_HANDLE(db,handle);
+	cachedb_get_stats(db, &stats);
+	cachedb_stats_to_array(return_value, &stats);
+}
+/* }}} */
+
+/* {{{ proto boolean cachedb_close([int handle[, string mode[, array &stats]]])
+   Closes a cachedb DB, optionally committing additions or truncating the DB.  Mode 'r' discards
+   any additions and mode 'p' also rewrites the DB to purge any expired records.  Mode 'd' defers 
+   the commit until after the request has completed, as do all commits if cachedb.deferred_commit
+   is set.  A deferred close returns true as its outcome isn't known at the time of the close.  If
+   the stats argument is given then it is set to the DB's final statistics, as for cachedb_stats(),
+   including the commit outcome and time. */
 PHP_FUNCTION(cachedb_close)
 {
 	char       *mode=NULL;   /* The mode to close the stream with */
-	int         mode_length, i;
+	int         mode_length;
 	long        handle=0;   /* The handle to be used (default 0) */
-	cachedb_t **pdb;
+	zval       *zstats=NULL;   /* Optional by-ref return of the final statistics */
 	cachedb_t   *db;
 	int         status;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|ls", &handle, &mode, &mode_length) == FAILURE ||
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|lsz", &handle, &mode, &mode_length, &zstats) == FAILURE ||
         (mode != NULL && mode_length!=1)) {
 		return;
 	}
 
-	pdb = CACHEDB_G(db);
 	CHECK_HANDLE(db,handle);
 	
-	status = cachedb_close2(db, (mode ? mode[0] : '*'));
+	status = cachedb_close_common(db, mode, zstats TSRMLS_CC);
+	cachedb_release_handle(handle TSRMLS_CC);
+
+	RETURN_BOOL(status==SUCCESS);
+}
+/* }}} */
+
+/* {{{ proto CacheDB::__construct(string file, string mode)
+   Opens a cachedb file as for cachedb_open(), throwing an exception on failure */
+PHP_METHOD(CacheDB, __construct)
+{
+	char           *file, *mode;
+	int             file_length, mode_length;
+	cachedb_object *intern;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ss", &file, &file_length, &mode, &mode_length) == FAILURE) {
+		return; 
+	}
+
+	intern = (cachedb_object *) zend_object_store_get_object(getThis() TSRMLS_CC);
+	if (intern->db) {
+		zend_throw_exception_ex(zend_exception_get_default(TSRMLS_C), 0 TSRMLS_CC, 
+		                        "CacheDB object is already open, so cannot open cachedb file %s", file);
+		return;
+	}
+	if (mode_length == 0 || mode_length > 3 || cachedb_open(&intern->db, file, file_length, mode) == FAILURE) {
+		intern->db = NULL;
+		zend_throw_exception_ex(zend_exception_get_default(TSRMLS_C), 0 TSRMLS_CC, 
+		                        "Cannot open cachedb file %s in mode '%s'", file, mode);
+		return;
+	}
+	cachedb_set_verify(intern->db, CACHEDB_G(verify));
+}
+/* }}} */
+
+/* {{{ proto boolean CacheDB::has(string key[, array &metadata])
+   Check if a key exists in the DB */
+PHP_METHOD(CacheDB, has)
+{
+	char        *key;
+	int          key_length;
+	zval        *metadata=NULL;
+	cachedb_t   *db;
 
-	pdb[handle] = NULL;
+	PARSE_KEY(key, key_length, metadata);
+	CHECK_OBJECT(db);
+	RETURN_BOOL(cachedb_find(db, key, key_length, metadata)==SUCCESS);
+}
+/* }}} */
+
+/* {{{ proto mixed CacheDB::get(string key[, array &metadata])
+   Reads the value for a given key and returns FALSE on key missing or an unreadable record */
+PHP_METHOD(CacheDB, get)
+{
+	char        *key;
+	int          key_length;
+	zval        *metadata=NULL;
+	cachedb_t   *db;
+
+	PARSE_KEY(key, key_length, metadata);
+	CHECK_OBJECT(db);
+	if (cachedb_find(db, key, key_length, metadata)==FAILURE) {
+		RETURN_FALSE;
+	}
+	if (return_value_used && cachedb_fetch(db, return_value) == FAILURE) {
+		RETURN_FALSE;
+	}
+}
+/* }}} */
+
+/* {{{ proto boolean CacheDB::add(string key, mixed value[, array metadata[, int ttl]])
+   Add a key with the given value as for cachedb_add() */
+PHP_METHOD(CacheDB, add)
+{
+	char        *key;
+	int          key_length;
+	zval        *value;
+	zval        *metadata=NULL;
+	long         ttl=0;
+	cachedb_t   *db;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz|a!l", &key, &key_length, &value, &metadata, &ttl) == FAILURE) {
+		return;
+	}
+	if (ttl < 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "The ttl must not be negative");
+		RETURN_FALSE;
+	}
+
+	CHECK_OBJECT(db);
+	RETURN_BOOL(cachedb_add_ex(db, key, key_length, value, metadata, (ttl ? time(NULL) + ttl : 0))==SUCCESS);
+}
+/* }}} */
+
+/* {{{ proto array CacheDB::info()
+   Returns an info array on the DB */
+PHP_METHOD(CacheDB, info)
+{
+	cachedb_t   *db;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+	CHECK_OBJECT(db);
+	cachedb_info(return_value, db);
+}
+/* }}} */
+
+/* {{{ proto array CacheDB::stats()
+   Returns the statistics counters and timings of the DB, as for cachedb_stats() */
+PHP_METHOD(CacheDB, stats)
+{
+	cachedb_t       *db;
+	cachedb_stats_t  stats;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+	CHECK_OBJECT(db);
+	cachedb_get_stats(db, &stats);
+	cachedb_stats_to_array(return_value, &stats);
+}
+/* }}} */
+
+/* {{{ proto int CacheDB::expiredCount()
+   Returns the number of expired records in the DB */
+PHP_METHOD(CacheDB, expiredCount)
+{
+	cachedb_t   *db;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+	CHECK_OBJECT(db);
+	RETURN_LONG(cachedb_expired_count(db));
+}
+/* }}} */
+
+/* {{{ proto boolean CacheDB::close([string mode[, array &stats]])
+   Closes the DB with the same modes as cachedb_close().  Any later method call returns false. */
+PHP_METHOD(CacheDB, close)
+{
+	char           *mode=NULL;
+	int             mode_length;
+	zval           *zstats=NULL;
+	cachedb_object *intern;
+	int             status;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|sz", &mode, &mode_length, &zstats) == FAILURE ||
+        (mode != NULL && mode_length!=1)) {
+		return;
+	}
+
+	intern = (cachedb_object *) zend_object_store_get_object(getThis() TSRMLS_CC);
+	if (intern->db == NULL) {
+		RETURN_FALSE;
+	}
+	status     = cachedb_close_common(intern->db, mode, zstats TSRMLS_CC);
+	intern->db = NULL;
 
 	RETURN_BOOL(status==SUCCESS);
 }
@@ -0,0 +1,45 @@
+--TEST--
+CacheDB cachedb:// stream wrapper test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test10.db';
+	$url    = "cachedb://$dbname#";
+
+	(($db = cachedb_open($dbname, 'cb'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	cachedb_add("lib/hello.php", "<?php return 'Hello from ' . basename(__FILE__);", $db) || die("CacheDB: add hello failed\n");
+	cachedb_add("assets/style.css", "body { color: #333; }", $db) || die("CacheDB: add style failed\n");
+	cachedb_add("empty.txt", "", $db) || die("CacheDB: add empty failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	in_array('cachedb', stream_get_wrappers()) || die("CacheDB: wrapper not registered\n");
+	((include "{$url}lib/hello.php") == "Hello from hello.php") || die("CacheDB: include failed\n");
+	(file_get_contents("{$url}assets/style.css") == "body { color: #333; }") || die("CacheDB: file_get_contents failed\n");
+	(file_get_contents("{$url}empty.txt") === "") || die("CacheDB: empty file incorrect\n");
+
+	file_exists("{$url}assets/style.css") || die("CacheDB: file_exists failed\n");
+	is_file("{$url}assets/style.css") || die("CacheDB: is_file failed\n");
+	(filesize("{$url}assets/style.css") == 21) || die("CacheDB: filesize incorrect\n");
+	(filemtime("{$url}assets/style.css") == filemtime($dbname)) || die("CacheDB: filemtime incorrect\n");
+	file_exists("{$url}missing.txt") && die("CacheDB: missing key exists\n");
+	file_exists("cachedb://" . dirname(__FILE__) . "/missing.db#key") && die("CacheDB: missing DB exists\n");
+	(@file_get_contents("{$url}missing.txt") === FALSE) || die("CacheDB: missing key opened\n");
+	(@fopen("{$url}assets/style.css", "w") === FALSE) || die("CacheDB: opened for write\n");
+
+	(($fp = fopen("{$url}assets/style.css", "r")) !== FALSE) || die("CacheDB: fopen failed\n");
+	(fread($fp, 4) == "body") || die("CacheDB: fread incorrect\n");
+	fseek($fp, -5, SEEK_END);
+	(fread($fp, 100) == "33; }") || die("CacheDB: fseek incorrect\n");
+	fseek($fp, 7);
+	(fgets($fp) == "color: #333; }") || die("CacheDB: fgets incorrect\n");
+	feof($fp) || die("CacheDB: feof incorrect\n");
+	$stat = fstat($fp);
+	($stat['size'] == 21) || die("CacheDB: fstat incorrect\n");
+	fclose($fp);
+?>
+===DONE===
+--CLEAN--
+<?php @unlink(dirname(__FILE__) .'/test10.db'); ?>
+--EXPECT--
+===DONE===
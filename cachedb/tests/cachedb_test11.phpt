@@ -0,0 +1,56 @@
+--TEST--
+CacheDB paged index test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--INI--
+cachedb.verify=100
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test11.db';
+	$n = 3000;
+
+	(($db = cachedb_open($dbname, 'c'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	for ($i = 0; $i < $n; $i++) {
+		cachedb_add("key-$i", array($i, str_repeat('x', $i % 50)), $db) || die("CacheDB: add key-$i failed\n");
+	}
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	/* A paged handle reads the records without loading the index */
+	(($db = cachedb_open($dbname, 'rp'))!==FALSE) || die("CacheDB: Error opening paged database\n");
+	$info = cachedb_info($db);
+	(count($info[0]) == 0) || die("CacheDB: paged handle loaded the index\n");
+	foreach (array(0, 1, 9, 10, 99, 1234, 2047, $n - 1) as $i) {
+		(cachedb_fetch("key-$i", $db) == array($i, str_repeat('x', $i % 50))) || die("CacheDB: key-$i value incorrect\n");
+	}
+	cachedb_exists("key-$n", $db) && die("CacheDB: key-$n found\n");
+	cachedb_exists("key-", $db) && die("CacheDB: key- found\n");
+	cachedb_exists("a", $db) && die("CacheDB: a found\n");
+	cachedb_exists("zzz", $db) && die("CacheDB: zzz found\n");
+	cachedb_add("new", 1, $db) && die("CacheDB: add to paged handle succeeded\n");
+	$stats = cachedb_stats($db);
+	($stats['hits'] == 8 && $stats['misses'] == 4) || die("CacheDB: find counts incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #2\n");
+
+	/* Every key is found by a paged handle in random order */
+	(($db = cachedb_open($dbname, 'rp'))!==FALSE) || die("CacheDB: Error reopening paged database\n");
+	$keys = range(0, $n - 1);
+	shuffle($keys);
+	foreach ($keys as $i) {
+		cachedb_exists("key-$i", $db) || die("CacheDB: key-$i missing\n");
+	}
+	cachedb_close($db) || die("CacheDB: Error on DB close #3\n");
+
+	/* Paged mode can't be combined with integer mode, and is ignored for writes */
+	(cachedb_open($dbname, 'rip') === FALSE) || die("CacheDB: integer paged open succeeded\n");
+	(($db = cachedb_open($dbname, 'wp'))!==FALSE) || die("CacheDB: Error opening database for write\n");
+	cachedb_add("key-$n", $n, $db) || die("CacheDB: add key-$n failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #4\n");
+	(($db = cachedb_open($dbname, 'rp'))!==FALSE) || die("CacheDB: Error reopening paged database\n");
+	(cachedb_fetch("key-$n", $db) == $n) || die("CacheDB: key-$n value incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #5\n");
+?>
+===DONE===
+--CLEAN--
+<?php @unlink(dirname(__FILE__) .'/test11.db'); ?>
+--EXPECT--
+===DONE===
@@ -0,0 +1,93 @@
+--TEST--
+CacheDB metadata index test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test12.db';
+
+	(($db = cachedb_open($dbname, 'c'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	cachedb_index_metadata(array('version', 'lang'), $db) || die("CacheDB: index_metadata failed\n");
+	for ($i = 0; $i < 200; $i++) {
+		$meta = array('version' => 30 + $i % 3, 'lang' => ($i % 2 ? 'en' : 'fr'), 'other' => $i);
+		cachedb_add("key$i", "value $i", $db, $meta) || die("CacheDB: add key$i failed\n");
+	}
+	cachedb_add("nometa", "no metadata", $db) || die("CacheDB: add nometa failed\n");
+
+	/* Staged records are found before the commit */
+	(count(cachedb_find_by('version', 32, $db)) == 66) || die("CacheDB: staged version=32 count incorrect\n");
+	(cachedb_find_by('other', 1, $db) === FALSE) || die("CacheDB: unindexed field found\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	/* Committed records are found from the postings */
+	(($db = cachedb_open($dbname, 'w'))!==FALSE) || die("CacheDB: Error reopening database\n");
+	$keys = cachedb_find_by('version', 32, $db);
+	(count($keys) == 66 && $keys[0] == 'key2' && $keys[65] == 'key197') || die("CacheDB: version=32 keys incorrect\n");
+	(count(cachedb_find_by('version', "32", $db)) == 66) || die("CacheDB: version='32' count incorrect\n");
+	(count(cachedb_find_by('lang', 'en', $db)) == 100) || die("CacheDB: lang=en count incorrect\n");
+	(cachedb_find_by('lang', 'de', $db) === array()) || die("CacheDB: lang=de found\n");
+	(cachedb_find_by('lang', array(), $db) === FALSE) || die("CacheDB: array value accepted\n");
+	$records = cachedb_find_by('version', 30, $db, TRUE);
+	(count($records) == 67 && $records['key0'] == 'value 0' && $records['key198'] == 'value 198') ||
+		die("CacheDB: fetched records incorrect\n");
+	cachedb_index_metadata(array('other'), $db) && die("CacheDB: index_metadata allowed in write mode\n");
+
+	/* Additions are merged with the postings, and the declaration is kept by the next commit */
+	cachedb_add("new", "new value", $db, array('version' => 32)) || die("CacheDB: add new failed\n");
+	(count(cachedb_find_by('version', 32, $db)) == 67) || die("CacheDB: merged version=32 count incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #2\n");
+
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening database\n");
+	$records = cachedb_find_by('version', 32, $db, TRUE);
+	(count($records) == 67 && $records['new'] == 'new value' && $records['key2'] == 'value 2') ||
+		die("CacheDB: committed version=32 records incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #3\n");
+
+	/* Damaged postings aren't used, but the next commit rebuilds them from the index */
+	$contents = file_get_contents($dbname);
+	(($pos = strpos($contents, "version\0lang\0")) !== FALSE) || die("CacheDB: indexed field names not found\n");
+	$contents[$pos + 13] = chr(ord($contents[$pos + 13]) ^ 0xff);
+	file_put_contents($dbname, $contents);
+	(($db = cachedb_open($dbname, 'w'))!==FALSE) || die("CacheDB: Error reopening damaged database\n");
+	(@cachedb_find_by('version', 32, $db) === FALSE) || die("CacheDB: damaged postings used\n");
+	cachedb_add("newer", "newer value", $db, array('version' => 32)) || die("CacheDB: add newer failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #4\n");
+
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening rebuilt database\n");
+	(count(cachedb_find_by('version', 32, $db)) == 68) || die("CacheDB: rebuilt version=32 count incorrect\n");
+	(count(cachedb_find_by('lang', 'en', $db)) == 100) || die("CacheDB: rebuilt lang=en count incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #5\n");
+
+	/* A sharded DB is searched across all shards, including those created without any records */
+	$dir = dirname(__FILE__) .'/test12.shards';
+	(($db = cachedb_open_sharded($dir, 4, 'c'))!==FALSE) || die("CacheDB: cannot create sharded Db\n");
+	cachedb_index_metadata(array('version'), $db) || die("CacheDB: sharded index_metadata failed\n");
+	cachedb_add("first", "first value", $db, array('version' => 1)) || die("CacheDB: add first failed\n");
+	cachedb_close($db) || die("CacheDB: Error on sharded DB close #1\n");
+
+	(($db = cachedb_open_sharded($dir, 4, 'w'))!==FALSE) || die("CacheDB: Error reopening sharded Db\n");
+	for ($i = 0; $i < 20; $i++) {
+		cachedb_add("shard$i", "value $i", $db, array('version' => 1 + $i % 2)) || die("CacheDB: add shard$i failed\n");
+	}
+	(count(cachedb_find_by('version', 1, $db)) == 11) || die("CacheDB: staged sharded version=1 count incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on sharded DB close #2\n");
+
+	(($db = cachedb_open_sharded($dir, 4, 'r'))!==FALSE) || die("CacheDB: Error reopening sharded Db #2\n");
+	$keys = cachedb_find_by('version', 1, $db);
+	(count($keys) == 11 && in_array('first', $keys) && in_array('shard18', $keys)) || 
+		die("CacheDB: sharded version=1 keys incorrect\n");
+	(cachedb_find_by('other', 1, $db) === FALSE) || die("CacheDB: unindexed sharded field found\n");
+	cachedb_close($db) || die("CacheDB: Error on sharded DB close #3\n");
+?>
+===DONE===
+--CLEAN--
+<?php
+	$dir = dirname(__FILE__) .'/test12.shards';
+	@unlink(dirname(__FILE__) .'/test12.db');
+	foreach ((array) glob("$dir/*") as $file) {
+		@unlink($file);
+	}
+	@rmdir($dir);
+?>
+--EXPECT--
+===DONE===
@@ -0,0 +1,73 @@
+--TEST--
+CacheDB shared index test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--INI--
+cachedb.verify=100
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test13.db';
+
+	(($db = cachedb_open($dbname, 'c'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	for ($i = 0; $i < 100; $i++) {
+		cachedb_add("key$i", array($i), $db) || die("CacheDB: add key$i failed\n");
+	}
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	/* The first shared open builds the index and the second attaches to it */
+	(($db1 = cachedb_open($dbname, 'rs'))!==FALSE) || die("CacheDB: Error opening shared database #1\n");
+	(($db2 = cachedb_open($dbname, 'rs'))!==FALSE) || die("CacheDB: Error opening shared database #2\n");
+	$info = cachedb_info($db2);
+	(count($info[0]) == 0) || die("CacheDB: shared handle has a private index\n");
+	foreach (array(0, 42, 99) as $i) {
+		(cachedb_fetch("key$i", $db1) == array($i)) || die("CacheDB: key$i value incorrect on #1\n");
+		(cachedb_fetch("key$i", $db2) == array($i)) || die("CacheDB: key$i value incorrect on #2\n");
+	}
+	cachedb_exists("key100", $db2) && die("CacheDB: key100 found\n");
+	cachedb_add("key100", 100, $db2) && die("CacheDB: add to shared handle succeeded\n");
+	cachedb_close($db1) || die("CacheDB: Error on DB close #2\n");
+	(cachedb_fetch("key1", $db2) == array(1)) || die("CacheDB: key1 value incorrect after close\n");
+
+	/* A new version replaces the shared index, but the old handle keeps reading the old version */
+	(($db = cachedb_open($dbname, 'w'))!==FALSE) || die("CacheDB: Error opening database for write\n");
+	cachedb_add("key100", array(100), $db) || die("CacheDB: add key100 failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #3\n");
+	clearstatcache();
+
+	(($db3 = cachedb_open($dbname, 'rs'))!==FALSE) || die("CacheDB: Error opening shared database #3\n");
+	(cachedb_fetch("key100", $db3) == array(100)) || die("CacheDB: key100 value incorrect on #3\n");
+	cachedb_exists("key100", $db2) && die("CacheDB: key100 found in old version\n");
+	(cachedb_fetch("key2", $db2) == array(2)) || die("CacheDB: key2 value incorrect in old version\n");
+	cachedb_close($db2) || die("CacheDB: Error on DB close #4\n");
+	(cachedb_fetch("key2", $db3) == array(2)) || die("CacheDB: key2 value incorrect on #3\n");
+	cachedb_close($db3) || die("CacheDB: Error on DB close #5\n");
+
+	/* The index of a renamed file is evicted on its last close, and each file is then rebuilt */
+	$renamed = dirname(__FILE__) .'/test13_renamed.db';
+	(($db4 = cachedb_open($dbname, 'rs'))!==FALSE) || die("CacheDB: Error opening shared database #4\n");
+	rename($dbname, $renamed) || die("CacheDB: rename failed\n");
+	cachedb_close($db4) || die("CacheDB: Error on DB close #6\n");
+	(($db = cachedb_open($dbname, 'c'))!==FALSE) || die("CacheDB: cannot recreate Db\n");
+	cachedb_add("new", array('new'), $db) || die("CacheDB: add new failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #7\n");
+	clearstatcache();
+	(($db5 = cachedb_open($dbname, 'rs'))!==FALSE) || die("CacheDB: Error opening shared database #5\n");
+	(cachedb_fetch("new", $db5) == array('new')) || die("CacheDB: new value incorrect on #5\n");
+	cachedb_exists("key1", $db5) && die("CacheDB: key1 found in recreated DB\n");
+	cachedb_close($db5) || die("CacheDB: Error on DB close #8\n");
+	(($db6 = cachedb_open($renamed, 'rs'))!==FALSE) || die("CacheDB: Error opening shared database #6\n");
+	(cachedb_fetch("key100", $db6) == array(100)) || die("CacheDB: key100 value incorrect on #6\n");
+	cachedb_close($db6) || die("CacheDB: Error on DB close #9\n");
+
+	/* Shared mode can't be combined with the other index modes */
+	(cachedb_open($dbname, 'rsp') === FALSE) || die("CacheDB: paged shared open succeeded\n");
+	(cachedb_open($dbname, 'ris') === FALSE) || die("CacheDB: integer shared open succeeded\n");
+?>
+===DONE===
+--CLEAN--
+<?php
+	@unlink(dirname(__FILE__) .'/test13.db');
+	@unlink(dirname(__FILE__) .'/test13_renamed.db');
+?>
+--EXPECT--
+===DONE===
@@ -0,0 +1,52 @@
+--TEST--
+CacheDB sharded DB recreate test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dir = dirname(__FILE__) .'/test14.shards';
+
+	/* Create a 4-way sharded DB with keys spread over every shard */
+	(($db = cachedb_open_sharded($dir, 4, 'c'))!==FALSE) || die("CacheDB: cannot create sharded Db\n");
+	for ($i = 0; $i < 40; $i++) {
+		cachedb_add("old$i", "old value $i", $db) || die("CacheDB: add old$i failed\n");
+	}
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+	(count(glob("$dir/shard-*-of-004.cachedb")) == 4) || die("CacheDB: expected 4 shard files\n");
+
+	/* A discarded create leaves the old generation in place */
+	(($db = cachedb_open_sharded($dir, 4, 'c'))!==FALSE) || die("CacheDB: cannot recreate sharded Db #1\n");
+	cachedb_add("new0", "new value 0", $db) || die("CacheDB: add new0 failed\n");
+	cachedb_close($db, 'r') || die("CacheDB: Error on DB discard\n");
+	(($db = cachedb_open_sharded($dir, 4, 'r'))!==FALSE) || die("CacheDB: Error reopening sharded Db #1\n");
+	(cachedb_fetch("old7", $db) == "old value 7") || die("CacheDB: old7 lost by discarded create\n");
+	cachedb_close($db);
+
+	/* Recreating it with a single key replaces every shard, including those left untouched */
+	(($db = cachedb_open_sharded($dir, 4, 'c'))!==FALSE) || die("CacheDB: cannot recreate sharded Db #2\n");
+	cachedb_add("new0", "new value 0", $db) || die("CacheDB: add new0 failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #2\n");
+
+	(($db = cachedb_open_sharded($dir, 4, 'r'))!==FALSE) || die("CacheDB: Error reopening sharded Db #2\n");
+	(cachedb_fetch("new0", $db) == "new value 0") || die("CacheDB: new0 value incorrect\n");
+	for ($i = 0; $i < 40; $i++) {
+		cachedb_exists("old$i", $db) && die("CacheDB: stale key old$i found\n");
+	}
+	$total = 0;
+	foreach (cachedb_info($db) as $shard_info) {
+		$total += count($shard_info[0]);
+	}
+	($total == 1) || die("CacheDB: sharded record count != 1\n");
+	cachedb_close($db);
+?>
+===DONE===
+--CLEAN--
+<?php
+	$dir = dirname(__FILE__) .'/test14.shards';
+	foreach ((array) glob("$dir/*") as $file) {
+		@unlink($file);
+	}
+	@rmdir($dir);
+?>
+--EXPECT--
+===DONE===
@@ -0,0 +1,60 @@
+--TEST--
+CacheDB deferred commit test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test15.db';
+	$child  = dirname(__FILE__) .'/test15_child.php';
+
+	/* Deferred commits only run once a request has completed, so each close is done by a child */
+	$php = getenv('TEST_PHP_EXECUTABLE');
+	$php = escapeshellarg($php ? $php : PHP_BINARY);
+	$ext = '';
+	if (file_exists(ini_get('extension_dir') .'/cachedb.'. PHP_SHLIB_SUFFIX)) {
+		$ext = ' -d extension_dir='. escapeshellarg(ini_get('extension_dir')) .' -d extension=cachedb.'. PHP_SHLIB_SUFFIX;
+	}
+	file_put_contents($child, '<?php
+		$db = cachedb_open($argv[1], $argv[2]);
+		cachedb_add($argv[3], "value of ". $argv[3], $db) || die("add failed\n");
+		cachedb_close($db, $argv[4], $stats) || die("close failed\n");
+		echo $stats["commit_outcome"], " ", (file_exists($argv[1]) ? "old" : "absent"), "\n";
+	');
+
+	function wait_for_key($dbname, $key) {
+		for ($i = 0; $i < 50; $i++) {
+			clearstatcache();
+			if (file_exists($dbname) && ($db = cachedb_open($dbname, 'r')) !== FALSE) {
+				$value = cachedb_fetch($key, $db);
+				cachedb_close($db);
+				if ($value == "value of $key") {
+					return TRUE;
+				}
+			}
+			usleep(100000);
+		}
+		return FALSE;
+	}
+
+	/* Close mode 'd' defers the commit until after the child's request */
+	$out = shell_exec("$php$ext ". escapeshellarg($child) ." ". escapeshellarg($dbname) ." c key1 d 2>/dev/null");
+	(trim($out) == "deferred absent") || die("CacheDB: unexpected deferred close output: $out\n");
+	wait_for_key($dbname, "key1") || die("CacheDB: deferred commit of key1 not published\n");
+
+	/* cachedb.deferred_commit defers every committing close */
+	$out = shell_exec("$php$ext -d cachedb.deferred_commit=1 ". escapeshellarg($child) ." ". escapeshellarg($dbname) ." w key2 '*' 2>/dev/null");
+	(trim($out) == "deferred old") || die("CacheDB: unexpected deferred_commit output: $out\n");
+	wait_for_key($dbname, "key2") || die("CacheDB: deferred commit of key2 not published\n");
+
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening database\n");
+	(cachedb_fetch("key1", $db) == "value of key1") || die("CacheDB: key1 lost by second commit\n");
+	cachedb_close($db);
+?>
+===DONE===
+--CLEAN--
+<?php
+	@unlink(dirname(__FILE__) .'/test15.db');
+	@unlink(dirname(__FILE__) .'/test15_child.php');
+?>
+--EXPECT--
+===DONE===
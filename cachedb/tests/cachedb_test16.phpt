@@ -0,0 +1,43 @@
+--TEST--
+CacheDB commit durability test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dir    = dirname(__FILE__) .'/test16.dir';
+	$dbname = "$dir/test16.db";
+	@mkdir($dir);
+
+	/* Commit at each durability level, adding to the DB each time */
+	foreach (array(1, 2, 2) as $n => $durability) {
+		ini_set('cachedb.durability', $durability);
+		(($db = cachedb_open($dbname, $n ? 'w' : 'c'))!==FALSE) || die("CacheDB: cannot open Db #$n\n");
+		for ($i = 0; $i < 10; $i++) {
+			cachedb_add("key$n.$i", "value $n.$i", $db) || die("CacheDB: add key$n.$i failed\n");
+		}
+		cachedb_close($db, '*', $stats) || die("CacheDB: Error on DB close #$n\n");
+		($stats['commit_outcome'] === 'published') || die("CacheDB: commit #$n not published\n");
+	}
+
+	/* The DB reopens with every record, and no temporary files are left behind */
+	clearstatcache();
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening database\n");
+	$info = cachedb_info($db);
+	(count($info[0]) == 30) || die("CacheDB: record count != 30\n");
+	(cachedb_fetch("key0.0", $db) == "value 0.0") || die("CacheDB: key0.0 value incorrect\n");
+	(cachedb_fetch("key2.9", $db) == "value 2.9") || die("CacheDB: key2.9 value incorrect\n");
+	cachedb_close($db);
+	(count(glob("$dir/.cachedb_tmp_*")) == 0) || die("CacheDB: temporary files left in the directory\n");
+	(count(glob("$dir/*")) == 1) || die("CacheDB: unexpected files in the directory\n");
+?>
+===DONE===
+--CLEAN--
+<?php
+	$dir = dirname(__FILE__) .'/test16.dir';
+	foreach (array_merge((array) glob("$dir/*"), (array) glob("$dir/.cachedb_tmp_*")) as $file) {
+		@unlink($file);
+	}
+	@rmdir($dir);
+?>
+--EXPECT--
+===DONE===
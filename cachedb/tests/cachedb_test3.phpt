@@ -0,0 +1,64 @@
+--TEST--
+CacheDB record expiry test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test3.db';
+
+	/* Create a DB with a mix of records with and without a TTL */
+	(($db = cachedb_open($dbname, 'c'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	cachedb_add("forever", "Content String 1", $db) || die("CacheDB: add forever failed\n");
+	cachedb_add("fresh", "Content String 2", $db, NULL, 3600) || die("CacheDB: add fresh failed\n");
+	cachedb_add("stale", "Content String 3", $db, array('lang'=>'en'), 1) || die("CacheDB: add stale failed\n");
+	cachedb_exists("stale", $db) || die("CacheDB: stale not visible before expiry\n");
+	var_dump(cachedb_add("negative", "Content String 0", $db, NULL, -1));
+	cachedb_exists("negative", $db) && die("CacheDB: record with negative ttl added\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	sleep(2);
+
+	/* Expired records are misses and can be re-added */
+	(($db = cachedb_open($dbname, 'w'))!==FALSE) || die("CacheDB: Error reopening database\n");
+	(cachedb_expired_count($db) == 1) || die("CacheDB: expired count != 1\n");
+	cachedb_exists("forever", $db) || die("CacheDB: forever missing\n");
+	cachedb_exists("fresh", $db) || die("CacheDB: fresh missing\n");
+	cachedb_exists("stale", $db) && die("CacheDB: stale found\n");
+	(cachedb_fetch("stale", $db) === FALSE) || die("CacheDB: stale fetched\n");
+	cachedb_add("fresh", "XXX", $db) && die("CacheDB: unexpired key replaced\n");
+	cachedb_add("stale", "Content String 4", $db) || die("CacheDB: re-add stale failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #2\n");
+
+	/* The commit has dropped the expired record */
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening database #2\n");
+	(cachedb_expired_count($db) == 0) || die("CacheDB: expired count != 0\n");
+	$info = cachedb_info($db);
+	(count($info[0]) == 3) || die("CacheDB: record count != 3\n");
+	(cachedb_fetch("forever", $db) == "Content String 1") || die("CacheDB: forever value incorrect\n");
+	(cachedb_fetch("stale", $db) == "Content String 4") || die("CacheDB: stale value incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #3\n");
+
+	/* An explicit purge evicts expired records without any additions */
+	(($db = cachedb_open($dbname, 'w'))!==FALSE) || die("CacheDB: Error reopening database #3\n");
+	cachedb_add("brief", "Content String 5", $db, NULL, 1) || die("CacheDB: add brief failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #4\n");
+
+	sleep(2);
+
+	(($db = cachedb_open($dbname, 'w'))!==FALSE) || die("CacheDB: Error reopening database #4\n");
+	(cachedb_expired_count($db) == 1) || die("CacheDB: expired count != 1\n");
+	cachedb_close($db, 'p') || die("CacheDB: Error on DB purge\n");
+
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening database #5\n");
+	$info = cachedb_info($db);
+	(count($info[0]) == 3) || die("CacheDB: record count after purge != 3\n");
+	(cachedb_fetch("fresh", $db) == "Content String 2") || die("CacheDB: fresh value incorrect\n");
+	cachedb_close($db);
+?>
+===DONE===
+--CLEAN--
+<?php @unlink(dirname(__FILE__) .'/test3.db'); ?>
+--EXPECTF--
+Warning: cachedb_add(): The ttl must not be negative in %s on line %d
+bool(false)
+===DONE===
@@ -0,0 +1,53 @@
+--TEST--
+CacheDB layered handle test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$shared = dirname(__FILE__) .'/test4_shared.db';
+	$tenant = dirname(__FILE__) .'/test4_tenant.db';
+
+	/* Create the shared base and the tenant override DBs */
+	(($db = cachedb_open($shared, 'c'))!==FALSE) || die("CacheDB: cannot create shared Db\n");
+	for ($i = 0; $i < 100; $i++) {
+		cachedb_add("key$i", "shared $i", $db);
+	}
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	(($db = cachedb_open($tenant, 'c'))!==FALSE) || die("CacheDB: cannot create tenant Db\n");
+	cachedb_add("key1", "tenant 1", $db, array('owner'=>'tenant'));
+	cachedb_add("tenant_only", "tenant only", $db);
+	cachedb_close($db) || die("CacheDB: Error on DB close #2\n");
+
+	/* Lookups walk the layers top down */
+	(($db = cachedb_open_layers(array($tenant, $shared), 'w'))!==FALSE) || die("CacheDB: cannot open layers\n");
+	(cachedb_fetch("key1", $db, $meta) == "tenant 1") || die("CacheDB: key1 not overridden\n");
+	($meta == array('owner'=>'tenant')) || die("CacheDB: key1 metadata incorrect\n");
+	(cachedb_fetch("key2", $db) == "shared 2") || die("CacheDB: key2 not found in shared layer\n");
+	(cachedb_fetch("tenant_only", $db) == "tenant only") || die("CacheDB: tenant_only missing\n");
+	(cachedb_fetch("key99", $db) == "shared 99") || die("CacheDB: key99 not found in shared layer\n");
+	cachedb_exists("missing", $db) && die("CacheDB: missing key found\n");
+
+	/* Additions go to the top layer */
+	cachedb_add("key2", "tenant 2", $db) || die("CacheDB: override add failed\n");
+	(cachedb_fetch("key2", $db) == "tenant 2") || die("CacheDB: key2 add not visible\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #3\n");
+
+	(($db = cachedb_open($tenant, 'r'))!==FALSE) || die("CacheDB: Error reopening tenant\n");
+	(cachedb_fetch("key2", $db) == "tenant 2") || die("CacheDB: key2 not committed to tenant\n");
+	cachedb_close($db);
+
+	(($db = cachedb_open($shared, 'r'))!==FALSE) || die("CacheDB: Error reopening shared\n");
+	(cachedb_fetch("key2", $db) == "shared 2") || die("CacheDB: shared layer was modified\n");
+	$info = cachedb_info($db);
+	(count($info[0]) == 100) || die("CacheDB: shared record count != 100\n");
+	cachedb_close($db);
+?>
+===DONE===
+--CLEAN--
+<?php
+	@unlink(dirname(__FILE__) .'/test4_shared.db');
+	@unlink(dirname(__FILE__) .'/test4_tenant.db');
+?>
+--EXPECT--
+===DONE===
@@ -0,0 +1,57 @@
+--TEST--
+CacheDB sharded DB test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dir = dirname(__FILE__) .'/test5.shards';
+
+	/* Create a 4-way sharded DB */
+	(($db = cachedb_open_sharded($dir, 4, 'c'))!==FALSE) || die("CacheDB: cannot create sharded Db\n");
+	for ($i = 0; $i < 40; $i++) {
+		cachedb_add("key$i", "value $i", $db) || die("CacheDB: add key$i failed\n");
+	}
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+	(count(glob("$dir/shard-*-of-004.cachedb")) == 4) || die("CacheDB: expected 4 shard files\n");
+
+	/* Read back through the sharded handle */
+	(($db = cachedb_open_sharded($dir, 4, 'r'))!==FALSE) || die("CacheDB: Error reopening sharded Db\n");
+	for ($i = 0; $i < 40; $i++) {
+		(cachedb_fetch("key$i", $db) == "value $i") || die("CacheDB: key$i value incorrect\n");
+	}
+	cachedb_exists("missing", $db) && die("CacheDB: missing key found\n");
+	cachedb_add("key40", "value 40", $db) && die("CacheDB: cannot add to RO db\n");
+	$total = 0;
+	foreach (cachedb_info($db) as $shard_info) {
+		$total += count($shard_info[0]);
+	}
+	($total == 40) || die("CacheDB: sharded record count != 40\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #2\n");
+
+	/* A commit only rewrites the shards that received additions */
+	clearstatcache();
+	$before = array();
+	foreach (glob("$dir/shard-*-of-004.cachedb") as $file) {
+		$before[$file] = fileinode($file);
+	}
+	(($db = cachedb_open_sharded($dir, 4, 'w'))!==FALSE) || die("CacheDB: Error reopening sharded Db R/W\n");
+	cachedb_add("key40", "value 40", $db) || die("CacheDB: add key40 failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #3\n");
+	clearstatcache();
+	$changed = 0;
+	foreach ($before as $file => $inode) {
+		$changed += (fileinode($file) != $inode);
+	}
+	($changed == 1) || die("CacheDB: expected 1 shard rewrite, got $changed\n");
+?>
+===DONE===
+--CLEAN--
+<?php
+	$dir = dirname(__FILE__) .'/test5.shards';
+	foreach ((array) glob("$dir/*") as $file) {
+		@unlink($file);
+	}
+	@rmdir($dir);
+?>
+--EXPECT--
+===DONE===
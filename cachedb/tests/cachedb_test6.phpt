@@ -0,0 +1,48 @@
+--TEST--
+CacheDB checksum verification test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test6.db';
+
+	(($db = cachedb_open($dbname, 'cb'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	cachedb_add("key1", "Content String 1", $db) || die("CacheDB: add key1 failed\n");
+	cachedb_add("key2", "Content String 2", $db) || die("CacheDB: add key2 failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	/* Damage one byte of the second record */
+	$contents = file_get_contents($dbname);
+	(($pos = strpos($contents, "Content String 2")) !== FALSE) || die("CacheDB: record not found\n");
+	$contents[$pos] = 'X';
+	file_put_contents($dbname, $contents);
+
+	/* Without verification the damaged record is returned as is */
+	ini_set('cachedb.verify', 0);
+	(($db = cachedb_open($dbname, 'rb'))!==FALSE) || die("CacheDB: Error reopening database #1\n");
+	(cachedb_fetch("key2", $db) == "Xontent String 2") || die("CacheDB: unverified value incorrect\n");
+	cachedb_close($db);
+
+	/* With verification the damaged record is rejected but the others are still returned */
+	ini_set('cachedb.verify', 100);
+	(($db = cachedb_open($dbname, 'rb'))!==FALSE) || die("CacheDB: Error reopening database #2\n");
+	(@cachedb_fetch("key2", $db) === FALSE) || die("CacheDB: damaged record fetched\n");
+	(cachedb_fetch("key1", $db) == "Content String 1") || die("CacheDB: key1 value incorrect\n");
+	var_dump(cachedb_fetch("key2", $db));
+	cachedb_close($db);
+
+	/* A damaged index or a truncated file fail the open */
+	$contents[30] = chr(ord($contents[30]) ^ 0xff);
+	file_put_contents($dbname, $contents);
+	(@cachedb_open($dbname, 'rb') === FALSE) || die("CacheDB: damaged index opened\n");
+
+	file_put_contents($dbname, substr($contents, 0, -8));
+	(@cachedb_open($dbname, 'rb') === FALSE) || die("CacheDB: truncated file opened\n");
+?>
+===DONE===
+--CLEAN--
+<?php @unlink(dirname(__FILE__) .'/test6.db'); ?>
+--EXPECTF--
+Warning: cachedb_fetch(): Checksum mismatch in cachedb file %stest6.db in %s on line %d
+bool(false)
+===DONE===
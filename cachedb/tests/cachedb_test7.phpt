@@ -0,0 +1,34 @@
+--TEST--
+CacheDB statistics test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test7.db';
+
+	(($db = cachedb_open($dbname, 'c'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	cachedb_add("key1", array(1, 2, 3), $db) || die("CacheDB: add key1 failed\n");
+	cachedb_add("key2", "Content String 2", $db) || die("CacheDB: add key2 failed\n");
+	(cachedb_fetch("key1", $db) == array(1, 2, 3)) || die("CacheDB: key1 value incorrect\n");
+	$stats = cachedb_stats($db);
+	($stats['records_added'] == 2) || die("CacheDB: records_added != 2\n");
+	($stats['staged_bytes_read'] > 0 && $stats['base_bytes_read'] == 0) || die("CacheDB: staged bytes incorrect\n");
+	cachedb_close($db, '*', $stats) || die("CacheDB: Error on DB close #1\n");
+	($stats['commit_outcome'] == 'published') || die("CacheDB: commit not published\n");
+	($stats['commit_time'] > 0) || die("CacheDB: commit time not set\n");
+
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening database\n");
+	cachedb_exists("key2", $db) || die("CacheDB: key2 missing\n");
+	cachedb_exists("key3", $db) && die("CacheDB: key3 found\n");
+	(cachedb_fetch("key1", $db) == array(1, 2, 3)) || die("CacheDB: key1 value incorrect\n");
+	$stats = cachedb_stats($db);
+	($stats['finds'] == 3 && $stats['hits'] == 2 && $stats['misses'] == 1) || die("CacheDB: find counts incorrect\n");
+	($stats['fetches'] == 1 && $stats['base_bytes_read'] > 0) || die("CacheDB: fetch counts incorrect\n");
+	cachedb_close($db, 'r', $stats) || die("CacheDB: Error on DB close #2\n");
+	($stats['commit_outcome'] == 'none') || die("CacheDB: unexpected commit\n");
+?>
+===DONE===
+--CLEAN--
+<?php @unlink(dirname(__FILE__) .'/test7.db'); ?>
+--EXPECT--
+===DONE===
@@ -0,0 +1,77 @@
+--TEST--
+CacheDB handle vector and CacheDB class test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test8.db';
+
+	$db = new CacheDB($dbname, 'c');
+	$db->add("key1", array(1, 2, 3)) || die("CacheDB: add key1 failed\n");
+	$db->add("key2", "Content String 2", array('lang'=>'en')) || die("CacheDB: add key2 failed\n");
+	$db->add("key1", "Duplicate") && die("CacheDB: duplicate key1 added\n");
+	try {
+		$db->__construct($dbname, 'r');
+		die("CacheDB: open object reopened\n");
+	} catch (Exception $e) {
+	}
+	$db->has("key1") || die("CacheDB: pending addition lost by reopen\n");
+	var_dump($db->add("key3", "Negative ttl", NULL, -1));
+	$db->close() || die("CacheDB: Error on DB close #1\n");
+	$db->has("key1") && die("CacheDB: closed DB still usable\n");
+
+	$db = new CacheDB($dbname, 'r');
+	$db->has("key2") || die("CacheDB: key2 missing\n");
+	$db->has("key3") && die("CacheDB: key3 found\n");
+	($db->get("key1") == array(1, 2, 3)) || die("CacheDB: key1 value incorrect\n");
+	($db->get("key2", $meta) == "Content String 2" && $meta['lang'] == 'en') || die("CacheDB: key2 metadata incorrect\n");
+	($db->get(3) === FALSE) || die("CacheDB: key 3 found\n");
+	unset($db);
+
+	/* A damaged record is returned as FALSE with a warning */
+	$binname = dirname(__FILE__) .'/test8b.db';
+	$db = new CacheDB($binname, 'cb');
+	$db->add("key1", "Content String 1") || die("CacheDB: add binary key1 failed\n");
+	$db->close() || die("CacheDB: Error on DB close #2\n");
+	$contents = file_get_contents($binname);
+	(($pos = strpos($contents, "Content String 1")) !== FALSE) || die("CacheDB: record not found\n");
+	$contents[$pos] = 'X';
+	file_put_contents($binname, $contents);
+	ini_set('cachedb.verify', 100);
+	$db = new CacheDB($binname, 'rb');
+	var_dump($db->get("key1"));
+	unset($db);
+
+	try {
+		$db = @new CacheDB(dirname(__FILE__) .'/nonexistent/test8.db', 'r');
+		die("CacheDB: missing DB opened\n");
+	} catch (Exception $e) {
+	}
+
+	/* More handles than the old fixed limit of 10, with closed handles being reused */
+	$handles = array();
+	for ($i = 0; $i < 25; $i++) {
+		(($handles[$i] = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: cannot open handle $i\n");
+	}
+	(count(array_unique($handles)) == 25) || die("CacheDB: duplicate handles\n");
+	cachedb_close($handles[7]) || die("CacheDB: Error on close of handle 7\n");
+	cachedb_exists("key1", $handles[7]) && die("CacheDB: closed handle still usable\n");
+	(cachedb_open($dbname, 'r') === $handles[7]) || die("CacheDB: closed handle not reused\n");
+	cachedb_exists("key1", $handles[24]) || die("CacheDB: key1 missing on handle 24\n");
+	foreach ($handles as $h) {
+		cachedb_close($h) || die("CacheDB: Error on close of handle $h\n");
+	}
+?>
+===DONE===
+--CLEAN--
+<?php
+	@unlink(dirname(__FILE__) .'/test8.db');
+	@unlink(dirname(__FILE__) .'/test8b.db');
+?>
+--EXPECTF--
+Warning: CacheDB::add(): The ttl must not be negative in %s on line %d
+bool(false)
+
+Warning: CacheDB::get(): Checksum mismatch in cachedb file %stest8b.db in %s on line %d
+bool(false)
+===DONE===
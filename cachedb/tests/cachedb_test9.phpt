@@ -0,0 +1,65 @@
+--TEST--
+CacheDB integer mode test
+--SKIPIF--
+<?php extension_loaded('cachedb') or die('Info: cachedb not loaded'); ?>
+--FILE--
+<?php
+	$dbname = dirname(__FILE__) .'/test9.db';
+
+	(($db = cachedb_open($dbname, 'ci'))!==FALSE) || die("CacheDB: cannot create Db\n");
+	for ($i = 0; $i < 100; $i += 3) {
+		cachedb_add_int($i, array('id' => $i), $db) || die("CacheDB: add $i failed\n");
+	}
+	cachedb_add_int(3, "Duplicate", $db) && die("CacheDB: duplicate 3 added\n");
+	var_dump(cachedb_add_int(-1, "Negative id", $db));
+	var_dump(cachedb_add_int(202, "Negative ttl", $db, -1));
+	var_dump(cachedb_add_int(16777215, "Sparse id", $db));
+	cachedb_add("key", "String key", $db) && die("CacheDB: string key added\n");
+	cachedb_add("007", "Leading zeros", $db) && die("CacheDB: non-canonical key added\n");
+	cachedb_add("200", "Canonical string key", $db) || die("CacheDB: add 200 failed\n");
+	cachedb_add_int(201, "Expiring", $db, 1) || die("CacheDB: add 201 failed\n");
+	(cachedb_fetch_int(9, $db) == array('id' => 9)) || die("CacheDB: staged 9 value incorrect\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #1\n");
+
+	(($db = cachedb_open($dbname, 'ri'))!==FALSE) || die("CacheDB: Error reopening database\n");
+	(cachedb_fetch_int(0, $db) == array('id' => 0)) || die("CacheDB: 0 value incorrect\n");
+	(cachedb_fetch_int(99, $db) == array('id' => 99)) || die("CacheDB: 99 value incorrect\n");
+	(cachedb_fetch_int(98, $db) === FALSE) || die("CacheDB: 98 found\n");
+	(cachedb_fetch_int(5000, $db) === FALSE) || die("CacheDB: 5000 found\n");
+	(cachedb_fetch("200", $db) == "Canonical string key") || die("CacheDB: 200 value incorrect\n");
+	cachedb_exists("33", $db) || die("CacheDB: 33 missing\n");
+	cachedb_exists("key", $db) && die("CacheDB: string key found\n");
+	cachedb_close($db);
+
+	/* The DB is still readable by a normal handle */
+	(($db = cachedb_open($dbname, 'r'))!==FALSE) || die("CacheDB: Error reopening database #2\n");
+	(cachedb_fetch("42", $db) == array('id' => 42)) || die("CacheDB: string 42 value incorrect\n");
+	cachedb_close($db);
+
+	sleep(2);
+	(($db = cachedb_open($dbname, 'wi'))!==FALSE) || die("CacheDB: Error reopening database R/W\n");
+	(cachedb_fetch_int(201, $db) === FALSE) || die("CacheDB: expired 201 found\n");
+	cachedb_add_int(201, "Replaced", $db) || die("CacheDB: re-add 201 failed\n");
+	cachedb_add_int(1000, "Extended", $db) || die("CacheDB: add 1000 failed\n");
+	cachedb_close($db) || die("CacheDB: Error on DB close #2\n");
+
+	ini_set('cachedb.verify', 100);
+	(($db = cachedb_open($dbname, 'ri'))!==FALSE) || die("CacheDB: Error reopening database #3\n");
+	(cachedb_fetch_int(201, $db) == "Replaced") || die("CacheDB: 201 value incorrect\n");
+	(cachedb_fetch_int(1000, $db) == "Extended") || die("CacheDB: 1000 value incorrect\n");
+	(cachedb_fetch_int(51, $db) == array('id' => 51)) || die("CacheDB: 51 value incorrect\n");
+	cachedb_close($db);
+?>
+===DONE===
+--CLEAN--
+<?php @unlink(dirname(__FILE__) .'/test9.db'); ?>
+--EXPECTF--
+Warning: cachedb_add_int(): The id must not be negative in %s on line %d
+bool(false)
+
+Warning: cachedb_add_int(): The ttl must not be negative in %s on line %d
+bool(false)
+
+Warning: cachedb_add_int(): The id 16777215 is too sparse for the 34 records in cachedb file %s in %s on line %d
+bool(false)
+===DONE===
@@ -0,0 +1,225 @@
+<?php
+/*
+   +----------------------------------------------------------------------+
+   | PHP Version 5                                                        |
+   +----------------------------------------------------------------------+
+   | Copyright (c) 1997-2012 The PHP Group                                |
+   +----------------------------------------------------------------------+
+   | This source file is subject to version 3.01 of the PHP license,      |
+   | that is bundled with this package in the file LICENSE, and is        |
+   | available through the world-wide-web at the following url:           |
+   | http://www.php.net/license/3_01.txt                                  |
+   | If you did not receive a copy of the PHP license and are unable to   |
+   | obtain it through the world-wide-web, please send a note to          |
+   | license@php.net so we can mail you a copy immediately.               |
+   +----------------------------------------------------------------------+
+   | Author: Terry Ellison <Terry@ellisonsorg.uk>                         |
+   +----------------------------------------------------------------------+
+ */
+
+/* 
+ * cachedb-bench: a concurrency stress and throughput benchmark for cachedb.
+ *
+ * N worker processes are forked against a single DB file.  Each worker repeatedly emulates a 
+ * request: it opens the DB in 'w' mode, does a number of lookups of random keys, fetching those 
+ * that exist and adding a proportion of those that don't, and then closes (and so commits) the DB.
+ * Since all workers are adding from the same key space, this exercises the commit race in the same
+ * way as a cold cache being warmed by concurrent requests.
+ *
+ *   php -d extension=cachedb.so cachedb-bench.php [options]
+ *
+ *   --dir=PATH          directory for the DB, e.g. a tmpfs or a local disk mount  (default: /tmp)
+ *   --procs=N           number of worker processes                               (default: 4)
+ *   --requests=N        requests per worker                                      (default: 200)
+ *   --lookups=N         key lookups per request                                  (default: 50)
+ *   --keys=N            size of the key space                                    (default: 5000)
+ *   --add-ratio=R       probability that a missed key is added, 0..1             (default: 0.2)
+ *   --values=DIST       value size distribution: fixed:N, uniform:MIN-MAX or exp:MEAN
+ *                                                                                (default: exp:2000)
+ *   --binary            use a binary mode DB with string values
+ *   --keep              don't delete the DB at the end
+ *
+ * The report gives the overall ops/s, the p50 and p99 latency of each operation, the commit 
+ * outcomes, and the bytes written per committed record.  As each commit rewrites the whole DB, 
+ * the last figure is the write amplification of the commit path.
+ */
+
+if (PHP_SAPI != 'cli') {
+	die("cachedb-bench must be run from the command line\n");
+}
+extension_loaded('cachedb') || die("cachedb-bench: the cachedb extension is not loaded\n");
+function_exists('pcntl_fork') || die("cachedb-bench: the pcntl extension is required\n");
+
+$opts = getopt('', array('dir:', 'procs:', 'requests:', 'lookups:', 'keys:', 'add-ratio:', 'values:', 
+                         'binary', 'keep', 'help'));
+if (isset($opts['help'])) {
+	passthru('sed -n "/^ \\* cachedb-bench:/,/^ \\*\\//p" ' . escapeshellarg(__FILE__));
+	exit(0);
+}
+$dir       = isset($opts['dir'])       ? rtrim($opts['dir'], '/') : sys_get_temp_dir();
+$procs     = isset($opts['procs'])     ? (int) $opts['procs']     : 4;
+$requests  = isset($opts['requests'])  ? (int) $opts['requests']  : 200;
+$lookups   = isset($opts['lookups'])   ? (int) $opts['lookups']   : 50;
+$keys      = isset($opts['keys'])      ? (int) $opts['keys']      : 5000;
+$add_ratio = isset($opts['add-ratio']) ? (float) $opts['add-ratio'] : 0.2;
+$values    = isset($opts['values'])    ? $opts['values']          : 'exp:2000';
+$binary    = isset($opts['binary']);
+
+$dbname  = sprintf("%s/cachedb-bench-%d.db", $dir, getmypid());
+$results = sprintf("%s/cachedb-bench-%d.results", $dir, getmypid());
+@unlink($dbname);
+
+/* {{{ Value generation */
+function value_size($dist) {
+	list($type, $arg) = explode(':', $dist, 2) + array(NULL, NULL);
+	switch ($type) {
+		case 'fixed':
+			return (int) $arg;
+		case 'uniform':
+			list($min, $max) = explode('-', $arg);
+			return mt_rand((int) $min, (int) $max);
+		case 'exp':
+			return max(1, (int) (-log(1 - mt_rand() / (mt_getrandmax() + 1)) * (float) $arg));
+		default:
+			die("cachedb-bench: invalid value distribution $dist\n");
+	}
+}
+
+/* The values are moderately compressible, as real cached content usually is */
+function make_value($size, $binary) {
+	$s = substr(str_repeat(md5(mt_rand()) . ' lorem ipsum ', (int) ($size / 45) + 1), 0, $size);
+	return $binary ? $s : array('size' => $size, 'body' => $s, 'stamp' => mt_rand());
+}
+/* }}} */
+
+/* {{{ Worker */
+function run_worker($worker) {
+	global $dbname, $requests, $lookups, $keys, $add_ratio, $values, $binary;
+
+	mt_srand(getmypid() ^ (int) (microtime(TRUE) * 1000000));
+	$lat = array('open' => array(), 'find' => array(), 'fetch' => array(), 'add' => array(), 'close' => array());
+	$res = array('lat' => &$lat, 'ops' => 0, 'outcomes' => array(), 'written' => 0, 'committed' => 0);
+	$mode = $binary ? 'b' : '';
+
+	for ($r = 0; $r < $requests; $r++) {
+		$t  = microtime(TRUE);
+		$db = cachedb_open($dbname, 'w' . $mode);
+		$lat['open'][] = microtime(TRUE) - $t;
+		if ($db === FALSE) {
+			continue;
+		}
+
+		for ($i = 0; $i < $lookups; $i++) {
+			$key = 'key-' . mt_rand(1, $keys);
+
+			$t     = microtime(TRUE);
+			$found = cachedb_exists($key, $db);
+			$lat['find'][] = microtime(TRUE) - $t;
+
+			if ($found) {
+				$t = microtime(TRUE);
+				cachedb_fetch($key, $db);
+				$lat['fetch'][] = microtime(TRUE) - $t;
+			} elseif (mt_rand() / mt_getrandmax() < $add_ratio) {
+				$value = make_value(value_size($values), $binary);
+				$t     = microtime(TRUE);
+				cachedb_add($key, $value, $db);
+				$lat['add'][] = microtime(TRUE) - $t;
+			}
+		}
+
+		$stats = NULL;
+		$t = microtime(TRUE);
+		cachedb_close($db, '*', $stats);
+		$lat['close'][] = microtime(TRUE) - $t;
+
+		$outcome = $stats['commit_outcome'];
+		$res['outcomes'][$outcome] = isset($res['outcomes'][$outcome]) ? $res['outcomes'][$outcome] + 1 : 1;
+		if ($outcome == 'published') {
+			clearstatcache();
+			$res['written']   += filesize($dbname);
+			$res['committed'] += $stats['records_added'];
+		}
+	}
+
+	foreach ($lat as $samples) {
+		$res['ops'] += count($samples);
+	}
+	return $res;
+}
+/* }}} */
+
+/* {{{ Fork the workers and collect their results */
+$start = microtime(TRUE);
+$pids  = array();
+for ($w = 0; $w < $procs; $w++) {
+	$pid = pcntl_fork();
+	if ($pid == -1) {
+		die("cachedb-bench: fork failed\n");
+	} elseif ($pid == 0) {
+		$res = run_worker($w);
+		file_put_contents("$results.$w", serialize($res));
+		exit(0);
+	}
+	$pids[] = $pid;
+}
+foreach ($pids as $pid) {
+	pcntl_waitpid($pid, $status);
+}
+$elapsed = microtime(TRUE) - $start;
+
+$lat      = array();
+$ops      = 0;
+$outcomes = array();
+$written  = $committed = 0;
+for ($w = 0; $w < $procs; $w++) {
+	$res = @unserialize(file_get_contents("$results.$w"));
+	@unlink("$results.$w");
+	if (!is_array($res)) {
+		fwrite(STDERR, "cachedb-bench: worker $w produced no results\n");
+		continue;
+	}
+	foreach ($res['lat'] as $op => $samples) {
+		$lat[$op] = isset($lat[$op]) ? array_merge($lat[$op], $samples) : $samples;
+	}
+	foreach ($res['outcomes'] as $outcome => $n) {
+		$outcomes[$outcome] = (isset($outcomes[$outcome]) ? $outcomes[$outcome] : 0) + $n;
+	}
+	$ops       += $res['ops'];
+	$written   += $res['written'];
+	$committed += $res['committed'];
+}
+/* }}} */
+
+/* {{{ Report */
+function percentile($sorted, $p) {
+	return $sorted ? $sorted[min(count($sorted) - 1, (int) floor($p * count($sorted)))] : 0;
+}
+
+clearstatcache();
+printf("DB:          %s (%s, %d bytes at end)\n", $dbname, $binary ? 'binary' : 'serialized', @filesize($dbname));
+printf("Workload:    %d procs x %d requests x %d lookups, %d keys, add ratio %.2f, values %s\n",
+       $procs, $requests, $lookups, $keys, $add_ratio, $values);
+printf("Throughput:  %d ops in %.2fs = %.0f ops/s\n\n", $ops, $elapsed, $elapsed ? $ops / $elapsed : 0);
+
+printf("%-8s %10s %12s %12s\n", 'op', 'count', 'p50 (us)', 'p99 (us)');
+foreach ($lat as $op => $samples) {
+	sort($samples);
+	printf("%-8s %10d %12.1f %12.1f\n", $op, count($samples), 
+	       1e6 * percentile($samples, 0.5), 1e6 * percentile($samples, 0.99));
+}
+
+$commits = (isset($outcomes['published']) ? $outcomes['published'] : 0) + 
+           (isset($outcomes['discarded']) ? $outcomes['discarded'] : 0) +
+           (isset($outcomes['failed'])    ? $outcomes['failed']    : 0);
+printf("\nCommits:     %d attempted", $commits);
+foreach ($outcomes as $outcome => $n) {
+	printf(", %d %s", $n, $outcome);
+}
+printf("\nWin rate:    %.1f%%\n", $commits ? 100 * (isset($outcomes['published']) ? $outcomes['published'] : 0) / $commits : 0);
+printf("Written:     %.0f bytes per committed record\n", $committed ? $written / $committed : 0);
+/* }}} */
+
+if (!isset($opts['keep'])) {
+	@unlink($dbname);
+}
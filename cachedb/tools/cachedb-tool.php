@@ -0,0 +1,352 @@
+<?php
+/*
+   +----------------------------------------------------------------------+
+   | PHP Version 5                                                        |
+   +----------------------------------------------------------------------+
+   | Copyright (c) 1997-2012 The PHP Group                                |
+   +----------------------------------------------------------------------+
+   | This source file is subject to version 3.01 of the PHP license,      |
+   | that is bundled with this package in the file LICENSE, and is        |
+   | available through the world-wide-web at the following url:           |
+   | http://www.php.net/license/3_01.txt                                  |
+   | If you did not receive a copy of the PHP license and are unable to   |
+   | obtain it through the world-wide-web, please send a note to          |
+   | license@php.net so we can mail you a copy immediately.               |
+   +----------------------------------------------------------------------+
+   | Author: Terry Ellison <Terry@ellisonsorg.uk>                         |
+   +----------------------------------------------------------------------+
+ */
+
+/* 
+ * cachedb-tool: offline inspection and compaction of cachedb files, for use in deploy scripts.
+ *
+ *   php cachedb-tool.php info    <db>          header, trailer and space summary
+ *   php cachedb-tool.php list    <db>          one line per record: offsets, sizes and expiry
+ *   php cachedb-tool.php verify  <db>          check the footer, index CRC and all record CRCs
+ *   php cachedb-tool.php compact <db> [<out>]  rewrite the live records into a new DB, dropping 
+ *                                              expired records and adding any missing trailer 
+ *                                              sections; the DB is replaced if <out> is omitted
+ *
+ * The info, list and verify commands parse the file directly, so they don't need the extension and
+ * can be run on a file which the extension would reject.  They assume the file was written on a 
+ * 64-bit little-endian host, as the header lengths are native size_t values.  The compact command
+ * uses the extension, so the rewritten DB is produced by exactly the same code as a commit.
+ *
+ * The exit status is 0 on success, 1 if verify finds a problem and 2 on a usage or I/O error.
+ */
+
+define('CACHEDB_HEADER_LENGTH',  24);
+define('CACHEDB_FOOTER_LENGTH',  16);
+define('CACHEDB_SECTION_BLOOM',  1);
+define('CACHEDB_SECTION_CRC',    2);
+define('CACHEDB_SECTION_DENSE',  3);
+define('CACHEDB_SECTION_PAGED',  4);
+define('CACHEDB_SECTION_POSTINGS', 5);
+
+function usage($msg = NULL) {
+	if ($msg) {
+		fwrite(STDERR, "cachedb-tool: $msg\n");
+	}
+	fwrite(STDERR, "Usage: cachedb-tool.php info|list|verify <db>\n" .
+	               "       cachedb-tool.php compact <db> [<out>]\n");
+	exit(2);
+}
+
+/* {{{ File parsing */
+function u64($s, $offset) {
+	$v = unpack('Vlo/Vhi', substr($s, $offset, 8));
+	return $v['lo'] + $v['hi'] * 4294967296;
+}
+
+/* Parse a DB file into an array describing its header, index, records and trailer sections.  Any
+ * structural problems are returned in the 'errors' element rather than aborting the parse. */
+function cachedb_parse($file) {
+	if (($data = @file_get_contents($file)) === FALSE) {
+		usage("cannot read $file");
+	}
+	$db = array('file' => $file, 'size' => strlen($data), 'errors' => array(), 'records' => array(),
+	            'sections' => array(), 'index_crc' => NULL, 'crcs' => NULL, 'indexed' => array());
+
+	if (strlen($data) < CACHEDB_HEADER_LENGTH) {
+		$db['errors'][] = "file is too short for a header";
+		return $db;
+	}
+	$db['fingerprint'] = substr($data, 0, 8);
+	$db['index_zlen']  = u64($data, 8);
+	$db['index_len']   = u64($data, 16);
+	$db['has_trailer'] = ($db['fingerprint'] == 'cachedb+');
+	if (!$db['has_trailer'] && $db['fingerprint'] != 'cachedb-') {
+		$db['errors'][] = "invalid fingerprint";
+		return $db;
+	}
+
+	/* Locate the trailer from the footer */
+	$db['records_end'] = $db['size'];
+	if ($db['has_trailer']) {
+		$footer_start = $db['size'] - CACHEDB_FOOTER_LENGTH;
+		$trailer_len  = ($footer_start > 0) ? u64($data, $footer_start) : -1;
+		if ($footer_start < CACHEDB_HEADER_LENGTH || substr($data, $footer_start + 8, 8) != 'cachedb+' ||
+		    $trailer_len > $footer_start - CACHEDB_HEADER_LENGTH) {
+			$db['errors'][] = "missing or invalid footer (truncated file?)";
+			return $db;
+		}
+		$db['records_end'] = $footer_start - $trailer_len;
+		for ($p = $db['records_end']; $p + 16 <= $footer_start; $p += 16 + $section['length']) {
+			$section = unpack('Vtag/Vparam', substr($data, $p, 8));
+			$section['length'] = u64($data, $p + 8);
+			$section['offset'] = $p + 16;
+			$db['sections'][]  = $section;
+			if ($section['tag'] == CACHEDB_SECTION_CRC) {
+				$db['index_crc'] = $section['param'];
+				$db['crcs']      = array_values(unpack('V*', substr($data, $p + 16, $section['length'])));
+			} elseif ($section['tag'] == CACHEDB_SECTION_POSTINGS) {
+				$names    = unpack('Vlength/Vcrc', substr($data, $p + 24, 8));
+				$postings = @unserialize(@gzuncompress(substr($data, $p + 32 + $names['length'], 
+				                                              $section['length'] - 16 - $names['length'])));
+				if (is_array($postings)) {
+					$db['indexed'] = array_keys($postings);
+				} else {
+					$db['indexed'] = explode("\0", rtrim(substr($data, $p + 32, $names['length']), "\0"));
+					$db['errors'][] = "metadata postings cannot be decoded";
+				}
+			}
+		}
+	}
+
+	/* Load the index and derive the record offsets */
+	$zindex = substr($data, CACHEDB_HEADER_LENGTH, $db['index_zlen']);
+	$db['index_zdata'] = $zindex;
+	$index = @unserialize(@gzuncompress($zindex));
+	if (!is_array($index)) {
+		$db['errors'][] = "index cannot be decoded";
+		return $db;
+	}
+	$offset = CACHEDB_HEADER_LENGTH + $db['index_zlen'];
+	$now    = time();
+	foreach (array_values($index) as $ndx => $entry) {
+		$db['records'][] = array(
+			'ndx'     => $ndx,
+			'key'     => $entry[0],
+			'offset'  => $offset,
+			'zlen'    => $entry[1],
+			'len'     => $entry[2],
+			'meta'    => isset($entry[3]) ? $entry[3] : NULL,
+			'expires' => isset($entry[4]) ? $entry[4] : 0,
+			'expired' => isset($entry[4]) && $entry[4] > 0 && $entry[4] <= $now,
+			'data'    => substr($data, $offset, $entry[1]),
+		);
+		$offset += $entry[1];
+	}
+	if ($offset != $db['records_end']) {
+		$db['errors'][] = sprintf("records end at %d but the %s starts at %d", $offset, 
+		                          $db['has_trailer'] ? 'trailer' : 'end of file', $db['records_end']);
+	}
+
+	/* A DB is binary if its records are stored uncompressed, i.e. zlen == len and not zlib data */
+	$db['is_binary'] = FALSE;
+	foreach ($db['records'] as $rec) {
+		$db['is_binary'] = ($rec['zlen'] == $rec['len'] && @gzuncompress($rec['data']) === FALSE);
+		break;
+	}
+	return $db;
+}
+/* }}} */
+
+/* {{{ CRC32C, using the hash extension where it supports it */
+function crc32c($s) {
+	static $table = NULL, $native = NULL;
+
+	if ($native === NULL) {
+		$native = in_array('crc32c', hash_algos());
+	}
+	if ($native) {
+		return hexdec(hash('crc32c', $s));
+	}
+	if ($table === NULL) {
+		for ($i = 0; $i < 256; $i++) {
+			for ($c = $i, $k = 0; $k < 8; $k++) {
+				$c = ($c & 1) ? (($c >> 1) & 0x7fffffff) ^ 0x82f63b78 : ($c >> 1) & 0x7fffffff;
+			}
+			$table[$i] = $c;
+		}
+	}
+	$crc = 0xffffffff;
+	for ($i = 0, $n = strlen($s); $i < $n; $i++) {
+		$crc = $table[($crc ^ ord($s[$i])) & 0xff] ^ (($crc >> 8) & 0x00ffffff);
+	}
+	return ($crc ^ 0xffffffff) & 0xffffffff;
+}
+/* }}} */
+
+/* {{{ Commands */
+function cmd_info($db) {
+	$live = $dead = $zlive = $lenlive = 0;
+	$expired = 0;
+	foreach ($db['records'] as $rec) {
+		if ($rec['expired']) {
+			$expired++;
+			$dead += $rec['zlen'];
+		} else {
+			$live++;
+			$zlive   += $rec['zlen'];
+			$lenlive += $rec['len'];
+		}
+	}
+	$data_bytes = $zlive + $dead;
+
+	printf("File:              %s\n", $db['file']);
+	printf("Size:              %d bytes\n", $db['size']);
+	printf("Format:            %s\n", $db['has_trailer'] ? 'cachedb+ (v2, with trailer)' : 'cachedb- (v1)');
+	printf("Record encoding:   %s\n", $db['is_binary'] ? 'binary' : 'serialized + zlib');
+	printf("Index:             %d bytes compressed, %d uncompressed\n", $db['index_zlen'], $db['index_len']);
+	printf("Records:           %d live, %d expired\n", $live, $expired);
+	printf("Record data:       %d bytes stored, %d bytes logical\n", $zlive, $lenlive);
+	printf("Compression ratio: %.2f\n", $zlive ? $lenlive / $zlive : 1.0);
+	printf("Dead space:        %d bytes (%.1f%% of record data)\n", $dead, $data_bytes ? 100 * $dead / $data_bytes : 0);
+
+	/* Fragmentation is the number of breaks in the runs of live records, i.e. the number of extra
+	 * seeks a reader scanning the live records in index order would make */
+	$runs = 0;
+	$in_run = FALSE;
+	foreach ($db['records'] as $rec) {
+		if (!$rec['expired'] && !$in_run) {
+			$runs++;
+		}
+		$in_run = !$rec['expired'];
+	}
+	printf("Fragmentation:     %d live record runs\n", $runs);
+
+	foreach ($db['sections'] as $section) {
+		switch ($section['tag']) {
+			case CACHEDB_SECTION_BLOOM:
+				printf("Trailer section:   Bloom filter, %d bits, %d hashes\n", $section['length'] * 8, $section['param']);
+				break;
+			case CACHEDB_SECTION_CRC:
+				printf("Trailer section:   CRC32C, index CRC %08x, %d record CRCs\n", $section['param'], $section['length'] / 4);
+				break;
+			case CACHEDB_SECTION_DENSE:
+				printf("Trailer section:   integer mode slots, %d ids, %d records\n", $section['length'] / 24, $section['param']);
+				break;
+			case CACHEDB_SECTION_POSTINGS:
+				printf("Trailer section:   metadata postings for %s, %d bytes\n", implode(', ', $db['indexed']), $section['length']);
+				break;
+			case CACHEDB_SECTION_PAGED:
+				printf("Trailer section:   paged index, %d levels, %d bytes\n", $section['param'] + 1, $section['length']);
+				break;
+			default:
+				printf("Trailer section:   unknown tag %d, %d bytes\n", $section['tag'], $section['length']);
+		}
+	}
+	return 0;
+}
+
+function cmd_list($db) {
+	printf("%6s %12s %10s %10s %6s %10s  %s\n", 'ndx', 'offset', 'zlen', 'len', 'ratio', 'expires', 'key');
+	foreach ($db['records'] as $rec) {
+		printf("%6d %12d %10d %10d %6.2f %10s  %s\n", $rec['ndx'], $rec['offset'], $rec['zlen'], $rec['len'],
+		       $rec['zlen'] ? $rec['len'] / $rec['zlen'] : 1.0, 
+		       $rec['expires'] ? ($rec['expired'] ? 'expired' : $rec['expires'] - time()) : '-', $rec['key']);
+	}
+	return 0;
+}
+
+function cmd_verify($db) {
+	$errors = 0;
+
+	if ($db['crcs'] === NULL) {
+		echo "No CRC section: only the record encoding can be checked\n";
+	} else {
+		if (crc32c($db['index_zdata']) != $db['index_crc']) {
+			echo "Index CRC mismatch\n";
+			$errors++;
+		}
+		if (count($db['crcs']) != count($db['records'])) {
+			printf("CRC section has %d entries for %d records\n", count($db['crcs']), count($db['records']));
+			$errors++;
+		}
+	}
+
+	foreach ($db['records'] as $rec) {
+		if (isset($db['crcs'][$rec['ndx']]) && crc32c($rec['data']) != $db['crcs'][$rec['ndx']]) {
+			printf("Record %d (%s): CRC mismatch\n", $rec['ndx'], $rec['key']);
+			$errors++;
+		} elseif (!$db['is_binary'] && strlen(@gzuncompress($rec['data'])) != $rec['len']) {
+			printf("Record %d (%s): cannot be decompressed\n", $rec['ndx'], $rec['key']);
+			$errors++;
+		}
+	}
+
+	printf("%s: %d records checked, %d errors\n", $db['file'], count($db['records']), $errors);
+	return $errors ? 1 : 0;
+}
+
+function cmd_compact($db, $out) {
+	if (!extension_loaded('cachedb')) {
+		usage("compact requires the cachedb extension");
+	}
+	$binary = $db['is_binary'] ? 'b' : '';
+	$dense  = '';
+	foreach ($db['sections'] as $section) {
+		if ($section['tag'] == CACHEDB_SECTION_DENSE) {
+			$dense = 'i';      /* keep an integer mode DB's dense section */
+		}
+	}
+	$target = $out ? $out : $db['file'] . '.compact';
+	@unlink($target);
+
+	(($in = cachedb_open($db['file'], 'r' . $binary)) !== FALSE) || usage("cannot open {$db['file']}");
+	(($new = cachedb_open($target, 'c' . $binary . $dense)) !== FALSE) || usage("cannot create $target");
+	if ($db['indexed'] && !cachedb_index_metadata($db['indexed'], $new)) {
+		usage("cannot index metadata of $target");
+	}
+
+	$copied = 0;
+	$now    = time();
+	foreach ($db['records'] as $rec) {
+		if ($rec['expired']) {
+			continue;
+		}
+		$metadata = NULL;
+		$value    = cachedb_fetch($rec['key'], $in, $metadata);
+		$ttl      = $rec['expires'] ? max(1, $rec['expires'] - $now) : 0;
+		if ($value === FALSE || !cachedb_add($rec['key'], $value, $new, ($dense ? NULL : $rec['meta']), $ttl)) {
+			usage("cannot copy record {$rec['ndx']} ({$rec['key']})");
+		}
+		$copied++;
+	}
+	cachedb_close($in, 'r');
+	cachedb_close($new) || usage("cannot commit $target");
+
+	if (!$out && !rename($target, $db['file'])) {
+		usage("cannot replace {$db['file']}");
+	}
+	$size = filesize($out ? $out : $db['file']);
+	printf("%s: %d records copied, %d -> %d bytes\n", $out ? $out : $db['file'], $copied, $db['size'], $size);
+	return 0;
+}
+/* }}} */
+
+if (PHP_SAPI != 'cli') {
+	die("cachedb-tool must be run from the command line\n");
+}
+if ($argc < 3) {
+	usage();
+}
+
+$command = $argv[1];
+$db      = cachedb_parse($argv[2]);
+
+foreach ($db['errors'] as $error) {
+	fwrite(STDERR, "{$argv[2]}: $error\n");
+}
+if ($db['errors'] && $command != 'info') {
+	exit($command == 'verify' ? 1 : 2);
+}
+
+switch ($command) {
+	case 'info':    exit(cmd_info($db));
+	case 'list':    exit(cmd_list($db));
+	case 'verify':  exit(cmd_verify($db));
+	case 'compact': exit(cmd_compact($db, isset($argv[3]) ? $argv[3] : NULL));
+	default:        usage("unknown command $command");
+}
@@ -56,6 +56,19 @@ if test "$PHP_LPC" != "no"; then
   		[AC_DEFINE([HAVE_VALGRIND_MEMCHECK_H],1, [enable valgrind memchecks])])
   ])
 
+  dnl LZ4 (1.9+ for in-place decompression) and zstd (1.5.4+) are optional compression algos
+  PHP_CHECK_LIBRARY(lz4, LZ4_initStream,
+  [
+    PHP_ADD_LIBRARY(lz4,, LPC_SHARED_LIBADD)
+    AC_DEFINE(HAVE_LPC_LZ4, 1, [Whether LPC supports LZ4 compression])
+  ],[],[])
+  PHP_CHECK_LIBRARY(zstd, ZSTD_decompressionMargin,
+  [
+    PHP_ADD_LIBRARY(zstd,, LPC_SHARED_LIBADD)
+    AC_DEFINE(HAVE_LPC_ZSTD, 1, [Whether LPC supports zstd compression])
+  ],[],[])
+  PHP_SUBST(LPC_SHARED_LIBADD)
+
   lpc_sources="lpc.c php_lpc.c \
                lpc_request.c \
                lpc_copy_class.c \
@@ -65,7 +78,8 @@ if test "$PHP_LPC" != "no"; then
                lpc_hashtable.c \
                lpc_cache.c \
                lpc_debug.c \
-               lpc_pool.c "
+               lpc_pool.c \
+               lpc_shm.c "
 
   PHP_NEW_EXTENSION(lpc, $lpc_sources, $ext_shared,, \\$(LPC_CFLAGS))
   PHP_SUBST(LPC_CFLAGS)
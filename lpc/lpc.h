@@ -168,6 +168,10 @@ ZEND_BEGIN_MODULE_GLOBALS(lpc)
     zend_uint   pool_buffer_size;       /* Shared serial pool buffer size */
     zend_uint   pool_buffer_rec_size;   /* Shared serial pool buffer record size */
     zend_uint   pool_buffer_comp_size;  /* Shared serial pool buffer compressed record size */
+    zend_bool   pool_buffer_expanded;   /* Shared serial pool buffer already holds the expanded
+                                           record */
+    zend_bool   pool_buffer_mapped;     /* Shared serial pool buffer is mapped at pool_base */
+    size_t      pool_base;              /* preferred address of the pool buffer, 0 = none */
     zend_llist  exec_pools;             /* Linked list of created exec pools */
     zend_bool   force_cache_delete;     /* Flag that the file D/B is to be deleted and further
                                            loading disabbled */
@@ -180,12 +184,23 @@ ZEND_BEGIN_MODULE_GLOBALS(lpc)
     zend_uint   debug_flags;            /* flags to allow run-time selective dump output */
     zend_uint   storage_quantum;        /* quantum for pool buffer allocation */
     zend_bool   reuse_serial_buffer;    /* if true then the serial buffer persists over the request */
-    zend_uint   compression_algo;       /* 0 = none; 1 = RLE; 2 = GZ */
-    JMP_BUF    *bailout;                /* used to sentence known throws from bailouts */
+    zend_uint   compression_algo;       /* 0 = none; 1 = zero-run; 2 = GZ; 3 = LZ4; 4 = ZSTD */
+    zend_uint   zstd_dict_max;          /* maximum size of a trained zstd dictionary, 0 = none */
+    zend_uchar *zstd_dict;              /* the cache-wide zstd dictionary, or NULL */
+    zend_uint   zstd_dict_size;         /* ... and its size */
+    void       *zstd_cdict;             /* zstd digested dictionaries and contexts, */
+    void       *zstd_ddict;             /* created on first use */
+    void       *zstd_cctx;
+    void       *zstd_dctx;
     HashTable   intern_hash;            /* used to create interned strings */
     zend_uchar **interns;               /* used on copy-in and out, array of LPC interns[]  */
     uint        intern_cnt;             /* used on copy-in and out, count of LPC interns[]  */
     php_stream *opcode_logger;          /* used for debug logging */
+    zend_uint   shm_size;               /* size of the shared memory module cache, 0 = disabled */
+    char       *shm_dir;                /* directory holding the shared memory segment file */
+    zend_uint   persistent_size;        /* maximum size of the retained records, 0 = disabled */
+    zend_uint   persistent_used;        /* size of the retained records */
+    HashTable  *persistent_caches;      /* persistent cache indexes which survive the request */
 
 ZEND_END_MODULE_GLOBALS(lpc)
 
@@ -257,32 +272,6 @@ extern int lpc_reserved_offset;
 #  define LPC_MAX_OPCODE     150
 # endif
 
-/*
- * The LPC bailout macros are effectively cloned from the Zend equivalents.  The Zend bailout 
- * macros resets the execution status and execution context, but in the LPC case for pool overflow, 
- * the code makes a soft recovery that enables execution to continue. 
- */ 
-#define lpc_try \
-    { \
-        JMP_BUF *__orig_bailout = LPCG(bailout); \
-        JMP_BUF  __bailout; \
-        int      __jump_status; \
-        LPCG(bailout) = &__bailout; \
-        __jump_status = SETJMP(__bailout); \
-        if (__jump_status==0) { 
-#define lpc_catch \
-	    } else if (__jump_status==1) { \
-            LPCG(bailout) = __orig_bailout;
-#define lpc_end_try() \
-	    } else { \
-            LPCG(bailout) = __orig_bailout; \
-            zend_throw(); \
-        } \
-	    LPCG(bailout) = __orig_bailout; \
-    }
-#define lpc_throw_storage_overflow()	LONGJMP(*LPCG(bailout), 1)
-
-
 /* {{{ lpc_vm_get_opcode_handler
        This is a copy of Zend/zend_vm_execute.c:zend_vm_get_opcode_handler() */
 #define _LPC_CONST_CODE  0
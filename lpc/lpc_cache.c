@@ -30,16 +30,60 @@
 #include "lpc_cache.h"
 #include "lpc_pool.h"
 #include "lpc_request.h"
+#include "lpc_shm.h"
 
 typedef struct _cachedb_t cachedb_t, *cachedb_pt;
 
-/* {{{ private struct definitions: lpc_cache_t */
+/* {{{ private struct definitions: lpc_cache_t, lpc_index_entry_t and lpc_cache_persist_t */
+typedef struct _lpc_cache_persist_t lpc_cache_persist_t;
+
 struct _lpc_cache_t {
     cachedb_t           *db;           /* CacheDB database to be used to hold the filesysten copy */
-    HashTable           *index;        /* Local index array of filename=>array(...) */
+    HashTable           *index;        /* Local index array of filename=>lpc_index_entry_t */
+    lpc_cache_persist_t *persist;      /* Persistent index in use, or NULL */
     time_t               mtime;        /* mtime of the cache */
     off_t                filesize;
     lpc_request_context_t *context;
+    HashTable           *pending;      /* filename=>lpc_pending_entry_t held for dictionary training */
+    zend_uint            pending_algo; /* the compression algo to restore once training is done */
+    zend_uchar          *dict;         /* non-persistent zstd dictionary, or NULL */
+};
+
+typedef struct _lpc_index_entry_t {
+    zend_uint            length;       /* compressed record length */
+    time_t               mtime;        /* mtime of the module */
+    size_t               filesize;     /* filesize of the module */
+    zend_uint            pool_length;  /* uncompressed record length */
+    zend_uchar          *image;        /* expanded record retained in a persistent index or NULL */
+} lpc_index_entry_t;
+
+typedef struct _lpc_pending_entry_t {
+    time_t               mtime;        /* mtime of the module */
+    size_t               filesize;     /* filesize of the module */
+    zend_uint            pool_length;  /* uncompressed record length */
+    zend_uchar          *image;        /* emalloced copy of the uncompressed record */
+} lpc_pending_entry_t;
+
+/*
+ * In persistent mode (lpc.persistent_size > 0), the parsed index and the expanded records are kept
+ * in malloced storage across requests, one persistent index per cache file.  This is revalidated
+ * on each request by a single stat of the cache file, and the CacheDB is then only opened if a
+ * record needs to be read from or added to the file.
+ */
+struct _lpc_cache_persist_t {
+    char                *cachedb_fullpath;
+    char                *request_fullpath; /* the request context that the index was validated */
+    time_t               request_mtime;    /* against */
+    size_t               request_filesize;
+    time_t               mtime;        /* mtime, size and inode of the cache file when loaded; */
+    off_t                filesize;     /* mtime is zeroed to force a reload */
+    ino_t                inode;
+    zend_uint            compression_algo;
+    zend_uint            max_len;
+    zend_uint            images_size;  /* total size of the retained images */
+    zend_uchar          *dict;         /* malloced zstd dictionary, or NULL */
+    zend_uint            dict_size;
+    HashTable            index;        /* persistent filename=>lpc_index_entry_t */
 };
 /* }}} */
 
@@ -87,16 +131,318 @@ static struct _cachedb {
 #define CHECK(p) if(!(p)) goto error;
 /* }}} */
 
+/* {{{ Persistent index helpers */
+/* {{{ index_entry_dtor */
+static void index_entry_dtor(void *p)
+{
+    lpc_index_entry_t *ie = (lpc_index_entry_t *) p;
+    if (ie->image) {
+        free(ie->image);
+    }
+}
+/* }}} */
+
+/* {{{ persist_dtor */
+static void persist_dtor(void *p)
+{
+    lpc_cache_persist_t *persist = *(lpc_cache_persist_t **) p;
+    zend_hash_destroy(&persist->index);
+    if (persist->dict) {
+        free(persist->dict);
+    }
+    free(persist->cachedb_fullpath);
+    free(persist->request_fullpath);
+    free(persist);
+}
+/* }}} */
+
+/* {{{ persist_find
+       Return the persistent index for the cache if it is still current, otherwise NULL */
+static lpc_cache_persist_t *persist_find(lpc_request_context_t *r_cxt, struct stat *sb TSRMLS_DC)
+{ENTER(persist_find)
+    HashTable            *caches = LPCG(persistent_caches);
+    lpc_cache_persist_t **ppersist, *persist;
+    char                 *cachedb_fullpath = r_cxt->cachedb_fullpath;
+    uint                  cachedb_fullpath_length = strlen(cachedb_fullpath);
+
+    if (!caches || hash_find(caches, cachedb_fullpath, ppersist) == FAILURE) {
+        return NULL;
+    }
+    persist = *ppersist;
+    if (persist->mtime == sb->st_mtime && persist->filesize == sb->st_size &&
+        persist->inode == sb->st_ino &&
+        persist->request_mtime == r_cxt->request_mtime &&
+        persist->request_filesize == r_cxt->request_filesize &&
+        !strcmp(persist->request_fullpath, r_cxt->request_fullpath)) {
+        return persist;
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ persist_create */
+static lpc_cache_persist_t *persist_create(lpc_request_context_t *r_cxt, struct stat *sb, 
+                                           uint size)
+{ENTER(persist_create)
+    lpc_cache_persist_t *persist = calloc(1, sizeof(lpc_cache_persist_t));
+
+    if (!persist) {
+        return NULL;
+    }
+    persist->cachedb_fullpath = strdup(r_cxt->cachedb_fullpath);
+    persist->request_fullpath = strdup(r_cxt->request_fullpath);
+    persist->request_mtime    = r_cxt->request_mtime;
+    persist->request_filesize = r_cxt->request_filesize;
+    persist->mtime            = sb->st_mtime;
+    persist->filesize         = sb->st_size;
+    persist->inode            = sb->st_ino;
+    zend_hash_init(&persist->index, size, NULL, index_entry_dtor, 1);
+    return persist;
+}
+/* }}} */
+
+/* {{{ persist_install
+       Add a new persistent index to the process list, replacing any previous version for the same
+       cache.  Images of any unchanged records are carried over from the previous version. */
+static void persist_install(lpc_cache_persist_t *persist TSRMLS_DC)
+{ENTER(persist_install)
+    HashTable            *caches = LPCG(persistent_caches);
+    lpc_cache_persist_t **pold, *old;
+    lpc_index_entry_t    *ie, *old_ie;
+    char                 *cachedb_fullpath = persist->cachedb_fullpath;
+    uint                  cachedb_fullpath_length = strlen(cachedb_fullpath);
+
+    if (!caches) {
+        caches = LPCG(persistent_caches) = malloc(sizeof(HashTable));
+        zend_hash_init(caches, 8, NULL, persist_dtor, 1);
+    }
+
+    if (hash_find(caches, cachedb_fullpath, pold) == SUCCESS) {
+        char *filename;
+        uint  filename_length;
+        ulong dummy;
+
+        old = *pold;
+        for (hash_reset(&persist->index); hash_get(&persist->index, ie) == SUCCESS; 
+             hash_next(&persist->index)) {
+            hash_key(&persist->index, filename, dummy);
+            if (zend_hash_find(&old->index, filename, filename_length, (void **) &old_ie) == SUCCESS &&
+                old_ie->image && old_ie->length == ie->length && old_ie->mtime == ie->mtime &&
+                old_ie->filesize == ie->filesize && old_ie->pool_length == ie->pool_length) {
+                ie->image            = old_ie->image;
+                old_ie->image        = NULL;
+                old->images_size    -= ie->pool_length;
+                persist->images_size+= ie->pool_length;
+            }
+        }
+        LPCG(persistent_used) -= old->images_size;   /* the remaining old images are freed */
+    }
+
+    zend_hash_update(caches, cachedb_fullpath, cachedb_fullpath_length+1, 
+                     &persist, sizeof(lpc_cache_persist_t *), NULL);
+}
+/* }}} */
+
+/* {{{ lpc_cache_free_persistent
+       Called from the globals DTOR to free any persistent indexes */
+void lpc_cache_free_persistent(HashTable **caches)
+{
+    if (*caches) {
+        zend_hash_destroy(*caches);
+        free(*caches);
+        *caches = NULL;
+    }
+}
+/* }}} */
+
+/* {{{ cache_open_db
+       In persistent mode, the CacheDB is only opened when first needed */
+static int cache_open_db(lpc_cache_t *cache TSRMLS_DC)
+{
+    char *cachedb_fullpath = cache->context->cachedb_fullpath;
+
+    if (cache->db) {
+        return SUCCESS;
+    }
+    return cachedb_open(&cache->db, cachedb_fullpath, strlen(cachedb_fullpath), "wb");
+}
+/* }}} */
+/* }}} */
+
+/* {{{ Context record and zstd dictionary helpers */
+/* {{{ cache_add_context
+       Add the cache context record.  Its payload is the zstd dictionary if the cache has one, and 
+       otherwise a dummy int, as cachedb currently doesn't support 0 length records */
+static int cache_add_context(lpc_cache_t *cache, zend_uchar *dict, zend_uint dict_size TSRMLS_DC)
+{ENTER(cache_add_context)
+    lpc_request_context_t *r_cxt = cache->context;
+    zval  zpayload, *zctxt_metadata;
+    int   dummy = 0, status;
+    char  context_key[] = "_ context _";
+
+    INIT_ZVAL(zpayload);
+    if (dict_size) {
+        ZVAL_STRINGL(&zpayload, (char *) dict, dict_size, 0);
+    } else {
+        ZVAL_STRINGL(&zpayload, (char *) &dummy, sizeof(dummy), 0);
+    }
+
+    MAKE_STD_ZVAL(zctxt_metadata);
+    array_init_size(zctxt_metadata, 7);
+    add_next_index_string(zctxt_metadata, r_cxt->PHP_version, 1);
+    add_next_index_string(zctxt_metadata, r_cxt->request_dir, 1);
+    add_next_index_string(zctxt_metadata, r_cxt->request_basename, 1);
+    add_next_index_long(zctxt_metadata, r_cxt->request_mtime);
+    add_next_index_long(zctxt_metadata, r_cxt->request_filesize);
+    add_next_index_long(zctxt_metadata, LPCG(compression_algo));
+    add_next_index_long(zctxt_metadata, LPC_SERIAL_FORMAT);
+
+    status = cachedb_add(cache->db, context_key, sizeof(context_key)-1, &zpayload, zctxt_metadata);
+
+    /* No DTOR for the payload zval as this doesn't own its string */
+
+    if (!Z_DELREF_P(zctxt_metadata)) {
+        zval_dtor(zctxt_metadata);
+        FREE_ZVAL(zctxt_metadata);
+    }
+    return status;
+}
+/* }}} */
+
+/* {{{ cache_load_dict
+       Read the zstd dictionary held as the context record payload into malloced storage, so that
+       it can be retained by a persistent index.  Returns NULL on failure. */
+static zend_uchar *cache_load_dict(lpc_cache_t *cache, zend_uint dict_size TSRMLS_DC)
+{ENTER(cache_load_dict)
+    zend_uchar *dict = malloc(dict_size);
+    zval        db_rec;
+    char        context_key[] = "_ context _";
+
+    CHECK(dict);
+    CHECK(cachedb_find(cache->db, context_key, sizeof(context_key)-1, 0) == SUCCESS);
+
+    INIT_ZVAL(db_rec); ZVAL_STRINGL(&db_rec, (char *) dict, dict_size, 0);
+
+    CHECK(cachedb_fetch(cache->db, &db_rec) == SUCCESS && Z_STRLEN(db_rec) == dict_size);
+    DEBUG1(LOAD, "zstd dictionary of %u bytes loaded", dict_size);
+    return dict;
+
+error:
+    if (dict) {
+        free(dict);
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ pending_entry_dtor */
+static void pending_entry_dtor(void *p)
+{
+    efree(((lpc_pending_entry_t *) p)->image);
+}
+/* }}} */
+
+/* {{{ cache_flush_pending
+       Called at request shutdown for a new zstd cache.  The modules compiled during the request
+       have been held uncompressed, so train the cache-wide dictionary over them, write the context
+       record carrying it, and then compress and add each module using the dictionary. */
+static void cache_flush_pending(lpc_cache_t *cache TSRMLS_DC)
+{ENTER(cache_flush_pending)
+    HashTable           *pending   = cache->pending;
+    size_t               max_total = (size_t) LPCG(zstd_dict_max) * 100;
+    size_t               total     = 0, *sample_sizes;
+    zend_uchar          *samples, *dict;
+    zend_uint            n = 0, dict_size = 0;
+    lpc_pending_entry_t *pe;
+    char                *filename;
+    uint                 filename_length;
+    ulong                dummy;
+   /*
+    * Concatenate the sample images for the trainer.  Training time grows with the sample volume,
+    * so this is capped at ~100 times the dictionary size, which is zstd's own recommended ratio.
+    */
+    for (hash_reset(pending); hash_get(pending, pe) == SUCCESS; hash_next(pending)) {
+        if (total + pe->pool_length <= max_total) {
+            total += pe->pool_length;
+        }
+    }
+    samples      = emalloc(total + 1);
+    sample_sizes = emalloc((hash_count(pending) + 1) * sizeof(size_t));
+    for (total = 0, hash_reset(pending); hash_get(pending, pe) == SUCCESS; hash_next(pending)) {
+        if (total + pe->pool_length <= max_total) {
+            memcpy(samples + total, pe->image, pe->pool_length);
+            total += sample_sizes[n++] = pe->pool_length;
+        }
+    }
+
+    LPCG(compression_algo) = cache->pending_algo;
+    dict = malloc(LPCG(zstd_dict_max));
+    if (dict && n) {
+        dict_size = lpc_pool_train_dict(dict, LPCG(zstd_dict_max), samples, 
+                                        sample_sizes, n TSRMLS_CC);
+    }
+    efree(samples);
+    efree(sample_sizes);
+
+    if (dict_size) {
+        cache->dict = dict;
+        lpc_pool_set_dict(dict, dict_size TSRMLS_CC);
+    } else if (dict) {
+        free(dict);
+    }
+
+    CHECK(cache_add_context(cache, cache->dict, dict_size TSRMLS_CC) == SUCCESS);
+
+    for (hash_reset(pending); hash_get(pending, pe) == SUCCESS; hash_next(pending)) {
+        zval        buffer, *metadata;
+        zend_uchar *record;
+        zend_uint   record_length;
+        int         status;
+
+        hash_key(pending, filename, dummy);
+        record = lpc_pool_compress_image(pe->image, pe->pool_length, &record_length TSRMLS_CC);
+        INIT_ZVAL(buffer); ZVAL_STRINGL(&buffer, (char *) record, record_length, 0);
+
+        MAKE_STD_ZVAL(metadata);
+        array_init_size(metadata, 3);
+        add_next_index_long(metadata, pe->mtime);
+        add_next_index_long(metadata, pe->filesize);
+        add_next_index_long(metadata, (ulong) pe->pool_length);
+
+        status = cachedb_add(cache->db, filename, filename_length-1, &buffer, metadata);
+        efree(record);
+        if(Z_DELREF_P(metadata)==0) {
+            zval_dtor(metadata);
+            efree(metadata);
+        }
+        CHECK(status == SUCCESS);
+    }
+    return;
+
+error:
+   /*
+    * This is at request shutdown, so rather than raise an error, discard the new cache.  The next
+    * request through will then rebuild it.
+    */
+    lpc_warning("Internal failure during write of trained cache %s" TSRMLS_CC, 
+                cache->context->cachedb_fullpath);
+    LPCG(enabled) = 0;
+}
+/* }}} */
+/* }}} */
+
 /* {{{ lpc_cache_create */
 zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
 {ENTER(lpc_cache_create)
     lpc_cache_t           *cache = (lpc_cache_t*) ecalloc(1, sizeof(lpc_cache_t));
-    struct stat           *sb;
+    struct stat           *sb, cache_sb;
     zend_uint              max_len = 0;
     lpc_request_context_t *r_cxt;
+    lpc_cache_persist_t   *persist = NULL;
     zval         **zctxt, *zinfo, **zlist;
     HashTable    *hlist, *hindex;
     char         *dummy;
+    int           have_cache_sb = 0;
 
     if (!cdb._cachedb_open) {
         if ((cdb._cachedb_open  = lpc_resolve_symbol("_cachedb_open" TSRMLS_CC)) &&
@@ -112,6 +458,29 @@ zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
     }
 
     cache->context = r_cxt = LPCG(request_context);
+    sb             = sapi_get_stat(TSRMLS_C);
+    cache->mtime   = sb->st_mtime;
+    cache->filesize= sb->st_size;
+   /*
+    * In persistent mode, a single stat of the cache file validates any persistent index held for
+    * it.  Note that the stat is taken before the CacheDB is opened, so that if the file is replaced
+    * in between, the next request will reload the index rather than use a stale one.
+    */
+    if (LPCG(persistent_size)) {
+        have_cache_sb = (stat(r_cxt->cachedb_fullpath, &cache_sb) == 0);
+        if (have_cache_sb && (persist = persist_find(r_cxt, &cache_sb TSRMLS_CC)) != NULL) {
+            cache->persist         = persist;
+            cache->index           = &persist->index;
+            LPCG(compression_algo) = persist->compression_algo;
+            LPCG(lpc_cache)        = cache;
+            if (persist->dict) {
+                lpc_pool_set_dict(persist->dict, persist->dict_size TSRMLS_CC);
+            }
+            *max_module_len        = persist->max_len;
+            DEBUG1(LOAD, "Persistent index for %s reused", r_cxt->cachedb_fullpath);
+            return SUCCESS;
+        }
+    }
 
     /* Open the CacheDB using the cache name and obtain the directory info */
     CHECK(cachedb_open(&cache->db, r_cxt->cachedb_fullpath,
@@ -123,20 +492,22 @@ zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
     hash_get_first_zv(Z_ARRVAL_P(zinfo), zlist);
     hlist = Z_ARRVAL_PP(zlist);
 
-    hindex = emalloc(sizeof(HashTable));
-    hash_init(hindex, hash_count(hlist));
-
     if( hash_count(hlist) > 0 ) {
        /*
         * The cache files exists. Get the 1st entry, the cache context record and validate that the
         * cache context is still valid. Note that this record is a funny in that the record payload
-        * is a dummy and all of the material content is in the metadata fields. The compression algo
-        * is cached as this persists for the life of the cache.
+        * is a dummy (or the zstd dictionary) and all of the material content is in the metadata 
+        * fields. The compression algo is cached as this persists for the life of the cache.
         */
-        zval **zcontext, **zctxt_metadata, **zPHP_version, **zdir, **zbasename, **zmtime, 
-             **zfilesize, **zcomp_algo, **zle, *zie; 
+        zval **zcontext, **zctxt_len, **zctxt_metadata, **zPHP_version, **zdir, **zbasename, 
+             **zmtime, **zfilesize, **zcomp_algo, **zformat = NULL, **zle; 
+        zend_uchar *dict = NULL;
+        zend_uint   dict_size = 0;
  
         hash_get_first_zv(hlist, zcontext);
+        hash_get_first_zv(Z_ARRVAL_PP(zcontext), zctxt_len);       /* skip filename and zzlen */
+        hash_get_next_zv(Z_ARRVAL_PP(zcontext), zctxt_len);
+        hash_get_next_zv(Z_ARRVAL_PP(zcontext), zctxt_len);
         hash_get_last_zv(Z_ARRVAL_PP(zcontext),  zctxt_metadata);
 
         hash_get_first_zv(Z_ARRVAL_PP(zctxt_metadata),zPHP_version);
@@ -145,22 +516,40 @@ zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
         hash_get_next_zv(Z_ARRVAL_PP(zctxt_metadata),zmtime);
         hash_get_next_zv(Z_ARRVAL_PP(zctxt_metadata),zfilesize);
         hash_get_next_zv(Z_ARRVAL_PP(zctxt_metadata),zcomp_algo);
+        if (hash_count(Z_ARRVAL_PP(zctxt_metadata)) > 6) {
+            hash_get_next_zv(Z_ARRVAL_PP(zctxt_metadata),zformat);
+        }
 
         if (!strcmp(Z_STRVAL_PP(zPHP_version), r_cxt->PHP_version) &&
             !strcmp(Z_STRVAL_PP(zdir), r_cxt->request_dir) &&
             !strcmp(Z_STRVAL_PP(zbasename), r_cxt->request_basename) &&
             Z_LVAL_PP(zmtime) == r_cxt->request_mtime &&
             Z_LVAL_PP(zfilesize) == r_cxt->request_filesize &&
-            !r_cxt->clear_flag_set) {
+            zformat && Z_LVAL_PP(zformat) == LPC_SERIAL_FORMAT &&
+            lpc_pool_compression_supported(Z_LVAL_PP(zcomp_algo)) &&
+            !r_cxt->clear_flag_set &&
+            (Z_LVAL_PP(zcomp_algo) != 4 || Z_LVAL_PP(zctxt_len) <= (long) sizeof(int) ||
+             (dict = cache_load_dict(cache, dict_size = Z_LVAL_PP(zctxt_len) TSRMLS_CC)) != NULL)) {
            /*
             * The cache is OK to use so loop over the remaining list array setting up zle to
             * enumerate the elements of: 
             *     hlist = array( array(filename, zlen, len, metadata), ... ) 
             * and creating a new 
-            *     index = array( filename=>array(len, mtime, filesize, pool_len), ... ) 
+            *     index = array( filename=>lpc_index_entry_t(len, mtime, filesize, pool_len), ... )
+            * which is a persistent index in persistent mode.  A zstd cache may also carry a trained
+            * dictionary as its context payload, and this has been loaded by the validation check.
             */
+            if (have_cache_sb && 
+                (persist = persist_create(r_cxt, &cache_sb, hash_count(hlist))) != NULL) {
+                hindex = &persist->index;
+            } else {
+                hindex = emalloc(sizeof(HashTable));
+                zend_hash_init(hindex, hash_count(hlist), NULL, NULL, 0);
+            }
+
             for (hash_next(hlist); hash_get(hlist, zle) == SUCCESS; hash_next(hlist)) {
-                zval **zfilename, /* **zzlen, */ **zlen, **zmetadata;
+                zval **zfilename, /* **zzlen, */ **zlen, **zmetadata, **zm;
+                lpc_index_entry_t ie = {0,};
 
                 /* Pick up the len and metadata from the list entry */
                 hash_get_first_zv(Z_ARRVAL_PP(zle), zfilename);
@@ -171,15 +560,33 @@ zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
                 }
                 hash_get_next_zv(Z_ARRVAL_PP(zle),  zmetadata);
 
-                MAKE_STD_ZVAL(zie);
-                array_init_size(zie, 4);
-                add_next_index_long(zie, Z_LVAL_PP(zlen));
-                php_array_merge(Z_ARRVAL_P(zie), Z_ARRVAL_PP(zmetadata), 0 TSRMLS_CC);
+                ie.length = Z_LVAL_PP(zlen);
+                hash_get_first_zv(Z_ARRVAL_PP(zmetadata), zm);
+                ie.mtime = Z_LVAL_PP(zm);
+                hash_get_next_zv(Z_ARRVAL_PP(zmetadata), zm);
+                ie.filesize = Z_LVAL_PP(zm);
+                hash_get_next_zv(Z_ARRVAL_PP(zmetadata), zm);
+                ie.pool_length = Z_LVAL_PP(zm);
 
-                hash_add(hindex,Z_STRVAL_PP(zfilename),zie);
+                zend_hash_add(hindex, Z_STRVAL_PP(zfilename), Z_STRLEN_PP(zfilename)+1, 
+                              &ie, sizeof(lpc_index_entry_t), NULL);
             }
 
             LPCG(compression_algo) = Z_LVAL_PP(zcomp_algo); /* Use the DB ver of the comp algo */
+
+            if (persist) {
+                persist->compression_algo = LPCG(compression_algo);
+                persist->max_len          = max_len;
+                persist->dict             = dict;
+                persist->dict_size        = dict_size;
+                persist_install(persist TSRMLS_CC);
+                cache->persist            = persist;
+            } else {
+                cache->dict               = dict;
+            }
+            if (dict) {
+                lpc_pool_set_dict(dict, dict_size TSRMLS_CC);
+            }
  
         } else {
            /*
@@ -188,7 +595,6 @@ zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
             */
             zval_dtor(zinfo);
             FREE_ZVAL(zinfo);
-            cache->index = hindex;
             LPCG(lpc_cache) = cache;
             lpc_cache_clear(TSRMLS_C);
             lpc_cache_destroy(TSRMLS_C);
@@ -197,32 +603,21 @@ zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
     
     } else {
        /* 
-        * This is a new cache file.  Create the context record and add it to the cache
+        * This is a new cache file.  Create the context record and add it to the cache, except for
+        * a zstd cache with lpc.zstd_dictionary_size set.  Here the modules compiled by this request
+        * are held back uncompressed as the training set for a cache-wide dictionary, and the 
+        * context record and the modules are only written at request shutdown.
         */
-        zval *zctxt_metadata, *zdummy;
-        int dummy = 0;
-        char context_key[] = "_ context _";
-
-        MAKE_STD_ZVAL(zdummy);  /* cachedb currently doesn't support 0 length records */
-        ZVAL_STRINGL(zdummy, (char *) &dummy, sizeof(dummy), 1); 
-
-        MAKE_STD_ZVAL(zctxt_metadata);
-        array_init_size(zctxt_metadata, 5);
-        add_next_index_string(zctxt_metadata, r_cxt->PHP_version, 1);
-        add_next_index_string(zctxt_metadata, r_cxt->request_dir, 1);
-        add_next_index_string(zctxt_metadata, r_cxt->request_basename, 1);
-        add_next_index_long(zctxt_metadata, r_cxt->request_mtime);
-        add_next_index_long(zctxt_metadata, r_cxt->request_filesize);
-        add_next_index_long(zctxt_metadata, LPCG(compression_algo));
-
-        CHECK(cachedb_add(cache->db, context_key, sizeof(context_key)-1, 
-                          zdummy, zctxt_metadata)==SUCCESS);
-        zval_dtor(zdummy);
-        FREE_ZVAL(zdummy);
-
-        if (!Z_DELREF_P(zctxt_metadata)) {
-            zval_dtor(zctxt_metadata);
-            FREE_ZVAL(zctxt_metadata);
+        hindex = emalloc(sizeof(HashTable));
+        zend_hash_init(hindex, 8, NULL, NULL, 0);
+
+        if (LPCG(compression_algo) == 4 && LPCG(zstd_dict_max)) {
+            cache->pending         = emalloc(sizeof(HashTable));
+            zend_hash_init(cache->pending, 8, NULL, pending_entry_dtor, 0);
+            cache->pending_algo    = LPCG(compression_algo);
+            LPCG(compression_algo) = 0;
+        } else {
+            CHECK(cache_add_context(cache, NULL, 0 TSRMLS_CC) == SUCCESS);
         }
     }
 
@@ -232,10 +627,6 @@ zend_bool lpc_cache_create(uint *max_module_len TSRMLS_DC)
     LPCG(lpc_cache) = cache;
     cache->index    = hindex;
 
-    sb              = sapi_get_stat(TSRMLS_C);
-    cache->mtime    = sb->st_mtime;
-    cache->filesize = sb->st_size;
-
     *max_module_len = max_len;
     return SUCCESS;
 
@@ -251,10 +642,18 @@ void lpc_cache_destroy(TSRMLS_D)
 {ENTER(lpc_cache_destroy)
     lpc_cache_t  *cache = LPCG(lpc_cache);
     if (cache) {
-        if (cache->index) {
+        if (cache->index && !cache->persist) {
             zend_hash_destroy(cache->index);
             efree(cache->index);
         }
+
+        if (cache->pending) {
+            if (cache->db && LPCG(enabled)) {
+                cache_flush_pending(cache TSRMLS_CC);
+            }
+            zend_hash_destroy(cache->pending);
+            efree(cache->pending);
+        }
             
         if (cache->db) {
            /*
@@ -263,6 +662,11 @@ void lpc_cache_destroy(TSRMLS_D)
             */ 
             cachedb_close2(cache->db, (LPCG(enabled) ? '*' : 'r'));
         }
+
+        lpc_pool_set_dict(NULL, 0 TSRMLS_CC);
+        if (cache->dict) {
+            free(cache->dict);
+        }
         efree(cache);
         LPCG(lpc_cache) = NULL;
     }
@@ -275,6 +679,9 @@ void lpc_cache_clear(TSRMLS_D)
     lpc_cache_t  *cache = LPCG(lpc_cache);
     if (cache->db) cachedb_close2(cache->db, 'r');
     cache->db = NULL;
+    if (cache->persist) {
+        cache->persist->mtime = 0;   /* force a reload by the next request */
+    }
     remove(cache->context->cachedb_fullpath);
     LPCG(enabled) = 0;
 }
@@ -286,10 +693,28 @@ void lpc_cache_insert(lpc_cache_key_t *key,  zend_uchar *compressed_buffer,
                       zend_uint compressed_length, zend_uint pool_length TSRMLS_DC)
 {ENTER(lpc_cache_insert)
     lpc_cache_t  *cache;
-    char         *zbuf;
-    zval          buffer, *metadata, *index_entry;
+    zval          buffer, *metadata;
+    lpc_index_entry_t ie = {0,};
 
     cache = LPCG(lpc_cache);
+   /*
+    * A new zstd cache that is training its dictionary holds back a copy of the uncompressed record
+    * until request shutdown.  The index isn't updated, so any re-include is simply recompiled.
+    */
+    if (cache->pending) {
+        lpc_pending_entry_t pe;
+
+        pe.mtime       = key->mtime;
+        pe.filesize    = key->filesize;
+        pe.pool_length = pool_length;
+        pe.image       = emalloc(pool_length);
+        memcpy(pe.image, compressed_buffer, pool_length);
+        zend_hash_update(cache->pending, key->filename, key->filename_length+1, 
+                         &pe, sizeof(lpc_pending_entry_t), NULL);
+        return;
+    }
+
+    CHECK(cache_open_db(cache TSRMLS_CC) == SUCCESS);
 
     INIT_ZVAL(buffer); ZVAL_STRINGL(&buffer, compressed_buffer, compressed_length, 0);
 
@@ -305,18 +730,24 @@ void lpc_cache_insert(lpc_cache_key_t *key,  zend_uchar *compressed_buffer,
 
     /* No DTOR for the buffer zval as the compressed_buffer will be cleaned up by the pool DTOR */
 
-    /* Update the cache index with the new entry */
-    MAKE_STD_ZVAL(index_entry);
-    array_init_size(index_entry, 4);
-    add_next_index_long(index_entry, compressed_length);
-    php_array_merge(Z_ARRVAL_P(index_entry), Z_ARRVAL_P(metadata), 0 TSRMLS_CC);
-
     if(Z_DELREF_P(metadata)==0) {
         zval_dtor(metadata);
         efree(metadata);
     }
 
-    hash_add(cache->index, key->filename, index_entry);
+   /*
+    * Update the cache index with the new entry.  A persistent index is also marked for reload by
+    * the next request, as the new entry isn't committed to the cache file until request shutdown.
+    */
+    ie.length      = compressed_length;
+    ie.mtime       = key->mtime;
+    ie.filesize    = key->filesize;
+    ie.pool_length = pool_length;
+    zend_hash_add(cache->index, key->filename, key->filename_length+1, 
+                  &ie, sizeof(lpc_index_entry_t), NULL);
+    if (cache->persist) {
+        cache->persist->mtime = 0;
+    }
     return;
 
 error:
@@ -327,31 +758,70 @@ error:
 /* {{{ lpc_cache_retrieve */
 lpc_pool* 	lpc_cache_retrieve(lpc_cache_key_t *key, void **entry_rec TSRMLS_DC)
 {ENTER(lpc_cache_retrieve)
-    lpc_cache_t *cache = LPCG(lpc_cache);
-    zval       **index_entry, **length, **pool_length, db_rec;
-    zend_uchar  *buffer;
-    zend_uint    compressed_length, uncompressed_length;
-
-    if (hash_find(cache->index, key->filename, index_entry) == FAILURE) {
+    lpc_cache_t       *cache = LPCG(lpc_cache);
+    lpc_index_entry_t *ie;
+    zval               db_rec;
+    zend_uchar        *buffer, *image;
+    zend_uint          compressed_length, uncompressed_length;
+
+    if (zend_hash_find(cache->index, key->filename, key->filename_length+1, 
+                       (void **) &ie) == FAILURE) {
         return NULL;
     }
-    CHECK(cachedb_find(cache->db, (char *) key->filename, key->filename_length, 0) == SUCCESS);
-
-    hash_get_first_zv(Z_ARRVAL_PP(index_entry), length);
-    hash_get_last_zv(Z_ARRVAL_PP(index_entry), pool_length);
 
-    compressed_length   = Z_LVAL_PP(length);
-    uncompressed_length = Z_LVAL_PP(pool_length);
+    compressed_length   = ie->length;
+    uncompressed_length = ie->pool_length;
    /*
     * cachedb_fetch() returns a string zval. It is layered over a php_stream_copy_to_mem() which 
     * peamllocs the return buffer, so this must be pefreed after decompression.  The temporary zval
     * db_rec is set up to accept the fetch.
     */
     lpc_pool_storage( uncompressed_length, compressed_length, &buffer TSRMLS_CC);
-    INIT_ZVAL(db_rec); ZVAL_STRINGL(&db_rec, buffer, compressed_length, 0);
+   /*
+    * If a persistent index has retained the expanded record then this is simply copied into the
+    * pool image.
+    */
+    if (ie->image) {
+        memcpy(lpc_pool_image(0 TSRMLS_CC), ie->image, uncompressed_length);
+        return lpc_pool_create(LPC_RO_SERIALPOOL, (void**) entry_rec TSRMLS_CC);
+    }
+   /*
+    * If the shared memory cache holds the expanded record then copy it straight into the pool
+    * image, bypassing both the cache file read and the decompression.  Otherwise read and expand
+    * the record, and publish it for the other processes of this account.
+    */
+    if (LPCG(shm_size) &&
+        lpc_shm_fetch(cache->context->cachedb_fullpath, key, uncompressed_length,
+                      lpc_pool_image(0 TSRMLS_CC) TSRMLS_CC)) {
+        image = lpc_pool_image(0 TSRMLS_CC);
+    } else {
+        CHECK(cache_open_db(cache TSRMLS_CC) == SUCCESS);
+        CHECK(cachedb_find(cache->db, (char *) key->filename, key->filename_length, 0) == SUCCESS);
+
+        INIT_ZVAL(db_rec); ZVAL_STRINGL(&db_rec, buffer, compressed_length, 0);
 
-    CHECK(cachedb_fetch(cache->db, &db_rec) == SUCCESS &&
-         Z_STRLEN(db_rec) == compressed_length);
+        CHECK(cachedb_fetch(cache->db, &db_rec) == SUCCESS &&
+             Z_STRLEN(db_rec) == compressed_length);
+
+        if (!LPCG(shm_size) && !cache->persist) {
+            return lpc_pool_create(LPC_RO_SERIALPOOL, (void**) entry_rec TSRMLS_CC);
+        }
+        image = lpc_pool_image(1 TSRMLS_CC);
+        if (LPCG(shm_size)) {
+            lpc_shm_store(cache->context->cachedb_fullpath, key, uncompressed_length,
+                          image TSRMLS_CC);
+        }
+    }
+   /*
+    * A persistent index retains a copy of the expanded record, subject to lpc.persistent_size.
+    */
+    if (cache->persist && 
+        LPCG(persistent_used) + uncompressed_length <= LPCG(persistent_size) &&
+        (ie->image = malloc(uncompressed_length)) != NULL) {
+        memcpy(ie->image, image, uncompressed_length);
+        cache->persist->images_size += uncompressed_length;
+        LPCG(persistent_used)       += uncompressed_length;
+    }
 
     return lpc_pool_create(LPC_RO_SERIALPOOL, (void**) entry_rec TSRMLS_CC);
 
@@ -369,7 +839,7 @@ lpc_cache_key_t* lpc_cache_make_key(zend_file_handle* handle, const char* includ
     uint              filename_length;
     char             *buf; 
     size_t            buf_length;
-    zval            **index_entry = NULL, **recsize, **mtime, **filesize, **pool_length;
+    lpc_index_entry_t *index_entry = NULL;
     int               mismatch, stat_file;
 
     if(filename==NULL) {
@@ -379,12 +849,8 @@ lpc_cache_key_t* lpc_cache_make_key(zend_file_handle* handle, const char* includ
    /*
     * If filename already exists in index, then use the index entry
     */
-    if (hash_find(LPCG(lpc_cache)->index, filename, index_entry) == SUCCESS) {
-
-        hash_get_first_zv(Z_ARRVAL_PP(index_entry), recsize);
-        hash_get_next_zv( Z_ARRVAL_PP(index_entry), mtime);
-        hash_get_next_zv( Z_ARRVAL_PP(index_entry), filesize);
-        hash_get_next_zv( Z_ARRVAL_PP(index_entry), pool_length);
+    if (hash_find(LPCG(lpc_cache)->index, filename, index_entry) == FAILURE) {
+        index_entry = NULL;
     }
    /*
     * Unlike APC, LPC uses a percentage for fpstat, so if 0 < fpstat < 100, a random number 
@@ -402,8 +868,8 @@ lpc_cache_key_t* lpc_cache_make_key(zend_file_handle* handle, const char* includ
        /*
         * This is a cache hit and it's OK to use the cache details.
         */
-        key->mtime           = Z_LVAL_PP(mtime);
-        key->filesize        = Z_LVAL_PP(filesize);
+        key->mtime           = index_entry->mtime;
+        key->filesize        = index_entry->filesize;
         key->type            = LPC_CACHE_LOOKUP;
 
     } else { 
@@ -423,7 +889,7 @@ lpc_cache_key_t* lpc_cache_make_key(zend_file_handle* handle, const char* includ
 
         if (stat_file) {
  
-            if ((Z_LVAL_PP(mtime) != sb.st_mtime) || (Z_LVAL_PP(filesize) != sb.st_size)) {
+            if ((index_entry->mtime != sb.st_mtime) || (index_entry->filesize != sb.st_size)) {
                /*
                 * There is a mismatch between the cached and on filesystem versions.  This means 
                 * that cache should be treated as invalid, and purged at the end of the request.
@@ -433,8 +899,8 @@ lpc_cache_key_t* lpc_cache_make_key(zend_file_handle* handle, const char* includ
                 return NULL;
             } else { /* The stat was consistent with the cache so use the cache version */
                 zend_file_handle_dtor(handle TSRMLS_CC);
-                key->mtime    = Z_LVAL_PP(mtime);
-                key->filesize = Z_LVAL_PP(filesize);
+                key->mtime    = index_entry->mtime;
+                key->filesize = index_entry->filesize;
                 key->type     = LPC_CACHE_LOOKUP;
             }
         } else { /* its a new file to compile*/
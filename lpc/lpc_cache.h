@@ -159,6 +159,12 @@ extern lpc_pool* lpc_cache_retrieve(lpc_cache_key_t *key, void** first_entry TSR
  */
 extern void lpc_cache_insert(lpc_cache_key_t *key, zend_uchar *compressed_buffer,
                              zend_uint compressed_length, zend_uint pool_length TSRMLS_DC);
+/*
+ * lpc_cache_free_persistent frees any persistent cache indexes held in the global vector.  This
+ * is called from the globals DTOR.
+ */
+extern void lpc_cache_free_persistent(HashTable **caches);
+
 /*
  * Give information on the cache content
  */
@@ -293,8 +293,8 @@ void lpc_copy_class_entry(zend_class_entry* dst, zend_class_entry* src, lpc_pool
 
     /* In the case of a user class dup the doc_comment if any */
     if (CE_DOC_COMMENT(src)) {
-        pool_memcpy(CE_DOC_COMMENT(dst),
-                    CE_DOC_COMMENT(src), (CE_DOC_COMMENT_LEN(src) + 1));
+        pool_memcpy_data(CE_DOC_COMMENT(dst),
+                         CE_DOC_COMMENT(src), (CE_DOC_COMMENT_LEN(src) + 1));
         CE_DOC_COMMENT_LEN(dst) = CE_DOC_COMMENT_LEN(src);
     }
  
@@ -56,6 +56,7 @@ static void copy_opcodes_out(zend_op_array *dst, zend_op_array *src, lpc_pool* p
 #define POOL_ESTRDUP_FLD(fld) if(src->fld) pool_strdup(dst->fld,src->fld, 1)
 #define POOL_MEMCPY(dst,src,n) if(src) pool_memcpy(dst,src,n)
 #define POOL_MEMCPY_FLD(fld,n) POOL_MEMCPY(dst->fld,src->fld,n)
+#define POOL_MEMCPY_DATA_FLD(fld,n) if(src->fld) pool_memcpy_data(dst->fld,src->fld,n)
 #define POOL_NSTRDUP_FLD(fld) if (src->fld) \
     pool_nstrdup(dst->fld, dst->fld##_len, src->fld, src->fld##_len, 0)
 #define POOL_ENSTRDUP(dst,src) if (src) \
@@ -364,8 +365,8 @@ void lpc_copy_op_array(zend_op_array* dst, zend_op_array* src, lpc_pool* pool)
  *  zend_uint              *refcount        [E] pool_memcpy if not nul                          
  *  zend_op                *opcodes         [E] See below                 
  *  zend_compiled_variable *vars            [E] deep copy the array using pool_memcpy                    
- *  zend_brk_cont_element  *brk_cont_array  [E] pool_memcpy if not nul                                  
- *  zend_try_catch_element *try_catch_array [E] pool_memcpy if not nul                                  
+ *  zend_brk_cont_element  *brk_cont_array  [E] pool_memcpy_data if not nul                             
+ *  zend_try_catch_element *try_catch_array [E] pool_memcpy_data if not nul                             
  *  HashTable              *static_variables[R] HT copy                            
  *  zend_op                *start_op        [R] processed with opcodes     
  *  char                   *filename        [R] pool_memcpy if not nul                           
@@ -413,8 +414,8 @@ TODO: Add processing of literals and interned strings for Zend 2.4
         POOL_ENSTRDUP(dst->vars[i].name, src->vars[i].name);
     }
 #endif
-    POOL_MEMCPY_FLD(brk_cont_array, sizeof(zend_brk_cont_element) * src->last_brk_cont);
-    POOL_MEMCPY_FLD(try_catch_array, sizeof(zend_try_catch_element) * src->last_try_catch);
+    POOL_MEMCPY_DATA_FLD(brk_cont_array, sizeof(zend_brk_cont_element) * src->last_brk_cont);
+    POOL_MEMCPY_DATA_FLD(try_catch_array, sizeof(zend_try_catch_element) * src->last_try_catch);
 
     /* copy the table of static variables */
     if (src->static_variables) {
@@ -111,7 +111,7 @@ zend_op_array* lpc_compile_file(zend_file_handle* h, int type TSRMLS_DC)
         * HashTables.  So these last two HTs are first high-water marked to determine any additions.
         */
         zend_op_array *op_array;
-        zend_uint      pool_length, compressed_length, request;
+        zend_uint      pool_length, compressed_length;
         zend_uchar    *compressed_buffer;
 
         int num_functions = zend_hash_num_elements(CG(function_table));
@@ -121,44 +121,15 @@ zend_op_array* lpc_compile_file(zend_file_handle* h, int type TSRMLS_DC)
         num_classes       = zend_hash_num_elements(CG(class_table))    - num_classes;
        /*
         * Once a compile is (cleanly) completed, it is then serialised for o/p to the file cache.  
-        * LPC adopts an optimistic strategy here, preallocating the serial storage before doing the 
-        * build. Overflows can still occur, but this is a delatively rare occurance with the default
-        * lpc.compression setting.  However if overflow occurs then the copy out process bails out,
-        * and the copy-out is then retried with a larger allocation. Retry is infrequent and is
-        * relatively cheap, but this approach considerably simplifies the pool allocations logic.
-        * See TECHNOTES.txt for further discussion of this approach.  
+        * The serial pool grows in chunks as the copy-out proceeds and is flattened into the pool
+        * buffer on serialization, so the copy-out is done in a single pass.  See TECHNOTES.txt for
+        * further discussion of this approach.  
         */
         LPCG(current_filename) = op_array->filename;
 
-        request = 0;  /* start off with current / default buffer */
-        do {
-            lpc_try {
-
-                pool = NULL;
-                compressed_length = 0;
-                /* Any of the following 3 calls can bailout with an LPC_POOL_OVERFLOW */
-                lpc_pool_storage(request, 0, NULL TSRMLS_CC);
-                pool = build_cache_entry(key, op_array, num_functions, num_classes TSRMLS_CC);
-                compressed_buffer = lpc_pool_serialize(pool, &compressed_length, &pool_length);
-
-            } lpc_catch {
-
-                request = LPCG(storage_quantum); /* retry with an enlarged pool buffer */
-                lpc_pool_destroy(&LPCG(serial_pool));
-
-            } lpc_end_try();
-
-        } while (!compressed_length);
-
-       /*
-        * If the bailout_status != LPC_POOL_OVERFLOW, but compressed_length == 0 then we've
-        * bailed out for some other reason, so clean up LPC and reissue the bailout.
-        */
-        if (compressed_length == 0) {
-            lpc_pool_destroy(&LPCG(serial_pool));
-            lpc_pool_shutdown(TSRMLS_C);
-            zend_bailout();
-        }
+        lpc_pool_storage(0, 0, NULL TSRMLS_CC);
+        pool = build_cache_entry(key, op_array, num_functions, num_classes TSRMLS_CC);
+        compressed_buffer = lpc_pool_serialize(pool, &compressed_length, &pool_length);
 
         lpc_cache_insert(key, compressed_buffer, compressed_length, pool_length TSRMLS_CC);
         lpc_cache_free_key(key TSRMLS_CC);
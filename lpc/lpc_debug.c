@@ -85,6 +85,8 @@ int lpc_debug_enter(char *s)
 "lpc_resolve_symbol",
 "*** lpc_cache.c", "lpc_cache_create", "lpc_cache_destroy", "lpc_cache_clear", "lpc_cache_insert",
 "lpc_cache_retrieve", "lpc_cache_make_key", "lpc_cache_free_key", "lpc_cache_info",
+"persist_find", "persist_create", "persist_install",
+"cache_add_context", "cache_load_dict", "cache_flush_pending",
 "lpc_include_or_eval_handler", 
 "*** lpc_copy_class.c", "lpc_copy_new_classes", "lpc_install_classes", "lpc_copy_class_entry",
 "copy_property_info", "is_local_method", "is_local_default_property", "is_local_property_info",
@@ -99,10 +101,14 @@ int lpc_debug_enter(char *s)
 "*** lpc_pool.c", "lpc_pool_init", "lpc_pool_shutdown","_lpc_pool_alloc", "_lpc_pool_alloc_ht",
 "_lpc_pool_alloc_zval", "_lpc_pool_strdup", "_lpc_pool_nstrdup", "_lpc_pool_strcmp",
 "_lpc_pool_strncmp", "_lpc_pool_memcpy", "lpc_pool_storage", "lpc_pool_create",
+"_lpc_pool_alloc_data", "_lpc_pool_memcpy_data", "pool_chunk_alloc", "flatten_pool",
 "lpc_pool_serialize","lpc_pool_destroy", "make_pool_rbvec", "missed_tag_check", "relocate_pool",
-"generate_interned_strings", "pool_compress", "pool_uncompress",
+"generate_interned_strings", "pool_compress", "pool_uncompress", "lpc_pool_image",
+"pool_buffer_alloc", "pool_buffer_free", "lpc_pool_compression_supported",
+"lpc_pool_set_dict", "lpc_pool_train_dict", "lpc_pool_compress_image",
 "*** lpc_request.c ***", "lpc_set_compile_hook", "lpc_module_shutdown", 
 "add_filter_delims", "lpc_request_init", "lpc_request_shutdown", "lpc_dtor_context", 
+"*** lpc_shm.c", "lpc_shm_attach", "lpc_shm_fetch", "lpc_shm_store",
 //"*** lpc_string.c", "dummy_interned_strings_snapshot_for_php",
 //"dummy_interned_strings_restore_for_php", "lpc_new_interned_string", "lpc_copy_internal_strings",
 //"lpc_interned_strings_init", "lpc_interned_strings_shutdown",  
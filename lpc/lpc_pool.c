@@ -24,12 +24,22 @@
 
 #include <zlib.h>
 #include <assert.h>
+#ifndef PHP_WIN32
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_LPC_LZ4
+# include <lz4.h>
+#endif
+#ifdef HAVE_LPC_ZSTD
+# include <zstd.h>
+# include <zstd_errors.h>
+# include <zdict.h>
+#endif
 
 #include "lpc.h"
 #include "lpc_pool.h"
 #include "lpc_debug.h"
 #include "Zend/zend_types.h"
-#include "ext/standard/crc32.h"
 
 /* 
  * The APC REALPOOL and BDPOOL implementations used a hashtable to track individual 
@@ -46,7 +56,6 @@
 #define POOL_TYPE_STR() (pool->type == LPC_EXECPOOL ? "Exec" : "Serial")
 
 #define FREE(p) if (p) free(p)  
-#define POOL_TAG_HASH_INITIAL_SIZE    0x800
 #define POOL_INTERN_HASH_INITIAL_SIZE 0x800
 #define END_MARKER "\xEE\0\xEE\00"
 #define CHECK(p) if(!(p)) goto error
@@ -59,25 +68,115 @@ typedef void *pointer;
 #define POINTER_MASK ((size_t)(sizeof(pointer)-1))
 #define ROUNDUP(s) (((zend_uint)s+(sizeof(pointer)-1)) & (~(zend_uint)(sizeof(pointer)-1)))
 
+/* The relocation bit vector is held in size_t mask words of RELOC_BITS bits */
+#define RELOC_BITS (sizeof(size_t)*8)
+#define RELOC_MASKS(nwords) (((nwords)+RELOC_BITS-1)/RELOC_BITS)
+#if defined(__GNUC__)
+# define RELOC_CTZ(m) __builtin_ctzll((unsigned long long)(m))
+#else
+static int reloc_ctz(size_t m) { int n = 0; for (; !(m & 1); m >>= 1, n++) {} return n; }
+# define RELOC_CTZ(m) reloc_ctz(m)
+#endif
+#if defined(__x86_64__) && defined(__AVX2__)
+# include <immintrin.h>
+# define RELOC_AVX2
+#elif defined(__x86_64__) && defined(__SSE2__)
+# include <emmintrin.h>
+# define RELOC_SSE2
+#endif
+
+/*
+ * The zero-run codec (lpc.compression = 1) scans the record ZRUN_BLOCK bytes at a time for zero
+ * bytes, using the same vector width as the relocation kernel, or NEON on AArch64.  A literal run
+ * is only ended by a run of at least ZRUN_MIN zeros.  The record check is a CRC32C, which uses the
+ * SSE4.2 instruction (selected at runtime on x86-64 GCC builds) or the ARMv8 CRC extension.
+ */
+#define ZRUN_MIN                4
+#define ZRUN_INPLACE_MARGIN     32
+#if defined(RELOC_AVX2)
+# define ZRUN_BLOCK 32
+#elif defined(RELOC_SSE2)
+# define ZRUN_BLOCK 16
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+# define ZRUN_NEON
+# define ZRUN_BLOCK 16
+#else
+# define ZRUN_BLOCK 8
+#endif
+#define ZRUN_ALL_ZERO ((zend_uint) (((unsigned long long) 1 << ZRUN_BLOCK) - 1))
+#if defined(__x86_64__) && defined(__GNUC__)
+# include <nmmintrin.h>
+# define CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+# include <arm_acle.h>
+# define CRC32C_ARM
+#endif
+
 typedef struct _pool_storage_header {
     uint  size;
     uint  allocated;
     uint  reloc_vec;
     uint  intern_vec;
     uint  count;
+    size_t base;           /* the base address that the internal pointers are serialized against */
 } pool_storage_header;
 
+/*
+ * During copy-out a serial pool is built in a chain of emalloced chunks, each used as a bump
+ * allocator, with a new chunk (twice the size of the last) started when the current one fills.
+ * Each chunk records the offset at which it will be placed in the flattened pool, so that the
+ * tags bitmap can be indexed by the flattened word offset from the outset.
+ */
+struct _lpc_pool_chunk {
+    lpc_pool_chunk *next;
+    zend_uchar     *start;
+    zend_uint       size;          /* usable bytes in the chunk */
+    zend_uint       used;          /* bytes allocated from it */
+    zend_uint       flat;          /* offset of the chunk within its flattened region */
+};
+#define IN_CHUNK(c,p) ((size_t)(p) - (size_t)(c)->start < (c)->used)
+
+/*
+ * The LZ4 and zstd RO record buffers are decompressed in-place, which both libraries support
+ * provided that the compressed record is at the end of a buffer with the following margin beyond
+ * the uncompressed size.  (These are the documented LZ4_DECOMPRESS_INPLACE_MARGIN and
+ * ZSTD_DECOMPRESSION_MARGIN values, but those macros are not in every header version.)
+ */
+#define LZ4_INPLACE_MARGIN(c)   (((c) >> 8) + 32)
+#define ZSTD_INPLACE_MARGIN(r)  (18 + 4 + 3*(((r) >> 17) + 1) + MIN((r), 128*1024))
+#define ZSTD_LEVEL              3
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+#if defined(MAP_ANONYMOUS) && !defined(PHP_WIN32) && !defined(ZTS)
+# define LPC_POOL_MMAP
+# ifndef MAP_FIXED_NOREPLACE
+#  define MAP_FIXED_NOREPLACE 0      /* the base is then only a hint, which is checked on return */
+# endif
+#endif
+
 /* }}} */
 
 /* {{{ static function prototypes */
-static int offset_compare(const void *a, const void *b);
+static void *pool_chunk_alloc(lpc_pool *pool, lpc_pool_chunk **chain, lpc_pool_chunk **current,
+                              zend_uint size);
+static lpc_pool_chunk *pool_find_chunk(lpc_pool_chunk *c, const void *p);
+static void pool_free_chunks(lpc_pool_chunk **chain, lpc_pool_chunk **current);
+static void flatten_pool(lpc_pool *pool);
+static zend_uint pool_compress_headroom(zend_uint insize TSRMLS_DC);
+static zend_uint interned_strings_size(HashTable *ht);
 static zend_uchar *make_pool_rbvec(lpc_pool *pool);
 static void missed_tag_check(lpc_pool *pool);
-static void *relocate_pool(lpc_pool *pool, zend_bool copy_out);
+static void relocate_words(size_t *q, const size_t *rbvec, size_t nmasks, size_t delta);
+static void relocate_pool(lpc_pool *pool, zend_bool copy_out);
 static zend_uchar* generate_interned_strings(lpc_pool *pool);
 static int pool_compress(zend_uchar *outbuf, zend_uchar *inbuf, zend_uint insize TSRMLS_DC);
 static void pool_uncompress(zend_uchar *outbuf, zend_uint outsize, 
                             zend_uchar *inbuf, zend_uint insize TSRMLS_DC);
+static zend_uchar *pool_buffer_alloc(zend_lpc_globals *gv, zend_uint size);
+static void pool_buffer_free(zend_lpc_globals *gv);
 /* }}} */
 
 /* {{{ Pool-specific module init and shutdown -- called from request init and shutdown */
@@ -96,8 +195,7 @@ int lpc_pool_init(uint max_module_len TSRMLS_DC)
 
     if (gv->reuse_serial_buffer) {
         /* need to check malloc return as this can fail and return a NULL pointer */
-        gv->pool_buffer = malloc(gv->pool_buffer_size);
-        if (!gv->pool_buffer) {
+        if (!pool_buffer_alloc(gv, gv->pool_buffer_size)) {
             lpc_error("Out of memory.  Cannot allocate %u bytes for pool buffer storage"
                       TSRMLS_CC,gv->pool_buffer_size);
             return 0;
@@ -111,13 +209,13 @@ int lpc_pool_init(uint max_module_len TSRMLS_DC)
 /* {{{ lpc_pool_shutdown*/
 void lpc_pool_shutdown(TSRMLS_D)
 {ENTER(lpc_pool_shutdown)
-    if (zend_llist_count(&LPCG(exec_pools))) {
-        zend_llist_destroy(&LPCG(exec_pools));
-        memset(&LPCG(exec_pools),0, sizeof(zend_llist));
+    FETCH_GLOBAL_VEC()
+    if (zend_llist_count(&gv->exec_pools)) {
+        zend_llist_destroy(&gv->exec_pools);
+        memset(&gv->exec_pools,0, sizeof(zend_llist));
         }
-    if (LPCG(reuse_serial_buffer) && LPCG(pool_buffer)) {
-        free(LPCG(pool_buffer));
-        LPCG(pool_buffer) = NULL;
+    if (gv->reuse_serial_buffer && gv->pool_buffer) {
+        pool_buffer_free(gv);
     }
 }
 /* }}} */
@@ -143,19 +241,28 @@ void _lpc_pool_alloc(void **dest, lpc_pool* pool, uint size ZEND_FILE_LINE_DC)
         */
         zend_uint rounded_size = ROUNDUP(size);
 
-        if (rounded_size >= pool->available) {
-            TSRMLS_FETCH_FROM_POOL()
-            /*
-             * If the pool is full then bailout with a POOL_OVERFLOW.  The upper level will retry
-             * the copy with a larger allocation;
-             */ 
-            lpc_throw_storage_overflow();
+        if (pool->chunks) {
+           /*
+            * During copy-out, the storage is bumped from the current chunk, and only the storage
+            * handed out is zeroed.
+            */
+            storage = pool_chunk_alloc(pool, &pool->chunks, &pool->chunk, rounded_size);
+            memset(storage, 0, rounded_size);
+        } else {
+           /*
+            * Once flattened, lpc_pool_serialize has sized the storage for its own allocations, 
+            * so overflow here is an internal sizing error and is fatal.
+            */
+            if (rounded_size > pool->available) {
+                TSRMLS_FETCH_FROM_POOL()
+                lpc_error("Internal error: serial pool storage exhausted after flattening" TSRMLS_CC);
+                zend_bailout();
+            }
+            storage = (zend_uchar *) pool->storage + pool->allocated;
+            pool->allocated  += rounded_size;
+            pool->available  -= rounded_size;
         }
 
-        storage = (zend_uchar *) pool->storage + pool->allocated;
-        pool->allocated  += rounded_size;
-        pool->available  -= rounded_size;
-
     } else {/* LPC_RO_SERIALPOOL */
         lpc_error("Allocation operations are not permitted on a readonly Serial Pool" TSRMLS_PC);
         return;
@@ -176,6 +283,35 @@ void _lpc_pool_alloc(void **dest, lpc_pool* pool, uint size ZEND_FILE_LINE_DC)
 }
 /* }}} */
 
+/* {{{ _lpc_pool_alloc_data 
+       Allocator for pointer-free elements.  In serial pools these are allocated from their own
+       chain of chunks, which is placed after the pointer-bearing chunks on flattening */
+void _lpc_pool_alloc_data(void **dest, lpc_pool* pool, uint size ZEND_FILE_LINE_DC)
+{ENTER(_lpc_pool_alloc_data)
+    void *storage;
+
+    if (pool->type == LPC_SERIALPOOL && pool->chunks) {
+        zend_uint rounded_size = ROUNDUP(size);
+
+        storage = pool_chunk_alloc(pool, &pool->data_chunks, &pool->data_chunk, rounded_size);
+        memset(storage, 0, rounded_size);
+
+        DEBUG3(ALLOC,"%s data alloc: 0x%08lx allocated 0x%04x bytes at %s:%d", POOL_TYPE_STR(),
+               storage, size ZEND_FILE_LINE_RELAY_CC);
+
+        pool->size += size;
+        pool->count++;
+
+        if (dest) {
+            *dest = storage;
+            _lpc_pool_tag_ptr(dest, pool ZEND_FILE_LINE_RELAY_CC);
+        }
+    } else {
+        _lpc_pool_alloc(dest, pool, size ZEND_FILE_LINE_RELAY_CC);
+    }
+}
+/* }}} */
+
 /* {{{ _lpc_pool_alloc_zval 
        Special allocator that uses the Zend fast ZVAL storage allocator in exec pools */
 void _lpc_pool_alloc_zval(void **dest, lpc_pool* pool ZEND_FILE_LINE_DC)
@@ -357,13 +493,23 @@ void _lpc_pool_memcpy(void **dest, const void* p, uint n, lpc_pool* pool ZEND_FI
 }
 /* }}} */
 
+/* {{{ lpc_pmemcpy_data */
+void _lpc_pool_memcpy_data(void **dest, const void* p, uint n, lpc_pool* pool ZEND_FILE_LINE_DC)
+{ENTER(_lpc_pool_memcpy_data)
+    void* q;
+    _lpc_pool_alloc_data(&q, pool, n ZEND_FILE_LINE_RELAY_CC);
+    memcpy(q, p, n);
+    if (dest) {
+        *dest = q;
+        if (!is_exec_pool()) _lpc_pool_tag_ptr(dest, pool ZEND_FILE_LINE_RELAY_CC);
+    }
+}
+/* }}} */
+
 /* {{{ _lpc_pool_tag_ptr 
        Used to tag any internal pointers within a serial pool to enable its relocation */
 void _lpc_pool_tag_ptr(void **ptr, lpc_pool* pool ZEND_FILE_LINE_DC)
 {
-    size_t offset;
-    int i;
-    void *dummy = NULL;
    /*
     * Handle obvious no-ops and errors
     */
@@ -378,22 +524,30 @@ void _lpc_pool_tag_ptr(void **ptr, lpc_pool* pool ZEND_FILE_LINE_DC)
 
     assert(((size_t)ptr & POINTER_MASK) == 0);
    /*
-    * Internal pointer are tagged, that is if (a) its address is inside the pool,  and (b) it is
-    * pointing to an address inside the pool. If the appropriate log flag is set any pointers to
-    * outside the pool are also logged.  And since all pointer are size_t aligned, the offset of 
-    * pointer (in sizeof pointer units) is used as the index in the tags HT.
+    * Internal pointer are tagged, that is if (a) its address is inside one of the pointer-bearing
+    * chunks, and (b) it is pointing to an address inside either a pointer-bearing or a data chunk.
+    * If the appropriate log flag is set any pointers to outside the pool are also logged.  Since
+    * all pointers are size_t aligned, the offset of pointer within the flattened pool (in sizeof
+    * pointer units) is used as the bit index in the tags bitmap.  Nothing is tagged once the pool
+    * has been flattened, as the chunks have then been released.
     */
-    if (GET_BYTEOFF(ptr,pool->storage)  < pool->allocated) {
-        if (GET_BYTEOFF(*ptr,pool->storage) < pool->allocated) {
-            ulong offset = GET_PTROFF(ptr,pool->storage);
-            zend_hash_index_update(&pool->tags, offset, &dummy, sizeof(void *), NULL);
+    if (pool->chunks) {
+        lpc_pool_chunk *c = IN_CHUNK(pool->chunk, ptr) ? pool->chunk : 
+                                                         pool_find_chunk(pool->chunks, ptr);
+        if (!c) {
+            return;
+        }
+        if (IN_CHUNK(pool->chunk, *ptr) || pool_find_chunk(pool->chunks, *ptr) || 
+            pool_find_chunk(pool->data_chunks, *ptr)) {
+            size_t offset = (c->flat + GET_BYTEOFF(ptr, c->start)) / sizeof(size_t);
+            pool->tags[offset/RELOC_BITS] |= ((size_t)1) << (offset%RELOC_BITS);
             DEBUG4(RELC, "check: 0x%08lx (0x%08lx + 0x%04x) "
                          "Inserting relocation addr to 0x%08lx call at %s:%u",
-                         ptr, pool->storage, offset,  *(void **)ptr ZEND_FILE_LINE_RELAY_CC);
+                         ptr, c->start, GET_BYTEOFF(ptr, c->start), *(void **)ptr 
+                         ZEND_FILE_LINE_RELAY_CC);
         } else {
             DEBUG2(RELO, "check: 0x%08lx Relocation addr call to 0x%08lx  outside pool at %s:%u",  
                          ptr, *(size_t *)ptr ZEND_FILE_LINE_RELAY_CC);
-            return;
         }
     }
 }
@@ -430,13 +584,23 @@ extern void  lpc_pool_storage(zend_uint arg1, zend_uint compressed_size,
                 storage_size = record_size;
                 break;
 
-            case 1:  /* = RLE */
-                storage_size = MAX(compressed_size, record_size) + (compressed_size/15);
+            case 1:  /* = zero-run */
+                storage_size = MAX(compressed_size, record_size) + ZRUN_INPLACE_MARGIN;
                 break;
 
             case 2:  /* = GZ */
                 storage_size = MAX(compressed_size, record_size) + (record_size >> 11);
                 break;
+
+            case 3:  /* = LZ4 */
+                storage_size = MAX(compressed_size, record_size) + 
+                               LZ4_INPLACE_MARGIN(compressed_size) + sizeof(size_t);
+                break;
+
+            case 4:  /* = ZSTD */
+                storage_size = MAX(compressed_size, record_size) + 
+                               ZSTD_INPLACE_MARGIN(record_size) + sizeof(size_t);
+                break;
         }
         num_quanta   = (storage_size + sizeof(zend_uint) + gv->storage_quantum - 1) 
                           / gv->storage_quantum;
@@ -447,14 +611,12 @@ extern void  lpc_pool_storage(zend_uint arg1, zend_uint compressed_size,
         * end of compressed_buffer.
         */
         if (!gv->reuse_serial_buffer || !gv->pool_buffer) {
-            gv->pool_buffer      = malloc(storage_size);
-            gv->pool_buffer_size = storage_size;
+            pool_buffer_alloc(gv, storage_size);
             DEBUG2(LOAD, "Pool storage allocated (size %u) at 0x%012x)", 
                          gv->pool_buffer_size, gv->pool_buffer);
         } else if (storage_size > gv->pool_buffer_size) {
 
-            gv->pool_buffer      = realloc(gv->pool_buffer, storage_size);
-            gv->pool_buffer_size = storage_size;
+            pool_buffer_alloc(gv, storage_size);
             DEBUG2(LOAD,"Pool storage re-allocated (size %u) at 0x%012x)", 
                         gv->pool_buffer_size, gv->pool_buffer);
         }
@@ -466,6 +628,7 @@ extern void  lpc_pool_storage(zend_uint arg1, zend_uint compressed_size,
 
         gv->pool_buffer_rec_size = record_size;
         gv->pool_buffer_comp_size= compressed_size;
+        gv->pool_buffer_expanded = 0;
 
         *opt_addr = (gv->compression_algo == 0) ? 
                         gv->pool_buffer :
@@ -477,42 +640,122 @@ extern void  lpc_pool_storage(zend_uint arg1, zend_uint compressed_size,
         * Free the pool buffer if not reusing
         */
         if (gv->pool_buffer && !gv->reuse_serial_buffer) {
-            free(gv->pool_buffer);
-            gv->pool_buffer      = NULL;
+            pool_buffer_free(gv);
             gv->pool_buffer_size = 0;
         }
     } else {        
        /*
-        * The buffer is going to be used for creating a new compiled module in a Serial Pool for 
-        * writing into the cache.  A non-zero request means grow the buffer by the requested amount.
-        * Again reuse according to reuse policy.
+        * A new compiled module is going to be copied out to a Serial Pool for writing into the
+        * cache.  The pool allocates its own chunks as it grows, and lpc_pool_serialize sizes the
+        * pool buffer for the flattened image, so there is nothing to book here.
         */
-        zend_uint request_size = arg1;
-
-        storage_size = (request_size) ? gv->pool_buffer_size + request_size :
-                                        gv->storage_quantum;
-        num_quanta   = (storage_size + gv->storage_quantum - 1) / gv->storage_quantum;
-        storage_size = num_quanta * gv->storage_quantum;
+        gv->pool_buffer_rec_size = 0;
+        gv->pool_buffer_comp_size= 0;
+    }
+}
+/* }}} */
 
-        if (!gv->reuse_serial_buffer || !gv->pool_buffer) {
-            gv->pool_buffer      = malloc(storage_size);
-            gv->pool_buffer_size = storage_size;
+/* {{{ lpc_pool_compression_supported 
+       The LZ4 and zstd algos are only available if the build found the libraries */
+extern zend_bool lpc_pool_compression_supported(zend_uint algo)
+{ENTER(lpc_pool_compression_supported)
+    switch (algo) {
+        case 0: case 1: case 2:
+            return 1;
+#ifdef HAVE_LPC_LZ4
+        case 3:
+            return 1;
+#endif
+#ifdef HAVE_LPC_ZSTD
+        case 4:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+/* }}} */
 
-        } else if (storage_size > gv->pool_buffer_size) {
-            gv->pool_buffer      = realloc(gv->pool_buffer, storage_size);
-            gv->pool_buffer_size = storage_size;
+/* {{{ lpc_pool_set_dict 
+       Set (or with a NULL dict, clear) the cache-wide zstd dictionary used by pool_compress and 
+       pool_uncompress.  The dictionary storage is owned by the caller and must persist until it is
+       cleared.  The compression and decompression dictionaries are only digested on first use. */
+extern void lpc_pool_set_dict(zend_uchar *dict, zend_uint dict_size TSRMLS_DC)
+{ENTER(lpc_pool_set_dict)
+    FETCH_GLOBAL_VEC()
+#ifdef HAVE_LPC_ZSTD
+    if (gv->zstd_cdict) {
+        ZSTD_freeCDict((ZSTD_CDict *) gv->zstd_cdict);
+    }
+    if (gv->zstd_ddict) {
+        ZSTD_freeDDict((ZSTD_DDict *) gv->zstd_ddict);
+    }
+    if (gv->zstd_cctx) {
+        ZSTD_freeCCtx((ZSTD_CCtx *) gv->zstd_cctx);
+    }
+    if (gv->zstd_dctx) {
+        ZSTD_freeDCtx((ZSTD_DCtx *) gv->zstd_dctx);
+    }
+    gv->zstd_cdict = gv->zstd_ddict = gv->zstd_cctx = gv->zstd_dctx = NULL;
+    gv->zstd_dict      = dict;
+    gv->zstd_dict_size = dict ? dict_size : 0;
+#endif
+}
+/* }}} */
 
-        }
+/* {{{ lpc_pool_train_dict 
+       Train a zstd dictionary of up to capacity bytes over n sample images concatenated in
+       samples.  Returns the dictionary size, or 0 if there are too few samples to train on. */
+extern zend_uint lpc_pool_train_dict(zend_uchar *dict, zend_uint capacity, const zend_uchar *samples,
+                                     const size_t *sample_sizes, zend_uint n TSRMLS_DC)
+{ENTER(lpc_pool_train_dict)
+#ifdef HAVE_LPC_ZSTD
+    size_t dict_size = ZDICT_trainFromBuffer(dict, capacity, samples, sample_sizes, n);
+
+    if (ZDICT_isError(dict_size)) {
+        DEBUG1(LOAD, "No zstd dictionary trained: %s", ZDICT_getErrorName(dict_size));
+        return 0;
+    }
+    DEBUG2(LOAD, "zstd dictionary of %u bytes trained on %u modules", (uint) dict_size, n);
+    return (zend_uint) dict_size;
+#else
+    return 0;
+#endif
+}
+/* }}} */
 
-        if (!gv->pool_buffer) {
-            lpc_error("Out of memory allocating pool storage" TSRMLS_CC);
-            zend_bailout();
-        }
+/* {{{ lpc_pool_compress_image 
+       Compress an uncompressed image outside the serial pool, e.g. one deferred until a dictionary
+       has been trained. Returns an emalloced record, with its length in compressed_size.  The
+       image is placed above the compression headroom, so pool_compress can't overflow.   */
+extern zend_uchar* lpc_pool_compress_image(const zend_uchar *image, zend_uint size,
+                                           zend_uint *compressed_size TSRMLS_DC)
+{ENTER(lpc_pool_compress_image)
+    zend_uint   headroom = ROUNDUP(pool_compress_headroom(size TSRMLS_CC));
+    zend_uchar *buffer   = emalloc(headroom + size);
+
+    memcpy(buffer + headroom, image, size);
+    *compressed_size = pool_compress(buffer, buffer + headroom, size TSRMLS_CC);
+    return buffer;
+}
+/* }}} */
 
-        gv->pool_buffer_rec_size = 0;
-        gv->pool_buffer_comp_size= 0;
+/* {{{ lpc_pool_image 
+       Returns the address of the uncompressed record in storage booked for a RO serial pool. If
+       expand is set then the compressed record is first expanded into it; otherwise the caller is
+       expected to fill it, e.g. from the shared memory cache.  */
+extern zend_uchar* lpc_pool_image(zend_bool expand TSRMLS_DC)
+{ENTER(lpc_pool_image)
+    FETCH_GLOBAL_VEC()
 
+    if (expand && gv->compression_algo) {
+        zend_uchar *comp_buf = gv->pool_buffer + 
+                               (gv->pool_buffer_size - ROUNDUP(gv->pool_buffer_comp_size+4));
+        pool_uncompress(gv->pool_buffer, gv->pool_buffer_rec_size,
+                        comp_buf, gv->pool_buffer_comp_size TSRMLS_CC);
     }
+    gv->pool_buffer_expanded = 1;
+    return gv->pool_buffer;
 }
 /* }}} */
 
@@ -564,7 +807,6 @@ extern lpc_pool* lpc_pool_create(lpc_pool_type_t type, void** arg1 TSRMLS_DC)
        /*
         * This is the R/W serial allocator used as the destination pool for copy-out.
         */ 
-        pool_storage_header *hdr;
         lpc_pool *pool = &gv->serial_pool;
 
         memset(pool, 0, sizeof(lpc_pool));
@@ -574,25 +816,20 @@ extern lpc_pool* lpc_pool_create(lpc_pool_type_t type, void** arg1 TSRMLS_DC)
         pool->gv      = (zend_lpc_globals *) &LPCG(enabled);  /* first element addr = GV addr */
 
 #endif 
-        DEBUG3(LOAD, "Serial pool created for %s (size %u at 0x%012x)", 
-                     gv->current_filename, gv->pool_buffer_size, gv->pool_buffer);
        /*
-        * Use the pool global variables to allocate the appropriate pool storage. 
+        * Start the first pointer-bearing chunk, which also sizes the tags bitmap.  The storage
+        * vector itself isn't used until the pool is flattened on serialization. 
         */
-        pool->storage   = (void *) gv->pool_buffer;
-        pool->available = gv->pool_buffer_size - sizeof (zend_uint);
-        pool->allocated = 0;
-        
-        zend_hash_init(&pool->tags, POOL_TAG_HASH_INITIAL_SIZE, NULL, NULL, 1);
+        pool_chunk_alloc(pool, &pool->chunks, &pool->chunk, 0);
         zend_hash_init(&gv->intern_hash, POOL_INTERN_HASH_INITIAL_SIZE, NULL, NULL, 1);
+
+        DEBUG3(LOAD, "Serial pool created for %s (chunk size %u at 0x%012x)", 
+                     gv->current_filename, pool->chunk->size, pool->chunk->start);
        /*
-        * Allocate the pool header.  Use a stack destination to prevent pointer tagging.
+        * Allocate the pool header.  Use a stack destination to prevent pointer tagging.  This is
+        * the first allocation, so it is the zeroth entry of the flattened pool.
         */ 
         pool_alloc(dummy, sizeof(pool_storage_header));
-        hdr            = pool->storage;      /* the header is the zeroth entry */
-        memset(pool->storage , 0, gv->pool_buffer_size);
-        memcpy(ADD_BYTEOFF(pool->storage, gv->pool_buffer_size - sizeof (zend_uint)), 
-               END_MARKER, sizeof (zend_uint));
         return pool;
 
     } else if (type == LPC_RO_SERIALPOOL && gv->pool_buffer_comp_size) {
@@ -619,11 +856,8 @@ extern lpc_pool* lpc_pool_create(lpc_pool_type_t type, void** arg1 TSRMLS_DC)
         * otherwise emalloc the storage.
         */
 
-        if (gv->compression_algo) {
-            zend_uchar *comp_buf = gv->pool_buffer + 
-                                  (gv->pool_buffer_size - ROUNDUP(gv->pool_buffer_comp_size+4));
-            pool_uncompress(gv->pool_buffer, gv->pool_buffer_rec_size,
-                            comp_buf, gv->pool_buffer_comp_size TSRMLS_CC);
+        if (!gv->pool_buffer_expanded) {
+            lpc_pool_image(1 TSRMLS_CC);
         }
 
         DEBUG3(LOAD, "Serial R/O pool created for %s (size %u at 0x%012x)", 
@@ -671,9 +905,7 @@ extern lpc_pool* lpc_pool_create(lpc_pool_type_t type, void** arg1 TSRMLS_DC)
 zend_uchar* lpc_pool_serialize(lpc_pool* pool, zend_uint* compressed_size, 
                                zend_uint* record_size)
 {ENTER(lpc_pool_serialize)
-    int           length, size, offset, buffer_length;
     zend_uchar   *storage, *reloc_bvec, *interned_bvec;
-    HashTable    *ht = &pool->tags;
     pool_storage_header *hdr;
     TSRMLS_FETCH_FROM_POOL()
 
@@ -681,6 +913,8 @@ zend_uchar* lpc_pool_serialize(lpc_pool* pool, zend_uint* compressed_size,
         return NULL;
     }
 
+    flatten_pool(pool);
+
     reloc_bvec = make_pool_rbvec(pool);
 
     interned_bvec = generate_interned_strings(pool);
@@ -697,6 +931,7 @@ zend_uchar* lpc_pool_serialize(lpc_pool* pool, zend_uint* compressed_size,
     hdr->size       = pool->size;
     hdr->allocated  = pool->allocated;
     hdr->intern_vec = (interned_bvec == NULL) ? 0 : GET_PTROFF(interned_bvec, storage);
+    hdr->base       = LPCG(pool_base);
     *record_size    = hdr->allocated;
 
     relocate_pool(pool, 1);
@@ -711,26 +946,21 @@ zend_uchar* lpc_pool_serialize(lpc_pool* pool, zend_uint* compressed_size,
         *compressed_size = hdr->allocated;
     } else {
        /*
-        * Top-end justify the allocated section of the storage and detach from pool as this is all
-        * we now need, so the pool itself can now be destroyed.  Then compress back to the bottom
-        * end of the storage. (This allows the compression to be done in-place to save storage, 
-        * whilst minimising the chance of throwing a LPC_POOL_OVERFLOW.)  The compressed buffer is 
-        * then returned to the calling routine.
+        * The pool was flattened above the compression headroom in the pool buffer, so compress it
+        * down to the bottom of the buffer.  The pool itself can now be destroyed, and the
+        * compressed buffer is returned to the calling routine.
         */
         pool_storage_header h=*hdr;
-        length        = pool->allocated + pool->available;
-        size          = pool->allocated;
-        offset        = length - size;
+        zend_uint           size = pool->allocated;
 
-        memmove(storage + offset, storage, size);   /* overlapped buffers so use memmove! */
-        *compressed_size = pool_compress(storage, storage + offset, size  TSRMLS_CC);
+        *compressed_size = pool_compress(LPCG(pool_buffer), storage, size  TSRMLS_CC);
         DEBUG5(LOAD, "unload:  buffer %u bytes (%u + %u + %u compressed to %u bytes) unloaded",
                      size, h.reloc_vec*sizeof(size_t),
                      (h.intern_vec-h.reloc_vec)*sizeof(size_t),
                      size-(h.intern_vec*sizeof(size_t)), *compressed_size);
+        storage = LPCG(pool_buffer);
     }
-    pool->storage = NULL;
-    return (zend_uchar*) storage;
+    return storage;
 }
 /* }}} */
 
@@ -744,7 +974,7 @@ void lpc_pool_destroy(lpc_pool *pool)
                   POOL_TYPE_STR(), pool, (uint) pool->size);
    /*
     * The pool can contain the following dynamic elements which need garbage collected on destruction:
-    *    The tags and intern_hash HashTables used in serial pools
+    *    The storage chunks, tags bitmap and the intern_hash HashTable used in serial pools
     *    The interns pointer vector used in R/O serial pools
     * Once destroyed, the pool record is zeroed. 
     */
@@ -757,9 +987,12 @@ void lpc_pool_destroy(lpc_pool *pool)
         gv->interns = NULL;
     }
 
-    if (pool->tags.arBuckets) {
-        zend_hash_destroy(&pool->tags);
-        pool->tags.arBuckets = NULL;
+    pool_free_chunks(&pool->chunks, &pool->chunk);
+    pool_free_chunks(&pool->data_chunks, &pool->data_chunk);
+
+    if (pool->tags) {
+        free(pool->tags);
+        pool->tags = NULL;
         }
 
     if (gv->intern_hash.arBuckets) {
@@ -768,8 +1001,7 @@ void lpc_pool_destroy(lpc_pool *pool)
         }
     /* free the pool storage if not in reuse mode */
     if (pool->storage && !gv->reuse_serial_buffer) {
-        free(pool->storage);
-        gv->pool_buffer = NULL;
+        pool_buffer_free(gv);
     }
 
     if (pool->intern_copy) {
@@ -779,124 +1011,275 @@ void lpc_pool_destroy(lpc_pool *pool)
 
     memset(pool, 0, sizeof(lpc_pool));
     gv->pool_buffer_comp_size = 0;
+    gv->pool_buffer_expanded  = 0;
  
 }
 /* }}} */
 /* }}} Pool creation and deletion functions */
 
 /* {{{ Internal helper functions */
-/* {{{ offset_compare
-       Simple sort callback to enable sorting of an a vector of offsets into offset order  */
-static int offset_compare(const void *a, const void *b)
-{
-    long diff = *(ulong *)a - *(ulong *)b;
-    return (diff > 0) ? 1 : ((diff < 0) ? -1 : 0);
+/* {{{ pool_buffer_alloc
+       (Re)allocate the serial pool buffer.  If lpc.pool_base is set then the buffer is mapped at
+       this address so that RO serial pools are loaded at the base that they were serialized against
+       and the relocation pass can be skipped.  If the address is unavailable then this silently 
+       falls back to malloc and the pool is relocated as normal.  Note that the previous content of
+       the buffer is NOT preserved, as none of the callers need it. */
+static zend_uchar *pool_buffer_alloc(zend_lpc_globals *gv, zend_uint size)
+{ENTER(pool_buffer_alloc)
+    if (gv->pool_buffer) {
+        pool_buffer_free(gv);
+    }
+#ifdef LPC_POOL_MMAP
+    if (gv->pool_base) {
+        void *base = (void *) gv->pool_base;
+        void *p    = mmap(base, size, PROT_READ|PROT_WRITE, 
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+        if (p == base) {
+            gv->pool_buffer        = (zend_uchar *) p;
+            gv->pool_buffer_size   = size;
+            gv->pool_buffer_mapped = 1;
+            return gv->pool_buffer;
+        } else if (p != MAP_FAILED) {   /* older kernels treat the address as a hint */
+            munmap(p, size);
+        }
+    }
+#endif
+    gv->pool_buffer        = malloc(size);
+    gv->pool_buffer_size   = size;
+    gv->pool_buffer_mapped = 0;
+    return gv->pool_buffer;
 }
 /* }}} */
 
-/* {{{ make_pool_rbvec */
-static zend_uchar *make_pool_rbvec(lpc_pool *pool)
-{ENTER(make_pool_rbvec)
-    HashTable       *ht = &pool->tags;
-    int              i, reloc_vec_len, cnt;
-    ulong           *reloc_vec, *p; 
-    size_t           ro;
-    size_t           max_offset=pool->allocated/sizeof(size_t);
-    zend_uchar      *reloc_bvec, *q;
-    pool_storage_header *hdr;
+/* {{{ pool_buffer_free 
+       Note that pool_buffer_size is left unchanged; lpc_pool_storage zeroes it when required */
+static void pool_buffer_free(zend_lpc_globals *gv)
+{ENTER(pool_buffer_free)
+#ifdef LPC_POOL_MMAP
+    if (gv->pool_buffer_mapped) {
+        munmap(gv->pool_buffer, gv->pool_buffer_size);
+    } else
+#endif
+    free(gv->pool_buffer);
+    gv->pool_buffer        = NULL;
+    gv->pool_buffer_mapped = 0;
+}
+/* }}} */
+
+/* {{{ pool_chunk_alloc
+       Bump size bytes from the current chunk of a chain, starting a new chunk if it is full.  The 
+       first chunk is one storage quantum and each new one doubles in size (or is large enough for
+       the allocation), so the chain stays short and copy-out is never restarted.  Note that the
+       storage isn't zeroed here; the callers zero what they hand out.  */
+static void *pool_chunk_alloc(lpc_pool *pool, lpc_pool_chunk **chain, lpc_pool_chunk **current,
+                              zend_uint size)
+{ENTER(pool_chunk_alloc)
+    lpc_pool_chunk *c = *current;
+    void           *storage;
     TSRMLS_FETCH_FROM_POOL()
-   /*
-    * The fixups hash of offsets is now complete and the processing takes a few passes of the
-    * offsets sorted into ascending offset order, so it's easier just to convert it into an ordered
-    * contiguous vector of the ulong indexes, reloc_vec, which is allocated from the headroom in the
-    * storage pool.  
-    *
-    * This is then sorted into ascending order using a standard qsort before being compressed down
-    * into the byte-compressed version, reloc_bvec. Since each entry of the compressed version is
-    * smaller, reloc_bvec can also be allocated on the same headroom, overlaying reloc_vec. The
-    * reason for extra size_t filler in front of reloc_vec is a safety to avoid collision at start
-    * of compression.
-    */
-    reloc_vec     = (ulong*)ADD_BYTEOFF(pool->storage, pool->allocated);
-    reloc_vec_len = zend_hash_num_elements(&pool->tags);
-    if (reloc_vec_len*sizeof(ulong) > pool->available) {
-        lpc_throw_storage_overflow();
-    }
- 
-    zend_hash_internal_pointer_reset(ht);
-    for (i = 0, p = reloc_vec; i < reloc_vec_len; i++) {
-        zend_hash_get_current_key_ex(ht, NULL, NULL, p, 0, NULL);
-        zend_hash_move_forward(ht);
-        if (*p < max_offset) {
-            p++;
+
+    if (!c || size > c->size - c->used) {
+        lpc_pool_chunk *prev   = c;
+        zend_uint       header = ROUNDUP(sizeof(lpc_pool_chunk));
+        zend_uint       csize  = prev ? 2 * prev->size : LPCGP(storage_quantum) - header;
+
+        csize = ROUNDUP(MAX(csize, size));
+        c = (lpc_pool_chunk *) emalloc(header + csize);
+        c->next  = NULL;
+        c->start = (zend_uchar *) c + header;
+        c->size  = csize;
+        c->used  = 0;
+        c->flat  = prev ? prev->flat + prev->used : 0;
+        if (prev) {
+            prev->next = c;
         } else {
-            DEBUG2(RELC, "Relocation notice: external pointer %08lx at offset %08x in serial pool",
-                         *q, (uint) GET_BYTEOFF(q,pool->storage));
+            *chain = c;
+        }
+        *current = c;
+       /*
+        * The tags bitmap covers every word that the pointer-bearing chunks could place in the
+        * flattened pool, so it is extended as each new one is started.
+        */
+        if (chain == &pool->chunks) {
+            zend_uint masks = RELOC_MASKS((c->flat + csize)/sizeof(size_t));
+            size_t   *tags  = realloc(pool->tags, masks * sizeof(size_t));
+
+            if (!tags) {
+                lpc_error("Out of memory allocating pool tags" TSRMLS_CC);
+                zend_bailout();
+            }
+            memset(tags + pool->tags_masks, 0, (masks - pool->tags_masks) * sizeof(size_t));
+            pool->tags       = tags;
+            pool->tags_masks = masks;
         }
+        DEBUG3(ALLOC, "%s chunk of %u bytes started at flattened offset 0x%08x", 
+                      (chain == &pool->chunks ? "Pool" : "Data"), csize, c->flat);
     }
 
-    reloc_vec_len = p - reloc_vec;
+    storage  = c->start + c->used;
+    c->used += size;
+    return storage;
+}
+/* }}} */
 
-    zend_hash_destroy(ht);
-    memset(ht, 0, sizeof(HashTable));
+/* {{{ pool_find_chunk
+       Returns the chunk in the chain from c which holds the address p, or NULL */
+static lpc_pool_chunk *pool_find_chunk(lpc_pool_chunk *c, const void *p)
+{
+    for (; c; c = c->next) {
+        if (IN_CHUNK(c, p)) {
+            return c;
+        }
+    }
+    return NULL;
+}
+/* }}} */
 
-    qsort(reloc_vec, reloc_vec_len, sizeof(ulong), offset_compare);
+/* {{{ pool_free_chunks */
+static void pool_free_chunks(lpc_pool_chunk **chain, lpc_pool_chunk **current)
+{
+    lpc_pool_chunk *c = *chain, *next;
+    for (; c; c = next) {
+        next = c->next;
+        efree(c);
+    }
+    *chain = *current = NULL;
+}
+/* }}} */
+
+/* {{{ flatten_pool 
+       Copy the chunks into a single contiguous image in the pool buffer, the pointer-bearing
+       chunks first followed by the data chunks, and translate each tagged pointer to its address
+       in the image.  The serialized pool then has all of its pointers in its leading pages,
+       followed by the pointer-free data, interned strings and relocation vector.  The buffer is
+       sized for all of these, and the image is placed above the headroom that the compression 
+       algo needs, so neither the remaining allocations nor pool_compress can overflow.  */
+static void flatten_pool(lpc_pool *pool)
+{ENTER(flatten_pool)
+    lpc_pool_chunk *c;
+    zend_uint       ptr_size, data_size, image_size, headroom, buffer_size;
+    size_t          nmasks, i;
+    size_t         *q;
+    zend_uchar     *image;
+    FETCH_GLOBAL_VEC_POOL()
+    TSRMLS_FETCH_FROM_POOL()
+
+    ptr_size  = pool->chunk->flat + pool->chunk->used;
+    data_size = pool->data_chunk ? pool->data_chunk->flat + pool->data_chunk->used : 0;
+    nmasks    = RELOC_MASKS((ptr_size + data_size)/sizeof(size_t));
+    image_size= ptr_size + data_size + nmasks*sizeof(size_t) + 
+                ROUNDUP(interned_strings_size(&gv->intern_hash));
+    headroom  = ROUNDUP(pool_compress_headroom(image_size TSRMLS_CC));
+    buffer_size = headroom + image_size + sizeof(size_t);
+
+    if (!gv->pool_buffer || buffer_size > gv->pool_buffer_size) {
+        pool_buffer_alloc(gv, ((buffer_size + gv->storage_quantum - 1) / gv->storage_quantum) *
+                               gv->storage_quantum);
+        if (!gv->pool_buffer) {
+            lpc_error("Out of memory allocating pool storage" TSRMLS_CC);
+            zend_bailout();
+        }
+    }
+    image = gv->pool_buffer + headroom;
 
+    for (c = pool->chunks; c; c = c->next) {
+        memcpy(image + c->flat, c->start, c->used);
+    }
+    for (c = pool->data_chunks; c; c = c->next) {
+        memcpy(image + ptr_size + c->flat, c->start, c->used);
+    }
    /*
-    * Convert relocation vector into delta offsets, d(i) = p(i-1) - p(i), in the range 1..
-    * reloc_vec_len-1 and the easiest way to do this in place is to work backwards from the end. 
-    * Note d(1) = p(1) - 0 
+    * The tags only cover the pointer-bearing words, so each tagged word is translated from its
+    * chunk address.  The bitmap is then extended to cover the data region for make_pool_rbvec.
     */
-    for (i = reloc_vec_len-1; i > 0; i--) {
-        reloc_vec[i] -= reloc_vec[i-1];
+    q = (size_t *) image;
+    for (i = 0; i < pool->tags_masks; i++, q += RELOC_BITS) {
+        size_t m = pool->tags[i];
+        while (m) {
+            size_t *w = q + RELOC_CTZ(m);
+            m &= m - 1;
+            if ((c = pool_find_chunk(pool->chunks, (void *) *w)) != NULL) {
+                *w = (size_t) image + c->flat + GET_BYTEOFF(*w, c->start);
+            } else if ((c = pool_find_chunk(pool->data_chunks, (void *) *w)) != NULL) {
+                *w = (size_t) image + ptr_size + c->flat + GET_BYTEOFF(*w, c->start);
+            }
+        }
     }
+    if (nmasks > pool->tags_masks) {
+        size_t *tags = realloc(pool->tags, nmasks * sizeof(size_t));
+        if (!tags) {
+            lpc_error("Out of memory allocating pool tags" TSRMLS_CC);
+            zend_bailout();
+        }
+        memset(tags + pool->tags_masks, 0, (nmasks - pool->tags_masks) * sizeof(size_t));
+        pool->tags       = tags;
+        pool->tags_masks = nmasks;
+    }
+
+    DEBUG3(RELC, "Pool flattened: %u pointer-bearing and %u data bytes at 0x%012lx", 
+                 ptr_size, data_size, image);
+
+    pool_free_chunks(&pool->chunks, &pool->chunk);
+    pool_free_chunks(&pool->data_chunks, &pool->data_chunk);
    /*
-    * The final relocation vector stored in the pool will be delta encoded one per byte. In real
-    * PHP opcode arrays, pointers are a LOT denser than every 127 longs (1016 bytes), but the coding
-    * needs to cope with pathological cases, so a simple high-bit multi-byte escape is used; hence
-    * delta offsets up to 131,064 bytes are encoded in 2 bytes, etc.. This pass to works out the
-    * COUNT of any extra encoding bytes needed to enable a vector of the correct size to be in the
-    * pool. The +1 is for the '\0' terminator. 
+    * The rest of the image is zeroed, as only part of it is filled by the remaining allocations
     */
-    for (i = 0, cnt = reloc_vec_len + 1; i < reloc_vec_len; i++) {
-        for (ro=reloc_vec[i]; ro>=0x80; ro >>= 7, cnt++) { }
+    memset(image + ptr_size + data_size, 0, image_size + sizeof(size_t) - (ptr_size + data_size));
+    pool->storage   = image;
+    pool->allocated = ptr_size + data_size;
+    pool->available = image_size + sizeof(size_t) - pool->allocated;
+}
+/* }}} */
+
+/* {{{ pool_compress_headroom
+       The space needed below a record of insize bytes for pool_compress to compress it in place,
+       or for LZ4 and zstd, which don't support overlapped compression, its worst case output */
+static zend_uint pool_compress_headroom(zend_uint insize TSRMLS_DC)
+{
+    switch (LPCG(compression_algo)) {
+        case 1:  /* = zero-run */
+            return ZRUN_INPLACE_MARGIN;
+        case 2:  /* = GZ */
+            return compressBound(insize) - insize;
+#ifdef HAVE_LPC_LZ4
+        case 3:  /* = LZ4 */
+            return LZ4_compressBound(insize);
+#endif
+#ifdef HAVE_LPC_ZSTD
+        case 4:  /* = ZSTD */
+            return ZSTD_compressBound(insize);
+#endif
+        default:
+            return 0;
     }
+}
+/* }}} */
+
+/* {{{ make_pool_rbvec 
+       Append the relocation bit vector to the pool.  */
+static zend_uchar *make_pool_rbvec(lpc_pool *pool)
+{ENTER(make_pool_rbvec)
+    size_t           nwords = pool->allocated/sizeof(size_t);
+    size_t           nmasks = RELOC_MASKS(nwords);
+    size_t          *rbvec;
+    TSRMLS_FETCH_FROM_POOL()
    /*
-    * Note that any further allocations MUST have a destination address outside the pool so as not
-    * to trigger further address tagging.  This of course includes the reloc_bvec itself.
-    */ 
-    pool_alloc(reloc_bvec, cnt);
-
-    /* Loop over relocation vector again, this time generating the relocation byte vector */
-    for (i = 0, q = reloc_bvec; i < reloc_vec_len; i++) {
-        if (reloc_vec[i]<=0x7f) { /* the typical case */
-            *q++ = (zend_uchar) (reloc_vec[i]);
-        } else {                  /* handle the pathological cases */
-            ro = reloc_vec[i];
-           /*
-            * Emit multi-bytes lsb first with 7 bits sig. and high-bit set to indicate follow-on.
-            */
-            *q++ = (zend_uchar)(ro & 0x7f) | 0x80;
-            if (ro <= 0x3fff) {
-                *q++ = (zend_uchar)((ro>>7) & 0x7f);
-            } else if (ro <= 0x1fffff) {
-                *q++ = (zend_uchar)((ro>>7) & 0x7f) | 0x80;
-                *q++ = (zend_uchar)((ro>>14) & 0x7f);    
-            } else if (ro <= 0xfffffff) {
-                *q++ = (zend_uchar)((ro>>7) & 0x7f) | 0x80;
-                *q++ = (zend_uchar)((ro>>14) & 0x7f) | 0x80;
-                *q++ = (zend_uchar)((ro>>21) & 0x7f);    
-            } else {
-                lpc_error("Fatal: invalid offset %lu found during internal copy"
-                          TSRMLS_CC,reloc_vec[i]);
-            }
-        }
-    }
-    *q++ = '\0'; /* add an end marker so the reverse process can terminate */
-    assert((zend_uchar *)q == reloc_bvec+cnt);
+    * The relocation vector is a bitmap with one bit per size_t word of the pool up to the start of
+    * the vector itself, lsb first within each size_t mask word. A bit is set if the corresponding
+    * word holds an internal pointer.  In real PHP opcode arrays internal pointers are dense, so
+    * this is typically smaller than a byte per pointer encoding.  The tags are already held in
+    * this form and as only words below allocated can be tagged, the leading mask words of the
+    * tags bitmap are simply copied into the pool directly after the tagged words.  
+    */
+    pool_alloc(rbvec, nmasks*sizeof(size_t));
+    memcpy(rbvec, pool->tags, nmasks*sizeof(size_t));
 
-    return reloc_bvec;
+    free(pool->tags);
+    pool->tags = NULL;
+
+    return (zend_uchar *) rbvec;
 }
+/* }}} */
 
 /* {{{ missed_tag_check */
 static void missed_tag_check(lpc_pool *pool)
@@ -912,6 +1295,13 @@ static void missed_tag_check(lpc_pool *pool)
     zend_uint    max_offset_x = ((pool_storage_header *)storage)->reloc_vec;
     zend_uint    max_offset   = max_offset_x * sizeof(size_t);
     zend_uint i, missed = 0, externs = 0;
+   /*
+    * Internal pointers serialized against a base equal to the storage address are unchanged by the
+    * relocation, so every one would be reported as missed.
+    */
+    if (((pool_storage_header *)storage)->base == (size_t) storage) {
+        return;
+    }
 
     IF_DEBUGP(RELR) {
         lpc_debug("=== Missed Report ====" TSRMLS_PC);
@@ -949,57 +1339,134 @@ static void missed_tag_check(lpc_pool *pool)
 }
 /* }}} */
 
+/* {{{ relocate_words
+       The copy-in relocation kernel, which adds delta to each word of the pool flagged in the 
+       relocation bit vector.  All zero mask words are skipped, and the x86-64 builds process
+       the set mask words 4 (AVX2) or 2 (SSE2) lanes at a time, using the mask bits to select
+       which lanes are adjusted.  Other builds use a scalar loop over the set bits. */
+static void relocate_words(size_t *q, const size_t *rbvec, size_t nmasks, size_t delta)
+{
+    size_t i;
+#if defined(RELOC_AVX2)
+    __m256i vdelta = _mm256_set1_epi64x((long long) delta);
+    __m256i vbits  = _mm256_set_epi64x(8, 4, 2, 1);
+
+    for (i = 0; i < nmasks; i++, q += RELOC_BITS) {
+        size_t m = rbvec[i];
+        int    j;
+        for (j = 0; m; j += 4, m >>= 4) {
+            if (m & 0xf) {
+                __m256i sel = _mm256_cmpeq_epi64(
+                                  _mm256_and_si256(_mm256_set1_epi64x(m & 0xf), vbits), vbits);
+                __m256i v   = _mm256_loadu_si256((__m256i *)(q + j));
+                _mm256_storeu_si256((__m256i *)(q + j), 
+                                    _mm256_add_epi64(v, _mm256_and_si256(sel, vdelta)));
+            }
+        }
+    }
+#elif defined(RELOC_SSE2)
+    static const size_t lanes[4][2] = {{0,0}, {~(size_t)0,0}, {0,~(size_t)0}, {~(size_t)0,~(size_t)0}};
+    __m128i vdelta = _mm_set1_epi64x((long long) delta);
+
+    for (i = 0; i < nmasks; i++, q += RELOC_BITS) {
+        size_t m = rbvec[i];
+        int    j;
+        for (j = 0; m; j += 2, m >>= 2) {
+            if (m & 0x3) {
+                __m128i sel = _mm_loadu_si128((__m128i *) lanes[m & 0x3]);
+                __m128i v   = _mm_loadu_si128((__m128i *)(q + j));
+                _mm_storeu_si128((__m128i *)(q + j), 
+                                 _mm_add_epi64(v, _mm_and_si128(sel, vdelta)));
+            }
+        }
+    }
+#else
+    for (i = 0; i < nmasks; i++, q += RELOC_BITS) {
+        size_t m = rbvec[i];
+        while (m) {
+            q[RELOC_CTZ(m)] += delta;
+            m &= m - 1;
+        }
+    }
+#endif
+}
+/* }}} */
+
 /* {{{ relocate_pool */
-static void *relocate_pool(lpc_pool *pool, zend_bool copy_out)
+static void relocate_pool(lpc_pool *pool, zend_bool copy_out)
 {ENTER(relocate_pool)
-   /* The relocation byte vector (rbvec) contains the byte offset (in size_t units) of each
-    * pointer to be relocated. As discussed above, these pointers are a LOT denser than every 
-    * 127 longs (1016 bytes), but the encoding uses a simple high-bit multi-byte escape to
-    * encode exceptions.  Also note that 0 is used as a terminator excepting that the first
-    * entry can validly be '0' 
+   /*
+    * The relocation bit vector (rbvec) has a bit set for each size_t word of the pool which holds
+    * an internal pointer.  On copy-out these are converted to their serialized form relative to
+    * base, and on copy-in back to absolute addresses. Copy-out is done by a checked scalar loop, 
+    * as is copy-in in debug builds; otherwise copy-in uses the relocate_words kernel.  Note that
+    * the record integrity is already covered by the compression algo checks.
     */  
     pool_storage_header *hdr = pool->storage;    /* The header block is the first allocated */
-    zend_uchar  *rbvec       = (zend_uchar*) ADD_PTROFF(pool->storage,hdr->reloc_vec);
-    zend_uchar  *p           = rbvec;
+    size_t      *rbvec       = ADD_PTROFF(pool->storage, hdr->reloc_vec);
+    size_t       nmasks      = RELOC_MASKS(hdr->reloc_vec);
     size_t      *q           = (size_t *)pool->storage;
     size_t       maxqval     = pool->allocated;
+    size_t       base        = hdr->base;
+    size_t       delta       = (size_t) pool->storage - base;
+    size_t       i;
     TSRMLS_FETCH_FROM_POOL()
    /*
-    * Use a do {} while loop rather than a while{} loop because the first byte offset can by zero, 
-    * but any other is a terminator 
+    * A pool serialized against its base and loaded back at the same address needs no relocation
     */
-    do {
-        if (p[0]<128) {         /* offset <1K the typical case */
-            q += *p++;
-        } else if (p[1]<128) {  /* offset <128Kb */
-            q += (uint)(p[0] & 0x7f) + (((uint)p[1])<<7);
-            p += 2;
-        } else if (p[2]<128) {  /* offset <16Mb */
-            q += (uint)(p[0] & 0x7f) + ((uint)(p[1] & 0x7f)<<7) + (((uint)p[2])<<14);
-            p += 3;
-        } else if (p[3]<128) {  /* offset <2Gb Ho-ho */
-            q += (uint)(p[0] & 0x7f)      + ((uint)(p[1] & 0x7f)<<7) + 
-                ((uint)(p[2] & 0x7f)<<14) + (((uint)p[3])<<21);
-            p += 3;
-        }
-        if (copy_out) {
-            if ((unsigned) GET_PTROFF(*q, pool->storage) >= maxqval) {
-                lpc_error("Relocation error: external pointer %08lx at offset %08lx in serial pool"
-                          TSRMLS_CC, *q, GET_BYTEOFF(q, pool->storage));
-            } else { 
-                *q -= (size_t) pool->storage;
-            }
-        } else { /* copy in */
-            if (*q >= maxqval) {
-                lpc_error("Relocation error: invalid offset %08lx at offset %08lx in serial pool"
-                          TSRMLS_CC, *q, GET_BYTEOFF(q, pool->storage));
-            } else { 
-                *q += (size_t) pool->storage;
+    if (delta == 0 && !copy_out) {
+        DEBUG1(RELC, "Pool loaded at its base 0x%012lx, so relocation skipped", base);
+        return;
+    }
+#ifndef LPC_DEBUG
+    if (!copy_out) {
+        relocate_words(q, rbvec, nmasks, delta);
+        return;
+    }
+#endif
+    for (i = 0; i < nmasks; i++, q += RELOC_BITS) {
+        size_t m = rbvec[i];
+        while (m) {
+            size_t *w = q + RELOC_CTZ(m);
+            m &= m - 1;
+            if (copy_out) {
+                if ((size_t) GET_BYTEOFF(*w, pool->storage) >= maxqval) {
+                    lpc_error("Relocation error: external pointer %08lx at offset %08lx in serial "
+                              "pool" TSRMLS_CC, *w, GET_BYTEOFF(w, pool->storage));
+                } else { 
+                    *w -= delta;
+                }
+            } else { /* copy in */
+                if (*w - base >= maxqval) {
+                    lpc_error("Relocation error: invalid offset %08lx at offset %08lx in serial "
+                              "pool" TSRMLS_CC, *w, GET_BYTEOFF(w, pool->storage));
+                } else { 
+                    *w += delta;
+                }
             }
         }
-    } while (*p != '\0');
-   
-    assert(GET_BYTEOFF(q, pool->storage) <= pool->allocated);
+    }
+}
+/* }}} */
+
+/* {{{ interned_strings_size
+       The size of the serialized interned strings, or 0 if there are none */
+static zend_uint interned_strings_size(HashTable *ht)
+{
+    int        i, cnt = zend_hash_num_elements(ht);
+    zend_uint  size = 0, sn = 0;
+    char      *s;
+
+    if (cnt == 0) {
+        return 0;
+    }
+    zend_hash_internal_pointer_reset(ht);
+    for (i = 0; i < cnt; i++) {
+        zend_hash_get_current_key_ex(ht, &s, &sn, NULL,  0, NULL);
+        zend_hash_move_forward(ht);
+        size += sn;   /* total up the sum of the string lengths */
+    }
+    return ((cnt+2)*sizeof(uint)) + size;
 }
 /* }}} */
 
@@ -1014,21 +1481,14 @@ static zend_uchar* generate_interned_strings(lpc_pool *pool)
     */
     HashTable *ht = &LPCGP(intern_hash);
     int  i, cnt = zend_hash_num_elements(ht);
-    zend_uint size = 0, sn = 0, total_size;
+    zend_uint sn = 0, total_size;
     zend_uchar *s, *d, *interned_vec;
 
     if (cnt == 0) {
         return NULL;
     }
 
-    zend_hash_internal_pointer_reset(ht);
-    for (i = 0; i < cnt; i++) {
-        zend_hash_get_current_key_ex(ht, (char **) &s, &sn, NULL,  0, NULL);
-        zend_hash_move_forward(ht);
-        size += sn;   /* total up the sum of the string lengths */
-    }
-
-    total_size = ((cnt+2)*sizeof(uint)) + size;
+    total_size = interned_strings_size(ht);
 
     pool_alloc(interned_vec, total_size);
     ((zend_uint *)interned_vec)[0] = total_size; /*allocs are size_t aligned so this is OK */
@@ -1043,7 +1503,7 @@ static zend_uchar* generate_interned_strings(lpc_pool *pool)
         d += sizeof(uint)+sn;
     }
 
-    assert((d-interned_vec) == (cnt+2)*sizeof(uint) + size);
+    assert((d-interned_vec) == total_size);
     zend_hash_destroy(ht);
     memset(ht, 0, sizeof(HashTable));
 
@@ -1051,68 +1511,315 @@ static zend_uchar* generate_interned_strings(lpc_pool *pool)
 }
 /* }}} */
 
-/* {{{ pool_compress */
-static int pool_compress(zend_uchar *outbuf, zend_uchar *inbuf, zend_uint insize TSRMLS_DC)
-{ENTER(pool_compress)
+/* {{{ Zero-run codec helpers
+ *
+ * A zero-run record is a sequence of tokens, each a run of zeros followed by a run of literal bytes.
+ * The token starts with a prefix byte 0xZL, where Z is the zero count and L the literal count, and
+ * a nibble of 15 means that the count is 15 plus an unsigned LEB128 value which follows (Z's then
+ * L's).  The L literal bytes follow, and the record ends with the CRC32C of the tokens.  Since a 
+ * literal run is only ended by ZRUN_MIN or more zeros, only the first token can expand its input.
+ */
+static const zend_uint crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+/* {{{ crc32c_sw */
+static zend_uint crc32c_sw(zend_uint crc, const zend_uchar *p, size_t n)
+{
+    for (; n; n--) {
+        crc = (crc >> 8) ^ crc32c_table[(zend_uchar)crc ^ *p++];
+    }
+    return crc;
+}
+/* }}} */
 
-    if (LPCG(compression_algo) == 1) {           /* 1 = RLE */
-        zend_uchar *p = inbuf, *pend = inbuf+insize, *q = outbuf;
-        zend_uchar *s;
-        int i, j, outsize;
-        uint final_crc;
-
-        while ( p < pend ) {
-            for (i = 0, j = 0; *p == 0; i++, p++) {}  /* count zero bytes */
-            if (p >= pend) {                          /* then the zeros run past the end */
-                i -= (p - pend);                      /* so trim to last true zero */
-                p = pend;
-            } else {
-                for (s = p; *p != 0; j++, p++) {}     /* count non-zero bytes */
-                if (p >= pend) {                      /* then the non-zeros run past the end */
-                    j -= (p - pend);                  /* so trim to last true non-zero */
-                    p = pend;
-                }
-            }
-           /*
-            * We now have i zeros followed by j non-zeros. The O/P is a repeat of a prefix byte 0xNM
-            * where N is the number of zeros (0..15) and M the number of non-zero bytes (0..15)
-            * followed by M non-zero bytes.  Clearly if i>15 then extra 0xf0's are needed and 
-            * if j>15 the o/p string will require an extra 0x0f prefix every 16th character.
-            */
+#if defined(CRC32C_SSE42)
+/* {{{ crc32c_sse42 */
+__attribute__((target("sse4.2")))
+static zend_uint crc32c_sse42(zend_uint crc, const zend_uchar *p, size_t n)
+{
+    unsigned long long c = crc, w;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (crc = (zend_uint) c; n; n--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+/* }}} */
+#endif
 
-            for (; i > 15;i -= 15) { *q++ = 0xf0; }  /* emit any extra zero run prefixes */
+/* {{{ pool_crc32c */
+static zend_uint pool_crc32c(const zend_uchar *p, size_t n)
+{
+    zend_uint crc = 0xFFFFFFFF;
+#if defined(CRC32C_SSE42)
+    static int has_sse42 = -1;
 
-            for (; j > 15; j -= 15, q += 15, s += 15) {
-                *q++ = (i<<4) + 0x0f;                /* emit blocks of prefix + 15 non-zero bytes */
-                memcpy(q, s, 15);
-                i = 0;
-            }
+    if (has_sse42 < 0) {
+        has_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    crc = has_sse42 ? crc32c_sse42(crc, p, n) : crc32c_sw(crc, p, n);
+#elif defined(CRC32C_ARM)
+    uint64_t w;
 
-            *q++ = (i<<4) + j;                       /* emit the last block with the prefix set */
-            memcpy(q, s, j);                         /* to the residue i/j                      */
-            q += j;
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+    }
+    for (; n; n--) {
+        crc = __crc32cb(crc, *p++);
+    }
+#else
+    crc = crc32c_sw(crc, p, n);
+#endif
+    return crc ^ 0xFFFFFFFF;
+}
+/* }}} */
 
-            if (q >= p) {                            /* bailout if overlap overflow has occurred */
-                lpc_throw_storage_overflow();
-            }
+/* {{{ zrun_zero_mask
+       Returns a mask with bit i set if byte i of the ZRUN_BLOCK bytes at p is zero */
+static zend_always_inline zend_uint zrun_zero_mask(const zend_uchar *p)
+{
+#if defined(RELOC_AVX2)
+    return (zend_uint) _mm256_movemask_epi8(
+               _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), _mm256_setzero_si256()));
+#elif defined(RELOC_SSE2)
+    return (zend_uint) _mm_movemask_epi8(
+               _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), _mm_setzero_si128()));
+#elif defined(ZRUN_NEON)
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(p), vdupq_n_u8(0)), vld1q_u8(bits));
+
+    return (zend_uint) vaddv_u8(vget_low_u8(m)) | ((zend_uint) vaddv_u8(vget_high_u8(m)) << 8);
+#else
+    zend_uint m = 0;
+    int       i;
+
+    for (i = 0; i < ZRUN_BLOCK; i++) {
+        m |= (zend_uint) (p[i] == 0) << i;
+    }
+    return m;
+#endif
+}
+/* }}} */
+
+/* {{{ zrun_skip_zeros
+       Returns the address of the first non-zero byte at or after p, or pend */
+static const zend_uchar *zrun_skip_zeros(const zend_uchar *p, const zend_uchar *pend)
+{
+    zend_uint m;
+
+    for (; p + ZRUN_BLOCK <= pend; p += ZRUN_BLOCK) {
+        if ((m = zrun_zero_mask(p)) != ZRUN_ALL_ZERO) {
+            return p + RELOC_CTZ(~m);
         }
-        outsize = q - outbuf;
-        {
-           	register zend_uint crc = 0xFFFFFFFF;
-            zend_uchar *p=outbuf;        
-            for (i = 0; i < outsize; i++) {
-                crc = (crc >> 8) ^ crc32tab[(zend_uchar)crc ^ *p++];
+    }
+    while (p < pend && *p == 0) {
+        p++;
+    }
+    return p;
+}
+/* }}} */
+
+/* {{{ zrun_skip_literals
+       Returns the address of the first run of ZRUN_MIN zeros (or of zeros to the end of the
+       record) at or after p, or pend */
+static const zend_uchar *zrun_skip_literals(const zend_uchar *p, const zend_uchar *pend)
+{
+    zend_uint m;
+    int       n;
+
+    while (p < pend) {
+        for (; p + ZRUN_BLOCK <= pend; p += ZRUN_BLOCK) {   /* find the next zero byte */
+            if ((m = zrun_zero_mask(p)) != 0) {
+                p += RELOC_CTZ(m);
+                break;
             }
-            final_crc = crc^0xFFFFFFFF;
-            memcpy(p, &final_crc, sizeof(uint));
         }
-        return (q+4) - outbuf;
+        while (p < pend && *p != 0) {
+            p++;
+        }
+        for (n = 1; n < ZRUN_MIN && p + n < pend && p[n] == 0; n++) {}
+        if (p >= pend || n == ZRUN_MIN || p + n == pend) {
+            return p;
+        }
+        p += n;
+    }
+    return pend;
+}
+/* }}} */
+
+/* {{{ zrun_put_count / zrun_get_count
+       Encode and decode the LEB128 extension of a count */
+static zend_uchar *zrun_put_count(zend_uchar *q, size_t n)
+{
+    for (; n >= 0x80; n >>= 7) {
+        *q++ = (zend_uchar) (n | 0x80);
+    }
+    *q++ = (zend_uchar) n;
+    return q;
+}
+
+static size_t zrun_get_count(const zend_uchar **pp, const zend_uchar *pend)
+{
+    const zend_uchar *p = *pp;
+    size_t            n = 0;
+    int               shift;
+
+    for (shift = 0; p < pend && shift < 35; shift += 7) {
+        n |= (size_t) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            break;
+        }
+    }
+    *pp = p;
+    return n;
+}
+/* }}} */
+
+/* {{{ zrun_encode
+       Encode the record [p,pend) into q, which may be below p in the same buffer.  Returns the
+       end of the encoded tokens, or NULL if the output would overrun the unread input. */
+static zend_uchar *zrun_encode(zend_uchar *q, const zend_uchar *p, const zend_uchar *pend)
+{
+    while (p < pend) {
+        const zend_uchar *z = p, *s;
+        size_t            nz, nl;
+        zend_uchar        prefix[1 + 2*5], *t = prefix + 1;
+
+        s  = zrun_skip_zeros(z, pend);
+        p  = zrun_skip_literals(s, pend);
+        nz = s - z;
+        nl = p - s;
+
+        prefix[0] = (zend_uchar) ((MIN(nz, 15) << 4) | MIN(nl, 15));
+        if (nz >= 15) {
+            t = zrun_put_count(t, nz - 15);
+        }
+        if (nl >= 15) {
+            t = zrun_put_count(t, nl - 15);
+        }
+        if (q + (t - prefix) + nl > p) {
+            return NULL;
+        }
+        memcpy(q, prefix, t - prefix);
+        q += t - prefix;
+        memmove(q, s, nl);
+        q += nl;
+    }
+    return q;
+}
+/* }}} */
+
+/* {{{ zrun_decode
+       Decode the tokens [p,pend) into [q,qend), which is either below p in the same buffer, as
+       for in-place expansion, or in a separate buffer at a lower address.  Short
+       runs are written as single 16 byte stores where these can't overrun the unread input or
+       the output.  Returns the end of the output, or NULL if the tokens are inconsistent.  */
+static zend_uchar *zrun_decode(zend_uchar *q, zend_uchar *qend, 
+                               const zend_uchar *p, const zend_uchar *pend)
+{
+    static const zend_uchar zeros[16] = {0};
+
+    while (p < pend) {
+        size_t nz = *p >> 4, nl = *p++ & 0x0f;
+
+        if (nz == 15) {
+            nz += zrun_get_count(&p, pend);
+        }
+        if (nl == 15) {
+            nl += zrun_get_count(&p, pend);
+        }
+        if (nz + nl > (size_t) (qend - q) || nl > (size_t) (pend - p) || q + nz > p) {
+            return NULL;
+        }
+        if (nz <= 16 && q + 16 <= p && q + 16 <= qend) {
+            memcpy(q, zeros, 16);
+        } else {
+            memset(q, 0, nz);
+        }
+        q += nz;
+        if (nl <= 16 && q + 16 <= p && q + 16 <= qend && p + 16 <= pend) {
+            memcpy(q, p, 16);
+        } else {
+            memmove(q, p, nl);
+        }
+        q += nl;
+        p += nl;
+    }
+    return q;
+}
+/* }}} */
+/* }}} */
+
+/* {{{ pool_compress */
+static int pool_compress(zend_uchar *outbuf, zend_uchar *inbuf, zend_uint insize TSRMLS_DC)
+{ENTER(pool_compress)
+
+    if (LPCG(compression_algo) == 1) {           /* 1 = zero-run */
+        zend_uchar *q = zrun_encode(outbuf, inbuf, inbuf + insize);
+        zend_uint   crc;
+
+        if (!q || q + sizeof(crc) > inbuf + insize) {  /* the headroom should prevent any overlap */
+            lpc_error("Internal error: zero-run output overran its input during compression" TSRMLS_CC);
+            zend_bailout();
+        }
+        crc = pool_crc32c(outbuf, q - outbuf);
+        memcpy(q, &crc, sizeof(crc));
+        return (q + sizeof(crc)) - outbuf;
 
     } else if (LPCG(compression_algo) == 2) {    /* 2 = GZ  */
         ulong outsize = (inbuf - outbuf) + insize; 
 
         if (outsize < compressBound(insize)) {
-            lpc_throw_storage_overflow();
+            lpc_error("Internal error: compression headroom is below the zlib bound" TSRMLS_CC);
+            zend_bailout();
         }
         if (compress2(outbuf, &outsize, inbuf, (uLong) insize, 2)==Z_OK) {
             return outsize;
@@ -1121,6 +1828,56 @@ static int pool_compress(zend_uchar *outbuf, zend_uchar *inbuf, zend_uint insize
             zend_bailout();
         }
 
+   /*
+    * Neither LZ4 nor zstd support overlapped compression, so the output is limited to the headroom
+    * below the top-justified input.  The callers size this headroom to the algo's compress bound 
+    * (see pool_compress_headroom), so a record that doesn't fit is an internal sizing error and is 
+    * fatal.
+    */
+#ifdef HAVE_LPC_LZ4
+    } else if (LPCG(compression_algo) == 3) {    /* 3 = LZ4 */
+        int outsize = LZ4_compress_default((const char *) inbuf, (char *) outbuf, 
+                                           (int) insize, (int) (inbuf - outbuf));
+        if (outsize <= 0) {
+            lpc_error("Internal error: compression headroom is below the LZ4 bound" TSRMLS_CC);
+            zend_bailout();
+        }
+        return outsize;
+#endif
+
+#ifdef HAVE_LPC_ZSTD
+    } else if (LPCG(compression_algo) == 4) {    /* 4 = ZSTD */
+        size_t outsize;
+        FETCH_GLOBAL_VEC()
+
+        if (gv->zstd_dict_size) {                /* compress using the cache-wide dictionary */
+            if (!gv->zstd_cdict) {
+                gv->zstd_cdict = ZSTD_createCDict(gv->zstd_dict, gv->zstd_dict_size, ZSTD_LEVEL);
+            }
+            if (!gv->zstd_cctx) {
+                gv->zstd_cctx  = ZSTD_createCCtx();
+            }
+            if (!gv->zstd_cdict || !gv->zstd_cctx) {
+                lpc_error("Out of memory creating zstd compression dictionary" TSRMLS_CC);
+                zend_bailout();
+            }
+            outsize = ZSTD_compress_usingCDict((ZSTD_CCtx *) gv->zstd_cctx, 
+                                               outbuf, (size_t) (inbuf - outbuf),
+                                               inbuf, insize, (ZSTD_CDict *) gv->zstd_cdict);
+        } else {
+            outsize = ZSTD_compress(outbuf, (size_t) (inbuf - outbuf), inbuf, insize, ZSTD_LEVEL);
+        }
+        if (ZSTD_isError(outsize)) {
+            if (ZSTD_getErrorCode(outsize) != ZSTD_error_dstSize_tooSmall) {
+                lpc_error("zstd compression error: %s" TSRMLS_CC, ZSTD_getErrorName(outsize));
+                zend_bailout();
+            }
+            lpc_error("Internal error: compression headroom is below the zstd bound" TSRMLS_CC);
+            zend_bailout();
+        }
+        return outsize;
+#endif
+
     } else {                                     /* 0 = none */
 
         memcpy(outbuf, inbuf, insize);
@@ -1135,44 +1892,54 @@ static void pool_uncompress(zend_uchar *outbuf, zend_uint outsize,
                             zend_uchar *inbuf, zend_uint insize TSRMLS_DC)
 {ENTER(pool_uncompress)
 
-    if (LPCG(compression_algo) == 1) {           /* 1 = RLE */
-        zend_uchar *p = inbuf, *pend, *q;
-        {
-            uint i, final_crc;
-           	register zend_uint crc = 0xFFFFFFFF; 
-            insize -= 4;
-            
-            for (i = 0; i < insize; i++) {
-                crc = (crc >> 8) ^ crc32tab[(zend_uchar)crc ^ *p++];
-            }
-            memcpy(&final_crc, p, sizeof(uint));
-            if ((crc^0xFFFFFFFF) != final_crc) {
-                lpc_error("CRC mismatch on record read: calculated 0x%08x; read 0x%08x" TSRMLS_CC, 
-                crc^0xFFFFFFFF, final_crc);
-                zend_bailout();
-            }
-        }
-        p    = inbuf;
-        pend = inbuf+insize;
-        q    = outbuf;
-        while ( p < pend ) {
-            int num_zeros     = (*p & 0xf0)>>4;
-            int num_non_zeros = *p++ & 0x0f;
-
-            memset (q, 0, num_zeros);
-            q += num_zeros;
-            memcpy (q, p, num_non_zeros);
-            p += num_non_zeros;
-            q += num_non_zeros;
+    if (LPCG(compression_algo) == 1) {           /* 1 = zero-run */
+        zend_uint crc, stored_crc;
+
+        CHECK(insize >= sizeof(crc));
+        insize -= sizeof(crc);
+        crc = pool_crc32c(inbuf, insize);
+        memcpy(&stored_crc, inbuf + insize, sizeof(crc));
+        if (crc != stored_crc) {
+            lpc_error("CRC mismatch on record read: calculated 0x%08x; read 0x%08x" TSRMLS_CC, 
+                      crc, stored_crc);
+            zend_bailout();
         }
+        CHECK(zrun_decode(outbuf, outbuf + outsize, inbuf, inbuf + insize) == outbuf + outsize);
 
-        CHECK(q == outbuf + outsize);
     } else if (LPCG(compression_algo) == 2) {    /* 2 = GZ  */
         ulong expanded_size = outsize;
 
         CHECK(uncompress(outbuf, &expanded_size, inbuf, insize) == Z_OK &&
               expanded_size == outsize);
 
+#ifdef HAVE_LPC_LZ4
+    } else if (LPCG(compression_algo) == 3) {    /* 3 = LZ4 */
+
+        CHECK(LZ4_decompress_safe((const char *) inbuf, (char *) outbuf, 
+                                  (int) insize, (int) outsize) == (int) outsize);
+#endif
+
+#ifdef HAVE_LPC_ZSTD
+    } else if (LPCG(compression_algo) == 4) {    /* 4 = ZSTD */
+
+        FETCH_GLOBAL_VEC()
+
+        if (gv->zstd_dict_size) {                /* decompress using the cache-wide dictionary */
+            if (!gv->zstd_ddict) {
+                gv->zstd_ddict = ZSTD_createDDict(gv->zstd_dict, gv->zstd_dict_size);
+            }
+            if (!gv->zstd_dctx) {
+                gv->zstd_dctx  = ZSTD_createDCtx();
+            }
+            CHECK(gv->zstd_ddict && gv->zstd_dctx &&
+                  ZSTD_decompress_usingDDict((ZSTD_DCtx *) gv->zstd_dctx, outbuf, outsize, 
+                                             inbuf, insize, 
+                                             (ZSTD_DDict *) gv->zstd_ddict) == outsize);
+        } else {
+            CHECK(ZSTD_decompress(outbuf, outsize, inbuf, insize) == outsize);
+        }
+#endif
+
     } else {                                     /* 0 = none */
 
         if ( outbuf != inbuf) memcpy(outbuf, inbuf, insize);
@@ -50,6 +50,12 @@
 
 typedef struct _zend_lpc_globals zend_lpc_globals;
 
+/*
+ * The serial format version is recorded in the cache context record, so that any change to the
+ * layout of a serialized pool forces a rebuild of existing caches.
+ */
+#define LPC_SERIAL_FORMAT 4
+
 /* {{{ Public pool types */
 typedef enum {
     LPC_EXECPOOL      = 0x0,  /* The Zend execution environment handles memory recovery */
@@ -57,6 +63,8 @@ typedef enum {
     LPC_RO_SERIALPOOL = 0x2   /* A pool in which all storage is in contiguous blocks */
 } lpc_pool_type_t;
 
+typedef struct _lpc_pool_chunk lpc_pool_chunk;   /* private to lpc_pool.c */
+
 typedef struct _lpc_pool {
 #ifdef ZTS
     void         ***tsrm_ls;         /* the thread context in ZTS builds */
@@ -66,10 +74,15 @@ typedef struct _lpc_pool {
     zend_uint       size;            /* sum of individual element sizes */
     zend_uint       count;           /* count of pool elements*/
     /* The following fields are only used for serial pools */
-    void           *storage;         /* pointer to storage vector */
-    zend_uint       available;       /* bytes available in current brick -- ditto */
-    zend_uint       allocated;       /* bytes available in current brick -- ditto */
-    HashTable       tags;            /* tag hash */
+    void           *storage;         /* pointer to the contiguous storage vector, once flattened */
+    zend_uint       available;       /* bytes available in the storage vector -- ditto */
+    zend_uint       allocated;       /* bytes allocated in the storage vector -- ditto */
+    lpc_pool_chunk *chunks;          /* chain of pointer-bearing chunks during copy-out */
+    lpc_pool_chunk *chunk;           /* ... and the current (last) one */
+    lpc_pool_chunk *data_chunks;     /* chain of pointer-free data chunks during copy-out */
+    lpc_pool_chunk *data_chunk;      /* ... and the current (last) one */
+    size_t         *tags;            /* tag bitmap, one bit per size_t word of the flattened pool */
+    zend_uint       tags_masks;      /* number of size_t mask words in tags */
     /* The following fields are only used for exec pools */
     zend_uchar     *intern_copy;
 } lpc_pool;
@@ -100,6 +113,10 @@ typedef struct _lpc_pool {
 #define pool_strcmp(dst,src)  _lpc_pool_strcmp((dst), (src), pool ZEND_FILE_LINE_CC)
 #define pool_strncmp(dst,src,n)  _lpc_pool_strncmp((dst),(src),(n), pool ZEND_FILE_LINE_CC)
 #define pool_memcpy(dst,src,n) _lpc_pool_memcpy((void **)&(dst),src,n,pool ZEND_FILE_LINE_CC)
+#define pool_alloc_data(dest, size) \
+    _lpc_pool_alloc_data((void **)&(dest), pool, size ZEND_FILE_LINE_CC)
+#define pool_memcpy_data(dst,src,n) \
+    _lpc_pool_memcpy_data((void **)&(dst),src,n,pool ZEND_FILE_LINE_CC)
 
 #define pool_tag_ptr(p) _lpc_pool_tag_ptr((void **)&(p), pool ZEND_FILE_LINE_CC)
 #define is_exec_pool() (pool->type == LPC_EXECPOOL)
@@ -119,11 +136,20 @@ typedef struct _lpc_pool {
  * it has an important functional difference from strndup() in that n bytes are always copied 
  * because the Zend engine supports zero-embedded strings, and uses them in mangled function and
  * class names.
+ *
+ * pool_alloc_data and pool_memcpy_data must only be used for elements which contain no pointers,
+ * such as doc comments and the brk/cont and try/catch arrays.  In serial pools these are allocated
+ * from a separate chain of chunks and are placed after the pointer-bearing elements when the pool
+ * is flattened on serialization, so that the relocation on reload only dirties the pages of the
+ * latter. 
  */
 extern void _lpc_pool_alloc(void **dest, lpc_pool* pool, uint size ZEND_FILE_LINE_DC);
+extern void _lpc_pool_alloc_data(void **dest, lpc_pool* pool, uint size ZEND_FILE_LINE_DC);
 extern void _lpc_pool_alloc_zval(void **dest, lpc_pool* pool ZEND_FILE_LINE_DC);
 extern void _lpc_pool_alloc_ht(void **dest, lpc_pool* pool ZEND_FILE_LINE_DC);
 extern void _lpc_pool_memcpy(void **dest, const void* p, uint n, lpc_pool* pool ZEND_FILE_LINE_DC);
+extern void _lpc_pool_memcpy_data(void **dest, const void* p, uint n, 
+                                  lpc_pool* pool ZEND_FILE_LINE_DC);
 extern void _lpc_pool_strdup(const char **d, const char* s, 
                              zend_bool type, lpc_pool* pool ZEND_FILE_LINE_DC);
 extern void _lpc_pool_nstrdup(const char **d, uint *dn, const char* s, uint sn, 
@@ -166,16 +192,31 @@ extern void lpc_pool_shutdown(TSRMLS_D);
  * Exec pools are only created as the destination for copy-in and here only the create and destroy
  * functions are used; the lcp_pool_storage() function is only used for serial pools.
  *
- * Also note that the copy-out allocators can bailout with an raise a LPC_POOL_OVERFLOW status, and
- * the upper logic must recover and retry the lpc_pool_create() ... lpc_pool_destroy() sequence (as
- * the create will allocate extra pool memory on retry). 
+ * Also note that the copy-out allocators don't overflow.  A serial pool grows by adding chunks of
+ * storage, and lpc_pool_serialize() flattens these into a single image in the pool buffer, which
+ * it sizes for the image plus the headroom that the compression algo needs.
  */
 extern void        lpc_pool_storage(zend_uint, zend_uint, zend_uchar** TSRMLS_DC);
 /*  Booking RO serial storage       rec_size   comp_size  &comp_buffer                      */
 /*  Booking    serial storage       0          0          NULL                              */
-/*  Extending  serial storage       incr       0          NULL (after Overflow retry)       */
 /*  Conditionally freeing       (unsigned) -1  0          NULL                              */
 
+extern zend_uchar* lpc_pool_image(zend_bool expand TSRMLS_DC);
+/*  Locating the uncompressed image in booked RO serial storage, expanding the compressed record   */
+/*  into it if expand is set.  Either way lpc_pool_create then treats the image as already expanded */
+
+extern zend_bool   lpc_pool_compression_supported(zend_uint algo);
+/*  Is the lpc.compression algo (0 = none; 1 = zero-run; 2 = GZ; 3 = LZ4; 4 = ZSTD) in the build */
+
+extern void        lpc_pool_set_dict(zend_uchar *dict, zend_uint dict_size TSRMLS_DC);
+extern zend_uint   lpc_pool_train_dict(zend_uchar *dict, zend_uint capacity, 
+                                       const zend_uchar *samples, const size_t *sample_sizes, 
+                                       zend_uint n TSRMLS_DC);
+extern zend_uchar* lpc_pool_compress_image(const zend_uchar *image, zend_uint size,
+                                           zend_uint *compressed_size TSRMLS_DC);
+/*  Setting or clearing the cache-wide zstd dictionary, training one over a set of sample images,  */
+/*  and compressing an image outside a serial pool, all for lpc.compression = 4                     */
+
 extern lpc_pool*   lpc_pool_create(lpc_pool_type_t type, void** first_rec TSRMLS_DC);
 extern zend_uchar* lpc_pool_serialize(lpc_pool* pool, zend_uint* compressed_size, 
                                       zend_uint* record_size);
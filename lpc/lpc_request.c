@@ -27,6 +27,7 @@
 #include "lpc.h"
 #include "lpc_request.h"
 #include "lpc_copy_source.h"
+#include "lpc_shm.h"
 
 /* {{{ module variables */
 zend_compile_t *lpc_old_compile_file;
@@ -70,6 +71,7 @@ int lpc_module_shutdown(TSRMLS_D)
 {ENTER(lpc_module_shutdown)
     if (LPCG(initialized)) {
         zend_compile_file = lpc_old_compile_file;
+        lpc_shm_detach();
         LPCG(initialized) = 0;
     }
     return 0;
@@ -124,9 +126,19 @@ int lpc_request_init(TSRMLS_D)
     gv->clear_parameter  = INI_STR("lpc.clear_parameter");
     gv->resolve_paths    = INI_BOOL("lpc.resolve_paths") ? 1 : 0;
     gv->debug_flags      = INI_INT("lpc.debug_flags");
-    gv->compression_algo = MIN(2,INI_INT("lpc.compression"));
+    gv->compression_algo = MIN(4,INI_INT("lpc.compression"));
+    if (!lpc_pool_compression_supported(gv->compression_algo)) {
+        gv->compression_algo = 2;                      /* fall back to GZ, which is always built */
+    }
     gv->storage_quantum  = lpc_atol(INI_STR("lpc.storage_quantum"), 0);
     gv->reuse_serial_buffer = INI_BOOL("lpc.reuse_serial_buffer") ? 1 : 0;
+    gv->shm_size         = lpc_atol(INI_STR("lpc.shm_size"), 0);
+    gv->shm_dir          = INI_STR("lpc.shm_dir");
+    gv->persistent_size  = lpc_atol(INI_STR("lpc.persistent_size"), 0);
+    gv->zstd_dict_max    = lpc_atol(INI_STR("lpc.zstd_dictionary_size"), 0);
+#ifndef ZTS
+    gv->pool_base        = (size_t) lpc_atol(INI_STR("lpc.pool_base"), 0);
+#endif
     if (gv->storage_quantum < 32768) {
         lpc_error("Invalid INI setting  %u is not a valid lpc.storage_quantum value. LPC disabled"
                   TSRMLS_CC, gv->storage_quantum);
@@ -160,6 +172,13 @@ int lpc_request_init(TSRMLS_D)
     IF_DEBUG(LOG_OPCODES) {
         LPCG(opcode_logger) = php_stream_open_wrapper("/tmp/opcodes.log", "a+", 0, NULL);
     }
+   /*
+    * Map the shared memory module cache if enabled.  This mapping persists for the life of the
+    * process, so this is only a check that the effective UID hasn't changed on subsequent requests.
+    */
+    if (gv->shm_size && !lpc_shm_attach(TSRMLS_C)) {
+        gv->shm_size = 0;
+    }
    /* 
     * Generate the cache name and create the cache.  Disable caching if any probs.  
     */
@@ -0,0 +1,363 @@
+/*
+  +----------------------------------------------------------------------+
+  | LPC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Terry Ellison <Terry@ellisons.org.uk                        |
+  +----------------------------------------------------------------------+
+
+   All other licensing and usage conditions are those of the PHP Group.
+*/
+
+#include "lpc.h"
+#include "lpc_cache.h"
+#include "lpc_shm.h"
+
+#if !defined(PHP_WIN32) && !defined(ZTS)
+# include <fcntl.h>
+# include <sys/file.h>
+# include <sys/mman.h>
+# define LPC_SHM_SUPPORTED
+#endif
+
+#ifdef LPC_SHM_SUPPORTED
+
+/* {{{ private defines and struct definitions */
+#define LPC_SHM_MAGIC    "LPCSHM1"
+#define LPC_SHM_MIN_SIZE (1<<20)
+#define ROUNDUP(s) (((zend_uint)(s)+(sizeof(void *)-1)) & (~(zend_uint)(sizeof(void *)-1)))
+#define CHECK(p) if(!(p)) goto error
+
+#ifndef O_NOFOLLOW
+# define O_NOFOLLOW 0
+#endif
+
+#if defined(__GNUC__)
+# define LPC_SHM_BARRIER() __sync_synchronize()
+#else
+# define LPC_SHM_BARRIER()
+#endif
+
+typedef struct _lpc_shm_header {
+    char               magic[8];          /* LPC_SHM_MAGIC */
+    zend_uint          size;              /* segment size */
+    volatile zend_uint generation;        /* odd whilst a reset is in progress */
+    zend_uint          used;              /* offset of the first free byte */
+    zend_uint          data_start;        /* offset of the first entry */
+    zend_uint          nbuckets;          /* number of hash buckets */
+    zend_uint          count;             /* number of entries */
+    zend_uint          buckets[1];        /* actually [nbuckets] entry offsets, 0 = empty */
+} lpc_shm_header;
+
+typedef struct _lpc_shm_entry {
+    zend_uint          next;              /* offset of the next entry in the chain; always lower */
+    zend_uint          hash;
+    zend_uint          key_length;        /* cache name + '\0' + module filename */
+    zend_uint          pool_length;
+    long               mtime;             /* module mtime and filesize from the cache index */
+    long               filesize;
+    /* followed by the key, then the pool image at the next aligned offset */
+} lpc_shm_entry;
+
+#define ENTRY_KEY(e)   ((char *)(e) + sizeof(lpc_shm_entry))
+#define ENTRY_IMAGE(e) ((zend_uchar *)(e) + ROUNDUP(sizeof(lpc_shm_entry) + (e)->key_length))
+
+static struct {
+    int         fd;
+    uid_t       uid;
+    zend_uchar *base;
+    zend_uint   size;
+} lpc_shm = {-1, 0, NULL, 0};
+/* }}} */
+
+/* {{{ shm_make_key
+       Builds the entry key in a local buffer.  Returns its length or 0 if it won't fit.  */
+static zend_uint shm_make_key(char *buf, size_t buf_len, const char *cache_name,
+                              lpc_cache_key_t *key)
+{
+    size_t cache_len = strlen(cache_name);
+    if (cache_len + 1 + key->filename_length > buf_len) {
+        return 0;
+    }
+    memcpy(buf, cache_name, cache_len + 1);
+    memcpy(buf + cache_len + 1, key->filename, key->filename_length);
+    return cache_len + 1 + key->filename_length;
+}
+/* }}} */
+
+/* {{{ shm_reset
+       Empty the segment.  Must be called with the segment file locked.  */
+static void shm_reset(lpc_shm_header *hdr)
+{
+    hdr->generation |= 1;
+    LPC_SHM_BARRIER();
+    memset(hdr->buckets, 0, hdr->nbuckets * sizeof(zend_uint));
+    hdr->used  = hdr->data_start;
+    hdr->count = 0;
+    LPC_SHM_BARRIER();
+    hdr->generation++;
+}
+/* }}} */
+
+/* {{{ shm_find
+       Walk the bucket chain for a key.  As the segment can be reset underneath a reader, every
+       offset is bounds checked, and the chain is guaranteed to terminate as entries are always
+       linked in front of lower addressed ones.  */
+static lpc_shm_entry *shm_find(lpc_shm_header *hdr, char *k, zend_uint k_len, zend_uint h)
+{
+    zend_uint off  = hdr->buckets[h % hdr->nbuckets];
+    zend_uint prev = lpc_shm.size;
+
+    while (off && off < prev && off >= hdr->data_start &&
+           off <= lpc_shm.size - sizeof(lpc_shm_entry)) {
+        lpc_shm_entry *e = (lpc_shm_entry *) (lpc_shm.base + off);
+        if (e->hash == h && e->key_length == k_len &&
+            off + sizeof(lpc_shm_entry) + k_len <= lpc_shm.size &&
+            !memcmp(ENTRY_KEY(e), k, k_len)) {
+            return e;
+        }
+        prev = off;
+        off  = e->next;
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ lpc_shm_attach */
+int lpc_shm_attach(TSRMLS_D)
+{ENTER(lpc_shm_attach)
+    uid_t           uid = geteuid();
+    char            path[MAXPATHLEN];
+    struct stat     sb;
+    lpc_shm_header *hdr;
+    zend_uint       size = LPCG(shm_size);
+    int             fd;
+
+    if (lpc_shm.base && lpc_shm.uid == uid) {
+        return 1;
+    }
+    lpc_shm_detach();
+   /*
+    * Open the segment file for this UID. The file must be a regular file owned by this UID with no
+    * group or world access, or another account could read or inject cached code.  It must also have
+    * no other links, as the name is predictable and a link planted in a shared lpc.shm_dir could 
+    * otherwise get some other private file of this account truncated or overwritten.  The name
+    * includes the serial format, so images in an older format are never picked up after an upgrade.
+    */
+    snprintf(path, sizeof(path), "%s/lpc-%lu-%s-%d.shm", LPCG(shm_dir), (ulong) uid, PHP_VERSION,
+             LPC_SERIAL_FORMAT);
+    CHECK((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600)) >= 0);
+
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_uid != uid || sb.st_nlink != 1 ||
+        (sb.st_mode & (S_IRWXG | S_IRWXO))) {
+        close(fd);
+        lpc_warning("Shared memory file %s is not private to this account.  "
+                    "Shared memory cache disabled" TSRMLS_CC, path);
+        return 0;
+    }
+    flock(fd, LOCK_EX);
+   /*
+    * An existing segment is used at its current size; otherwise the file is sized to lpc.shm_size.
+    */
+    if (sb.st_size >= LPC_SHM_MIN_SIZE) {
+        size = (zend_uint) MIN(sb.st_size, (off_t) 0x7fffffff);
+    } else {
+        size = MAX(size, LPC_SHM_MIN_SIZE);
+        if (ftruncate(fd, size) != 0) {
+            flock(fd, LOCK_UN);
+            close(fd);
+            goto error;
+        }
+    }
+    lpc_shm.base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (lpc_shm.base == MAP_FAILED) {
+        lpc_shm.base = NULL;
+        flock(fd, LOCK_UN);
+        close(fd);
+        goto error;
+    }
+    lpc_shm.fd   = fd;
+    lpc_shm.uid  = uid;
+    lpc_shm.size = size;
+
+    hdr = (lpc_shm_header *) lpc_shm.base;
+    if (memcmp(hdr->magic, LPC_SHM_MAGIC, sizeof(LPC_SHM_MAGIC)) || hdr->size != size) {
+       /*
+        * A new or unrecognised segment, so (re)initialise it.  One bucket per 16Kb is ample, as
+        * modules are rarely smaller than this.
+        */
+        memset(hdr, 0, sizeof(lpc_shm_header));
+        hdr->size       = size;
+        hdr->nbuckets   = MAX(64, size >> 14);
+        hdr->data_start = ROUNDUP(sizeof(lpc_shm_header) + hdr->nbuckets * sizeof(zend_uint));
+        shm_reset(hdr);
+        memcpy(hdr->magic, LPC_SHM_MAGIC, sizeof(LPC_SHM_MAGIC));
+    } else if (hdr->generation & 1) {
+        shm_reset(hdr);         /* a writer died mid-reset */
+    }
+    flock(fd, LOCK_UN);
+
+    DEBUG2(LOAD, "Shared memory segment %s mapped (size %u)", path, size);
+    return 1;
+
+error:
+    lpc_warning("Cannot map shared memory file %s.  Shared memory cache disabled" TSRMLS_CC, path);
+    return 0;
+}
+/* }}} */
+
+/* {{{ lpc_shm_detach */
+void lpc_shm_detach(void)
+{
+    if (lpc_shm.base) {
+        munmap(lpc_shm.base, lpc_shm.size);
+        lpc_shm.base = NULL;
+    }
+    if (lpc_shm.fd >= 0) {
+        close(lpc_shm.fd);
+        lpc_shm.fd = -1;
+    }
+}
+/* }}} */
+
+/* {{{ lpc_shm_fetch */
+zend_bool lpc_shm_fetch(const char *cache_name, lpc_cache_key_t *key,
+                        zend_uint pool_length, zend_uchar *image TSRMLS_DC)
+{ENTER(lpc_shm_fetch)
+    lpc_shm_header *hdr = (lpc_shm_header *) lpc_shm.base;
+    lpc_shm_entry  *e;
+    char            k[2*MAXPATHLEN];
+    zend_uint       k_len, h, generation;
+
+    if (!LPCG(shm_size) || !hdr || !(k_len = shm_make_key(k, sizeof(k), cache_name, key))) {
+        return 0;
+    }
+    generation = hdr->generation;
+    if (generation & 1) {
+        return 0;
+    }
+    LPC_SHM_BARRIER();
+
+    h = zend_inline_hash_func(k, k_len);
+    e = shm_find(hdr, k, k_len, h);
+    if (!e || e->pool_length != pool_length || e->mtime != key->mtime ||
+        e->filesize != (long) key->filesize ||
+        (size_t) (ENTRY_IMAGE(e) - lpc_shm.base) + pool_length > lpc_shm.size) {
+        return 0;
+    }
+    memcpy(image, ENTRY_IMAGE(e), pool_length);
+   /*
+    * If the segment has been reset since the lookup started then the copy may be torn.
+    */
+    LPC_SHM_BARRIER();
+    if (hdr->generation != generation) {
+        return 0;
+    }
+    DEBUG2(LOAD, "Shared memory hit for %s (%u bytes)", key->filename, pool_length);
+    return 1;
+}
+/* }}} */
+
+/* {{{ lpc_shm_store */
+void lpc_shm_store(const char *cache_name, lpc_cache_key_t *key,
+                   zend_uint pool_length, const zend_uchar *image TSRMLS_DC)
+{ENTER(lpc_shm_store)
+    lpc_shm_header *hdr = (lpc_shm_header *) lpc_shm.base;
+    lpc_shm_entry  *e;
+    char            k[2*MAXPATHLEN];
+    zend_uint       k_len, h, need, b;
+
+    if (!LPCG(shm_size) || !hdr || !(k_len = shm_make_key(k, sizeof(k), cache_name, key))) {
+        return;
+    }
+    need = ROUNDUP(sizeof(lpc_shm_entry) + k_len) + ROUNDUP(pool_length);
+    if (need > hdr->size - hdr->data_start) {
+        return;
+    }
+   /*
+    * Don't hold up the request if another process is publishing; this module will simply be
+    * published by a later request.
+    */
+    if (flock(lpc_shm.fd, LOCK_EX | LOCK_NB) != 0) {
+        return;
+    }
+    h = zend_inline_hash_func(k, k_len);
+    e = shm_find(hdr, k, k_len, h);
+    if (e && e->pool_length == pool_length && e->mtime == key->mtime &&
+        e->filesize == (long) key->filesize) {
+        flock(lpc_shm.fd, LOCK_UN);
+        return;
+    }
+    if (hdr->used + need > hdr->size) {
+        shm_reset(hdr);
+        DEBUG0(LOAD, "Shared memory segment full and reset");
+    }
+   /*
+    * Fill in the entry, then link it into the chain.  The barriers ensure that a concurrent reader
+    * can never see a linked entry that isn't complete.
+    */
+    e = (lpc_shm_entry *) (lpc_shm.base + hdr->used);
+    e->hash        = h;
+    e->key_length  = k_len;
+    e->pool_length = pool_length;
+    e->mtime       = key->mtime;
+    e->filesize    = key->filesize;
+    memcpy(ENTRY_KEY(e), k, k_len);
+    memcpy(ENTRY_IMAGE(e), image, pool_length);
+
+    b       = h % hdr->nbuckets;
+    e->next = hdr->buckets[b];
+    LPC_SHM_BARRIER();
+    hdr->buckets[b] = hdr->used;
+    hdr->used      += need;
+    hdr->count++;
+
+    flock(lpc_shm.fd, LOCK_UN);
+    DEBUG2(LOAD, "Shared memory entry for %s published (%u bytes)", key->filename, pool_length);
+}
+/* }}} */
+
+#else  /* !LPC_SHM_SUPPORTED */
+
+/* {{{ Stubs for Windows and ZTS builds where the shared memory cache isn't supported */
+int lpc_shm_attach(TSRMLS_D)
+{
+    lpc_warning("The shared memory cache isn't supported in this build" TSRMLS_CC);
+    return 0;
+}
+
+void lpc_shm_detach(void)
+{
+}
+
+zend_bool lpc_shm_fetch(const char *cache_name, lpc_cache_key_t *key,
+                        zend_uint pool_length, zend_uchar *image TSRMLS_DC)
+{
+    return 0;
+}
+
+void lpc_shm_store(const char *cache_name, lpc_cache_key_t *key,
+                   zend_uint pool_length, const zend_uchar *image TSRMLS_DC)
+{
+}
+/* }}} */
+
+#endif /* LPC_SHM_SUPPORTED */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -0,0 +1,81 @@
+/*
+  +----------------------------------------------------------------------+
+  | LPC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Terry Ellison <Terry@ellisons.org.uk                        |
+  +----------------------------------------------------------------------+
+
+   All other licensing and usage conditions are those of the PHP Group.
+*/
+
+#ifndef LPC_SHM_H
+#define LPC_SHM_H
+
+#include "zend.h"
+#include "lpc_cache.h"
+
+/* {{{ Overview documentation
+
+ The shared memory module cache is an optional second level cache which sits above the CacheDB file
+ cache.  It is enabled by setting the PER_DIR INI parameter lpc.shm_size to a non-zero value.
+
+ The segment is a MAP_SHARED mapping of a file in lpc.shm_dir which is named by the effective UID,
+ the PHP version and the LPC serial format.  The file is created mode 0600 and is only used if it is
+ a regular file owned by the effective UID with a single link and no group or other access, so the
+ segment is only ever shared between the PHP processes of a single account, and LPC's account 
+ separation model is preserved.
+
+ Each entry holds the uncompressed (and still position independent) image of a serial pool, keyed
+ by the cache file name plus the module filename and validated against the module mtime, filesize
+ and pool length from the cache index.  A hit is copied straight into the pool buffer, so both the
+ cache file read and the decompression are bypassed.  Misses are published once they have been read
+ and decompressed from the cache file.
+
+ Lookups are lock-free.  Writers take a non-blocking flock() on the segment file and simply skip the
+ publish if another process holds it.  Entries are bump-allocated and are never individually freed;
+ when the segment is full it is reset in its entirety.  A generation count is bumped either side of
+ a reset so that a reader which overlaps a reset can detect this and treat the lookup as a miss.
+*/
+/* }}} */
+
+/* {{{ Public functions */
+/*
+ * lpc_shm_attach maps the shared memory segment for the current effective UID, if it isn't already
+ * mapped. It is called during RINIT when lpc.shm_size is non-zero and returns 1 on success.
+ */
+extern int lpc_shm_attach(TSRMLS_D);
+
+/*
+ * lpc_shm_detach unmaps any segment mapped by this process.  Called during MSHUTDOWN.
+ */
+extern void lpc_shm_detach(void);
+
+/*
+ * lpc_shm_fetch copies the pool image for the key into image if the segment has a valid entry for
+ * it, and returns 1 on a hit.  lpc_shm_store publishes an image read from the cache file.
+ */
+extern zend_bool lpc_shm_fetch(const char *cache_name, lpc_cache_key_t *key,
+                               zend_uint pool_length, zend_uchar *image TSRMLS_DC);
+extern void lpc_shm_store(const char *cache_name, lpc_cache_key_t *key,
+                          zend_uint pool_length, const zend_uchar *image TSRMLS_DC);
+/* }}} */
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
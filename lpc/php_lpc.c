@@ -77,6 +77,11 @@ perdir_ini_entry("debug_flags",             "0")
 perdir_ini_entry("compression",             "1")
 perdir_ini_entry("reuse_serial_buffer",     "1")
 perdir_ini_entry("storage_quantum",      "128K")
+perdir_ini_entry("shm_size",                "0")
+perdir_ini_entry("shm_dir",          "/dev/shm")
+perdir_ini_entry("persistent_size",         "0")
+perdir_ini_entry("pool_base",               "0")
+perdir_ini_entry("zstd_dictionary_size",  "64K")
 PHP_INI_END()
 /* }}} */
 
@@ -128,6 +133,14 @@ static PHP_MINFO_FUNCTION(lpc)
     php_info_print_table_row(2, "Reuse serial buffer",buf);
     info_convert("%u", storage_quantum);
     php_info_print_table_row(2, "Storage quantum",buf);
+    info_convert("%u", shm_size);
+    php_info_print_table_row(2, "Shared memory size",buf);
+    info_convert("%u", persistent_size);
+    php_info_print_table_row(2, "Persistent size",buf);
+    info_convert("0x%lx", pool_base);
+    php_info_print_table_row(2, "Pool base",buf);
+    info_convert("%u", zstd_dict_max);
+    php_info_print_table_row(2, "zstd dictionary size",buf);
     php_info_print_table_end();
     DISPLAY_INI_ENTRIES();
 }
@@ -157,6 +170,7 @@ static PHP_GSHUTDOWN_FUNCTION(lpc)
     char *clear_cookie;           /* Name of Cookie which will force a cache clear */
     char *clear_parameter;        /* Name of Request parameter which will force a cache clear */
 #endif
+    lpc_cache_free_persistent(&lpc_globals->persistent_caches);
 
     /* the rest of the globals are cleaned up in lpc_module_shutdown() */
 }
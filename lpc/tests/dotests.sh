@@ -50,6 +50,38 @@ run() {
         dotest $t . .
 	done
 }
+bench() {
+    # Compare the lpc.compression algos over the test corpus, reporting the total cache file size,
+    # the cold (compile and cache) run time and the mean warm (load from cache) run time. Algos 3
+    # (LZ4) and 4 (zstd) fall back to 2 if they aren't in the build, so the effective algo is
+    # taken from the php -i Compression row and any algo which falls back is reported as not built.
+    runs=${BENCH_RUNS:-10}
+    cacheDir=$(mktemp -d)
+    printf "%-5s %12s %10s %10s\n" algo "cache bytes" "cold secs" "warm secs"
+    for algo in 0 1 2 3 4; do
+        effective=$(/opt/bin/php $OPT -d lpc.compression=$algo -i 2>/dev/null | sed -n 's/^Compression => //p')
+        if [[ "$effective" != "$algo" ]]; then
+            printf "%-5s %12s\n" $algo "not built"
+            continue
+        fi
+        rm -f $cacheDir/*.cache
+        start=$(date +%s.%N)
+        for ((i = 0; i <= runs; i++)); do
+            for t in test*.php; do
+                SKIP_SLOW_TESTS=1 /opt/bin/php $OPT -d lpc.compression=$algo \
+                    -d lpc.cache_pattern=".*?/$t" -d lpc.cache_replacement="$cacheDir/${t%.php}.cache" \
+                    $t > /dev/null 2>&1
+            done
+            test $i -eq 0 && cold=$(date +%s.%N)
+        done
+        end=$(date +%s.%N)
+        size=$(cat $cacheDir/*.cache | wc -c)
+        printf "%-5s %12d %10.3f %10.3f\n" $algo $size \
+               $(echo "$cold - $start" | bc) $(echo "($end - $cold) / $runs" | bc -l)
+    done
+    rm -Rf $cacheDir
+}
+
 php() {
     inDir="$1"
     outDir="$2"
@@ -90,7 +122,11 @@ clean)
     clean
 	exit
     ;;
+bench)
+    bench
+	exit
+    ;;
 *)
-    echo "Usage: $0 {clean|run|php|zend}"
+    echo "Usage: $0 {clean|run|php|zend|bench}"
     exit 1
 esac